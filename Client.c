@@ -1,3 +1,4 @@
+#define _GNU_SOURCE
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
@@ -6,42 +7,84 @@
 #include <netinet/in.h>
 #include <arpa/inet.h>
 #include <sys/stat.h>
+#include <sys/mman.h>
 #include <fcntl.h>
 #include <libgen.h>
 #include <errno.h>
+#include "dfs_proto.h"
+#include "dfs_list.h"
+#include "dfs_hash.h"
+#include "dfs_delta.h"
+#include "dfs_lz4.h"
 
 #define MIN(a, b) ((a) < (b) ? (a) : (b))
 #define S1_IP "127.0.0.1"  //  localhost 
 #define S1_PORT 9080
 #define MAX_BUFF 4096
+#define HASH_UPLOAD_MIN (1 << 20)   // smaller files are sent without asking S1 for their content first
+#define COMPRESS_SAVING_MIN 8       // an upload goes compressed if that saves at least 1/8 of it
+#define COMPRESS_SAMPLE_BLOCKS 4    // blocks of an upload compressed to judge that
+
+// DFS_F_LZ4, with DFS_F_DENSE for slow links, if transfers may be compressed; -z sets it
+int compress_flags = DFS_F_LZ4;
 
 // functions 
-int validate_command(char *cmd, char *arg1, char *arg2);
+int validate_command(char *cmd, char *arg1, char *arg2, char *arg3);
 int upload_command_validation(char *filename, char *dest_path);
 int download_command_validation(char *filepath);
 int remove_command_validation(char *filepath);
 int downloadtar_command_validation(char *filetype);
-int display_command_validation(char *pathname);
-void send_file(int sock, char *filename);
-void receive_file(int sock, char *filename);
-void receive_tar(int sock, char *filetype);
-void receive_filenames(int sock);
+int display_command_validation(char *pathname, char *limit);
+int stat_command_validation(char *filepath);
+int send_request(int sock, int opcode, int flags, uint32_t request_id, const char *path);
+int upload_path(char *path, char *filename, char *dest_path);
+int send_file(int sock, DfsReader *rd, uint32_t request_id, char *filename, char *dest_path);
+int send_delta(int sock, DfsReader *rd, uint32_t request_id, char *filename, char *dest_path);
+int upload_by_hash(int sock, DfsReader *rd, uint32_t request_id, const char *path, int fd, off_t file_size);
+int send_compressed(int sock, uint32_t request_id, const char *path, int fd, off_t file_size);
+int read_reply_header(DfsReader *rd, uint32_t request_id, DfsHeader *h, char *path);
+int read_reply(DfsReader *rd, uint32_t request_id, DfsHeader *h, char *path);
+void print_error(DfsReader *rd, const DfsHeader *h);
+void print_message(DfsReader *rd, const DfsHeader *h);
+int send_list_request(int sock, uint32_t request_id, char *pathname, char *limit, char *token, int long_list);
+int send_range_request(int sock, uint32_t request_id, const char *path, uint64_t offset, uint64_t length,
+                       const char *tag);
+void download_file(int sock, DfsReader *rd, uint32_t request_id, uint32_t *next_id, char *path, char *filename);
+void receive_message(DfsReader *rd, uint32_t request_id);
+void receive_file(DfsReader *rd, uint32_t request_id, char *filename, int is_tar, off_t offset);
+int receive_payload(DfsReader *rd, const DfsHeader *h, char *filename, int is_tar, off_t offset);
+int receive_chunks(DfsReader *rd, char *filename);
+int receive_compressed(DfsReader *rd, char *filename);
+void receive_tar(DfsReader *rd, uint32_t request_id, char *filetype);
+void receive_filenames(DfsReader *rd, uint32_t request_id, char *pathname, char *limit, int long_list);
+void receive_stat(DfsReader *rd, uint32_t request_id);
 void print_help();
 int connect_to_server();
 
-int main(int argc, char const *argv[]) {
+int main(int argc, char *argv[]) {
     char command[MAX_BUFF];
-    char response[MAX_BUFF];
+    uint32_t next_request_id = 1;
+    int opt;
+
+    // -z off|fast|dense: compression of file transfers, dense spends more CPU for slow links
+    while ((opt = getopt(argc, argv, "z:")) != -1) {
+        if (opt == 'z' && strcmp(optarg, "off") == 0) {
+            compress_flags = 0;
+        } else if (opt == 'z' && strcmp(optarg, "fast") == 0) {
+            compress_flags = DFS_F_LZ4;
+        } else if (opt == 'z' && strcmp(optarg, "dense") == 0) {
+            compress_flags = DFS_F_LZ4 | DFS_F_DENSE;
+        } else {
+            fprintf(stderr, "Usage: %s [-z off|fast|dense]\n", argv[0]);
+            exit(EXIT_FAILURE);
+        }
+    }
     
     printf("W25 Distributed File System Client\n");
     printf("Type 'help' for available commands\n");
     printf("w25client$ ");
     
     while (fgets(command, MAX_BUFF, stdin)) {
-        // save original command for sending
-        char original_cmd[MAX_BUFF];
-        strcpy(original_cmd, command);
-        
         // Remove newline for local validation
         size_t len = strlen(command);
         if (len > 0 && command[len - 1] == '\n')
@@ -59,6 +102,16 @@ int main(int argc, char const *argv[]) {
         char *cmd = strtok(cmd_copy, " ");
         char *arg1 = strtok(NULL, " ");
         char *arg2 = strtok(NULL, " ");
+        char *arg3 = strtok(NULL, " ");
+
+        // dispfnames -l: long listing with sizes and modification times
+        int long_list = 0;
+        if (cmd && strcmp(cmd, "dispfnames") == 0 && arg1 && strcmp(arg1, "-l") == 0) {
+            long_list = 1;
+            arg1 = arg2;
+            arg2 = arg3;
+            arg3 = strtok(NULL, " ");
+        }
         
         // Check for help command
         if (strcmp(cmd, "help") == 0) {
@@ -74,7 +127,7 @@ int main(int argc, char const *argv[]) {
         }
         
         // Validate command syntax
-        int valid = validate_command(cmd, arg1, arg2);
+        int valid = validate_command(cmd, arg1, arg2, arg3);
         
         if (!valid) {
             printf("w25client$ ");
@@ -89,20 +142,26 @@ int main(int argc, char const *argv[]) {
             continue;
         }
         
-        // Send command
-        printf("Sending command: %s", original_cmd);
-        if (len > 0 && original_cmd[len - 1] != '\n') {
-            // Ensure command ends with newline
-            send(sock, command, strlen(command), 0);
-            send(sock, "\n", 1, 0);
-        } else {
-            send(sock, original_cmd, strlen(original_cmd), 0);
-        }
+        // Send the request frame, uploads carry the file as payload
+        static DfsReader rd;
+        dfs_reader_init(&rd, sock);
+        uint32_t request_id = next_request_id++;
+        printf("Sending command: %s\n", command);
         
         // Handle file upload
         if (strcmp(cmd, "uploadf") == 0) {
             printf("Uploading file: %s\n", arg1);
-            send_file(sock, arg1);
+            if (send_file(sock, &rd, request_id, arg1, arg2) == 0) {
+                receive_message(&rd, request_id);
+            }
+        }
+
+        // Handle update of a stored file, only its changes are sent
+        if (strcmp(cmd, "updatef") == 0) {
+            printf("Updating file: %s\n", arg1);
+            if (send_delta(sock, &rd, request_id, arg1, arg2) == 0) {
+                receive_message(&rd, request_id);
+            }
         }
         
         // Handle file download
@@ -114,39 +173,42 @@ int main(int argc, char const *argv[]) {
             } else {
                 filename++; // Skip the '/'
             }
-            receive_file(sock, filename);
+            if (arg2) {
+                // a byte range, written into the local file at its offset
+                off_t offset = strtoull(arg2, NULL, 10);
+                if (send_range_request(sock, request_id, arg1, offset, arg3 ? strtoull(arg3, NULL, 10) : 0, NULL) == 0) {
+                    receive_file(&rd, request_id, filename, 0, offset);
+                }
+            } else {
+                download_file(sock, &rd, request_id, &next_request_id, arg1, filename);
+            }
         }
         
         // Handle tar download
         if (strcmp(cmd, "downltar") == 0) {
-            receive_tar(sock, arg1);
+            if (send_request(sock, DFS_OP_TAR, 0, request_id, arg1) == 0) {
+                receive_tar(&rd, request_id, arg1);
+            }
         }
         
         // Handle display filenames
         if (strcmp(cmd, "dispfnames") == 0) {
-            receive_filenames(sock);
+            if (send_list_request(sock, request_id, arg1, arg2, arg3, long_list) == 0) {
+                receive_filenames(&rd, request_id, arg1, arg2, long_list);
+            }
         }
         
         // Receive server response for commands
         if (strcmp(cmd, "removef") == 0) {
-            fd_set readfds;
-            struct timeval tv;
-            FD_ZERO(&readfds);
-            FD_SET(sock, &readfds);
-            tv.tv_sec = 5;  // 5 sec timeout
-            tv.tv_usec = 0;
-            
-            if (select(sock + 1, &readfds, NULL, NULL, &tv) > 0) {
-                memset(response, 0, MAX_BUFF);  // Clear the buffer
-                ssize_t bytes_received = recv(sock, response, MAX_BUFF - 1, 0);
-                if (bytes_received <= 0) {
-                    printf("Server disconnected\n");
-                } else {
-                    response[bytes_received] = '\0';
-                    printf("Server: %s\n", response);
-                }
-            } else {
-                printf("No response from server (timeout)\n");
+            if (send_request(sock, DFS_OP_REMOVE, 0, request_id, arg1) == 0) {
+                receive_message(&rd, request_id);
+            }
+        }
+        
+        // Handle file metadata
+        if (strcmp(cmd, "stat") == 0) {
+            if (send_request(sock, DFS_OP_STAT, 0, request_id, arg1) == 0) {
+                receive_stat(&rd, request_id);
             }
         }
         
@@ -159,21 +221,26 @@ int main(int argc, char const *argv[]) {
 }
 
 // Validate different command types
-int validate_command(char *cmd, char *arg1, char *arg2) {
+int validate_command(char *cmd, char *arg1, char *arg2, char *arg3) {
     if (!cmd) {
         printf("Error: No command provided\n");
         return 0;
     }
     
-    if (strcmp(cmd, "uploadf") == 0) {
+    if (strcmp(cmd, "uploadf") == 0 || strcmp(cmd, "updatef") == 0) {
         if (!arg1 || !arg2) {
-            printf("Usage: uploadf <filename> <destination_path>\n");
+            printf("Usage: %s <filename> <destination_path>\n", cmd);
             return 0;
         }
         return upload_command_validation(arg1, arg2);
     } else if (strcmp(cmd, "downlf") == 0) {
         if (!arg1) {
-            printf("Usage: downlf <filepath>\n");
+            printf("Usage: downlf <filepath> [offset [length]]\n");
+            return 0;
+        }
+        if ((arg2 && strspn(arg2, "0123456789") != strlen(arg2)) ||
+            (arg3 && strspn(arg3, "0123456789") != strlen(arg3))) {
+            printf("Error: Offset and length must be numbers\n");
             return 0;
         }
         return download_command_validation(arg1);
@@ -192,10 +259,16 @@ int validate_command(char *cmd, char *arg1, char *arg2) {
         return downloadtar_command_validation(arg1);
     } else if (strcmp(cmd, "dispfnames") == 0) {
         if (!arg1) {
-            printf("Usage: dispfnames <pathname>\n");
+            printf("Usage: dispfnames [-l] <pathname> [limit [token]]\n");
+            return 0;
+        }
+        return display_command_validation(arg1, arg2);
+    } else if (strcmp(cmd, "stat") == 0) {
+        if (!arg1) {
+            printf("Usage: stat <filepath>\n");
             return 0;
         }
-        return display_command_validation(arg1);
+        return stat_command_validation(arg1);
     } else {
         printf("Error: Unknown command '%s'\n", cmd);
         printf("Type 'help' for available commands\n");
@@ -286,176 +359,839 @@ int downloadtar_command_validation(char *filetype) {
     return 1;
 }
 
-int display_command_validation(char *pathname) {
+int display_command_validation(char *pathname, char *limit) {
     // Validate pathname starts with ~S1/
     if (strncmp(pathname, "~S1/", 4) != 0) {
         printf("Error: Path must start with ~S1/\n");
         return 0;
     }
+    if (limit && strspn(limit, "0123456789") != strlen(limit)) {
+        printf("Error: Limit must be a number\n");
+        return 0;
+    }
     return 1;
 }
 
-void send_file(int sock, char *filename) {
+int stat_command_validation(char *filepath) {
+    // same rules as for a download
+    return download_command_validation(filepath);
+}
+
+// send a request without payload, returns 0 or -1
+int send_request(int sock, int opcode, int flags, uint32_t request_id, const char *path) {
+    if (dfs_send_header(sock, opcode, flags, 0, request_id, path, 0) < 0) {
+        perror("Send error");
+        return -1;
+    }
+    return 0;
+}
+
+// LIST request; with a limit the listing comes in pages, and the token printed
+// after a page (hex) resumes it. a long listing asks for sizes and mtimes too
+// returns 0 or -1
+int send_list_request(int sock, uint32_t request_id, char *pathname, char *limit, char *token, int long_list) {
+    unsigned char args[DFS_LIST_ARGS_MAX];
+    size_t len = 0;
+    if (limit) {
+        dfs_put64(args, strtoull(limit, NULL, 10));
+        len = 8;
+    }
+    for (char *p = token; p && p[0]; p += 2) {
+        unsigned int byte;
+        if (len == sizeof(args) || !p[1] || sscanf(p, "%2x", &byte) != 1) {
+            printf("Error: Invalid resume token\n");
+            return -1;
+        }
+        args[len++] = byte;
+    }
+
+    if (dfs_send_header(sock, DFS_OP_LIST, long_list ? DFS_F_LONG : 0, 0, request_id, pathname, len) < 0 ||
+        (len && dfs_send_all(sock, args, len, 0) < 0)) {
+        perror("Send error");
+        return -1;
+    }
+    return 0;
+}
+
+// DOWNLOAD of part of a file, length 0 for the rest of it. with a tag S1
+// only serves the range from that version of the file; returns 0 or -1
+int send_range_request(int sock, uint32_t request_id, const char *path, uint64_t offset, uint64_t length,
+                       const char *tag) {
+    unsigned char args[DFS_RANGE_ARGS + DFS_FILE_TAG];
+    size_t len = DFS_RANGE_ARGS;
+    dfs_put64(args, offset);
+    dfs_put64(args + 8, length);
+    if (tag) {
+        memcpy(args + len, tag, DFS_FILE_TAG);
+        len += DFS_FILE_TAG;
+    }
+    if (dfs_send_header(sock, DFS_OP_DOWNLOAD, DFS_F_RANGE, 0, request_id, path, len) < 0 ||
+        dfs_send_all(sock, args, len, 0) < 0) {
+        perror("Send error");
+        return -1;
+    }
+    return 0;
+}
+
+// the request path of an upload, which names the file at its destination
+// path has DFS_MAX_PATH bytes; returns 0 or -1 if it is too long
+int upload_path(char *path, char *filename, char *dest_path) {
+    char *base = strrchr(filename, '/');
+    base = base ? base + 1 : filename;
+    size_t dlen = strlen(dest_path);
+    if (snprintf(path, DFS_MAX_PATH, "%s%s%s", dest_path,
+                 dlen > 0 && dest_path[dlen - 1] == '/' ? "" : "/", base) >= DFS_MAX_PATH) {
+        printf("Error: Destination path too long\n");
+        return -1;
+    }
+    return 0;
+}
+
+// upload a file; returns 0 if the reply to the upload is still to be read, 1
+// if S1 stored it from content it has already, -1 on failure
+int send_file(int sock, DfsReader *rd, uint32_t request_id, char *filename, char *dest_path) {
     struct stat st;
     if (stat(filename, &st) != 0) {
         perror("Cannot stat file");
-        return;
+        return -1;
     }
-    
+
     off_t file_size = st.st_size;
     printf("File size: %ld bytes\n", file_size);
-    
-    // Send file size header with newline
-    char size_header[32];
-    snprintf(size_header, sizeof(size_header), "%ld\n", file_size);
-    send(sock, size_header, strlen(size_header), 0);
-    
-    // Send file content
+
+    char path[DFS_MAX_PATH];
+    if (upload_path(path, filename, dest_path) < 0) return -1;
+
     int fd = open(filename, O_RDONLY);
     if (fd < 0) {
         perror("Cannot open file");
-        return;
+        return -1;
     }
-    
-    char buffer[MAX_BUFF];
+
+    // S1 may have the content already, then no data has to move
+    if (file_size >= HASH_UPLOAD_MIN) {
+        int r = upload_by_hash(sock, rd, request_id, path, fd, file_size);
+        if (r != 0) {
+            close(fd);
+            return r;
+        }
+        printf("Content not stored yet, sending the file\n");
+    }
+
+    // text and source files shrink a lot, they go compressed if that pays
+    if (compress_flags) {
+        int r = send_compressed(sock, request_id, path, fd, file_size);
+        if (r != 0) {
+            close(fd);
+            return r > 0 ? 0 : -1;
+        }
+    }
+
+    // Send request header with the file size
+    if (dfs_send_header(sock, DFS_OP_UPLOAD, 0, 0, request_id, path, file_size) < 0) {
+        perror("Send error");
+        close(fd);
+        return -1;
+    }
+
+    // Send file content
+    char buffer[DFS_READER_SIZE];
     ssize_t bytes_read;
     off_t total_sent = 0;
-    
-    while ((bytes_read = read(fd, buffer, MAX_BUFF)) > 0) {
-        ssize_t bytes_sent = send(sock, buffer, bytes_read, 0);
-        if (bytes_sent < 0) {
+
+    while (total_sent < file_size && (bytes_read = read(fd, buffer, sizeof(buffer))) > 0) {
+        if (bytes_read > file_size - total_sent) bytes_read = file_size - total_sent;
+        if (dfs_send_all(sock, buffer, bytes_read, 0) < 0) {
             perror("Send error");
             break;
         }
-        total_sent += bytes_sent;
-        
+        total_sent += bytes_read;
+
         // Show progress
         float percent = (float)total_sent / file_size * 100.0;
         printf("\rProgress: %.1f%% (%ld/%ld bytes)", percent, total_sent, file_size);
         fflush(stdout);
     }
-    
+
     close(fd);
     printf("\nFile transfer complete: %ld/%ld bytes\n", total_sent, file_size);
-    
-    // Receive server response
-    char response[MAX_BUFF];
-    fd_set readfds;
-    struct timeval tv;
-    FD_ZERO(&readfds);
-    FD_SET(sock, &readfds);
-    tv.tv_sec = 30;  // 10 second timeout
-    tv.tv_usec = 0;
-    
-    if (select(sock + 1, &readfds, NULL, NULL, &tv) > 0) {
-        memset(response, 0, MAX_BUFF);
-        ssize_t bytes_received = recv(sock, response, MAX_BUFF - 1, 0);
-        if (bytes_received > 0) {
-            response[bytes_received] = '\0';
-            printf("Server: %s\n", response);
+    return total_sent == file_size ? 0 : -1;
+}
+
+// send the size, XXH64 and SHA-256 of a file instead of its data (DFS_F_HASH)
+// returns 1 if S1 stored the file (its message is printed), 0 if the data
+// has to be sent after all, -1 on failure
+int upload_by_hash(int sock, DfsReader *rd, uint32_t request_id, const char *path, int fd, off_t file_size) {
+    void *map = mmap(NULL, file_size, PROT_READ, MAP_PRIVATE, fd, 0);
+    if (map == MAP_FAILED) return 0;
+    madvise(map, file_size, MADV_SEQUENTIAL);
+    unsigned char claim[DFS_HASH_CLAIM];
+    DfsXxh64 hash;
+    DfsSha256 sha;
+    dfs_xxh64_init(&hash);
+    dfs_sha256_init(&sha);
+    // both in one pass, a piece at a time while it is in the cache
+    for (off_t off = 0; off < file_size; off += DFS_READER_SIZE) {
+        size_t n = file_size - off < DFS_READER_SIZE ? file_size - off : DFS_READER_SIZE;
+        dfs_xxh64_update(&hash, (char *)map + off, n);
+        dfs_sha256_update(&sha, (char *)map + off, n);
+    }
+    munmap(map, file_size);
+
+    dfs_put64(claim, file_size);
+    dfs_put64(claim + 8, dfs_xxh64_digest(&hash));
+    dfs_sha256_final(&sha, claim + 16);
+    if (dfs_send_header(sock, DFS_OP_UPLOAD, DFS_F_HASH, 0, request_id, path, sizeof(claim)) < 0 ||
+        dfs_send_all(sock, claim, sizeof(claim), 0) < 0) {
+        perror("Send error");
+        return -1;
+    }
+
+    DfsHeader h;
+    if (!read_reply_header(rd, request_id, &h, NULL)) return -1;
+    if (h.status == DFS_E_MISSING) return dfs_skip(rd, h.payload_len) < 0 ? -1 : 0;
+    if (h.status != DFS_OK) {
+        print_error(rd, &h);
+        return -1;
+    }
+    print_message(rd, &h);
+    return 1;
+}
+
+// the changes of a file against the signatures of its stored version
+typedef struct {
+    int type;                       // DFS_DELTA_OP_*
+    uint64_t a;                     // first block, or offset of the literal in the file
+    uint64_t b;                     // block count, or length of the literal
+} DeltaOp;
+
+typedef struct {
+    DeltaOp *ops;
+    size_t count;
+    size_t cap;
+    uint64_t copied;                // bytes of the stored version reused
+    uint64_t literal;               // and bytes sent
+} Delta;
+
+// append an op, merging it into the last one where they are contiguous
+// returns 0 or -1 if out of memory
+int delta_add(Delta *d, int type, uint64_t a, uint64_t b) {
+    DeltaOp *last = d->count > 0 ? &d->ops[d->count - 1] : NULL;
+    if (last && last->type == type && last->a + last->b == a) {
+        last->b += b;
+        return 0;
+    }
+    if (d->count == d->cap) {
+        size_t cap = d->cap ? d->cap * 2 : 64;
+        DeltaOp *ops = realloc(d->ops, cap * sizeof(DeltaOp));
+        if (!ops) return -1;
+        d->ops = ops;
+        d->cap = cap;
+    }
+    d->ops[d->count++] = (DeltaOp){type, a, b};
+    return 0;
+}
+
+// roll the weak checksum over data and match it against the full blocks of
+// the signatures; a match whose strong checksum agrees becomes a copy. a
+// short last block can only match at the end of the file
+// returns 0 or -1 if out of memory
+int delta_compute(Delta *d, const unsigned char *data, uint64_t size,
+                  const unsigned char *sigs, uint64_t block, uint64_t base_size) {
+    const unsigned char *sig = sigs + DFS_DELTA_HEADER - 8;
+    uint64_t blocks = dfs_delta_blocks(base_size, block);
+    uint64_t full = base_size / block;
+    uint64_t tail = base_size - full * block;
+
+    // open addressing over the weak checksums, slots hold block + 1
+    size_t slots = 16;
+    while (slots < full * 2) slots *= 2;
+    uint32_t *table = calloc(slots, sizeof(uint32_t));
+    if (!table) return -1;
+    for (uint64_t i = 0; i < full; i++) {
+        size_t s = (dfs_get32(sig + i * DFS_DELTA_SIG) * 0x9e3779b1u) & (slots - 1);
+        while (table[s]) s = (s + 1) & (slots - 1);
+        table[s] = i + 1;
+    }
+
+    uint64_t pos = 0, literal = 0;
+    DfsWeak w;
+    if (size >= block) dfs_weak_init(&w, data, block);
+    while (pos + block <= size && full > 0) {
+        uint32_t v = dfs_weak_value(&w);
+        int64_t match = -1;
+        uint64_t strong = 0;
+        int hashed = 0;
+        // the block after the last copy first, so runs stay one record
+        DeltaOp *last = d->count > 0 ? &d->ops[d->count - 1] : NULL;
+        if (last && last->type == DFS_DELTA_OP_COPY && literal == pos && last->a + last->b < full &&
+            dfs_get32(sig + (last->a + last->b) * DFS_DELTA_SIG) == v) {
+            strong = dfs_delta_strong(data + pos, block);
+            hashed = 1;
+            if (dfs_get64(sig + (last->a + last->b) * DFS_DELTA_SIG + 4) == strong) match = last->a + last->b;
+        }
+        for (size_t s = (v * 0x9e3779b1u) & (slots - 1); match < 0 && table[s]; s = (s + 1) & (slots - 1)) {
+            const unsigned char *cand = sig + (uint64_t)(table[s] - 1) * DFS_DELTA_SIG;
+            if (dfs_get32(cand) != v) continue;
+            if (!hashed) {
+                strong = dfs_delta_strong(data + pos, block);
+                hashed = 1;
+            }
+            if (dfs_get64(cand + 4) == strong) match = table[s] - 1;
+        }
+
+        if (match >= 0) {
+            if ((pos > literal && delta_add(d, DFS_DELTA_OP_LITERAL, literal, pos - literal) < 0) ||
+                delta_add(d, DFS_DELTA_OP_COPY, match, 1) < 0) {
+                free(table);
+                return -1;
+            }
+            d->copied += block;
+            pos += block;
+            literal = pos;
+            if (pos + block <= size) dfs_weak_init(&w, data + pos, block);
+            continue;
         }
+        if (pos + block < size) dfs_weak_roll(&w, data[pos], data[pos + block]);
+        pos++;
     }
+    free(table);
+
+    // the stored version's short last block, if the file ends with it
+    uint64_t end = size;
+    if (tail > 0 && size - literal >= tail) {
+        const unsigned char *last_sig = sig + (blocks - 1) * DFS_DELTA_SIG;
+        DfsWeak t;
+        dfs_weak_init(&t, data + size - tail, tail);
+        if (dfs_get32(last_sig) == dfs_weak_value(&t) &&
+            dfs_get64(last_sig + 4) == dfs_delta_strong(data + size - tail, tail)) {
+            end = size - tail;
+        }
+    }
+    if (end > literal && delta_add(d, DFS_DELTA_OP_LITERAL, literal, end - literal) < 0) return -1;
+    if (end < size) {
+        if (delta_add(d, DFS_DELTA_OP_COPY, blocks - 1, 1) < 0) return -1;
+        d->copied += tail;
+    }
+    d->literal = size - d->copied;
+    return 0;
 }
 
-void receive_file(int sock, char *filename) {
-    char size_buf[32];
-    ssize_t bytes_read = 0;
-    int i = 0;
-    
-    // Read file size (with timeout)
-    fd_set readfds;
-    struct timeval tv;
-    FD_ZERO(&readfds);
-    FD_SET(sock, &readfds);
-    tv.tv_sec = 5;
-    tv.tv_usec = 0;
-    
-    if (select(sock + 1, &readfds, NULL, NULL, &tv) <= 0) {
-        printf("Timeout waiting for server response\n");
+// the PATCH request of a delta; literal bytes come straight from data
+// returns 0 or -1 if the socket failed
+int send_patch(int sock, uint32_t request_id, const char *path, const Delta *d,
+               const unsigned char *data, uint64_t size, uint64_t block) {
+    uint64_t payload = DFS_DELTA_HEADER;
+    for (size_t i = 0; i < d->count; i++) {
+        payload += d->ops[i].type == DFS_DELTA_OP_COPY ? DFS_DELTA_COPY : DFS_DELTA_LITERAL + d->ops[i].b;
+    }
+    unsigned char buf[DFS_READER_SIZE];
+    dfs_put64(buf, size);
+    dfs_put64(buf + 8, dfs_delta_strong(data, size));
+    dfs_put64(buf + 16, block);
+    size_t len = DFS_DELTA_HEADER;
+    if (dfs_send_header(sock, DFS_OP_PATCH, 0, 0, request_id, path, payload) < 0) return -1;
+
+    for (size_t i = 0; i < d->count; i++) {
+        const DeltaOp *op = &d->ops[i];
+        if (len + DFS_DELTA_COPY > sizeof(buf)) {
+            if (dfs_send_all(sock, buf, len, 0) < 0) return -1;
+            len = 0;
+        }
+        buf[len] = op->type;
+        if (op->type == DFS_DELTA_OP_COPY) {
+            dfs_put64(buf + len + 1, op->a);
+            dfs_put64(buf + len + 9, op->b);
+            len += DFS_DELTA_COPY;
+            continue;
+        }
+        dfs_put64(buf + len + 1, op->b);
+        len += DFS_DELTA_LITERAL;
+        // short literals go with the records, long ones on their own
+        if (len + op->b <= sizeof(buf)) {
+            memcpy(buf + len, data + op->a, op->b);
+            len += op->b;
+            continue;
+        }
+        if (dfs_send_all(sock, buf, len, 0) < 0 || dfs_send_all(sock, data + op->a, op->b, 0) < 0) return -1;
+        len = 0;
+    }
+    return len > 0 ? dfs_send_all(sock, buf, len, 0) : 0;
+}
+
+// upload a new version of a stored file as its changes: the signatures of
+// the stored version first, then a PATCH. a file not stored yet, or whose
+// stored version changed in between, is sent whole instead
+// returns like send_file
+int send_delta(int sock, DfsReader *rd, uint32_t request_id, char *filename, char *dest_path) {
+    char path[DFS_MAX_PATH];
+    if (upload_path(path, filename, dest_path) < 0) return -1;
+    if (send_request(sock, DFS_OP_SIGS, 0, request_id, path) < 0) return -1;
+
+    DfsHeader h;
+    if (!read_reply_header(rd, request_id, &h, NULL)) return -1;
+    if (h.status == DFS_E_NOTFOUND) {
+        if (dfs_skip(rd, h.payload_len) < 0) return -1;
+        printf("No stored version, sending the file\n");
+        return send_file(sock, rd, request_id, filename, dest_path);
+    }
+    if (h.status != DFS_OK) {
+        print_error(rd, &h);
+        return -1;
+    }
+    uint64_t sigs_len = h.payload_len;
+    if (sigs_len < DFS_DELTA_HEADER - 8 || (sigs_len - (DFS_DELTA_HEADER - 8)) % DFS_DELTA_SIG != 0) {
+        printf("Invalid response from server\n");
+        return -1;
+    }
+    unsigned char *sigs = malloc(sigs_len);
+    if (!sigs) {
+        perror("Out of memory");
+        return -1;
+    }
+    if (dfs_read_full(rd, sigs, sigs_len) < 0) {
+        printf("Server disconnected\n");
+        free(sigs);
+        return -1;
+    }
+    uint64_t block = dfs_get64(sigs);
+    uint64_t base_size = dfs_get64(sigs + 8);
+    if (block < 1 || block > DFS_DELTA_BLOCK_MAX ||
+        dfs_delta_blocks(base_size, block) != (sigs_len - (DFS_DELTA_HEADER - 8)) / DFS_DELTA_SIG) {
+        printf("Invalid response from server\n");
+        free(sigs);
+        return -1;
+    }
+
+    int fd = open(filename, O_RDONLY);
+    struct stat st;
+    if (fd < 0 || fstat(fd, &st) < 0) {
+        perror("Cannot open file");
+        if (fd >= 0) close(fd);
+        free(sigs);
+        return -1;
+    }
+    uint64_t size = st.st_size;
+    unsigned char *data = NULL;
+    if (size > 0) {
+        data = mmap(NULL, size, PROT_READ, MAP_PRIVATE, fd, 0);
+        if (data == MAP_FAILED) {
+            perror("Cannot map file");
+            close(fd);
+            free(sigs);
+            return -1;
+        }
+        madvise(data, size, MADV_SEQUENTIAL);
+    }
+    close(fd);
+
+    Delta d = {0};
+    int r = delta_compute(&d, data, size, sigs, block, base_size);
+    free(sigs);
+    if (r < 0) {
+        perror("Out of memory");
+    } else {
+        printf("Delta: %llu of %llu bytes reused from the stored version, %llu bytes to send\n",
+               (unsigned long long)d.copied, (unsigned long long)size, (unsigned long long)d.literal);
+        r = send_patch(sock, request_id, path, &d, data, size, block);
+        if (r < 0) perror("Send error");
+    }
+    free(d.ops);
+    if (data) munmap(data, size);
+    if (r < 0) return -1;
+
+    if (!read_reply_header(rd, request_id, &h, NULL)) return -1;
+    if (h.status == DFS_E_MISSING) {
+        if (dfs_skip(rd, h.payload_len) < 0) return -1;
+        printf("Stored version changed, sending the file\n");
+        return send_file(sock, rd, request_id, filename, dest_path);
+    }
+    if (h.status != DFS_OK) {
+        print_error(rd, &h);
+        return -1;
+    }
+    print_message(rd, &h);
+    return 1;
+}
+
+// send an upload compressed (DFS_F_LZ4): the size and XXH64 of the file,
+// then its blocks as chunks, each sent as soon as it is compressed. the
+// payload's length is not known up front, so it goes chunked; whether it
+// saves enough is judged by the first COMPRESS_SAMPLE_BLOCKS blocks
+// returns 1 if it was sent, 0 if the file does not shrink enough and has to
+// be sent as it is, -1 on failure
+int send_compressed(int sock, uint32_t request_id, const char *path, int fd, off_t file_size) {
+    if (file_size < DFS_LZ4_MIN) return 0;
+    unsigned char *map = mmap(NULL, file_size, PROT_READ, MAP_PRIVATE, fd, 0);
+    if (map == MAP_FAILED) return 0;
+    if (!dfs_lz4_worth(path, map, MIN(file_size, (off_t)DFS_LZ4_BLOCK))) {
+        munmap(map, file_size);
+        return 0;
+    }
+    madvise(map, file_size, MADV_SEQUENTIAL);
+
+    // the first blocks are compressed before anything goes out; a payload as
+    // large as they are is no saving, it has to stay below that by an eighth
+    int dense = compress_flags & DFS_F_DENSE;
+    unsigned char *out = malloc(DFS_LZ4_HEADER + COMPRESS_SAMPLE_BLOCKS * DFS_LZ4_CHUNK_MAX);
+    DfsLz4 *z = dfs_lz4_new();
+    size_t len = DFS_LZ4_HEADER;
+    off_t off = 0;
+    for (int i = 0; out && z && i < COMPRESS_SAMPLE_BLOCKS && off < file_size; i++) {
+        size_t n = MIN(file_size - off, (off_t)DFS_LZ4_BLOCK);
+        len += dfs_lz4_chunk(z, map + off, n, out + len, dense);
+        off += n;
+    }
+    if (!out || !z || len + DFS_CHUNK_HEADER > (size_t)(off - off / COMPRESS_SAVING_MIN)) {
+        munmap(map, file_size);
+        free(out);
+        free(z);
+        return 0;
+    }
+    DfsXxh64 hash;
+    dfs_xxh64_init(&hash);
+    dfs_xxh64_update(&hash, map, file_size);
+    dfs_put64(out, file_size);
+    dfs_put64(out + 8, dfs_xxh64_digest(&hash));
+
+    int r = dfs_send_header(sock, DFS_OP_UPLOAD, DFS_F_LZ4 | DFS_F_CHUNKED, 0, request_id, path, 0) < 0 ||
+            dfs_send_all(sock, out, len, 0) < 0 ? -1 : 1;
+    uint64_t sent = len;
+    while (r > 0 && off < file_size) {
+        size_t n = MIN(file_size - off, (off_t)DFS_LZ4_BLOCK);
+        len = dfs_lz4_chunk(z, map + off, n, out, dense);
+        if (dfs_send_all(sock, out, len, 0) < 0) r = -1;
+        sent += len;
+        off += n;
+    }
+    memset(out, 0, DFS_CHUNK_HEADER);
+    if (r > 0 && dfs_send_all(sock, out, DFS_CHUNK_HEADER, 0) < 0) r = -1;
+    sent += DFS_CHUNK_HEADER;
+    munmap(map, file_size);
+    free(out);
+    free(z);
+
+    if (r < 0) {
+        perror("Send error");
+        return -1;
+    }
+    printf("Compressed to %llu bytes (%.1f%%)\n", (unsigned long long)sent, 100.0 * sent / file_size);
+    printf("File transfer complete: %ld bytes\n", file_size);
+    return 1;
+}
+
+// read the reply header for a request; returns 1 if it is one, 0 otherwise
+// the reply path is stored in path (DFS_MAX_PATH bytes) unless that is NULL
+int read_reply_header(DfsReader *rd, uint32_t request_id, DfsHeader *h, char *path) {
+    char reply_path[DFS_MAX_PATH];
+    int r = dfs_read_header(rd, h, path ? path : reply_path, DFS_MAX_PATH);
+    if (r <= 0) {
+        if (r == 0) printf("Server disconnected\n");
+        else if (errno == EAGAIN || errno == EWOULDBLOCK) printf("Timeout waiting for server response\n");
+        else printf("Invalid response from server\n");
+        return 0;
+    }
+    if (!(h->flags & DFS_F_REPLY) || h->request_id != request_id) {
+        printf("Invalid response from server\n");
+        return 0;
+    }
+    return 1;
+}
+
+// read the reply header for a request; a failure is printed with the server's message
+// returns 1 for a successful reply, whose payload the caller reads, 0 otherwise
+// the reply path is stored in path (DFS_MAX_PATH bytes) unless that is NULL
+int read_reply(DfsReader *rd, uint32_t request_id, DfsHeader *h, char *path) {
+    if (!read_reply_header(rd, request_id, h, path)) return 0;
+    if (h->status != DFS_OK) {
+        print_error(rd, h);
+        return 0;
+    }
+    return 1;
+}
+
+// the server's message of a failed request
+void print_error(DfsReader *rd, const DfsHeader *h) {
+    char message[MAX_BUFF];
+    size_t n = MIN(h->payload_len, sizeof(message) - 1);
+    if (dfs_read_full(rd, message, n) < 0) n = 0;
+    message[n] = '\0';
+    printf("Server error: %s\n", n > 0 ? message : dfs_status_name(h->status));
+}
+
+// the status message of a successful request
+void print_message(DfsReader *rd, const DfsHeader *h) {
+    char response[MAX_BUFF];
+    size_t n = MIN(h->payload_len, sizeof(response) - 1);
+    if (dfs_read_full(rd, response, n) < 0) {
+        printf("Server disconnected\n");
         return;
     }
-    
-    // Read size character by character until newline
-    memset(size_buf, 0, sizeof(size_buf));
-    while (i < sizeof(size_buf) - 1) {
-        if (recv(sock, &size_buf[i], 1, 0) <= 0) {
-            printf("Failed to read file size\n");
+    response[n] = '\0';
+    printf("Server: %s\n", response);
+}
+
+// reply carrying a status message, for uploads and removals
+void receive_message(DfsReader *rd, uint32_t request_id) {
+    DfsHeader h;
+    if (read_reply(rd, request_id, &h, NULL)) print_message(rd, &h);
+}
+
+// metadata of a file, as lines ready to print
+void receive_stat(DfsReader *rd, uint32_t request_id) {
+    DfsHeader h;
+    if (!read_reply(rd, request_id, &h, NULL)) return;
+
+    char response[DFS_MAX_PATH + 256];
+    size_t n = MIN(h.payload_len, sizeof(response) - 1);
+    if (dfs_read_full(rd, response, n) < 0) {
+        printf("Server disconnected\n");
+        return;
+    }
+    response[n] = '\0';
+    printf("%s", response);
+}
+
+// name of the file that marks a partial download and holds the tag of the
+// version its bytes came from; marker has PATH_MAX bytes
+void partial_marker(char *marker, const char *filename) {
+    snprintf(marker, PATH_MAX, "%s.dfspart", filename);
+}
+
+// the tag a partial download was made from, into tag (DFS_MAX_PATH bytes),
+// with the size and checksum it names; returns 0, or -1 if there is no usable marker
+int read_partial(const char *marker, char *tag, uint64_t *size, uint64_t *checksum) {
+    FILE *f = fopen(marker, "r");
+    if (!f) return -1;
+    int ok = fgets(tag, DFS_MAX_PATH, f) != NULL;
+    fclose(f);
+    if (!ok) return -1;
+    tag[strcspn(tag, "\n")] = '\0';
+    return dfs_file_tag_parse(tag, size, checksum);
+}
+
+// mark a download as resumable before its bytes arrive, so that even a
+// killed client leaves the marker behind. a reply path that is no tag means
+// S1 could not name the version: nothing to resume. returns 1 if marked
+int mark_partial(const char *marker, const char *tag) {
+    uint64_t size, checksum;
+    if (dfs_file_tag_parse(tag, &size, &checksum) < 0) return 0;
+    FILE *f = fopen(marker, "w");
+    if (!f) return 0;
+    fprintf(f, "%s\n", tag);
+    fclose(f);
+    return 1;
+}
+
+// clean up after a complete download, or tell how to go on with a broken one
+void end_partial(const char *marker, int marked, int complete) {
+    if (complete) unlink(marker);
+    else if (marked) printf("Partial file kept, run the download again to resume it\n");
+}
+
+// XXH64 of a local file; returns 0, or -1 if it cannot be read
+int hash_local_file(const char *filename, uint64_t *checksum) {
+    int fd = open(filename, O_RDONLY);
+    if (fd < 0) return -1;
+    char buffer[DFS_READER_SIZE];
+    DfsXxh64 hash;
+    dfs_xxh64_init(&hash);
+    ssize_t n;
+    while ((n = read(fd, buffer, sizeof(buffer))) > 0) dfs_xxh64_update(&hash, buffer, n);
+    close(fd);
+    if (n < 0) return -1;
+    *checksum = dfs_xxh64_digest(&hash);
+    return 0;
+}
+
+// download a whole file. a partial file left by a broken download is
+// resumed where it stops, if S1 still has the version it came from; the
+// result is then checked against that version's checksum
+void download_file(int sock, DfsReader *rd, uint32_t request_id, uint32_t *next_id, char *path, char *filename) {
+    char marker[PATH_MAX];
+    char tag[DFS_MAX_PATH];
+    struct stat st;
+    uint64_t size, checksum;
+    DfsHeader h;
+    partial_marker(marker, filename);
+    if (read_partial(marker, tag, &size, &checksum) == 0 && stat(filename, &st) == 0 && st.st_size > 0 && (uint64_t)st.st_size <= size) {
+        printf("Resuming %s at %ld of %llu bytes\n", filename, (long)st.st_size, (unsigned long long)size);
+        if (send_range_request(sock, request_id, path, st.st_size, 0, tag) < 0 ||
+            !read_reply_header(rd, request_id, &h, NULL)) {
             return;
         }
-        if (size_buf[i] == '\n') {
-            size_buf[i] = '\0';
-            break;
+        if (h.status == DFS_OK) {
+            int complete = receive_payload(rd, &h, filename, 0, st.st_size);
+            uint64_t got;
+            if (complete && checksum && (hash_local_file(filename, &got) < 0 || got != checksum)) {
+                printf("Resumed file does not match the server's checksum, removed\n");
+                unlink(filename);
+                unlink(marker);
+                return;
+            }
+            end_partial(marker, 1, complete);
+            return;
         }
-        i++;
+        if (h.status != DFS_E_MISSING) {
+            print_error(rd, &h);
+            return;
+        }
+        // the file changed since: the partial copy is of no use
+        if (dfs_skip(rd, h.payload_len) < 0) return;
+        printf("%s changed on the server, downloading it again\n", filename);
+        unlink(marker);
+        request_id = (*next_id)++;
     }
-    
-    // Check if size starts with "ERR:"
-    if (strncmp(size_buf, "ERR:", 4) == 0) {
-        printf("Server error: %s\n", size_buf);
+
+    if (send_request(sock, DFS_OP_DOWNLOAD, compress_flags, request_id, path) < 0 ||
+        !read_reply(rd, request_id, &h, tag)) {
         return;
     }
-    
-    off_t file_size = atol(size_buf);
-    if (file_size <= 0) {
-        printf("Invalid file size received: %s\n", size_buf);
-        return;
+    int marked = mark_partial(marker, tag);
+    end_partial(marker, marked, receive_payload(rd, &h, filename, 0, -1));
+}
+
+// a whole file, or with an offset of 0 or more the bytes of a range: those
+// are written into the file where they belong, the rest of it is kept
+void receive_file(DfsReader *rd, uint32_t request_id, char *filename, int is_tar, off_t offset) {
+    DfsHeader h;
+    if (read_reply(rd, request_id, &h, NULL)) receive_payload(rd, &h, filename, is_tar, offset);
+}
+
+// the payload of a successful reply into the file, as receive_file
+// returns 1 if all of it arrived, 0 otherwise
+int receive_payload(DfsReader *rd, const DfsHeader *h, char *filename, int is_tar, off_t offset) {
+    if ((h->flags & DFS_F_CHUNKED) && (h->flags & DFS_F_LZ4)) return receive_compressed(rd, filename);
+    if (h->flags & DFS_F_CHUNKED) return receive_chunks(rd, filename);
+
+    off_t file_size = h->payload_len;
+    if (file_size == 0 && is_tar) {
+        printf("No files of this type found\n");
+        return 1;
     }
-    
-    printf("Receiving file: %s (%ld bytes)\n", filename, file_size);
-    
+
+    if (offset < 0) printf("Receiving file: %s (%ld bytes)\n", filename, file_size);
+    else printf("Receiving file: %s (%ld bytes at offset %ld)\n", filename, file_size, offset);
+
     // Create file
-    int fd = open(filename, O_WRONLY | O_CREAT | O_TRUNC, 0666);
-    if (fd < 0) {
+    int fd = open(filename, O_WRONLY | O_CREAT | (offset < 0 ? O_TRUNC : 0), 0666);
+    if (fd < 0 || (offset > 0 && lseek(fd, offset, SEEK_SET) < 0)) {
         perror("Cannot create file");
-        return;
+        if (fd >= 0) close(fd);
+        return 0;
     }
-    
-    char buffer[MAX_BUFF];
+
+    char buffer[DFS_READER_SIZE];
     off_t total_received = 0;
-    
+
     while (total_received < file_size) {
-        // Set timeout for each read
-        FD_ZERO(&readfds);
-        FD_SET(sock, &readfds);
-        tv.tv_sec = 10;
-        tv.tv_usec = 0;
-        
-        if (select(sock + 1, &readfds, NULL, NULL, &tv) <= 0) {
-            printf("\nTimeout waiting for data\n");
-            break;
-        }
-        
-        bytes_read = recv(sock, buffer, MIN(MAX_BUFF, file_size - total_received), 0);
+        ssize_t bytes_read = dfs_reader_read(rd, buffer, MIN((off_t)sizeof(buffer), file_size - total_received));
         if (bytes_read <= 0) {
-            if (bytes_read < 0) perror("Receive error");
+            if (bytes_read < 0 && (errno == EAGAIN || errno == EWOULDBLOCK)) printf("\nTimeout waiting for data\n");
+            else if (bytes_read < 0) perror("Receive error");
             else printf("\nServer closed connection\n");
             break;
         }
-        
+
         ssize_t bytes_written = write(fd, buffer, bytes_read);
         if (bytes_written < 0) {
             perror("Write error");
             break;
         }
-        
+
         total_received += bytes_read;
-        
+
         // Show progress
         float percent = (float)total_received / file_size * 100.0;
         printf("\rProgress: %.1f%% (%ld/%ld bytes)", percent, total_received, file_size);
         fflush(stdout);
     }
-    
+
     close(fd);
-    
+
     if (total_received == file_size) {
         printf("\nDownload complete: %s (%ld bytes)\n", filename, total_received);
+        return 1;
+    }
+    printf("\nIncomplete download: %ld/%ld bytes received\n", total_received, file_size);
+    return 0;
+}
+
+// chunked payload of unknown length, e.g. a tar archive that is sent while the
+// server is still collecting its files. the file is created with the first data
+// returns 1 if all of it arrived, 0 otherwise
+int receive_chunks(DfsReader *rd, char *filename) {
+    char buffer[DFS_READER_SIZE];
+    unsigned char chunk_header[DFS_CHUNK_HEADER];
+    int fd = -1;
+    off_t total_received = 0;
+    int complete = 0;
+
+    while (dfs_read_full(rd, chunk_header, sizeof(chunk_header)) == 0) {
+        uint64_t chunk_left = dfs_get64(chunk_header);
+        if (chunk_left == 0) {
+            complete = 1;
+            break;
+        }
+        if (fd < 0) {
+            printf("Receiving file: %s\n", filename);
+            fd = open(filename, O_WRONLY | O_CREAT | O_TRUNC, 0666);
+            if (fd < 0) {
+                perror("Cannot create file");
+                return 0;
+            }
+        }
+        while (chunk_left > 0) {
+            ssize_t bytes_read = dfs_reader_read(rd, buffer, MIN(sizeof(buffer), chunk_left));
+            if (bytes_read <= 0) break;
+            if (write(fd, buffer, bytes_read) != bytes_read) {
+                perror("Write error");
+                close(fd);
+                return 0;
+            }
+            chunk_left -= bytes_read;
+            total_received += bytes_read;
+        }
+        printf("\rReceived: %ld bytes", total_received);
+        fflush(stdout);
+        if (chunk_left > 0) break;
+    }
+
+    if (fd >= 0) close(fd);
+    if (!complete) {
+        printf("\nIncomplete download: %ld bytes received\n", total_received);
+    } else if (total_received == 0) {
+        printf("No files of this type found\n");
     } else {
-        printf("\nIncomplete download: %ld/%ld bytes received\n", total_received, file_size);
+        printf("\nDownload complete: %s (%ld bytes)\n", filename, total_received);
     }
+    return complete;
 }
 
-void receive_tar(int sock, char *filetype) {
+// compressed payload (DFS_F_LZ4), decoded into the file as it arrives
+// returns 1 if all of it arrived, 0 otherwise
+int receive_compressed(DfsReader *rd, char *filename) {
+    int fd = open(filename, O_WRONLY | O_CREAT | O_TRUNC, 0666);
+    if (fd < 0) {
+        perror("Cannot create file");
+        return 0;
+    }
+    printf("Receiving file: %s (compressed)\n", filename);
+    uint64_t written;
+    int status = dfs_lz4_recv(rd, NULL, fd, &written, NULL);
+    close(fd);
+    if (status == DFS_OK) {
+        printf("Download complete: %s (%llu bytes)\n", filename, (unsigned long long)written);
+    } else if (status == DFS_E_IO) {
+        perror("Write error");
+    } else {
+        printf("%s: %llu bytes received\n", status == DFS_E_INVALID ? "Invalid compressed data" : "Incomplete download",
+               (unsigned long long)written);
+    }
+    return status == DFS_OK;
+}
+
+void receive_tar(DfsReader *rd, uint32_t request_id, char *filetype) {
     // Determine filename based on filetype
     char filename[32];
     switch(filetype[0]) {
@@ -465,86 +1201,92 @@ void receive_tar(int sock, char *filetype) {
         case 'z': strcpy(filename, "zip_files.tar"); break;
         default: strcpy(filename, "files.tar");
     }
-    
+
     // Receive the file using the common receive function
-    receive_file(sock, filename);
+    receive_file(rd, request_id, filename, 1, -1);
 }
 
-void receive_filenames(int sock) {
-    char count_buf[32];
-    int i = 0;
-    
-    // Read count character by character until newline
-    memset(count_buf, 0, sizeof(count_buf));
-    while (i < sizeof(count_buf) - 1) {
-        if (recv(sock, &count_buf[i], 1, 0) <= 0) {
-            printf("Failed to read file count\n");
-            return;
+// lines of a listing as they arrive, the header goes out with the first one
+void print_listing(const char *lines, size_t len, int *file_count) {
+    if (len == 0) return;
+    if (*file_count == 0) {
+        printf("\nFile listing:\n");
+        printf("-------------------------------------------\n");
+    }
+    fwrite(lines, 1, len, stdout);
+    for (size_t i = 0; i < len; i++) {
+        if (lines[i] == '\n') (*file_count)++;
+    }
+}
+
+void receive_filenames(DfsReader *rd, uint32_t request_id, char *pathname, char *limit, int long_list) {
+    DfsHeader h;
+    char token[DFS_MAX_PATH];
+    if (!read_reply(rd, request_id, &h, token)) return;
+
+    // one "name (type)" per line, after size and mtime in a long listing; a whole listing is streamed in chunks and
+    // printed as S1 merges it, a page comes in one piece
+    char buffer[DFS_READER_SIZE];
+    int file_count = 0;
+    int complete = 0;
+    if (h.flags & DFS_F_CHUNKED) {
+        unsigned char chunk_header[DFS_CHUNK_HEADER];
+        while (dfs_read_full(rd, chunk_header, sizeof(chunk_header)) == 0) {
+            uint64_t chunk_left = dfs_get64(chunk_header);
+            if (chunk_left == 0) {
+                complete = 1;
+                break;
+            }
+            if (chunk_left > sizeof(buffer) || dfs_read_full(rd, buffer, chunk_left) < 0) break;
+            print_listing(buffer, chunk_left, &file_count);
         }
-        if (count_buf[i] == '\n') {
-            count_buf[i] = '\0';
-            break;
+    } else {
+        uint64_t left = h.payload_len;
+        while (left > 0) {
+            ssize_t n = dfs_reader_read(rd, buffer, MIN(sizeof(buffer), left));
+            if (n <= 0) break;
+            print_listing(buffer, n, &file_count);
+            left -= n;
         }
-        i++;
+        complete = left == 0;
     }
-    
-    // Check if count starts with "ERR:"
-    if (strncmp(count_buf, "ERR:", 4) == 0) {
-        printf("Server error: %s\n", count_buf);
+
+    if (file_count > 0) printf("-------------------------------------------\n");
+    if (!complete) {
+        printf("Failed to read file listing\n");
         return;
     }
-    
-    int file_count = atoi(count_buf);
     printf("Files found: %d\n", file_count);
-    
-    if (file_count == 0) {
-        printf("No files found in the specified path\n");
-        return;
-    }
-    
-    // Read each filename
-    char buffer[MAX_BUFF];
-    printf("\nFile listing:\n");
-    printf("-------------------------------------------\n");
-    
-    for (int j = 0; j < file_count; j++) {
-        // Clear buffer
-        memset(buffer, 0, MAX_BUFF);
-        
-        // Read filename character by character until newline
-        i = 0;
-        while (i < MAX_BUFF - 1) {
-            if (recv(sock, &buffer[i], 1, 0) <= 0) {
-                printf("Failed to read filename\n");
-                return;
-            }
-            if (buffer[i] == '\n') {
-                buffer[i] = '\0';
-                break;
-            }
-            i++;
-        }
-        
-        printf("%s\n", buffer);
+    if (file_count == 0) printf("No files found in the specified path\n");
+
+    if (h.path_len > 0) {
+        printf("More files: dispfnames %s%s %s ", long_list ? "-l " : "", pathname, limit);
+        for (uint32_t i = 0; i < h.path_len; i++) printf("%02x", (unsigned char)token[i]);
+        printf("\n");
     }
-    printf("-------------------------------------------\n");
 }
 
 void print_help() {
     printf("\nAvailable commands:\n");
     printf("-------------------------------------------\n");
     printf("--> uploadf <filename> <destination_path>  - Upload a file to server\n");
-    printf("-->downlf <filepath>                     - Download a file from server\n");
+    printf("-->updatef <filename> <destination_path> - Send only the changes of a stored file\n");
+    printf("-->downlf <filepath> [offset [length]]   - Download a file (resuming a broken one), or a byte range of it\n");
     printf("-->removef <filepath>                    - Remove a file from server\n");
     printf("-->downltar <filetype>                   - Download all files of specified type as tar\n");
     printf("                                         where filetype is: c, p, t, or z\n");
-    printf("-->dispfnames <pathname>                 - Display filenames in specified path\n");
+    printf("-->dispfnames [-l] <pathname> [limit [token]] - Display filenames in specified path\n");
+    printf("                                         limit pages the listing, token resumes it\n");
+    printf("                                         -l shows size and modification time\n");
+    printf("-->stat <filepath>                       - Show size, time and checksum of a file\n");
     printf("-->help                                  - Show this help message\n");
     printf("-->exit/quit                             - Exit the client\n");
     printf("-------------------------------------------\n");
     printf("Note: All paths must start with ~S1/\n");
+    printf("Start the client with -z off|fast|dense to set how file transfers are compressed\n");
     printf("Example: uploadf myfile.c ~S1/projects/\n");
     printf("Example: downlf ~S1/projects/myfile.c\n");
+    printf("Example: downlf ~S1/logs/app.txt 1048576 4096\n");
 }
 
 int connect_to_server() {
@@ -570,8 +1312,10 @@ int connect_to_server() {
     struct timeval tv;
     tv.tv_sec = 3;  // 3 sec timeout
     tv.tv_usec = 0;
-    setsockopt(sock, SOL_SOCKET, SO_RCVTIMEO, (const char*)&tv, sizeof tv);
     setsockopt(sock, SOL_SOCKET, SO_SNDTIMEO, (const char*)&tv, sizeof tv);
+    // replies to uploads arrive only after S1 forwarded the file
+    tv.tv_sec = 30;
+    setsockopt(sock, SOL_SOCKET, SO_RCVTIMEO, (const char*)&tv, sizeof tv);
     
     // Connect to S1
     if (connect(sock, (struct sockaddr *)&serv_addr, sizeof(serv_addr)) < 0) {
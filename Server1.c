@@ -1,3 +1,4 @@
+#define _GNU_SOURCE
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
@@ -6,6 +7,11 @@
 #include <netinet/in.h>
 #include <sys/types.h>
 #include <sys/wait.h>
+#include <sys/sendfile.h>
+#include <sys/epoll.h>
+#include <sys/eventfd.h>
+#include <sys/resource.h>
+#include <sys/file.h>
 #include <dirent.h>
 #include <fcntl.h>
 #include <libgen.h>
@@ -13,6 +19,20 @@
 #include <sys/stat.h>
 #include <ftw.h>
 #include <limits.h>
+#include <errno.h>
+#include <signal.h>
+#include <pthread.h>
+#include <time.h>
+#include <sys/time.h>
+#include <sched.h>
+#include "dfs_proto.h"
+#include "dfs_dir.h"
+#include "dfs_tar.h"
+#include "dfs_list.h"
+#include "dfs_hash.h"
+#include "dfs_index.h"
+#include "dfs_delta.h"
+#include "dfs_lz4.h"
 
 #define MIN(a, b) ((a) < (b) ? (a) : (b))
 #define PORT 9080
@@ -20,59 +40,474 @@
 #define S2_PORT 9081
 #define S3_PORT 9082
 #define S4_PORT 9083
+#define MAX_EVENTS 512
+#define IO_CHUNK 65536              // bytes moved per read/write step
+#define HIGH_WATER (4 * IO_CHUNK)   // stop producing output for a peer above this
+#define RELAY_PIPE_SIZE (1 << 20)   // pipe capacity asked for when splicing relays
+#define LIST_SOURCES 4              // dispfnames merges S1's .c files and S2-S4
+#define LIST_TYPES "cptz"           // type of each source, ties between equal names go in this order
+#define LIST_PAGE_MAX 10000         // most names on one page of a listing
+#define LIST_FORMAT_EXTRA 64        // a formatted line's bytes beyond its name
+#define POOL_MAX_IDLE 64            // idle connections kept per storage server and loop
+#define HEALTH_INTERVAL 15          // sec idle before a pooled connection is pinged
+#define PING_TIMEOUT 5              // sec to wait for the ping reply
+#define INDEX_RETRY 5               // sec before a storage server that missed its scan is asked again
+#define INDEX_SCAN_TIMEOUT 60       // sec a scan may stall before it is given up
+#define INDEX_DIR "~/S1_index"      // snapshot and log of the index
+#define LOCK_FILE "~/S1_index.lock" // held while an S1 owns the index, log and cache
+#define INDEX_COMPACT_BYTES (16 << 20)  // log size at which it is folded into a new snapshot
+#define INDEX_LOCK_SHARDS 16        // reader shards of the index lock
+#define HINT_SLOTS 65536            // content hints kept for uploads by hash
+#define HELPER_THREADS 4            // threads doing the file work that would block a loop
+#define CACHE_MEM_MB 64             // default size of the read cache's memory tier
+#define CACHE_SPILL_MB 256          // and of its spill tier on disk
+#define CACHE_FILE_MAX (4 << 20)    // largest download reply the cache keeps
+#define CACHE_BUCKETS 1024         // hash chains of each cache shard
+#define CACHE_SHARDS 16             // most shards the read cache is split in, by key
+#define CACHE_DIR "~/S1_cache"      // files of the spill tier, emptied at startup
 
-// Structure to hold file names for sorting
+// growable byte buffer, bytes in [off, len) are still pending
 typedef struct {
-    char name[256];
-    char type;  
-} FileEntry;
+    char *data;
+    size_t off;
+    size_t len;
+    size_t cap;
+} Buf;
+
+// states of the per-connection state machine
+enum conn_state {
+    ST_CMD,             // waiting for the next request header and path
+    ST_UPLOAD_BODY,     // client -> local file
+    ST_UPLOAD_CLAIM,    // waiting for the size and checksum of an upload by hash or a compressed one
+    ST_UPLOAD_LZ4,      // client -> compressed upload decoded into a local file
+    ST_LINK_ACK,        // waiting for the reply to a LINK of an upload by hash
+    ST_PATCH_HEADER,    // waiting for the header of a delta upload
+    ST_PATCH_BODY,      // client -> changes applied to a local file
+    ST_SEND_SIGS,       // block signatures of a local file -> client
+    ST_DISCARD,         // skipping the payload of a rejected request
+    ST_STREAM_BODY,     // client -> storage server, cut through without staging
+    ST_FORWARD_ACK,     // waiting for the reply to a forwarded upload
+    ST_SEND_FILE,       // local file -> client
+    ST_SEND_LZ4,        // local file -> compressed -> client
+    ST_SEND_TAR,        // tar of the local .c files -> client
+    ST_SEND_CACHED,     // download reply held by the read cache -> client
+    ST_RELAY_HEADER,    // waiting for the reply header of a download or tar
+    ST_RELAY_BODY,      // storage server -> client
+    ST_REMOVE_ACK,      // waiting for the reply to a remote remove
+    ST_LIST_ARGS,       // waiting for the limit and resume token of a listing
+    ST_RANGE_ARGS,      // waiting for the offset and length of a range download
+    ST_LIST_MERGE,      // merging the sorted listings of S1 and S2-S4 -> client
+    ST_JOB,             // file work that blocks is done on a helper thread, the loop waits for it
+    ST_WAL_SYNC,        // reply held back until the index change it reports is on disk
+    ST_DONE             // flush pending output, then close
+};
+
+enum endpoint_kind { EP_LISTEN, EP_CLIENT, EP_BACKEND, EP_LIST, EP_IDLE, EP_WAL, EP_JOB };
+
+struct Conn;
+struct EventLoop;
+struct PooledConn;
+
+// one per registered socket, handed back by epoll_wait
+typedef struct {
+    int fd;
+    int kind;
+    int registered;
+    uint32_t events;        // interest currently registered with epoll
+    struct Conn *conn;
+    struct PooledConn *pooled;
+} Endpoint;
+
+// one sorted listing merged into a dispfnames reply: the local .c files, or a
+// storage server answering on a connection of its own
+typedef struct {
+    Endpoint ep;            // first member, so the epoll event leads back here
+    int port;               // 0 for the local .c files
+    char type;
+    int active;             // names left to merge
+    int connecting;
+    int eof;
+    int error;
+    int reused;
+    int retried;
+    int header_done;
+    int from_index;         // the names come from S1's index, no request is sent
+    off_t rx;
+    uint32_t id;
+    uint64_t chunk_left;    // bytes left in the current chunk of names
+    int last_chunk;         // no chunk follows the current one
+    Buf in;
+    Buf out;
+} ListSource;
+
+// a client connection and the storage server connection it is using
+typedef struct Conn {
+    struct EventLoop *loop;
+    Endpoint cli;
+    Endpoint be;
+    int state;
+    int cli_eof;
+    int be_eof;
+    int be_connecting;
+    int be_error;
+    int be_reused;          // storage server connection came from the pool
+    int be_retried;         // request was already retried on a fresh connection
+    off_t be_rx;            // response bytes received for the current request
+    uint32_t be_id;         // request id the storage server has to echo
+    int be_op;
+    unsigned char be_request[DFS_HEADER_SIZE + 2 * DFS_MAX_PATH + 8];     // and a LINK's payload
+    size_t be_request_len;
+    int dead;
+    Buf in;                 // read from client, not yet consumed
+    Buf out;                // queued for client
+    Buf bin;                // read from storage server
+    Buf bout;               // queued for storage server
+    DfsHeader req;          // request being served
+    uint64_t req_body;      // payload bytes of the request not read from the client yet
+    int req_chunked;        // the payload is chunked, req_body stays open until its empty chunk
+    uint64_t chunk_left;    // bytes before the next chunk header of such a payload
+    unsigned char chunk_head[DFS_CHUNK_HEADER];
+    size_t chunk_head_len;
+    char path[DFS_MAX_PATH];
+    int file_fd;
+    off_t remaining;        // bytes left in the body being moved
+    int target_port;
+    DfsXxh64 upload_hash;   // checksum of the upload so far, kept in the index
+    char upload_tmp[PATH_MAX];  // a local upload is written here, then renamed into place
+    uint64_t claim_size;    // content of an upload by hash or compressed, or of a patch's new version
+    uint64_t claim_checksum;
+    unsigned char claim_digest[DFS_SHA256_SIZE];    // SHA-256 of an upload by hash
+    uint64_t stream_from;   // req_body when the payload started going to the storage server
+    int base_fd;            // stored version a patch is applied to
+    uint64_t delta_block;   // block size of the signatures or patch being handled
+    uint64_t delta_size;    // size of the stored version
+    uint64_t delta_off;     // next block to sign, or where the copy being applied reads
+    uint64_t delta_copy;    // bytes of that copy left
+    uint64_t delta_literal; // literal bytes of the patch record left
+    uint64_t delta_written; // bytes of the new version so far
+    unsigned char *lz4_chunk;   // chunk of a compressed upload being gathered, DFS_LZ4_CHUNK_MAX bytes
+    size_t lz4_len;
+    uint64_t lz4_written;   // bytes the upload decoded to so far
+    DfsTarWalk tar;         // walk of a local tar being sent
+    off_t tar_pad;          // zeros owed after the current member
+    char local_path[PATH_MAX];
+    int relay_chunked;      // the relayed reply is a chunked payload
+    int cache_filling;      // the relayed download is copied into cache_fill for the read cache
+    int cache_lz4;          // it is a compressed reply
+    DfsIndexEntry cache_index;  // the file as the index had it when the download was asked for
+    Buf cache_fill;
+    struct CacheEntry *cache_entry;     // held while a reply is sent from it
+    uint64_t cache_end;     // where the bytes sent from it end
+    uint64_t range_off;     // part of the file a DFS_F_RANGE download asks for,
+    uint64_t range_len;     // a length of 0 for the rest of it
+    char range_tag[DFS_FILE_TAG + 1];   // version the range has to come from, empty for any
+    char file_tag[DFS_FILE_TAG + 1];    // version of the file being sent, named in the reply path
+    int pipe_fd[2];         // storage server -> client relays are spliced through this
+    size_t pipe_len;        // relay bytes sitting in the pipe
+    size_t pipe_size;
+    ListSource lists[LIST_SOURCES];     // dispfnames sources, queried all at once
+    uint64_t list_limit;    // names on a page of the listing, 0 streams all of it
+    int list_long;          // names with size and mtime (DFS_F_LONG)
+    uint64_t list_count;    // names merged into the reply so far
+    int list_more;          // the page is full and more names follow
+    int list_after_source;  // source of the resume token's name
+    char list_after[DFS_LIST_NAME_MAX + 2];     // resume token: type letter, then a name
+    Buf list_page;          // a page goes out whole, its header carries the next token
+    uint64_t wal_lsn;       // log record of the index change the reply waits for
+    int sync_status;        // the held back reply
+    char sync_msg[64];
+    int wal_waiting;        // on the loop's list of replies waiting for the log
+    struct Conn *next_wal_waiter;
+    void (*job)(struct Conn *c);        // run on a helper thread in ST_JOB,
+    void (*job_done)(struct Conn *c);   // then on the loop, even if the client left meanwhile
+    int job_running;        // a helper thread has the connection, it is not freed until it is back
+    int job_status;
+    time_t commit_mtime;    // of the new version a local commit put in place
+    const char *commit_msg; // reply to a local commit that went through
+    struct Conn *next_job;
+    struct Conn *next_dead;
+} Conn;
+
+// an idle storage server connection parked in the pool of one event loop
+typedef struct PooledConn {
+    Endpoint ep;
+    int port;
+    int dead;
+    time_t idle_since;
+    time_t ping_sent;       // non-zero while a health check is in flight
+    uint32_t ping_id;
+    unsigned char pong[DFS_HEADER_SIZE];
+    size_t pong_len;
+    struct PooledConn *next;
+} PooledConn;
+
+// idle connections to one storage server, most recently used first
+typedef struct {
+    PooledConn *idle;
+    int count;
+} BackendPool;
+
+typedef struct EventLoop {
+    int id;
+    int epfd;
+    Endpoint listener;
+    Conn *dead;             // closed during this batch, freed after it
+    BackendPool pools[3];   // S2, S3, S4
+    PooledConn *dead_pooled;
+    time_t last_health_check;
+    uint32_t next_request_id;
+    int no_splice;          // splice() was refused once, relays copy through buffers
+    int no_sendfile;        // same for sendfile() and local files
+    Endpoint wal_event;     // eventfd the log writer signals after each fsync
+    Conn *wal_waiters;
+    Endpoint job_event;     // eventfd the helper threads signal when they hand connections back
+    pthread_mutex_t job_lock;
+    Conn *jobs_done;        // connections back from a helper thread, guarded by job_lock
+} EventLoop;
+
+// what the index holds of one listing source: S1's .c files, or S2-S4
+typedef struct {
+    int ready;              // every file of the source is in the index
+    int scanning;           // a scan is being merged, removes leave tombstones
+    int scan_failed;        // the scan in progress cannot be trusted to be complete
+    uint64_t scan_seq;      // index changes made before the scan began
+    uint32_t scan_mark;     // entries the scan saw carry this
+} IndexSource;
+
+// one directory listing filled from the index
+typedef struct {
+    Conn *c;
+    uint64_t limit;         // names per source, 0 for all
+    uint64_t counts[LIST_SOURCES];
+    int open;               // sources still taking names
+} ListIndexWalk;
+
+// write-ahead log of the index. changes are appended under the index lock,
+// and one thread writes and fsyncs whatever piled up meanwhile in one go, so
+// a whole batch of uploads and removes shares a single fsync
+typedef struct {
+    pthread_mutex_t lock;
+    pthread_cond_t wake;        // records to write or a new file to start
+    pthread_cond_t synced;      // a batch reached the disk
+    Buf pending;                // records not written yet
+    uint64_t appended;          // number of the last record appended
+    uint64_t durable;           // last record on disk, read by the loops without the lock
+    uint64_t gen;               // generation of the file being written
+    uint64_t rotate_gen;        // above gen: the bytes after rotate_at start this file
+    size_t rotate_at;
+    uint64_t bytes;             // logged since the last snapshot
+    int fd;
+    int failed;                 // the index is not persisted any more
+} IndexWal;
+
+// connections waiting for a helper thread, first come first served
+typedef struct {
+    pthread_mutex_t lock;
+    pthread_cond_t wake;
+    Conn *head;
+    Conn *tail;
+} JobQueue;
+
+// where content with a checksum was last seen stored, for uploads by hash.
+// a hint only names a candidate, the index entry of its path has the say
+typedef struct {
+    uint64_t checksum;
+    int port;
+    char *key;              // NULL while the slot is free
+} ContentHint;
+
+// one download reply kept by the read cache, in memory or spilled to a file
+typedef struct CacheEntry {
+    char *key;              // index key of the file
+    size_t key_len;
+    int lz4;                // the payload is the chunks of a compressed reply, else the file as it is
+    DfsIndexEntry e;        // the file as the index had it; the entry is only good while it still does
+    char *data;             // the payload, NULL in the spill tier
+    uint64_t len;
+    uint64_t spill_id;      // name of its file in CACHE_DIR
+    int refs;               // the cache's own, and one per reply being sent from data
+    struct CacheShard *shard;   // the one its key hashes to
+    struct CacheEntry *hnext;
+    struct CacheEntry *prev;    // LRU order within its tier, most recently used first
+    struct CacheEntry *next;
+} CacheEntry;
+
+// one tier of the read cache
+typedef struct {
+    CacheEntry *head;
+    CacheEntry *tail;
+    uint64_t bytes;
+    uint64_t max;           // 0 turns the tier off
+} CacheTier;
+
+// the read cache is split by key so loops serving different files do not
+// wait on one lock; each shard keeps its share of both tiers in LRU order
+// of its own, and on a cache line of its own
+typedef struct CacheShard {
+    pthread_mutex_t lock;
+    CacheEntry *buckets[CACHE_BUCKETS];
+    CacheTier mem;          // hot download replies of S2-S4
+    CacheTier spill;        // what the memory tier evicted, kept in CACHE_DIR
+} __attribute__((aligned(64))) CacheShard;
+
+// the namespace index, shared by every loop: what S1 stores and where
+DfsIndex file_index;
+IndexSource index_sources[LIST_SOURCES];
+// the index lock, split in shards on cache lines of their own so readers on
+// different loops do not bounce one line: a reader takes the shard of its
+// thread, a writer every shard
+typedef struct {
+    pthread_rwlock_t lock;
+} __attribute__((aligned(64))) IndexLockShard;
+IndexLockShard index_lock[INDEX_LOCK_SHARDS] = {
+    [0 ... INDEX_LOCK_SHARDS - 1] = { PTHREAD_RWLOCK_INITIALIZER }
+};
+int index_compacting;           // a snapshot is being written, removes leave tombstones
+uint32_t index_snapshot_ready;  // sources complete in the last snapshot
+unsigned char *index_base_seen; // snapshot entries the scan in progress saw
+IndexWal index_wal = { .lock = PTHREAD_MUTEX_INITIALIZER, .wake = PTHREAD_COND_INITIALIZER,
+                       .synced = PTHREAD_COND_INITIALIZER, .fd = -1 };
+ContentHint content_hints[HINT_SLOTS];     // direct mapped, a new hint replaces the old one
+pthread_mutex_t hint_lock = PTHREAD_MUTEX_INITIALIZER;
+CacheShard cache_shards[CACHE_SHARDS] = {
+    [0 ... CACHE_SHARDS - 1] = { .lock = PTHREAD_MUTEX_INITIALIZER }
+};
+int cache_shard_count;          // shards in use, a power of two; 0 turns the cache off
+uint64_t cache_next_spill;
+int cache_dir_fd = -1;
+char cache_dir[PATH_MAX];
+unsigned int upload_seq;        // makes temp file names of concurrent uploads unique
+JobQueue job_queue = { .lock = PTHREAD_MUTEX_INITIALIZER, .wake = PTHREAD_COND_INITIALIZER };
+EventLoop *event_loops;
+int event_loop_count;
 
 // Function declarations
-void process_client(int client_sock);
-ssize_t read_until(int sock, char *buf, char delim);
 void mkdirp(const char *path);
-void forward_file(char *filename, char *dest_path, int target_port);
-void handle_uploadf_command(int client_sock, char *filename, char *dest_path);
-void handle_downlf_command(int client_sock, char *filepath);
-void handle_removef_command(int client_sock, char *filepath);
-void handle_downltar_command(int client_sock, char *filetype);
-void handle_dispfnames_command(int client_sock, char *pathname);
 char* expand_path(const char* path);
-void get_file_from_server(int server_port, char *filepath, int client_sock);
-void remove_file_from_server(int server_port, char *filepath);
-void get_tar_from_server(int server_port, char *filetype, int client_sock);
-void get_filenames_from_server(int server_port, char *pathname, FileEntry *entries, int *count);
-int compare_file_entries(const void *a, const void *b);
+void buf_append(Buf *b, const void *data, size_t n);
+void buf_consume(Buf *b, size_t n);
+Conn *conn_new(EventLoop *loop, int fd);
+void conn_close(Conn *c);
+void conn_run(Conn *c);
+void reply(Conn *c, int status, const char *msg);
+int backend_open(EventLoop *loop, int port, int fresh, Endpoint *ep, int *connecting, int *reused);
+int backend_park(EventLoop *loop, int port, Endpoint *ep);
+int backend_connect(Conn *c, int port);
+int backend_request(Conn *c, int port, int opcode, int flags, const char *path);
+void backend_release(Conn *c);
+void backend_close(Conn *c);
+void process_client_request(Conn *c);
+void handle_uploadf_command(Conn *c, char *filepath);
+void handle_downlf_command(Conn *c, char *filepath);
+void handle_removef_command(Conn *c, char *filepath);
+void handle_downltar_command(Conn *c, char *filetype);
+void handle_dispfnames_command(Conn *c, char *pathname);
+void handle_stat_command(Conn *c, char *filepath);
+void list_source_finish(Conn *c, ListSource *ls);
+void stream_upload(Conn *c, int target_port);
+void start_relay(Conn *c, int server_port, int opcode, int flags, const char *path);
+void get_file_from_server(Conn *c, int server_port, char *filepath);
+void remove_file_from_server(Conn *c, int server_port, char *filepath);
+void get_tar_from_server(Conn *c, int server_port, char *filetype);
+void send_local_file(Conn *c, const char *path);
+int relay_pipe_open(Conn *c);
+void cache_release(CacheEntry *ce);
 
-// function to read a line up to a delimiter
-ssize_t read_until(int sock, char *buf, char delim) {
-    ssize_t total = 0;
-    while (total < MAX_BUFF - 1) {
-        ssize_t n = read(sock, buf + total, 1);
-        if (n <= 0) return n; // Return -1 on error, 0 on EOF
-        if (buf[total] == delim) break;
-        total++;
+// pending bytes of a buffer
+size_t buf_pending(Buf *b) {
+    return b->len - b->off;
+}
+
+// make room for n more bytes at the end of the buffer
+void buf_reserve(Buf *b, size_t n) {
+    if (b->off > 0 && b->off == b->len) {
+        b->off = b->len = 0;
+    }
+    if (b->len + n <= b->cap) return;
+    // reclaim consumed space before growing
+    if (b->off > 0) {
+        memmove(b->data, b->data + b->off, b->len - b->off);
+        b->len -= b->off;
+        b->off = 0;
+        if (b->len + n <= b->cap) return;
+    }
+    size_t cap = b->cap ? b->cap : IO_CHUNK;
+    while (cap < b->len + n) cap *= 2;
+    char *data = realloc(b->data, cap);
+    if (!data) {
+        perror("Buffer allocation failed");
+        exit(EXIT_FAILURE);
     }
-    buf[total] = '\0';
-    return total;
+    b->data = data;
+    b->cap = cap;
+}
+
+void buf_append(Buf *b, const void *data, size_t n) {
+    buf_reserve(b, n);
+    memcpy(b->data + b->len, data, n);
+    b->len += n;
+}
+
+void buf_consume(Buf *b, size_t n) {
+    b->off += n;
+    if (b->off == b->len) b->off = b->len = 0;
+}
+
+// append n zero bytes to a buffer
+void buf_append_zeros(Buf *b, size_t n) {
+    buf_reserve(b, n);
+    memset(b->data + b->len, 0, n);
+    b->len += n;
+}
+
+void buf_free(Buf *b) {
+    free(b->data);
+    memset(b, 0, sizeof(*b));
+}
+
+// take one frame header and its path out of the buffer, the payload stays
+// returns 1 if a frame was decoded, 0 if it is incomplete, -1 if it is malformed
+int buf_get_frame(Buf *b, DfsHeader *h, char *path, size_t max) {
+    if (buf_pending(b) < DFS_HEADER_SIZE) return 0;
+    if (dfs_decode_header((unsigned char *)b->data + b->off, h) < 0 || h->path_len >= max) return -1;
+    if (buf_pending(b) < DFS_HEADER_SIZE + h->path_len) return 0;
+
+    memcpy(path, b->data + b->off + DFS_HEADER_SIZE, h->path_len);
+    path[h->path_len] = '\0';
+    buf_consume(b, DFS_HEADER_SIZE + h->path_len);
+    return 1;
+}
+
+// read what is available on fd into the buffer, at most max bytes
+// returns bytes read, 0 on EOF, -1 if nothing was available or on error
+ssize_t buf_read_fd(Buf *b, int fd, size_t max) {
+    buf_reserve(b, max);
+    ssize_t n = read(fd, b->data + b->len, max);
+    if (n > 0) b->len += n;
+    return n;
 }
 
 // function to create directories recursively
 void mkdirp(const char *path) {
-    char cmd[256];
-    snprintf(cmd, sizeof(cmd), "mkdir -p %s", path);
-    int result = system(cmd);
-    if (result != 0) {
-        perror("mkdir command failed");
-    } else {
-        printf("Created directory: %s\n", path);
+    char tmp[PATH_MAX];
+    snprintf(tmp, sizeof(tmp), "%s", expand_path(path));
+
+    for (char *p = tmp + 1; *p; p++) {
+        if (*p == '/') {
+            *p = '\0';
+            mkdir(tmp, 0777);
+            *p = '/';
+        }
+    }
+    if (mkdir(tmp, 0777) != 0 && errno != EEXIST) {
+        perror("mkdir failed");
     }
 }
 
 // felper function to expand HOME_DIR to actual path
 char* expand_path(const char* path) {
-    static char expanded[PATH_MAX];
-    
+    static __thread char expanded[PATH_MAX];
+
     if (strncmp(path, "~/", 2) == 0) {
         char* home = getenv("HOME");
         if (home) {
@@ -80,846 +515,4165 @@ char* expand_path(const char* path) {
             return expanded;
         }
     }
-    
+
     return (char*)path;
 }
 
-// function to forward a file to another server (S2, S3, or S4)
-void forward_file(char *filename, char *dest_path, int target_port) {
-    int server_sock = socket(AF_INET, SOCK_STREAM, 0);
-    if (server_sock < 0) {
-        perror("Forward socket creation failed");
-        return;
+// short name of a storage server for client messages
+const char *server_name(int port) {
+    switch (port) {
+        case S2_PORT: return "S2";
+        case S3_PORT: return "S3";
+        case S4_PORT: return "S4";
     }
-    
-    // set socket timeout (e.g., 30 seconds)
-    struct timeval timeout;
-    timeout.tv_sec = 30;
-    timeout.tv_usec = 0;
+    return "S1";
+}
 
-    if (setsockopt(server_sock, SOL_SOCKET, SO_RCVTIMEO, &timeout, sizeof(timeout)) < 0) {
-        perror("Setting socket timeout failed");
-        close(server_sock);
-        return;
-    }
-    
-    // aadd socket receive buffer size increase
-    int rcvbuf = 65536;  
-    if (setsockopt(server_sock, SOL_SOCKET, SO_RCVBUF, &rcvbuf, sizeof(rcvbuf)) < 0) {
-        perror("Setting receive buffer size failed");
-       
-    }
+// queue the reply header for the current request, payload_len bytes follow it
+// a successful download names the version of the file it sends, if S1 knows it
+void reply_header(Conn *c, int status, uint64_t payload_len) {
+    unsigned char header[DFS_HEADER_SIZE + DFS_FILE_TAG];
+    const char *tag = status == DFS_OK && c->file_tag[0] ? c->file_tag : NULL;
+    size_t n = dfs_frame(header, c->req.opcode, DFS_F_REPLY, status, c->req.request_id, tag, payload_len);
+    buf_append(&c->out, header, n);
+}
 
-    struct sockaddr_in server_addr;
-    
-    server_addr.sin_family = AF_INET;
-    server_addr.sin_port = htons(target_port);
-    inet_pton(AF_INET, "127.0.0.1", &server_addr.sin_addr);
+// reply header for a payload sent as chunks, see DFS_F_CHUNKED; flags adds DFS_F_LZ4
+void reply_chunked_header(Conn *c, int flags) {
+    unsigned char header[DFS_HEADER_SIZE + DFS_FILE_TAG];
+    const char *tag = c->file_tag[0] ? c->file_tag : NULL;
+    size_t n = dfs_frame(header, c->req.opcode, DFS_F_REPLY | DFS_F_CHUNKED | flags, DFS_OK,
+                         c->req.request_id, tag, 0);
+    buf_append(&c->out, header, n);
+}
 
-    if (connect(server_sock, (struct sockaddr*)&server_addr, sizeof(server_addr)) < 0) {
-        perror("S1: Failed to connect to storage server");
-        close(server_sock);
-        return;
+// follow the chunk headers of a chunked payload through the n bytes at p the
+// request is about to consume. at the empty chunk that ends the payload n is
+// cut to end there, and req_body becomes exact
+void chunked_scan(Conn *c, const unsigned char *p, size_t *n) {
+    size_t i = 0;
+    while (i < *n) {
+        if (c->chunk_left > 0) {
+            size_t k = MIN(c->chunk_left, (uint64_t)(*n - i));
+            c->chunk_left -= k;
+            i += k;
+            continue;
+        }
+        c->chunk_head[c->chunk_head_len++] = p[i++];
+        if (c->chunk_head_len < DFS_CHUNK_HEADER) continue;
+        c->chunk_head_len = 0;
+        c->chunk_left = dfs_get64(c->chunk_head);
+        if (c->chunk_left == 0) {
+            c->req_chunked = 0;
+            c->req_body = i;
+            *n = i;
+            return;
+        }
     }
+}
 
-    // send command to storage server
-    char command[MAX_BUFF];
-    snprintf(command, sizeof(command), "uploadf %s %s\n", filename, dest_path);
+// the reply is queued, skip what is left of the request payload and wait for
+// the next request on the same connection. a chunked payload whose framing
+// broke has no end to find, the connection is closed instead
+void request_done(Conn *c) {
+    if (c->req_chunked && c->chunk_left > DFS_LZ4_CHUNK_MAX) c->state = ST_DONE;
+    else c->state = c->req_body > 0 ? ST_DISCARD : ST_CMD;
+}
 
-    write(server_sock, command, strlen(command));
-    
-    // send file content
-    char file_path[MAX_BUFF];
-    snprintf(file_path, sizeof(file_path), "~/S1/%s", dest_path);
-    // create directory if it doesn't exist
-    mkdirp(file_path);
-    // full path with filename
-    snprintf(file_path, sizeof(file_path), "~/S1/%s/%s", dest_path, filename);
-    char *expanded_path = expand_path(file_path);
-    printf("Forward file - full path: %s\n", expanded_path);
+// queue a reply carrying a message for the client and finish the request
+void reply(Conn *c, int status, const char *msg) {
+    size_t n = strlen(msg);
+    reply_header(c, status, n);
+    buf_append(&c->out, msg, n);
+    request_done(c);
+}
 
-    struct stat st;
-    if (stat(expanded_path, &st) != 0) {
-        perror("Cannot stat file for forwarding");
-        close(server_sock);
-        return;
-    }
-    
-    // send file size
-    char size_str[32];
-    snprintf(size_str, sizeof(size_str), "%ld", st.st_size);
-    write(server_sock, size_str, strlen(size_str));
-    
-    int fd = open(expanded_path, O_RDONLY);
-    if (fd < 0) {
-        perror("Cannot open file for forwarding");
-        close(server_sock);
+// reply with the generic message of a status, for failures of a storage server
+void reply_error(Conn *c, int status) {
+    char msg[64];
+    snprintf(msg, sizeof(msg), "ERR: %s", dfs_status_name(status));
+    reply(c, status, msg);
+}
+
+// register or update the epoll interest of one endpoint
+void endpoint_watch(EventLoop *loop, Endpoint *ep, uint32_t events) {
+    if (ep->fd < 0 || (ep->registered && ep->events == events)) return;
+    struct epoll_event ev;
+    ev.events = events;
+    ev.data.ptr = ep;
+    if (epoll_ctl(loop->epfd, ep->registered ? EPOLL_CTL_MOD : EPOLL_CTL_ADD, ep->fd, &ev) < 0) {
+        perror("epoll_ctl failed");
         return;
     }
-    
-    char buffer[MAX_BUFF];
-    ssize_t bytes_read;
-    while ((bytes_read = read(fd, buffer, MAX_BUFF)) > 0) {
-        write(server_sock, buffer, bytes_read);
-    }
-    close(fd);
-    
-    // wait for ACK 
-    // error handling
-    memset(buffer, 0, MAX_BUFF);
-    printf("S1: Waiting for server response...\n");
-    
-    //  multiple times with  timeouts
-    int retry_count = 3;
-    ssize_t read_result = 0;
-    
-    while (retry_count > 0) {
-        read_result = recv(server_sock, buffer, MAX_BUFF - 1, 0);
-        if (read_result > 0) {
-            buffer[read_result] = '\0';
-            break;
-        }
-        retry_count--;
-        if (retry_count > 0) {
-            printf("S1: Retrying read, attempts left: %d\n", retry_count);
-            usleep(500000);  // wait 500ms before retry
-        }
+    ep->registered = 1;
+    ep->events = events;
+}
+
+// states in which the client may be sent more output
+int state_produces_client_output(int state) {
+    return state == ST_SEND_FILE || state == ST_SEND_LZ4 || state == ST_SEND_TAR || state == ST_SEND_SIGS ||
+           state == ST_SEND_CACHED;
+}
+
+// relay body bytes bypass the buffers and go through the pipe; chunk
+// headers of a chunked reply are read through bin, and so is all of a
+// reply the read cache keeps a copy of
+int relay_splicing(Conn *c) {
+    return c->state == ST_RELAY_BODY && c->pipe_fd[0] >= 0 && c->remaining > 0 && !c->cache_filling;
+}
+
+// the storage server socket is read into bin, unless a splice relay
+// takes the bytes itself once the buffered ones are gone
+int backend_wants_input(Conn *c) {
+    if (c->be_eof) return 0;
+    if (relay_splicing(c)) {
+        return buf_pending(&c->bin) == 0 && buf_pending(&c->out) == 0 &&
+               c->pipe_len < c->pipe_size && c->remaining > (off_t)c->pipe_len;
     }
-    
-    printf("S1: Read result: %zd, Response: '%s'\n", read_result, buffer);
+    return buf_pending(&c->bin) < IO_CHUNK;
+}
 
-    if (read_result > 0 && strncmp(buffer, "ACK", 3) == 0) {
-        printf("File successfully forwarded to server on port %d\n", target_port);
-        printf("Deleting local file: %s\n", expanded_path);
+// recompute which events each socket of the connection is waiting for
+void conn_update_events(Conn *c) {
+    uint32_t ev = 0;
+    if (!c->cli_eof && buf_pending(&c->in) < IO_CHUNK) ev |= EPOLLIN;
+    if (buf_pending(&c->out) > 0 || c->pipe_len > 0 || state_produces_client_output(c->state)) {
+        ev |= EPOLLOUT;
+    }
+    endpoint_watch(c->loop, &c->cli, ev);
 
-        // delete local copy of forwarded file
-        if (unlink(expanded_path) == 0) {
-            printf("Deleted local copy of forwarded file: %s\n", expanded_path);
+    if (c->be.fd >= 0) {
+        ev = 0;
+        if (c->be_connecting) {
+            ev = EPOLLOUT;
         } else {
-            perror("Failed to delete forwarded file");
+            if (backend_wants_input(c)) ev |= EPOLLIN;
+            if (buf_pending(&c->bout) > 0) ev |= EPOLLOUT;
         }
-    } else {
-        if (read_result <= 0) {
-            printf("Error: No response from server (read result: %zd)\n", read_result);
+        endpoint_watch(c->loop, &c->be, ev);
+    }
+
+    for (int i = 0; i < LIST_SOURCES; i++) {
+        ListSource *ls = &c->lists[i];
+        if (ls->ep.fd < 0) continue;
+        ev = 0;
+        if (ls->connecting) {
+            ev = EPOLLOUT;
         } else {
-            printf("Error: Server rejected file with response: '%s'\n", buffer);
+            if (!ls->eof && buf_pending(&ls->in) < IO_CHUNK) ev |= EPOLLIN;
+            if (buf_pending(&ls->out) > 0) ev |= EPOLLOUT;
         }
+        endpoint_watch(c->loop, &ls->ep, ev);
     }
-    
-    close(server_sock);
 }
-// function to handle uploadf command
-void handle_uploadf_command(int client_sock, char *filename, char *dest_path) {
-    // Read file size
-    char size_header[32];
-    ssize_t bytes_read = read_until(client_sock, size_header, '\n');
-    if (bytes_read <= 0) {
-        write(client_sock, "ERR: Missing file size\n", 22);
-        return;
+
+Conn *conn_new(EventLoop *loop, int fd) {
+    Conn *c = calloc(1, sizeof(Conn));
+    if (!c) {
+        perror("Connection allocation failed");
+        close(fd);
+        return NULL;
     }
-    
-    off_t file_size = atol(size_header);
-    if (file_size <= 0) {
-        write(client_sock, "ERR: Invalid file size\n", 22);
-        return;
+    c->loop = loop;
+    c->cli.fd = fd;
+    c->cli.kind = EP_CLIENT;
+    c->cli.conn = c;
+    c->be.fd = -1;
+    c->be.kind = EP_BACKEND;
+    c->be.conn = c;
+    for (int i = 0; i < LIST_SOURCES; i++) {
+        c->lists[i].ep.fd = -1;
+        c->lists[i].ep.kind = EP_LIST;
+        c->lists[i].ep.conn = c;
     }
-    
-    // dest_path starts with ~S1/
-    if (strncmp(dest_path, "~S1/", 4) != 0) {
-        write(client_sock, "ERR: Path must start with ~S1/\n", 29);
-        return;
+    c->file_fd = -1;
+    c->base_fd = -1;
+    c->pipe_fd[0] = c->pipe_fd[1] = -1;
+    c->state = ST_CMD;
+    conn_update_events(c);
+    return c;
+}
+
+// close everything; the memory is released after the current epoll batch
+void conn_close(Conn *c) {
+    if (c->dead) return;
+    backend_close(c);
+    close(c->cli.fd);
+    // the file of a job in progress belongs to the helper thread
+    if (c->file_fd >= 0 && !c->job_running) close(c->file_fd);
+    if (c->base_fd >= 0) close(c->base_fd);
+    if (c->state == ST_UPLOAD_BODY || c->state == ST_UPLOAD_LZ4 || c->state == ST_PATCH_BODY) unlink(c->upload_tmp);
+    free(c->lz4_chunk);
+    dfs_tar_close(&c->tar);
+    if (c->cache_entry) cache_release(c->cache_entry);
+    buf_free(&c->cache_fill);
+    if (c->pipe_fd[0] >= 0) {
+        close(c->pipe_fd[0]);
+        close(c->pipe_fd[1]);
+    }
+    buf_free(&c->in);
+    buf_free(&c->out);
+    buf_free(&c->list_page);
+    for (int i = 0; i < LIST_SOURCES; i++) {
+        c->lists[i].error = 1;
+        list_source_finish(c, &c->lists[i]);
     }
-    
-    // Convert path  ~S1/f1 -> /tmp/S1/f1/xyz.c
-    char full_path[MAX_BUFF];
-    snprintf(full_path, sizeof(full_path), "~/S1/%s/%s", 
-             dest_path + 4, filename); // Skip ~S1/
-    char *expanded_full_path = expand_path(full_path);
+    if (c->wal_waiting) {
+        Conn **p = &c->loop->wal_waiters;
+        while (*p != c) p = &(*p)->next_wal_waiter;
+        *p = c->next_wal_waiter;
+    }
+    c->dead = 1;
+    if (c->job_running) return;     // freed once its loop has it back
+    c->next_dead = c->loop->dead;
+    c->loop->dead = c;
+}
 
-    // create directory structure
-    char *dir_path = strdup(expanded_full_path);
-    char *dir = dirname(dir_path);
-    mkdirp(dir);
-    free(dir_path);
-    
-    // save file temporarily
-    int fd = open(expanded_full_path, O_WRONLY | O_CREAT, 0666);
-    if (fd < 0) {
-        perror("File creation failed");
-        write(client_sock, "ERR: File creation failed\n", 26);
-        return;
-    }
-    
-    off_t remaining = file_size;
-    off_t total_written = 0;
-    char buffer[MAX_BUFF];
-    
-    printf("Receiving file of size: %ld bytes\n", file_size);
-    
-    while (remaining > 0) {
-        bytes_read = read(client_sock, buffer, MIN(MAX_BUFF, remaining));
-        if (bytes_read <= 0) break;
-        
-        ssize_t bytes_written = write(fd, buffer, bytes_read);
-        if (bytes_written < 0) {
-            perror("Write error");
+BackendPool *pool_for(EventLoop *loop, int port) {
+    return &loop->pools[port - S2_PORT];
+}
+
+// take a pooled connection out of the pool, its memory is freed after the batch
+void pooled_unlink(EventLoop *loop, PooledConn *pc) {
+    BackendPool *pool = pool_for(loop, pc->port);
+    for (PooledConn **pp = &pool->idle; *pp; pp = &(*pp)->next) {
+        if (*pp == pc) {
+            *pp = pc->next;
+            pool->count--;
             break;
         }
-        
-        total_written += bytes_written;
-        remaining -= bytes_read;
-        
-        printf("Received: %ld bytes, Remaining: %ld bytes\n", bytes_read, remaining);
-    }
-    close(fd);
-    
-    if (remaining > 0) {
-        write(client_sock, "ERR: Incomplete file transfer\n", 30);
-        unlink(expanded_full_path);
-        return;
-    }
-    
-    // forward to appropriate server based on file extension
-    char *ext = strrchr(filename, '.');
-    if (ext) {
-        int target_port = 0;
-        if (strcmp(ext, ".pdf") == 0) target_port = S2_PORT;
-        else if (strcmp(ext, ".txt") == 0) target_port = S3_PORT;
-        else if (strcmp(ext, ".zip") == 0) target_port = S4_PORT;
-        
-        if (target_port) {
-            forward_file(filename, dest_path + 4, target_port);
-            write(client_sock, "OK: File stored remotely\n", 25);
-            // get directory path
-            char *dir_path = strdup(expanded_full_path);
-            char *parent_dir = dirname(dir_path);
-    
-            // remove parent directory if empty
-            rmdir(parent_dir);  // only succeed if directory is empty
-            
-            free(dir_path);
-           
-        } else if (strcmp(ext, ".c") == 0) {
-            // Keep .c files locally
-            write(client_sock, "OK: File stored locally\n", 23);
-        } else {
-            write(client_sock, "ERR: Unsupported file type\n", 27);
-            unlink(expanded_full_path);
-        }
-    } else {
-        write(client_sock, "ERR: File has no extension\n", 27);
-        unlink(expanded_full_path);
     }
+    pc->dead = 1;
+    pc->next = loop->dead_pooled;
+    loop->dead_pooled = pc;
 }
 
-// function to get a file from another server (S2, S3, or S4)
-void get_file_from_server(int server_port, char *filepath, int client_sock) {
-    int server_sock = socket(AF_INET, SOCK_STREAM, 0);
-    if (server_sock < 0) {
+void pooled_close(EventLoop *loop, PooledConn *pc) {
+    close(pc->ep.fd);
+    pooled_unlink(loop, pc);
+}
+
+// connect ep to a storage server: an idle pooled connection unless fresh is
+// set, otherwise a new non-blocking connect
+// returns 0 with *connecting and *reused filled in, -1 on failure
+int backend_open(EventLoop *loop, int port, int fresh, Endpoint *ep, int *connecting, int *reused) {
+    BackendPool *pool = pool_for(loop, port);
+    PooledConn *pc = pool->idle;
+    while (pc && (pc->ping_sent || fresh)) pc = pc->next;
+
+    if (pc) {
+        // hand the socket and its epoll registration over to the endpoint
+        ep->fd = pc->ep.fd;
+        ep->registered = 1;
+        ep->events = EPOLLOUT;
+        struct epoll_event ev;
+        ev.events = EPOLLOUT;
+        ev.data.ptr = ep;
+        epoll_ctl(loop->epfd, EPOLL_CTL_MOD, ep->fd, &ev);
+        *connecting = 0;
+        *reused = 1;
+        pooled_unlink(loop, pc);
+        return 0;
+    }
+
+    int fd = socket(AF_INET, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+    if (fd < 0) {
         perror("Socket creation failed");
-        write(client_sock, "ERR: Cannot connect to storage server\n", 38);
-        return;
+        return -1;
     }
-    
+    dfs_set_nodelay(fd);
+
     struct sockaddr_in server_addr;
+    memset(&server_addr, 0, sizeof(server_addr));
     server_addr.sin_family = AF_INET;
-    server_addr.sin_port = htons(server_port);
+    server_addr.sin_port = htons(port);
     inet_pton(AF_INET, "127.0.0.1", &server_addr.sin_addr);
-    
-    if (connect(server_sock, (struct sockaddr*)&server_addr, sizeof(server_addr)) < 0) {
+
+    int r = connect(fd, (struct sockaddr*)&server_addr, sizeof(server_addr));
+    if (r < 0 && errno != EINPROGRESS) {
         perror("Failed to connect to storage server");
-        write(client_sock, "ERR: Cannot connect to storage server\n", 38);
-        close(server_sock);
-        return;
-    }
-    
-    // send getf command to the server
-    char command[MAX_BUFF];
-    snprintf(command, sizeof(command), "getf %s", filepath);
-    write(server_sock, command, strlen(command));
-    
-    // read file size
-    char size_buf[32];
-    read_until(server_sock, size_buf, '\n');
-    off_t file_size = atol(size_buf);
-    
-    // forward file size to client
-    char size_header[64];
-    snprintf(size_header, sizeof(size_header), "%ld\n", file_size);
-    write(client_sock, size_header, strlen(size_header));
-    
-    // forward file data from server to client
-    char buffer[MAX_BUFF];
-    ssize_t bytes_read;
-    off_t total_read = 0;
-    
-    while (total_read < file_size && 
-          (bytes_read = read(server_sock, buffer, MIN(MAX_BUFF, file_size - total_read))) > 0) {
-        write(client_sock, buffer, bytes_read);
-        total_read += bytes_read;
-    }
-    
-    close(server_sock);
+        close(fd);
+        return -1;
+    }
+
+    ep->fd = fd;
+    ep->registered = 0;
+    ep->events = 0;
+    *connecting = (r < 0);
+    *reused = 0;
+    return 0;
 }
 
-// function to handle downlf command
-void handle_downlf_command(int client_sock, char *filepath) {
-    // filepath starts with ~S1/
-    if (strncmp(filepath, "~S1/", 4) != 0) {
-        write(client_sock, "ERR: Path must start with ~S1/\n", 29);
-        return;
+// open a non-blocking connection to a storage server, or reuse an idle pooled one
+int backend_connect(Conn *c, int port) {
+    c->be_eof = 0;
+    c->be_error = 0;
+    c->be_rx = 0;
+    c->target_port = port;
+    return backend_open(c->loop, port, c->be_retried, &c->be, &c->be_connecting, &c->be_reused);
+}
+
+// queue a request header for the connected storage server, remembering it for a retry
+void backend_frame(Conn *c, int opcode, int flags, const char *path, uint64_t payload_len) {
+    c->be_id = c->loop->next_request_id++;
+    c->be_op = opcode;
+    c->be_request_len = dfs_frame(c->be_request, opcode, flags, 0, c->be_id, path, payload_len);
+    buf_append(&c->bout, c->be_request, c->be_request_len);
+}
+
+// queue payload of the request just framed, kept with it for a retry
+void backend_payload(Conn *c, const void *data, size_t n) {
+    memcpy(c->be_request + c->be_request_len, data, n);
+    c->be_request_len += n;
+    buf_append(&c->bout, data, n);
+}
+
+// send a request without payload to a storage server
+int backend_request(Conn *c, int port, int opcode, int flags, const char *path) {
+    if (strlen(path) >= DFS_MAX_PATH || backend_connect(c, port) < 0) return -1;
+    backend_frame(c, opcode, flags, path, 0);
+    return 0;
+}
+
+// reply header from the storage server for the current request
+// returns 1 when it arrived, 0 while waiting, -1 if the connection failed
+int backend_reply(Conn *c, DfsHeader *h) {
+    char path[1];
+    int r = buf_get_frame(&c->bin, h, path, sizeof(path));
+    if (r == 0) return c->be_eof ? -1 : 0;
+    if (r < 0 || !(h->flags & DFS_F_REPLY) || h->request_id != c->be_id || h->opcode != c->be_op) {
+        printf("S1: Unexpected reply from %s\n", server_name(c->target_port));
+        c->be_error = 1;
+        return -1;
     }
-    
-    // extract filename from path
-    char *filename = strrchr(filepath, '/');
-    if (!filename) {
-        write(client_sock, "ERR: Invalid file path\n", 22);
-        return;
+    return 1;
+}
+
+// park the connection of ep, whose response was consumed completely, in the
+// pool of its server; returns 0, or -1 if the caller has to close it instead
+int backend_park(EventLoop *loop, int port, Endpoint *ep) {
+    BackendPool *pool = pool_for(loop, port);
+    if (pool->count >= POOL_MAX_IDLE) return -1;
+
+    PooledConn *pc = calloc(1, sizeof(PooledConn));
+    if (!pc) return -1;
+    pc->ep.fd = ep->fd;
+    pc->ep.kind = EP_IDLE;
+    pc->ep.registered = 1;
+    pc->ep.events = EPOLLIN | EPOLLRDHUP;
+    pc->ep.pooled = pc;
+    pc->port = port;
+    pc->idle_since = time(NULL);
+
+    // an idle connection only becomes readable if the server closed it
+    struct epoll_event ev;
+    ev.events = pc->ep.events;
+    ev.data.ptr = &pc->ep;
+    if (epoll_ctl(loop->epfd, EPOLL_CTL_MOD, pc->ep.fd, &ev) < 0) {
+        free(pc);
+        return -1;
     }
-    filename++; // Skip  '/'
-    
-    // check file extension
-    char *ext = strrchr(filename, '.');
-    if (!ext) {
-        write(client_sock, "ERR: File has no extension\n", 27);
+    pc->next = pool->idle;
+    pool->idle = pc;
+    pool->count++;
+
+    ep->fd = -1;
+    ep->registered = 0;
+    ep->events = 0;
+    return 0;
+}
+
+// the response was consumed completely, park the connection for the next request
+void backend_release(Conn *c) {
+    if (c->be.fd < 0 || c->be_eof || c->be_error || c->be_connecting ||
+        buf_pending(&c->bin) > 0 || buf_pending(&c->bout) > 0 ||
+        backend_park(c->loop, c->target_port, &c->be) < 0) {
+        backend_close(c);
         return;
     }
-    
-    if (strcmp(ext, ".c") == 0) {
-        // c files are stored locally
-        char full_path[MAX_BUFF];
-        snprintf(full_path, sizeof(full_path), "~/S1/%s", filepath + 4); // Skip ~S1/
-        char *expanded_full_path = expand_path(full_path);
+    buf_free(&c->bin);
+    buf_free(&c->bout);
+    c->be_eof = 0;
+    c->be_error = 0;
+}
 
-        struct stat st;
-        if (stat(expanded_full_path, &st) != 0) {
-            write(client_sock, "ERR: File not found\n", 20);
-            return;
+void backend_close(Conn *c) {
+    if (c->be.fd >= 0) {
+        close(c->be.fd);
+        c->be.fd = -1;
+        c->be.registered = 0;
+        c->be.events = 0;
+    }
+    buf_free(&c->bin);
+    buf_free(&c->bout);
+    c->be_connecting = 0;
+    c->be_eof = 0;
+    c->be_error = 0;
+}
+
+// a pooled connection the server closed before answering is retried once on a
+// fresh connection; returns 1 if the request was sent again
+int backend_retry(Conn *c) {
+    if (!c->be_reused || c->be_rx > 0 || c->be_retried) return 0;
+    // upload bytes already relayed from the client cannot be sent a second time
+    if ((c->be_op == DFS_OP_UPLOAD || c->be_op == DFS_OP_PATCH) && c->req_body < c->stream_from) return 0;
+
+    int port = c->target_port;
+    printf("S1: Pooled connection to %s went away, retrying\n", server_name(port));
+    backend_close(c);
+    c->be_retried = 1;
+
+    if (backend_connect(c, port) < 0) return 0;
+    buf_append(&c->bout, c->be_request, c->be_request_len);
+    return 1;
+}
+
+// non-blocking reads into the connection buffers
+int conn_fill(Conn *c) {
+    int progress = 0;
+    if (!c->cli_eof && buf_pending(&c->in) < IO_CHUNK) {
+        ssize_t n = buf_read_fd(&c->in, c->cli.fd, IO_CHUNK);
+        if (n > 0) progress = 1;
+        else if (n == 0 || (errno != EAGAIN && errno != EWOULDBLOCK && errno != EINTR)) {
+            c->cli_eof = 1;
+            progress = 1;
         }
-        
-        // send file size
-        char size_header[64];
-        snprintf(size_header, sizeof(size_header), "%ld\n", st.st_size);
-        write(client_sock, size_header, strlen(size_header));
-        
-        // send file content
-        int fd = open(expanded_full_path, O_RDONLY);
-        if (fd < 0) {
-            perror("Cannot open file");
-            return;
+    }
+    if (c->be.fd >= 0 && !c->be_connecting && !relay_splicing(c) && backend_wants_input(c)) {
+        ssize_t n = buf_read_fd(&c->bin, c->be.fd, IO_CHUNK);
+        if (n > 0) {
+            c->be_rx += n;
+            progress = 1;
         }
-        
-        char buffer[MAX_BUFF];
-        ssize_t bytes_read;
-        while ((bytes_read = read(fd, buffer, MAX_BUFF)) > 0) {
-            write(client_sock, buffer, bytes_read);
+        else if (n == 0 || (errno != EAGAIN && errno != EWOULDBLOCK && errno != EINTR)) {
+            if (n < 0) c->be_error = 1;
+            c->be_eof = 1;
+            progress = 1;
+        }
+    }
+    for (int i = 0; i < LIST_SOURCES; i++) {
+        ListSource *ls = &c->lists[i];
+        if (ls->ep.fd < 0 || ls->connecting || ls->eof || buf_pending(&ls->in) >= IO_CHUNK) continue;
+        ssize_t n = buf_read_fd(&ls->in, ls->ep.fd, IO_CHUNK);
+        if (n > 0) {
+            ls->rx += n;
+            progress = 1;
+        }
+        else if (n == 0 || (errno != EAGAIN && errno != EWOULDBLOCK && errno != EINTR)) {
+            if (n < 0) ls->error = 1;
+            ls->eof = 1;
+            progress = 1;
         }
-        close(fd);
-    } else if (strcmp(ext, ".pdf") == 0) {
-        // PDF files are stored on S2
-        get_file_from_server(S2_PORT, filepath, client_sock);
-    } else if (strcmp(ext, ".txt") == 0) {
-        // TXT files are stored on S3
-        get_file_from_server(S3_PORT, filepath, client_sock);
-    } else if (strcmp(ext, ".zip") == 0) {
-        // ZIP files are stored on S4
-        get_file_from_server(S4_PORT, filepath, client_sock);
-    } else {
-        write(client_sock, "ERR: Unsupported file type\n", 27);
     }
+    return progress;
 }
 
-// function to remove a file from another server
-void remove_file_from_server(int server_port, char *filepath) {
-    int server_sock = socket(AF_INET, SOCK_STREAM, 0);
-    if (server_sock < 0) {
-        perror("Socket creation failed");
-        return;
+// write as much pending output as the socket takes
+// returns 1 on progress, 0 if nothing moved, -1 if the peer is gone
+int flush_buf(int fd, Buf *b) {
+    int progress = 0;
+    while (buf_pending(b) > 0) {
+        ssize_t n = send(fd, b->data + b->off, buf_pending(b), MSG_NOSIGNAL);
+        if (n < 0) {
+            if (errno == EAGAIN || errno == EWOULDBLOCK) break;
+            if (errno == EINTR) continue;
+            return -1;
+        }
+        buf_consume(b, n);
+        progress = 1;
     }
-    
-    struct sockaddr_in server_addr;
-    server_addr.sin_family = AF_INET;
-    server_addr.sin_port = htons(server_port);
-    inet_pton(AF_INET, "127.0.0.1", &server_addr.sin_addr);
-    
-    if (connect(server_sock, (struct sockaddr*)&server_addr, sizeof(server_addr)) < 0) {
-        perror("Failed to connect to storage server");
-        close(server_sock);
-        return;
+    return progress;
+}
+
+int conn_drain(Conn *c) {
+    int progress = 0;
+    int r = flush_buf(c->cli.fd, &c->out);
+    if (r < 0) {
+        conn_close(c);
+        return 0;
     }
-    
-    // Send removef command to the server
-    char command[MAX_BUFF];
-    snprintf(command, sizeof(command), "removef %s", filepath);
-    write(server_sock, command, strlen(command));
-    
-    // Wait for acknowledgment
-    char response[4];
-    read(server_sock, response, 3);
-    response[3] = '\0';
-    
-    close(server_sock);
+    progress |= r;
+    if (c->be.fd >= 0 && !c->be_connecting) {
+        r = flush_buf(c->be.fd, &c->bout);
+        if (r < 0) {
+            c->be_error = 1;
+            c->be_eof = 1;
+            buf_free(&c->bout);
+            progress = 1;
+        } else {
+            progress |= r;
+        }
+    }
+    for (int i = 0; i < LIST_SOURCES; i++) {
+        ListSource *ls = &c->lists[i];
+        if (ls->ep.fd < 0 || ls->connecting) continue;
+        r = flush_buf(ls->ep.fd, &ls->out);
+        if (r < 0) {
+            ls->error = 1;
+            ls->eof = 1;
+            buf_free(&ls->out);
+            progress = 1;
+        } else {
+            progress |= r;
+        }
+    }
+    return progress;
 }
 
-// Function to handle removef command
-void handle_removef_command(int client_sock, char *filepath) {
-    // filepath starts with ~S1/
-    if (strncmp(filepath, "~S1/", 4) != 0) {
-        write(client_sock, "ERR: Path must start with ~S1/\n", 29);
+// start sending a local file (reply header first) to the client
+void send_local_file(Conn *c, const char *path) {
+    struct stat st;
+    int fd = open(path, O_RDONLY | O_CLOEXEC);
+    if (fd < 0 || fstat(fd, &st) != 0) {
+        if (fd >= 0) close(fd);
+        reply(c, DFS_E_NOTFOUND, "ERR: File not found");
         return;
     }
-    
-    // Extract filename from path
-    char *filename = strrchr(filepath, '/');
-    if (!filename) {
-        write(client_sock, "ERR: Invalid file path\n", 22);
+
+    posix_fadvise(fd, 0, 0, POSIX_FADV_SEQUENTIAL);
+    dfs_set_send_buffer(c->cli.fd);
+    snprintf(c->local_path, sizeof(c->local_path), "%s", path);
+
+    // a range goes out as it is from its offset
+    if (c->req.flags & DFS_F_RANGE) {
+        uint64_t len = c->range_len;
+        if (dfs_range_clip(st.st_size, c->range_off, &len) < 0 || lseek(fd, c->range_off, SEEK_SET) < 0) {
+            close(fd);
+            reply(c, DFS_E_INVALID, "ERR: Range starts past the end of the file");
+            return;
+        }
+        c->file_fd = fd;
+        c->remaining = len;
+        reply_header(c, DFS_OK, len);
+        c->state = ST_SEND_FILE;
         return;
     }
-    filename++; // Skip the '/'
-    
-    // Check file extension
-    char *ext = strrchr(filename, '.');
-    if (!ext) {
-        write(client_sock, "ERR: File has no extension\n", 27);
+    c->file_fd = fd;
+    c->remaining = st.st_size;
+
+    // compressed if the client takes it and the start of the file looks like it will shrink
+    static __thread unsigned char sample[DFS_LZ4_SAMPLE];
+    ssize_t n = c->req.flags & DFS_F_LZ4 ? pread(fd, sample, sizeof(sample), 0) : 0;
+    if (n > 0 && dfs_lz4_worth(path, sample, n)) {
+        reply_chunked_header(c, DFS_F_LZ4);
+        c->state = ST_SEND_LZ4;
         return;
     }
-    
-    // continuation of handle_removef_command 
-    if (strcmp(ext, ".c") == 0) {
-        // c files are stored locally
-        char full_path[MAX_BUFF];
-        snprintf(full_path, sizeof(full_path), "~/S1/%s", filepath + 4); // Skip ~S1/
-        char *expanded_full_path = expand_path(full_path);
+    reply_header(c, DFS_OK, st.st_size);
+    c->state = ST_SEND_FILE;
+}
 
-        // try to remove the file
-        if (unlink(expanded_full_path) == 0) {
-            write(client_sock, "OK: File removed\n", 17);
-        } else {
-            write(client_sock, "ERR: Could not remove file\n", 27);
-            perror("File removal failed");
+// local file -> compressed chunks in the output buffer, up to the high-water mark
+int step_send_lz4(Conn *c) {
+    static __thread DfsLz4 *lz4;
+    static __thread unsigned char block[DFS_LZ4_BLOCK];
+    if (!lz4 && !(lz4 = dfs_lz4_new())) {
+        perror("Compressor allocation failed");
+        close(c->file_fd);
+        c->file_fd = -1;
+        c->state = ST_DONE;
+        return 1;
+    }
+    int progress = 0;
+    while (c->remaining > 0 && buf_pending(&c->out) < HIGH_WATER) {
+        ssize_t n = read(c->file_fd, block, MIN(c->remaining, (off_t)DFS_LZ4_BLOCK));
+        if (n < 0 && errno == EINTR) continue;
+        if (n <= 0) {
+            // the reply ends without its empty chunk, the client sees it cut short
+            if (n == 0) fprintf(stderr, "File %s shrank while being sent\n", c->local_path);
+            else perror("File read failed");
+            close(c->file_fd);
+            c->file_fd = -1;
+            c->state = ST_DONE;
+            return 1;
         }
-    } else if (strcmp(ext, ".pdf") == 0) {
-        // PDF files are stored on S2
-        remove_file_from_server(S2_PORT, filepath);
-        write(client_sock, "OK: File removed from S2\n", 24);
-    } else if (strcmp(ext, ".txt") == 0) {
-        // TXT files are stored on S3
-        remove_file_from_server(S3_PORT, filepath);
-        write(client_sock, "OK: File removed from S3\n", 24);
-    } else if (strcmp(ext, ".zip") == 0) {
-        // ZIP files are stored on S4
-        remove_file_from_server(S4_PORT, filepath);
-        write(client_sock, "OK: File removed from S4\n", 24);
-    } else {
-        write(client_sock, "ERR: Unsupported file type\n", 27);
+        buf_reserve(&c->out, DFS_LZ4_CHUNK_MAX);
+        c->out.len += dfs_lz4_chunk(lz4, block, n, (unsigned char *)c->out.data + c->out.len,
+                                    (c->req.flags & DFS_F_DENSE) != 0);
+        c->remaining -= n;
+        progress = 1;
     }
+    if (c->remaining == 0) {
+        buf_append_zeros(&c->out, DFS_CHUNK_HEADER);
+        close(c->file_fd);
+        c->file_fd = -1;
+        request_done(c);
+        return 1;
+    }
+    return progress;
 }
 
-// function to get tar file from server
-void get_tar_from_server(int server_port, char *filetype, int client_sock) {
-    int server_sock = socket(AF_INET, SOCK_STREAM, 0);
-    if (server_sock < 0) {
-        perror("Socket creation failed");
-        write(client_sock, "ERR: Cannot connect to storage server\n", 38);
-        return;
+// move bytes from a local file into an output buffer up to the high-water mark
+// returns 1 on progress, -1 on read error
+int pump_file(Conn *c, Buf *dst) {
+    int progress = 0;
+    while (c->remaining > 0 && buf_pending(dst) < HIGH_WATER) {
+        size_t want = MIN((off_t)IO_CHUNK, c->remaining);
+        ssize_t n = buf_read_fd(dst, c->file_fd, want);
+        if (n <= 0) {
+            if (n < 0 && errno == EINTR) continue;
+            if (n == 0) fprintf(stderr, "File %s shrank while being sent\n", c->local_path);
+            else perror("File read failed");
+            return -1;
+        }
+        c->remaining -= n;
+        progress = 1;
     }
-    
-    struct sockaddr_in server_addr;
-    server_addr.sin_family = AF_INET;
-    server_addr.sin_port = htons(server_port);
-    inet_pton(AF_INET, "127.0.0.1", &server_addr.sin_addr);
-    
-    if (connect(server_sock, (struct sockaddr*)&server_addr, sizeof(server_addr)) < 0) {
-        perror("Failed to connect to storage server");
-        write(client_sock, "ERR: Cannot connect to storage server\n", 38);
-        close(server_sock);
-        return;
-    }
-    
-    // send get_tar command to the server
-    char command[MAX_BUFF];
-    snprintf(command, sizeof(command), "gettar %s", filetype);
-    write(server_sock, command, strlen(command));
-    
-    // Read file size
-    char size_buf[32];
-    read_until(server_sock, size_buf, '\n');
-    off_t file_size = atol(size_buf);
-    
-    // Forward file size to client
-    char size_header[64];
-    snprintf(size_header, sizeof(size_header), "%ld\n", file_size);
-    write(client_sock, size_header, strlen(size_header));
-    
-    // Forward tar file data from server to client
-    char buffer[MAX_BUFF];
-    ssize_t bytes_read;
-    off_t total_read = 0;
-    
-    while (total_read < file_size && 
-          (bytes_read = read(server_sock, buffer, MIN(MAX_BUFF, file_size - total_read))) > 0) {
-        write(client_sock, buffer, bytes_read);
-        total_read += bytes_read;
-    }
-    
-    close(server_sock);
+    return progress;
 }
 
+// storage server responsible for a file, 0 for .c files kept on S1, -1 if unsupported
+int server_for_file(const char *filepath) {
+    char *filename = strrchr(filepath, '/');
+    char *ext = filename ? strrchr(filename, '.') : NULL;
+    if (!ext) return -1;
+    if (strcmp(ext, ".c") == 0) return 0;
+    if (strcmp(ext, ".pdf") == 0) return S2_PORT;
+    if (strcmp(ext, ".txt") == 0) return S3_PORT;
+    if (strcmp(ext, ".zip") == 0) return S4_PORT;
+    return -1;
+}
 
+// shard of the index lock the calling thread reads under, handed out round
+// robin the first time the thread reads the index
+pthread_rwlock_t *index_reader_shard() {
+    static unsigned next_shard;
+    static __thread int shard = -1;
+    if (shard < 0) shard = __atomic_fetch_add(&next_shard, 1, __ATOMIC_RELAXED) % INDEX_LOCK_SHARDS;
+    return &index_lock[shard].lock;
+}
 
-// function to handle downltar command
-void handle_downltar_command(int client_sock, char *filetype) {
-    // Check valid file types
-     if (strcmp(filetype, "c") == 0) {
-        // current working directory (pwd)
-        char current_dir[MAX_BUFF];
-        if (getcwd(current_dir, sizeof(current_dir)) == NULL) {
-            write(client_sock, "ERR: Failed to get current directory\n", 37);
-            return;
-        }
+void index_rdlock() {
+    pthread_rwlock_rdlock(index_reader_shard());
+}
 
-        // expand the path to the S1 directory
-        char *expanded_s1_path = expand_path("~/S1");
+void index_rdunlock() {
+    pthread_rwlock_unlock(index_reader_shard());
+}
 
-      
-        char tar_path[MAX_BUFF];
-        snprintf(tar_path, sizeof(tar_path), "%s/c_files_%d.tar", current_dir, getpid());
+// a writer shuts out the readers of every shard, taken in a fixed order
+void index_wrlock() {
+    for (int i = 0; i < INDEX_LOCK_SHARDS; i++) pthread_rwlock_wrlock(&index_lock[i].lock);
+}
 
-        // Build the tar command
-        char tar_cmd[MAX_BUFF];
-        snprintf(tar_cmd, sizeof(tar_cmd), 
-                 "find '%s' -name '*.c' -exec tar -cf '%s' {} + 2>/dev/null || true", 
-                 expanded_s1_path, tar_path);
-        system(tar_cmd);
+void index_wrunlock() {
+    for (int i = INDEX_LOCK_SHARDS - 1; i >= 0; i--) pthread_rwlock_unlock(&index_lock[i].lock);
+}
 
-        // Check if the tar file is valid
-        struct stat st;
-        if (stat(tar_path, &st) != 0 || st.st_size == 0) {
-            write(client_sock, "0\n", 2); // No files or empty tar
-            unlink(tar_path); // Clean up empty tar
-            free(expanded_s1_path);
-            return;
-        }
+// listing source, and index source, of the files a server stores
+int index_source(int port) {
+    return port == 0 ? 0 : port - S2_PORT + 1;
+}
 
-        // Send file size
-        char size_header[64];
-        snprintf(size_header, sizeof(size_header), "%ld\n", st.st_size);
-        write(client_sock, size_header, strlen(size_header));
+// what the index knows of a file: 1 with its entry, 0 if there is no such
+// file, -1 if the index cannot tell (its server has not been scanned yet)
+int index_lookup(const char *path, int port, DfsIndexEntry *e) {
+    char key[DFS_MAX_PATH];
+    int len = dfs_index_key(path, key, sizeof(key));
+    if (len <= 0) return -1;
 
-        // Send file content
-        int fd = open(tar_path, O_RDONLY);
-        if (fd < 0) {
-            perror("Cannot open tar file");
-            free(expanded_s1_path);
-            return;
-        }
+    index_rdlock();
+    int r;
+    if (dfs_index_get(&file_index, key, len, e) && e->port == port) {
+        r = 1;
+    } else {
+        r = index_sources[index_source(port)].ready ? 0 : -1;
+    }
+    index_rdunlock();
+    return r;
+}
 
-        char buffer[MAX_BUFF];
-        ssize_t bytes_read;
-        while ((bytes_read = read(fd, buffer, MAX_BUFF)) > 0) {
-            write(client_sock, buffer, bytes_read);
-        }
-        close(fd);
+// the index lost track of a source; it is scanned again from scratch
+void index_lost(int source) {
+    printf("S1: Out of memory updating the index, %s is scanned again\n",
+           source == 0 ? "S1" : server_name(S2_PORT + source - 1));
+    index_sources[source].ready = 0;
+    index_sources[source].scan_failed = 1;
+}
 
-        // Clean up
-        unlink(tar_path); // delete the tar file...
-        
-    }
-     else if (strcmp(filetype, "p") == 0) {
-        // PDF files are stored on S2
-        get_tar_from_server(S2_PORT, filetype, client_sock);
-    } else if (strcmp(filetype, "t") == 0) {
-        // TXT files are stored on S3
-        get_tar_from_server(S3_PORT, filetype, client_sock);
-    } else if (strcmp(filetype, "z") == 0) {
-        // ZIP files are stored on S4
-        get_tar_from_server(S4_PORT, filetype, client_sock);
-    } else {
-        write(client_sock, "ERR: Unsupported file type\n", 27);
+// log a change of the index, called with the index locked so the log has
+// the changes in the order they were made
+// returns the number of the record, 0 if the index is not persisted
+uint64_t wal_append(int op, const char *key, size_t len, const DfsIndexEntry *e) {
+    unsigned char record[DFS_WAL_RECORD_MAX];
+    size_t n = dfs_wal_record(record, op, key, len, e);
+    uint64_t lsn = 0;
+    pthread_mutex_lock(&index_wal.lock);
+    if (!index_wal.failed) {
+        if (buf_pending(&index_wal.pending) == 0) pthread_cond_signal(&index_wal.wake);
+        buf_append(&index_wal.pending, record, n);
+        index_wal.bytes += n;
+        lsn = ++index_wal.appended;
     }
+    pthread_mutex_unlock(&index_wal.lock);
+    return lsn;
+}
 
- }        
+// last log record known to be on disk
+uint64_t wal_durable() {
+    return __atomic_load_n(&index_wal.durable, __ATOMIC_ACQUIRE);
+}
 
+// slot of the hint for content stored on a server
+size_t hint_slot(uint64_t checksum, int port) {
+    return (checksum ^ (uint64_t)port * 0x9E3779B97F4A7C15ULL) & (HINT_SLOTS - 1);
+}
 
-// Function to get filenames from a server
-void get_filenames_from_server(int server_port, char *pathname, FileEntry *entries, int *count) {
-    int server_sock = socket(AF_INET, SOCK_STREAM, 0);
-    if (server_sock < 0) {
-        perror("Socket creation failed");
+// remember that the file at key holds the content of its entry
+void hint_add(const char *key, size_t len, const DfsIndexEntry *e) {
+    if (!e->has_checksum || e->removed || len >= DFS_MAX_PATH) return;
+    char *copy = strndup(key, len);
+    if (!copy) return;
+    pthread_mutex_lock(&hint_lock);
+    ContentHint *h = &content_hints[hint_slot(e->checksum, e->port)];
+    free(h->key);
+    h->checksum = e->checksum;
+    h->port = e->port;
+    h->key = copy;
+    pthread_mutex_unlock(&hint_lock);
+}
+
+// a file of port with the given content, as the index has it now
+// returns the length of its key, or -1 if S1 knows of none
+int hint_find(uint64_t checksum, uint64_t size, int port, char *key) {
+    int len = -1;
+    pthread_mutex_lock(&hint_lock);
+    ContentHint *h = &content_hints[hint_slot(checksum, port)];
+    if (h->key && h->checksum == checksum && h->port == port) {
+        len = strlen(h->key);
+        memcpy(key, h->key, len + 1);
+    }
+    pthread_mutex_unlock(&hint_lock);
+    if (len < 0) return -1;
+
+    DfsIndexEntry e;
+    index_rdlock();
+    int found = dfs_index_get(&file_index, key, len, &e);
+    index_rdunlock();
+    if (!found || e.port != port || !e.has_checksum || e.checksum != checksum || e.size != size) return -1;
+    return len;
+}
+
+int hint_visit(void *arg, const char *key, size_t len, const DfsIndexEntry *e) {
+    (void)arg;
+    hint_add(key, len, e);
+    return 0;
+}
+
+// hints for the files of the loaded index; the maintainer thread fills them
+// in before it compacts, so the snapshot stays mapped meanwhile
+void hint_load() {
+    for (size_t i = 0; i < file_index.base.count; i++) {
+        size_t len;
+        const char *key = dfs_index_base_key(&file_index.base, i, &len);
+        DfsIndexEntry e;
+        dfs_index_base_entry(&file_index.base, i, &e);
+        hint_add(key, len, &e);
+    }
+    index_rdlock();
+    dfs_index_range(&file_index, "", 0, hint_visit, NULL);
+    index_rdunlock();
+}
+
+uint64_t cache_hash(const char *key, size_t len) {
+    uint64_t h = 0xcbf29ce484222325ULL;
+    for (size_t i = 0; i < len; i++) h = (h ^ (unsigned char)key[i]) * 0x100000001b3ULL;
+    return h;
+}
+
+// shard of a key; the low bits of the hash pick the chain within it
+CacheShard *cache_shard(const char *key, size_t len) {
+    return &cache_shards[(cache_hash(key, len) >> 32) & (cache_shard_count - 1)];
+}
+
+// chain of the cache entries of a key, both forms of its reply share it
+CacheEntry **cache_bucket(CacheShard *s, const char *key, size_t len) {
+    return &s->buckets[cache_hash(key, len) & (CACHE_BUCKETS - 1)];
+}
+
+// the entry of a key and reply form, called with its shard locked
+CacheEntry *cache_find(CacheShard *s, const char *key, size_t len, int lz4) {
+    for (CacheEntry *ce = *cache_bucket(s, key, len); ce; ce = ce->hnext) {
+        if (ce->lz4 == lz4 && ce->key_len == len && memcmp(ce->key, key, len) == 0) return ce;
+    }
+    return NULL;
+}
+
+CacheTier *cache_tier(CacheEntry *ce) {
+    return ce->data ? &ce->shard->mem : &ce->shard->spill;
+}
+
+void cache_tier_unlink(CacheTier *t, CacheEntry *ce) {
+    if (ce->prev) ce->prev->next = ce->next;
+    else t->head = ce->next;
+    if (ce->next) ce->next->prev = ce->prev;
+    else t->tail = ce->prev;
+    ce->prev = ce->next = NULL;
+    t->bytes -= ce->len;
+}
+
+void cache_tier_push(CacheTier *t, CacheEntry *ce) {
+    ce->prev = NULL;
+    ce->next = t->head;
+    if (t->head) t->head->prev = ce;
+    else t->tail = ce;
+    t->head = ce;
+    t->bytes += ce->len;
+}
+
+void cache_unref(CacheEntry *ce) {
+    if (--ce->refs > 0) return;
+    free(ce->key);
+    free(ce->data);
+    free(ce);
+}
+
+// take an entry out of the chains and its tier, the caller gets the cache's reference
+void cache_detach(CacheEntry *ce) {
+    CacheEntry **p = cache_bucket(ce->shard, ce->key, ce->key_len);
+    while (*p != ce) p = &(*p)->hnext;
+    *p = ce->hnext;
+    ce->hnext = NULL;
+    cache_tier_unlink(cache_tier(ce), ce);
+}
+
+// forget an entry for good; a spilled one loses its file, a reply still
+// being sent from memory keeps the payload until it is done
+void cache_drop(CacheEntry *ce) {
+    cache_detach(ce);
+    if (!ce->data) {
+        char name[32];
+        snprintf(name, sizeof(name), "%016llx", (unsigned long long)ce->spill_id);
+        unlinkat(cache_dir_fd, name, 0);
+    }
+    cache_unref(ce);
+}
+
+void cache_release(CacheEntry *ce) {
+    CacheShard *s = ce->shard;
+    pthread_mutex_lock(&s->lock);
+    cache_unref(ce);
+    pthread_mutex_unlock(&s->lock);
+}
+
+// an upload or remove of a file invalidates what the cache holds of it
+void cache_forget(const char *key, size_t len) {
+    if (cache_shard_count == 0) return;
+    CacheShard *s = cache_shard(key, len);
+    pthread_mutex_lock(&s->lock);
+    for (int lz4 = 0; lz4 <= 1; lz4++) {
+        CacheEntry *ce = cache_find(s, key, len, lz4);
+        if (ce) cache_drop(ce);
+    }
+    pthread_mutex_unlock(&s->lock);
+}
+
+// the entry was relayed for the file the index has now; a changed size,
+// time or checksum means the file was replaced behind S1's back or by an
+// upload that raced the relay
+int cache_current(const CacheEntry *ce, const DfsIndexEntry *e) {
+    return ce->e.port == e->port && ce->e.size == e->size && ce->e.mtime == e->mtime &&
+           ce->e.has_checksum == e->has_checksum && (!e->has_checksum || ce->e.checksum == e->checksum);
+}
+
+// largest reply worth keeping: a single file must not flush the memory tier
+// of its shard
+uint64_t cache_file_max() {
+    return MIN((uint64_t)CACHE_FILE_MAX, cache_shards[0].mem.max / 4);
+}
+
+// memory tier victims of a shard go to files of its spill tier. the files
+// are written without the lock held; an entry invalidated meanwhile comes back stale,
+// and the index check of the next hit drops it
+void cache_spill_out(CacheEntry *victims) {
+    while (victims) {
+        CacheEntry *v = victims;
+        victims = v->hnext;
+        v->hnext = NULL;
+
+        CacheEntry *d = calloc(1, sizeof(CacheEntry));
+        char name[32];
+        int fd = -1;
+        if (d) {
+            d->spill_id = __atomic_fetch_add(&cache_next_spill, 1, __ATOMIC_RELAXED);
+            snprintf(name, sizeof(name), "%016llx", (unsigned long long)d->spill_id);
+            fd = openat(cache_dir_fd, name, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+        }
+        int ok = fd >= 0 && dfs_chunk_write_all(fd, v->data, v->len) == 0;
+        if (fd >= 0) close(fd);
+        if (!ok) {
+            perror("Cache spill failed");
+            if (fd >= 0) unlinkat(cache_dir_fd, name, 0);
+            free(d);
+            cache_release(v);
+            continue;
+        }
+
+        CacheShard *s = v->shard;
+        pthread_mutex_lock(&s->lock);
+        if (cache_find(s, v->key, v->key_len, v->lz4)) {
+            // a newer reply of the file was cached meanwhile
+            unlinkat(cache_dir_fd, name, 0);
+            free(d);
+        } else {
+            d->key = v->key;
+            d->key_len = v->key_len;
+            d->lz4 = v->lz4;
+            d->e = v->e;
+            d->len = v->len;
+            d->refs = 1;
+            d->shard = s;
+            v->key = NULL;
+            CacheEntry **p = cache_bucket(s, d->key, d->key_len);
+            d->hnext = *p;
+            *p = d;
+            cache_tier_push(&s->spill, d);
+            while (s->spill.bytes > s->spill.max) cache_drop(s->spill.tail);
+        }
+        cache_unref(v);
+        pthread_mutex_unlock(&s->lock);
+    }
+}
+
+// keep a relayed download reply; data is taken over
+void cache_insert(const char *path, int lz4, const DfsIndexEntry *e, char *data, uint64_t len) {
+    char key[DFS_MAX_PATH];
+    int key_len = dfs_index_key(path, key, sizeof(key));
+    CacheEntry *ce = key_len > 0 ? calloc(1, sizeof(CacheEntry)) : NULL;
+    if (ce) ce->key = strndup(key, key_len);
+    if (!ce || !ce->key) {
+        if (ce) free(ce);
+        free(data);
+        return;
+    }
+    ce->key_len = key_len;
+    ce->lz4 = lz4;
+    ce->e = *e;
+    ce->data = data;
+    ce->len = len;
+    ce->refs = 1;
+    CacheShard *s = ce->shard = cache_shard(key, key_len);
+
+    CacheEntry *victims = NULL;
+    pthread_mutex_lock(&s->lock);
+    CacheEntry *old = cache_find(s, key, key_len, lz4);
+    if (old) cache_drop(old);
+    CacheEntry **p = cache_bucket(s, key, key_len);
+    ce->hnext = *p;
+    *p = ce;
+    cache_tier_push(&s->mem, ce);
+    while (s->mem.bytes > s->mem.max) {
+        CacheEntry *v = s->mem.tail;
+        cache_detach(v);
+        if (s->spill.max >= v->len) {
+            v->hnext = victims;
+            victims = v;
+        } else {
+            cache_unref(v);
+        }
+    }
+    pthread_mutex_unlock(&s->lock);
+    cache_spill_out(victims);
+}
+
+// reply to a download from the cache, if it holds a reply of the file the
+// index has; the compressed form only goes to clients that take it, and a
+// range is cut from the plain form
+// returns 1 if the reply is under way
+int cache_serve(Conn *c, const char *path, const DfsIndexEntry *e) {
+    if (cache_shard_count == 0) return 0;
+    char key[DFS_MAX_PATH];
+    int key_len = dfs_index_key(path, key, sizeof(key));
+    if (key_len <= 0) return 0;
+
+    CacheShard *s = cache_shard(key, key_len);
+    pthread_mutex_lock(&s->lock);
+    CacheEntry *ce = NULL;
+    int range = (c->req.flags & DFS_F_RANGE) != 0;
+    for (int lz4 = (c->req.flags & DFS_F_LZ4) && !range; lz4 >= 0 && !ce; lz4--) {
+        ce = cache_find(s, key, key_len, lz4);
+        if (ce && !cache_current(ce, e)) {
+            cache_drop(ce);
+            ce = NULL;
+        }
+    }
+    int fd = -1;
+    char name[32];
+    uint64_t off = range ? c->range_off : 0;
+    uint64_t len = range ? c->range_len : 0;
+    if (ce && dfs_range_clip(ce->len, off, &len) < 0) {
+        // the storage server answers an offset past the end
+        ce = NULL;
+    }
+    if (ce && !ce->data) {
+        // an unlink by another loop after the open does not hurt, the file stays readable
+        snprintf(name, sizeof(name), "%016llx", (unsigned long long)ce->spill_id);
+        fd = openat(cache_dir_fd, name, O_RDONLY | O_CLOEXEC);
+        // the name only shows in logs, but one cut short would name another file
+        if (fd >= 0 && snprintf(c->local_path, sizeof(c->local_path), "%s/%s", cache_dir, name) >=
+                           (int)sizeof(c->local_path)) {
+            close(fd);
+            fd = -1;
+        }
+        if (fd >= 0 && off > 0 && lseek(fd, off, SEEK_SET) < 0) {
+            close(fd);
+            fd = -1;
+        }
+        if (fd < 0) {
+            cache_drop(ce);
+            ce = NULL;
+        }
+    }
+    if (!ce) {
+        pthread_mutex_unlock(&s->lock);
+        return 0;
+    }
+    CacheTier *t = cache_tier(ce);
+    cache_tier_unlink(t, ce);
+    cache_tier_push(t, ce);
+    if (ce->data) ce->refs++;
+    int lz4 = ce->lz4;
+    pthread_mutex_unlock(&s->lock);
+
+    if (lz4) reply_chunked_header(c, DFS_F_LZ4);
+    else reply_header(c, DFS_OK, len);
+    c->remaining = len;
+    if (fd < 0) {
+        c->cache_entry = ce;
+        c->cache_end = off + len;
+        c->state = ST_SEND_CACHED;
+        return 1;
+    }
+    dfs_set_send_buffer(c->cli.fd);
+    c->file_fd = fd;
+    c->state = ST_SEND_FILE;
+    return 1;
+}
+
+// memory tier -> output buffer, up to the high-water mark
+int step_send_cached(Conn *c) {
+    CacheEntry *ce = c->cache_entry;
+    int progress = 0;
+    while (c->remaining > 0 && buf_pending(&c->out) < HIGH_WATER) {
+        size_t n = MIN(c->remaining, (off_t)IO_CHUNK);
+        buf_append(&c->out, ce->data + c->cache_end - c->remaining, n);
+        c->remaining -= n;
+        progress = 1;
+    }
+    if (c->remaining == 0) {
+        cache_release(ce);
+        c->cache_entry = NULL;
+        request_done(c);
+        return 1;
+    }
+    return progress;
+}
+
+// the relay of a download that missed the cache is copied for it, if the
+// file is small enough; the copy goes through the buffers instead of the pipe
+void cache_fill_begin(Conn *c, const DfsIndexEntry *e) {
+    buf_free(&c->cache_fill);
+    c->cache_filling = cache_shard_count > 0 && e->size <= cache_file_max();
+    c->cache_index = *e;
+}
+
+void cache_fill_stop(Conn *c) {
+    buf_free(&c->cache_fill);
+    c->cache_filling = 0;
+}
+
+void cache_fill_add(Conn *c, const void *data, size_t n) {
+    if (!c->cache_filling) return;
+    // a compressed reply that grew past the limit is not kept either
+    if (c->cache_fill.len + n > cache_file_max()) cache_fill_stop(c);
+    else buf_append(&c->cache_fill, data, n);
+}
+
+// the relay went through whole, the cache takes the copy
+void cache_fill_end(Conn *c) {
+    if (!c->cache_filling) return;
+    char *data = c->cache_fill.data;
+    uint64_t len = c->cache_fill.len;
+    char *fit = len > 0 ? realloc(data, len) : NULL;
+    if (fit) data = fit;
+    memset(&c->cache_fill, 0, sizeof(c->cache_fill));
+    c->cache_filling = 0;
+    // an empty file is not worth an entry
+    if (!data) return;
+    cache_insert(c->path, c->cache_lz4, &c->cache_index, data, len);
+}
+
+// the spill tier does not outlive S1, its entries are only known in memory.
+// the cache takes as many shards as still keep a reply of CACHE_FILE_MAX
+// to a quarter of a shard's memory tier, a small cache stays in one
+void cache_init(uint64_t mem_mb, uint64_t spill_mb) {
+    uint64_t mem = mem_mb << 20;
+    if (mem == 0) return;
+    int shards = 1;
+    while (shards < CACHE_SHARDS && mem / (shards * 2) >= 4 * (uint64_t)CACHE_FILE_MAX) shards *= 2;
+    for (int i = 0; i < shards; i++) {
+        cache_shards[i].mem.max = mem / shards;
+        cache_shards[i].spill.max = (spill_mb << 20) / shards;
+    }
+    cache_shard_count = shards;
+    mkdirp(CACHE_DIR);
+    snprintf(cache_dir, sizeof(cache_dir), "%s", expand_path(CACHE_DIR));
+    cache_dir_fd = open(cache_dir, O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+    DIR *dir = cache_dir_fd >= 0 ? fdopendir(dup(cache_dir_fd)) : NULL;
+    if (!dir) {
+        perror("Cannot open the cache directory, nothing is spilled");
+        for (int i = 0; i < shards; i++) cache_shards[i].spill.max = 0;
+        printf("S1: Read cache of %llu MiB\n", (unsigned long long)mem_mb);
+        return;
+    }
+    struct dirent *d;
+    while ((d = readdir(dir)) != NULL) {
+        if (d->d_name[0] != '.') unlinkat(cache_dir_fd, d->d_name, 0);
+    }
+    closedir(dir);
+    printf("S1: Read cache of %llu MiB, %llu MiB more spilled to %s\n",
+           (unsigned long long)mem_mb, (unsigned long long)spill_mb, CACHE_DIR);
+}
+
+// an upload went through: the index takes the file as S1 saw it pass, and
+// its content is remembered for uploads by hash
+// returns the log record to wait for before acknowledging it
+uint64_t index_file_stored(const char *path, int port, uint64_t size, uint64_t checksum, time_t mtime) {
+    char key[DFS_MAX_PATH];
+    int len = dfs_index_key(path, key, sizeof(key));
+    if (len <= 0) return 0;
+
+    DfsIndexEntry e;
+    memset(&e, 0, sizeof(e));
+    e.port = port;
+    e.size = size;
+    e.mtime = mtime;
+    e.checksum = checksum;
+    e.has_checksum = 1;
+
+    index_wrlock();
+    if (!dfs_index_set(&file_index, key, len, &e)) index_lost(index_source(port));
+    uint64_t lsn = wal_append(DFS_WAL_PUT, key, len, &e);
+    index_wrunlock();
+    hint_add(key, len, &e);
+    cache_forget(key, len);
+    return lsn;
+}
+
+// a file is gone; while its server is being scanned, or a snapshot written,
+// a tombstone keeps the file from coming back
+// returns the log record to wait for before acknowledging it
+uint64_t index_file_removed(const char *path, int port) {
+    char key[DFS_MAX_PATH];
+    int len = dfs_index_key(path, key, sizeof(key));
+    if (len <= 0) return 0;
+
+    DfsIndexEntry e;
+    memset(&e, 0, sizeof(e));
+    e.port = port;
+
+    index_wrlock();
+    int source = index_source(port);
+    if (dfs_index_delete(&file_index, key, len, port, index_sources[source].scanning || index_compacting) < 0) {
+        index_lost(source);
+    }
+    uint64_t lsn = wal_append(DFS_WAL_DEL, key, len, &e);
+    index_wrunlock();
+    cache_forget(key, len);
+    return lsn;
+}
+
+// queue a reply for once the log record lsn is on disk, so an acknowledged
+// upload or remove survives a restart of S1
+void reply_durable(Conn *c, uint64_t lsn, int status, const char *msg) {
+    c->wal_lsn = lsn;
+    c->sync_status = status;
+    snprintf(c->sync_msg, sizeof(c->sync_msg), "%s", msg);
+    c->state = ST_WAL_SYNC;
+}
+
+// the held back reply goes out once its log record is on disk; until then
+// the connection waits on its loop's list for the log writer's signal
+int step_wal_sync(Conn *c) {
+    if (c->wal_lsn > wal_durable()) {
+        if (!c->wal_waiting) {
+            c->wal_waiting = 1;
+            c->next_wal_waiter = c->loop->wal_waiters;
+            c->loop->wal_waiters = c;
+        }
+        return 0;
+    }
+    reply(c, c->sync_status, c->sync_msg);
+    return 1;
+}
+
+// hand the connection to a helper thread for file work that would block the
+// loop; job_done finishes it on the loop afterwards
+void job_start(Conn *c, void (*job)(Conn *c), void (*job_done)(Conn *c)) {
+    c->job = job;
+    c->job_done = job_done;
+    c->job_running = 1;
+    c->state = ST_JOB;
+    c->next_job = NULL;
+    pthread_mutex_lock(&job_queue.lock);
+    if (job_queue.tail) job_queue.tail->next_job = c;
+    else job_queue.head = c;
+    job_queue.tail = c;
+    pthread_cond_signal(&job_queue.wake);
+    pthread_mutex_unlock(&job_queue.lock);
+}
+
+// helper thread: runs jobs and hands the connections back to their loops
+void *job_helper(void *arg) {
+    (void)arg;
+    while (1) {
+        pthread_mutex_lock(&job_queue.lock);
+        while (!job_queue.head) pthread_cond_wait(&job_queue.wake, &job_queue.lock);
+        Conn *c = job_queue.head;
+        job_queue.head = c->next_job;
+        if (!job_queue.head) job_queue.tail = NULL;
+        pthread_mutex_unlock(&job_queue.lock);
+
+        c->job(c);
+
+        EventLoop *loop = c->loop;
+        pthread_mutex_lock(&loop->job_lock);
+        c->next_job = loop->jobs_done;
+        loop->jobs_done = c;
+        pthread_mutex_unlock(&loop->job_lock);
+        uint64_t one = 1;
+        if (write(loop->job_event.fd, &one, sizeof(one)) < 0 && errno != EAGAIN) {
+            perror("eventfd write failed");
+        }
+    }
+    return NULL;
+}
+
+// make a rename into dir stick
+void sync_dir(const char *dir) {
+    int dir_fd = open(dir, O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+    if (dir_fd >= 0) {
+        fsync(dir_fd);
+        close(dir_fd);
+    }
+}
+
+// helper thread: the new version of a local file reaches the disk before it
+// replaces the old one, and the rename before the upload is acknowledged
+void local_commit_job(Conn *c) {
+    struct stat st;
+    c->job_status = DFS_OK;
+    if (fsync(c->file_fd) < 0 || fstat(c->file_fd, &st) < 0) {
+        perror("Sync error");
+        c->job_status = DFS_E_IO;
+    }
+    close(c->file_fd);
+    c->file_fd = -1;
+    if (c->job_status == DFS_OK && rename(c->upload_tmp, c->local_path) < 0) {
+        perror("Rename error");
+        c->job_status = DFS_E_IO;
+    }
+    if (c->job_status != DFS_OK) {
+        unlink(c->upload_tmp);
+        return;
+    }
+    c->commit_mtime = st.st_mtime;
+    char *dir_path = strdup(c->local_path);
+    if (dir_path) sync_dir(dirname(dir_path));
+    free(dir_path);
+}
+
+// the file is in place: the index learns of it, and the reply waits for that
+// to be logged. a client gone meanwhile gets no reply, the file stays
+void local_commit_done(Conn *c) {
+    if (c->job_status != DFS_OK) {
+        if (!c->dead) reply(c, DFS_E_IO, "ERR: Write error");
+        return;
+    }
+    uint64_t lsn = index_file_stored(c->path, 0, c->claim_size, c->claim_checksum, c->commit_mtime);
+    if (!c->dead) reply_durable(c, lsn, DFS_OK, c->commit_msg);
+}
+
+// the temp file in file_fd holds a local file's new version of claim_size
+// bytes and checksum claim_checksum: it replaces the file off the loop
+void local_commit(Conn *c, const char *msg) {
+    c->commit_msg = msg;
+    job_start(c, local_commit_job, local_commit_done);
+}
+
+// temp file an upload to path is written to before it replaces the file; no
+// extension, so listings and tars never pick it up
+void upload_tmp_path(char *tmp, size_t max, const char *path) {
+    char *dir_path = strdup(path);
+    snprintf(tmp, max, "%s/.upload-%d-%u", dir_path ? dirname(dir_path) : ".", (int)getpid(),
+             __atomic_fetch_add(&upload_seq, 1, __ATOMIC_RELAXED));
+    free(dir_path);
+}
+
+// the temp file a local upload is written to; returns 0, or -1 once the
+// failure is answered
+int upload_local_open(Conn *c) {
+    // Convert path  ~S1/f1/xyz.c -> ~/S1/f1/xyz.c
+    char full_path[MAX_BUFF + 8];
+    snprintf(full_path, sizeof(full_path), "~/S1/%s", c->path + 4); // Skip ~S1/
+    snprintf(c->local_path, sizeof(c->local_path), "%s", expand_path(full_path));
+
+    // create directory structure
+    char *dir_path = strdup(c->local_path);
+    mkdirp(dirname(dir_path));
+    free(dir_path);
+
+    // Keep .c files locally, written next to the old version and renamed
+    // over it once complete, so files linked to it by uploads by hash keep it
+    upload_tmp_path(c->upload_tmp, sizeof(c->upload_tmp), c->local_path);
+    c->file_fd = open(c->upload_tmp, O_WRONLY | O_CREAT | O_EXCL | O_CLOEXEC, 0666);
+    if (c->file_fd < 0) {
+        perror("File creation failed");
+        reply(c, DFS_E_IO, "ERR: File creation failed");
+        return -1;
+    }
+    return 0;
+}
+
+// function to handle uploadf command, the file data follows as request payload
+void handle_uploadf_command(Conn *c, char *filepath) {
+    // filepath starts with ~S1/ and names a file
+    if (strncmp(filepath, "~S1/", 4) != 0) {
+        reply(c, DFS_E_INVALID, "ERR: Path must start with ~S1/");
+        return;
+    }
+    char *filename = strrchr(filepath, '/') + 1;
+    if (*filename == '\0') {
+        reply(c, DFS_E_INVALID, "ERR: Missing filename or destination");
+        return;
+    }
+    if (server_for_file(filepath) < 0) {
+        reply(c, DFS_E_INVALID, strchr(filename, '.') ? "ERR: Unsupported file type"
+                                                      : "ERR: File has no extension");
+        return;
+    }
+    if (c->req_body == 0) {
+        reply(c, DFS_E_INVALID, "ERR: Invalid file size");
+        return;
+    }
+    // an upload by hash carries the size and checksum of the data, not the data
+    if (c->req.flags & DFS_F_HASH) {
+        if (c->req_body != DFS_HASH_CLAIM) {
+            reply(c, DFS_E_INVALID, "ERR: Invalid content hash");
+            return;
+        }
+        c->state = ST_UPLOAD_CLAIM;
+        return;
+    }
+    // and a compressed one starts with them
+    if (c->req.flags & DFS_F_LZ4) {
+        if (c->req_body <= DFS_LZ4_HEADER) {
+            reply(c, DFS_E_INVALID, "ERR: Invalid compressed data");
+            return;
+        }
+        c->state = ST_UPLOAD_CLAIM;
+        return;
+    }
+
+    // pdf, txt and zip files go straight through to their storage server
+    dfs_xxh64_init(&c->upload_hash);
+    int target_port = server_for_file(filepath);
+    if (target_port > 0) {
+        stream_upload(c, target_port);
+        return;
+    }
+
+    if (upload_local_open(c) < 0) return;
+    printf("Receiving file of size: %lu bytes\n", (unsigned long)c->req_body);
+    c->state = ST_UPLOAD_BODY;
+}
+
+// a compressed upload, once its size and checksum are in: pdf, txt and zip
+// files go through to their storage server as they are, which decodes and
+// checks them; .c files are decoded here
+void upload_compressed(Conn *c) {
+    int port = server_for_file(c->path);
+    if (port > 0) {
+        if (backend_connect(c, port) < 0) {
+            reply(c, DFS_E_UNAVAILABLE, "ERR: Cannot connect to storage server");
+            return;
+        }
+        unsigned char claim[DFS_LZ4_HEADER];
+        dfs_put64(claim, c->claim_size);
+        dfs_put64(claim + 8, c->claim_checksum);
+        // a chunked upload goes on chunked, its end is where the client's ends
+        if (c->req_chunked) {
+            backend_frame(c, DFS_OP_UPLOAD, DFS_F_LZ4 | DFS_F_CHUNKED, c->path, 0);
+            printf("Streaming compressed %s to %s, %lu decoded\n", c->path, server_name(port),
+                   (unsigned long)c->claim_size);
+        } else {
+            backend_frame(c, DFS_OP_UPLOAD, DFS_F_LZ4, c->path, sizeof(claim) + c->req_body);
+            printf("Streaming %lu compressed bytes of %s to %s, %lu decoded\n", (unsigned long)c->req.payload_len,
+                   c->path, server_name(port), (unsigned long)c->claim_size);
+        }
+        backend_payload(c, claim, sizeof(claim));
+        c->stream_from = c->req_body;
+        c->state = ST_STREAM_BODY;
+        return;
+    }
+
+    if (upload_local_open(c) < 0) return;
+    if (c->req_chunked) {
+        printf("Receiving compressed file, %lu bytes decoded\n", (unsigned long)c->claim_size);
+    } else {
+        printf("Receiving compressed file of size: %lu bytes, %lu decoded\n", (unsigned long)c->req.payload_len,
+               (unsigned long)c->claim_size);
+    }
+    dfs_xxh64_init(&c->upload_hash);
+    c->lz4_len = 0;
+    c->lz4_written = 0;
+    c->state = ST_UPLOAD_LZ4;
+}
+
+// end of a compressed upload to a local file: it replaces the old version if
+// it decoded to the size and checksum the upload started with
+void upload_lz4_finish(Conn *c, int status) {
+    if (status == DFS_OK && (c->lz4_written != c->claim_size ||
+                             dfs_xxh64_digest(&c->upload_hash) != c->claim_checksum)) {
+        status = DFS_E_INVALID;
+    }
+    if (status != DFS_OK) {
+        close(c->file_fd);
+        c->file_fd = -1;
+        unlink(c->upload_tmp);
+        reply(c, status, status == DFS_E_INVALID ? "ERR: Invalid compressed data" : "ERR: Write error");
+        return;
+    }
+    local_commit(c, "OK: File stored locally");
+}
+
+// client -> compressed chunks, each gathered whole and decoded into a local file
+int step_upload_lz4(Conn *c) {
+    static __thread unsigned char block[DFS_LZ4_BLOCK];
+    if (!c->lz4_chunk && !(c->lz4_chunk = malloc(DFS_LZ4_CHUNK_MAX))) {
+        upload_lz4_finish(c, DFS_E_IO);
+        return 1;
+    }
+    int progress = 0;
+    // bounded, so a long upload cannot hold up the loop
+    for (int rounds = 0; rounds < 64; rounds++) {
+        size_t need = DFS_CHUNK_HEADER + (c->lz4_len < DFS_CHUNK_HEADER ? 0 : dfs_get64(c->lz4_chunk));
+        if (c->lz4_len < need) {
+            size_t n = MIN((uint64_t)buf_pending(&c->in), c->req_body);
+            n = MIN(n, need - c->lz4_len);
+            if (c->req_chunked) chunked_scan(c, (unsigned char *)c->in.data + c->in.off, &n);
+            if (n == 0) {
+                if (c->req_body > 0) break;
+                // the payload ended inside a chunk
+                upload_lz4_finish(c, DFS_E_INVALID);
+                return 1;
+            }
+            memcpy(c->lz4_chunk + c->lz4_len, c->in.data + c->in.off, n);
+            buf_consume(&c->in, n);
+            c->req_body -= n;
+            c->lz4_len += n;
+            progress = 1;
+            if (c->lz4_len == DFS_CHUNK_HEADER) {
+                uint64_t len = dfs_get64(c->lz4_chunk);
+                if (len == 0 || len > DFS_LZ4_CHUNK_MAX - DFS_CHUNK_HEADER || len > c->req_body) {
+                    // the empty chunk ends the data, and with it the payload
+                    upload_lz4_finish(c, len == 0 && c->req_body == 0 ? DFS_OK : DFS_E_INVALID);
+                    return 1;
+                }
+            }
+            continue;
+        }
+
+        ssize_t n = dfs_lz4_unchunk(c->lz4_chunk + DFS_CHUNK_HEADER, c->lz4_len - DFS_CHUNK_HEADER, block);
+        c->lz4_len = 0;
+        if (n < 0) {
+            upload_lz4_finish(c, DFS_E_INVALID);
+            return 1;
+        }
+        if (dfs_chunk_write_all(c->file_fd, block, n) < 0) {
+            perror("Write error");
+            upload_lz4_finish(c, DFS_E_IO);
+            return 1;
+        }
+        dfs_xxh64_update(&c->upload_hash, block, n);
+        c->lz4_written += n;
+    }
+    if (!progress && c->cli_eof) {
+        close(c->file_fd);
+        c->file_fd = -1;
+        unlink(c->upload_tmp);
+        reply(c, DFS_E_INVALID, "ERR: Incomplete file transfer");
+        return 1;
+    }
+    return progress;
+}
+
+// client -> local file
+int step_upload_body(Conn *c) {
+    int progress = 0;
+    while (c->req_body > 0 && buf_pending(&c->in) > 0) {
+        size_t n = MIN((uint64_t)buf_pending(&c->in), c->req_body);
+        ssize_t written = write(c->file_fd, c->in.data + c->in.off, n);
+        if (written < 0) {
+            if (errno == EINTR) continue;
+            perror("Write error");
+            close(c->file_fd);
+            c->file_fd = -1;
+            unlink(c->upload_tmp);
+            reply(c, DFS_E_IO, "ERR: Write error");
+            return 1;
+        }
+        dfs_xxh64_update(&c->upload_hash, c->in.data + c->in.off, written);
+        buf_consume(&c->in, written);
+        c->req_body -= written;
+        progress = 1;
+    }
+
+    if (c->req_body == 0) {
+        c->claim_size = c->req.payload_len;
+        c->claim_checksum = dfs_xxh64_digest(&c->upload_hash);
+        local_commit(c, "OK: File stored locally");
+        return 1;
+    }
+    if (c->cli_eof) {
+        close(c->file_fd);
+        c->file_fd = -1;
+        unlink(c->upload_tmp);
+        reply(c, DFS_E_INVALID, "ERR: Incomplete file transfer");
+        return 1;
+    }
+    return progress;
+}
+
+// payload of a rejected request, read and dropped to reach the next request
+int step_discard(Conn *c) {
+    size_t n = MIN((uint64_t)buf_pending(&c->in), c->req_body);
+    if (c->req_chunked) chunked_scan(c, (unsigned char *)c->in.data + c->in.off, &n);
+    buf_consume(&c->in, n);
+    c->req_body -= n;
+    if (c->req_body == 0) {
+        c->state = ST_CMD;
+        return 1;
+    }
+    if (c->cli_eof) {
+        c->state = ST_DONE;
+        return 1;
+    }
+    return n > 0;
+}
+
+// relay an upload to a storage server as it arrives; S1 keeps no copy and
+// buffers at most a few chunks, the client is answered once the server has it
+void stream_upload(Conn *c, int target_port) {
+    if (backend_connect(c, target_port) < 0) {
+        reply(c, DFS_E_UNAVAILABLE, "ERR: Cannot connect to storage server");
+        return;
+    }
+
+    // the same header goes out, with the size the client announced
+    backend_frame(c, DFS_OP_UPLOAD, 0, c->path, c->req_body);
+    c->stream_from = c->req_body;
+
+    printf("Streaming %lu bytes of %s to %s\n", (unsigned long)c->req_body,
+           c->path, server_name(target_port));
+    c->state = ST_STREAM_BODY;
+}
+
+// client -> storage server
+int step_stream_body(Conn *c) {
+    if (c->be_error || c->be_eof) {
+        if (backend_retry(c)) return 1;
+        printf("Error: Storage server on port %d dropped the upload\n", c->target_port);
+        backend_close(c);
+        reply(c, DFS_E_UNAVAILABLE, "ERR: Storage server unavailable");
+        return 1;
+    }
+
+    int progress = 0;
+    while (c->req_body > 0 && buf_pending(&c->in) > 0 && buf_pending(&c->bout) < HIGH_WATER) {
+        size_t n = MIN((uint64_t)buf_pending(&c->in), c->req_body);
+        n = MIN(n, (size_t)IO_CHUNK);
+        if (c->req_chunked) chunked_scan(c, (unsigned char *)c->in.data + c->in.off, &n);
+        buf_append(&c->bout, c->in.data + c->in.off, n);
+        if (c->req.opcode == DFS_OP_UPLOAD && !(c->req.flags & DFS_F_LZ4)) {
+            dfs_xxh64_update(&c->upload_hash, c->in.data + c->in.off, n);
+        }
+        buf_consume(&c->in, n);
+        c->req_body -= n;
+        progress = 1;
+    }
+
+    if (c->req_body == 0) {
+        printf("S1: Waiting for server response...\n");
+        c->state = ST_FORWARD_ACK;
+        return 1;
+    }
+    if (c->cli_eof && buf_pending(&c->in) == 0) {
+        // the storage server got a short body, it cannot be used again
+        backend_close(c);
+        reply(c, DFS_E_INVALID, "ERR: Incomplete file transfer");
+        return 1;
+    }
+    return progress;
+}
+
+// reply of the storage server for a forwarded upload
+int step_forward_ack(Conn *c) {
+    DfsHeader h;
+    int r = backend_reply(c, &h);
+    if (r == 0) return 0;
+    if (r < 0 && backend_retry(c)) return 1;
+
+    if (r > 0 && h.status == DFS_OK && c->req.opcode == DFS_OP_PATCH) {
+        // the storage server checked the new version against the patch's header
+        printf("File successfully patched on server on port %d\n", c->target_port);
+        uint64_t lsn = index_file_stored(c->path, c->target_port, c->claim_size, c->claim_checksum, time(NULL));
+        backend_release(c);
+        reply_durable(c, lsn, DFS_OK, "OK: File updated remotely");
+    } else if (r > 0 && h.status == DFS_OK) {
+        printf("File successfully forwarded to server on port %d\n", c->target_port);
+        // a compressed upload came with the size and checksum of its data
+        int compressed = (c->req.flags & DFS_F_LZ4) != 0;
+        uint64_t lsn = index_file_stored(c->path, c->target_port,
+                                         compressed ? c->claim_size : c->req.payload_len,
+                                         compressed ? c->claim_checksum : dfs_xxh64_digest(&c->upload_hash),
+                                         time(NULL));
+        backend_release(c);
+        reply_durable(c, lsn, DFS_OK, "OK: File stored remotely");
+    } else {
+        printf("Error: Server on port %d rejected file\n", c->target_port);
+        if (r > 0 && h.payload_len == 0) backend_release(c);
+        else backend_close(c);
+        int status = r > 0 ? h.status : DFS_E_UNAVAILABLE;
+        reply(c, status, status == DFS_E_MISSING && c->req.opcode == DFS_OP_PATCH
+                         ? "ERR: Stored version changed, send all of the file"
+                         : "ERR: Storage server rejected file");
+    }
+    return 1;
+}
+
+// whether the local file fd has the content an upload by hash claims. the
+// XXH64 that found it can be forged, its SHA-256 cannot
+int claim_matches(Conn *c, int fd) {
+    unsigned char digest[DFS_SHA256_SIZE];
+    struct stat st;
+    return fd >= 0 && fstat(fd, &st) == 0 && (uint64_t)st.st_size == c->claim_size &&
+           dfs_sha256_file(fd, digest) == 0 && memcmp(digest, c->claim_digest, sizeof(digest)) == 0;
+}
+
+// helper thread: hashing a stored file may read all of it, so the claim is
+// checked off the loop
+void claim_check_job(Conn *c) {
+    c->job_status = claim_matches(c, c->file_fd) ? DFS_OK : DFS_E_MISSING;
+    if (c->file_fd >= 0) close(c->file_fd);
+    c->file_fd = -1;
+}
+
+// the file the upload by hash names holds the claimed content already
+void claim_check_done(Conn *c) {
+    if (c->dead) return;
+    if (c->job_status != DFS_OK) {
+        reply(c, DFS_E_MISSING, "ERR: Content not stored");
+        return;
+    }
+    printf("S1: %s holds that content already\n", c->path);
+    reply(c, DFS_OK, "OK: File stored locally");
+}
+
+// helper thread: a linked temp file replaces the upload's file if it holds
+// the claimed content
+void local_link_job(Conn *c) {
+    if (!claim_matches(c, c->file_fd)) {
+        if (c->file_fd >= 0) close(c->file_fd);
+        c->file_fd = -1;
+        unlink(c->upload_tmp);
+        c->job_status = DFS_E_MISSING;
+        return;
+    }
+    local_commit_job(c);
+}
+
+void local_link_done(Conn *c) {
+    if (c->job_status != DFS_E_MISSING) {
+        local_commit_done(c);
+    } else if (!c->dead) {
+        reply(c, DFS_E_MISSING, "ERR: Content not stored");
+    }
+}
+
+// store an upload by hash from a file with the same content: a .c file is
+// hard linked here, other files are linked by their storage server, either
+// once the SHA-256 of the stored content matches the claim. content S1 knows
+// nothing of is answered with DFS_E_MISSING, and the client sends it
+void upload_by_hash(Conn *c) {
+    int port = server_for_file(c->path);
+    char key[DFS_MAX_PATH], source[DFS_MAX_PATH];
+    int len = dfs_index_key(c->path, key, sizeof(key));
+    if (len <= 0) {
+        reply(c, DFS_E_INVALID, "ERR: Invalid path");
+        return;
+    }
+    int source_len = hint_find(c->claim_checksum, c->claim_size, port, source);
+    if (source_len < 0 || source_len + 4 >= DFS_MAX_PATH) {
+        reply(c, DFS_E_MISSING, "ERR: Content not stored");
+        return;
+    }
+    // a stored file of the same path is checked by its storage server too
+    if (port == 0 && source_len == len && memcmp(source, key, len) == 0) {
+        char full_path[MAX_BUFF + 8];
+        snprintf(full_path, sizeof(full_path), "~/S1/%s", source);
+        c->file_fd = open(expand_path(full_path), O_RDONLY | O_CLOEXEC);
+        job_start(c, claim_check_job, claim_check_done);
+        return;
+    }
+    printf("S1: Linking %s to ~S1/%s, %llu bytes not transferred\n", c->path, source,
+           (unsigned long long)c->claim_size);
+
+    if (port > 0) {
+        if (backend_connect(c, port) < 0) {
+            reply(c, DFS_E_UNAVAILABLE, "ERR: Cannot connect to storage server");
+            return;
+        }
+        unsigned char size[8];
+        dfs_put64(size, c->claim_size);
+        backend_frame(c, DFS_OP_LINK, 0, c->path, sizeof(size) + DFS_SHA256_SIZE + 4 + source_len);
+        backend_payload(c, size, sizeof(size));
+        backend_payload(c, c->claim_digest, DFS_SHA256_SIZE);
+        backend_payload(c, "~S1/", 4);
+        backend_payload(c, source, source_len);
+        c->state = ST_LINK_ACK;
+        return;
+    }
+
+    char full_path[MAX_BUFF + 8], from[PATH_MAX];
+    snprintf(full_path, sizeof(full_path), "~/S1/%s", source);
+    snprintf(from, sizeof(from), "%s", expand_path(full_path));
+    snprintf(full_path, sizeof(full_path), "~/S1/%s", c->path + 4);
+    snprintf(c->local_path, sizeof(c->local_path), "%s", expand_path(full_path));
+    char *dir_path = strdup(c->local_path);
+    mkdirp(dirname(dir_path));
+    free(dir_path);
+
+    // linked under a temp name first, so a failure leaves the old file alone.
+    // the content checked is the one linked; a source gone, changed behind
+    // the index's back or merely colliding with the claim is sent after all
+    upload_tmp_path(c->upload_tmp, sizeof(c->upload_tmp), c->local_path);
+    if (link(from, c->upload_tmp) < 0) {
+        perror("Link failed");
+        reply(c, DFS_E_MISSING, "ERR: Content not stored");
+        return;
+    }
+    c->file_fd = open(c->upload_tmp, O_RDONLY | O_CLOEXEC);
+    c->commit_msg = "OK: File stored locally";
+    job_start(c, local_link_job, local_link_done);
+}
+
+// size and checksums of an upload by hash, or size and checksum of a compressed one
+int step_upload_claim(Conn *c) {
+    size_t need = c->req.flags & DFS_F_HASH ? DFS_HASH_CLAIM : DFS_LZ4_HEADER;
+    if (buf_pending(&c->in) < need) {
+        if (c->cli_eof) {
+            c->state = ST_DONE;
+            return 1;
+        }
+        return 0;
+    }
+    unsigned char claim[DFS_HASH_CLAIM];
+    memcpy(claim, c->in.data + c->in.off, need);
+    if (c->req_chunked) chunked_scan(c, claim, &need);
+    buf_consume(&c->in, need);
+    c->req_body -= need;
+    c->claim_size = dfs_get64(claim);
+    c->claim_checksum = dfs_get64(claim + 8);
+    if (c->req.flags & DFS_F_HASH) memcpy(c->claim_digest, claim + 16, DFS_SHA256_SIZE);
+    if (c->req.flags & DFS_F_HASH) upload_by_hash(c);
+    else upload_compressed(c);
+    return 1;
+}
+
+// reply of the storage server for the LINK of an upload by hash
+int step_link_ack(Conn *c) {
+    DfsHeader h;
+    int r = backend_reply(c, &h);
+    if (r == 0) return 0;
+    if (r < 0 && backend_retry(c)) return 1;
+
+    if (r > 0 && h.payload_len == 0) backend_release(c);
+    else backend_close(c);
+    if (r > 0 && h.status == DFS_OK) {
+        uint64_t lsn = index_file_stored(c->path, c->target_port, c->claim_size, c->claim_checksum, time(NULL));
+        reply_durable(c, lsn, DFS_OK, "OK: File stored remotely");
+    } else if (r > 0 && h.status == DFS_E_NOTFOUND) {
+        // the source changed since the index saw it, the data is sent after all
+        reply(c, DFS_E_MISSING, "ERR: Content not stored");
+    } else {
+        printf("Error: Server on port %d could not link file\n", c->target_port);
+        reply(c, r > 0 ? h.status : DFS_E_UNAVAILABLE, "ERR: Storage server rejected file");
+    }
+    return 1;
+}
+
+// Function to handle a SIGS request: the block signatures of the stored
+// version of a file, for a delta upload
+void handle_sigs_command(Conn *c, char *filepath) {
+    if (strncmp(filepath, "~S1/", 4) != 0) {
+        reply(c, DFS_E_INVALID, "ERR: Path must start with ~S1/");
+        return;
+    }
+    int port = server_for_file(filepath);
+    DfsIndexEntry entry;
+    if (port < 0) {
+        reply(c, DFS_E_INVALID, "ERR: Unsupported file type");
+        return;
+    }
+    if (index_lookup(filepath, port, &entry) == 0) {
+        reply(c, DFS_E_NOTFOUND, "ERR: File not found");
+        return;
+    }
+    if (port > 0) {
+        start_relay(c, port, DFS_OP_SIGS, 0, filepath);
+        return;
+    }
+
+    char full_path[MAX_BUFF + 8];
+    snprintf(full_path, sizeof(full_path), "~/S1/%s", filepath + 4); // Skip ~S1/
+    snprintf(c->local_path, sizeof(c->local_path), "%s", expand_path(full_path));
+    struct stat st;
+    int fd = open(c->local_path, O_RDONLY | O_CLOEXEC);
+    if (fd < 0 || fstat(fd, &st) != 0) {
+        if (fd >= 0) close(fd);
+        reply(c, DFS_E_NOTFOUND, "ERR: File not found");
+        return;
+    }
+
+    c->file_fd = fd;
+    c->delta_size = st.st_size;
+    c->delta_block = dfs_delta_block_size(st.st_size);
+    c->delta_off = 0;
+    unsigned char head[DFS_DELTA_HEADER - 8];
+    dfs_put64(head, c->delta_block);
+    dfs_put64(head + 8, c->delta_size);
+    reply_header(c, DFS_OK, sizeof(head) + dfs_delta_blocks(c->delta_size, c->delta_block) * DFS_DELTA_SIG);
+    buf_append(&c->out, head, sizeof(head));
+    c->state = ST_SEND_SIGS;
+}
+
+// signatures of a local file -> client, as far as the output buffer takes them
+int step_send_sigs(Conn *c) {
+    static __thread unsigned char block[DFS_DELTA_BLOCK_MAX];
+    uint64_t blocks = dfs_delta_blocks(c->delta_size, c->delta_block);
+    int progress = 0;
+    while (c->delta_off < blocks && buf_pending(&c->out) < HIGH_WATER) {
+        uint64_t off = c->delta_off * c->delta_block;
+        size_t n = MIN(c->delta_block, c->delta_size - off);
+        ssize_t got = pread(c->file_fd, block, n, off);
+        if (got < 0 && errno == EINTR) continue;
+        if (got != (ssize_t)n) {
+            // the reply promised every block, the client can only be cut off
+            if (got >= 0) fprintf(stderr, "File %s shrank while being sent\n", c->local_path);
+            else perror("File read failed");
+            close(c->file_fd);
+            c->file_fd = -1;
+            c->state = ST_DONE;
+            return 1;
+        }
+        unsigned char sig[DFS_DELTA_SIG];
+        dfs_delta_sign(sig, block, n);
+        buf_append(&c->out, sig, sizeof(sig));
+        c->delta_off++;
+        progress = 1;
+    }
+    if (c->delta_off == blocks) {
+        close(c->file_fd);
+        c->file_fd = -1;
+        request_done(c);
+        return 1;
+    }
+    return progress;
+}
+
+// Function to handle a PATCH request, a delta upload: the changes of the new
+// version against the stored one follow as request payload
+void handle_patch_command(Conn *c, char *filepath) {
+    if (strncmp(filepath, "~S1/", 4) != 0) {
+        reply(c, DFS_E_INVALID, "ERR: Path must start with ~S1/");
+        return;
+    }
+    if (server_for_file(filepath) < 0) {
+        reply(c, DFS_E_INVALID, "ERR: Unsupported file type");
+        return;
+    }
+    if (c->req_body < DFS_DELTA_HEADER) {
+        reply(c, DFS_E_INVALID, "ERR: Invalid patch");
+        return;
+    }
+    c->state = ST_PATCH_HEADER;
+}
+
+// header of a patch; pdf, txt and zip patches go through to their storage
+// server, which applies them, .c patches are applied here
+int step_patch_header(Conn *c) {
+    if (buf_pending(&c->in) < DFS_DELTA_HEADER) {
+        if (c->cli_eof) {
+            c->state = ST_DONE;
+            return 1;
+        }
+        return 0;
+    }
+    unsigned char head[DFS_DELTA_HEADER];
+    memcpy(head, c->in.data + c->in.off, sizeof(head));
+    buf_consume(&c->in, sizeof(head));
+    c->req_body -= sizeof(head);
+    DfsPatch patch;
+    if (dfs_patch_parse(head, &patch) < 0) {
+        reply(c, DFS_E_INVALID, "ERR: Invalid patch");
+        return 1;
+    }
+    c->claim_size = patch.size;
+    c->claim_checksum = patch.checksum;
+    c->delta_block = patch.block;
+
+    int port = server_for_file(c->path);
+    if (port > 0) {
+        if (backend_connect(c, port) < 0) {
+            reply(c, DFS_E_UNAVAILABLE, "ERR: Cannot connect to storage server");
+            return 1;
+        }
+        backend_frame(c, DFS_OP_PATCH, 0, c->path, sizeof(head) + c->req_body);
+        backend_payload(c, head, sizeof(head));
+        c->stream_from = c->req_body;
+        printf("Streaming patch of %s to %s, %lu bytes for %lu\n", c->path, server_name(port),
+               (unsigned long)c->req.payload_len, (unsigned long)patch.size);
+        c->state = ST_STREAM_BODY;
+        return 1;
+    }
+
+    char full_path[MAX_BUFF + 8];
+    snprintf(full_path, sizeof(full_path), "~/S1/%s", c->path + 4); // Skip ~S1/
+    snprintf(c->local_path, sizeof(c->local_path), "%s", expand_path(full_path));
+    struct stat st;
+    c->base_fd = open(c->local_path, O_RDONLY | O_CLOEXEC);
+    if (c->base_fd < 0 || fstat(c->base_fd, &st) != 0) {
+        if (c->base_fd >= 0) close(c->base_fd);
+        c->base_fd = -1;
+        reply(c, DFS_E_MISSING, "ERR: File not stored, send all of it");
+        return 1;
+    }
+    upload_tmp_path(c->upload_tmp, sizeof(c->upload_tmp), c->local_path);
+    c->file_fd = open(c->upload_tmp, O_WRONLY | O_CREAT | O_EXCL | O_CLOEXEC, 0666);
+    if (c->file_fd < 0) {
+        perror("File creation failed");
+        close(c->base_fd);
+        c->base_fd = -1;
+        reply(c, DFS_E_IO, "ERR: File creation failed");
+        return 1;
+    }
+    printf("Applying patch of %lu bytes to %s\n", (unsigned long)c->req.payload_len, c->path);
+    dfs_xxh64_init(&c->upload_hash);
+    c->delta_size = st.st_size;
+    c->delta_copy = c->delta_literal = c->delta_written = 0;
+    c->state = ST_PATCH_BODY;
+    return 1;
+}
+
+// end of a local patch: the new version replaces the file if it is the one
+// the patch describes; anything else means the stored version changed
+void patch_finish(Conn *c, int status) {
+    close(c->base_fd);
+    c->base_fd = -1;
+    if (status == DFS_OK && (c->delta_written != c->claim_size ||
+                             dfs_xxh64_digest(&c->upload_hash) != c->claim_checksum)) {
+        status = DFS_E_MISSING;
+    }
+    if (status != DFS_OK) {
+        close(c->file_fd);
+        c->file_fd = -1;
+        unlink(c->upload_tmp);
+        reply(c, status, status == DFS_E_MISSING ? "ERR: Stored version changed, send all of the file" :
+                         status == DFS_E_INVALID ? "ERR: Invalid patch" : "ERR: Write error");
+        return;
+    }
+    local_commit(c, "OK: File updated locally");
+}
+
+// client -> patch records applied to a local file
+int step_patch_body(Conn *c) {
+    static __thread unsigned char copy[IO_CHUNK];
+    int progress = 0;
+    // bounded, so a long copy cannot hold up the loop
+    for (int rounds = 0; rounds < 64; rounds++) {
+        if (c->delta_copy > 0) {
+            ssize_t got = pread(c->base_fd, copy, MIN(c->delta_copy, (uint64_t)IO_CHUNK), c->delta_off);
+            if (got < 0 && errno == EINTR) continue;
+            if (got <= 0) {
+                patch_finish(c, DFS_E_MISSING);
+                return 1;
+            }
+            if (dfs_chunk_write_all(c->file_fd, copy, got) < 0) {
+                perror("Write error");
+                patch_finish(c, DFS_E_IO);
+                return 1;
+            }
+            dfs_xxh64_update(&c->upload_hash, copy, got);
+            c->delta_off += got;
+            c->delta_copy -= got;
+            c->delta_written += got;
+            progress = 1;
+            continue;
+        }
+        if (c->delta_literal > 0) {
+            size_t n = MIN((uint64_t)buf_pending(&c->in), c->delta_literal);
+            if (n == 0) break;
+            ssize_t written = write(c->file_fd, c->in.data + c->in.off, n);
+            if (written < 0 && errno == EINTR) continue;
+            if (written < 0) {
+                perror("Write error");
+                patch_finish(c, DFS_E_IO);
+                return 1;
+            }
+            dfs_xxh64_update(&c->upload_hash, c->in.data + c->in.off, written);
+            buf_consume(&c->in, written);
+            c->req_body -= written;
+            c->delta_literal -= written;
+            c->delta_written += written;
+            progress = 1;
+            continue;
+        }
+        if (c->req_body == 0) {
+            patch_finish(c, DFS_OK);
+            return 1;
+        }
+
+        DfsDeltaOp op;
+        size_t avail = MIN((uint64_t)buf_pending(&c->in), c->req_body);
+        int n = dfs_delta_op((unsigned char *)c->in.data + c->in.off, avail, &op);
+        if (n == 0 && avail < c->req_body) break;
+        if (n <= 0 || (op.type == DFS_DELTA_OP_LITERAL && op.a > c->req_body - n)) {
+            patch_finish(c, DFS_E_INVALID);
+            return 1;
+        }
+        buf_consume(&c->in, n);
+        c->req_body -= n;
+        progress = 1;
+        if (op.type == DFS_DELTA_OP_LITERAL) {
+            c->delta_literal = op.a;
+        } else if (dfs_delta_copy_range(&op, c->delta_block, c->delta_size, &c->delta_off, &c->delta_copy) < 0) {
+            patch_finish(c, DFS_E_MISSING);
+            return 1;
+        }
+    }
+    if (!progress && c->cli_eof) {
+        patch_finish(c, DFS_E_INVALID);
+        return 1;
+    }
+    return progress;
+}
+
+// send a request to a storage server and relay its reply to the client
+void start_relay(Conn *c, int server_port, int opcode, int flags, const char *path) {
+    if (backend_request(c, server_port, opcode, flags, path) < 0) {
+        cache_fill_stop(c);
+        reply(c, DFS_E_UNAVAILABLE, "ERR: Cannot connect to storage server");
+        return;
+    }
+    c->state = ST_RELAY_HEADER;
+}
+
+// function to get a file from another server (S2, S3, or S4)
+void get_file_from_server(Conn *c, int server_port, char *filepath) {
+    if (c->req.flags & DFS_F_RANGE) {
+        // the storage server reads only the bytes of the range
+        if (backend_connect(c, server_port) < 0) {
+            reply(c, DFS_E_UNAVAILABLE, "ERR: Cannot connect to storage server");
+            return;
+        }
+        unsigned char range[DFS_RANGE_ARGS];
+        dfs_put64(range, c->range_off);
+        dfs_put64(range + 8, c->range_len);
+        backend_frame(c, DFS_OP_DOWNLOAD, DFS_F_RANGE, filepath, sizeof(range));
+        backend_payload(c, range, sizeof(range));
+        c->state = ST_RELAY_HEADER;
+        return;
+    }
+    // the storage server compresses the file if the client takes that
+    start_relay(c, server_port, DFS_OP_DOWNLOAD, c->req.flags & (DFS_F_LZ4 | DFS_F_DENSE), filepath);
+}
+
+// function to get tar file from server
+void get_tar_from_server(Conn *c, int server_port, char *filetype) {
+    start_relay(c, server_port, DFS_OP_TAR, 0, filetype);
+}
+
+// reply header from the storage server, forward its status and size to the client
+int step_relay_header(Conn *c) {
+    DfsHeader h;
+    int r = backend_reply(c, &h);
+    if (r == 0) return 0;
+    if (r < 0 && backend_retry(c)) return 1;
+
+    if (r < 0 || h.status != DFS_OK) {
+        if (r > 0 && h.payload_len == 0) backend_release(c);
+        else backend_close(c);
+        cache_fill_stop(c);
+        if (r > 0 && h.status == DFS_E_INVALID && c->be_op == DFS_OP_DOWNLOAD && (c->req.flags & DFS_F_RANGE)) {
+            reply(c, DFS_E_INVALID, "ERR: Range starts past the end of the file");
+        } else {
+            reply_error(c, r > 0 ? h.status : DFS_E_UNAVAILABLE);
+        }
+        return 1;
+    }
+
+    // a chunked payload is passed through as it is, chunk headers included
+    c->relay_chunked = (h.flags & DFS_F_CHUNKED) != 0;
+    c->cache_lz4 = (h.flags & DFS_F_LZ4) != 0;
+    if (c->cache_filling && !c->relay_chunked) {
+        if (h.payload_len > cache_file_max()) cache_fill_stop(c);
+        else buf_reserve(&c->cache_fill, h.payload_len);
+    }
+    if (c->relay_chunked) reply_chunked_header(c, h.flags & DFS_F_LZ4);
+    else reply_header(c, DFS_OK, h.payload_len);
+    c->remaining = c->relay_chunked ? 0 : h.payload_len;
+    c->state = ST_RELAY_BODY;
+    relay_pipe_open(c);
+    if (c->remaining == 0 && !c->relay_chunked) {
+        backend_release(c);
+        cache_fill_end(c);
+        request_done(c);
+    }
+    return 1;
+}
+
+// create the relay pipe on first use, it is kept for the life of the connection
+// returns 0 when relays can be spliced, -1 to copy through the buffers instead
+int relay_pipe_open(Conn *c) {
+    if (c->pipe_fd[0] >= 0) return 0;
+    if (c->loop->no_splice) return -1;
+    if (pipe2(c->pipe_fd, O_NONBLOCK | O_CLOEXEC) < 0) {
+        perror("Relay pipe creation failed");
+        c->pipe_fd[0] = c->pipe_fd[1] = -1;
+        return -1;
+    }
+    // a bigger pipe means fewer splice calls per relayed megabyte; the
+    // default is kept if pipe-max-size does not allow it
+    fcntl(c->pipe_fd[1], F_SETPIPE_SZ, RELAY_PIPE_SIZE);
+    int size = fcntl(c->pipe_fd[1], F_GETPIPE_SZ);
+    c->pipe_size = size > 0 ? size : IO_CHUNK;
+    c->pipe_len = 0;
+    return 0;
+}
+
+void relay_pipe_close(Conn *c) {
+    close(c->pipe_fd[0]);
+    close(c->pipe_fd[1]);
+    c->pipe_fd[0] = c->pipe_fd[1] = -1;
+    c->pipe_len = 0;
+}
+
+// storage server socket -> pipe -> client socket, the data never enters user space
+// returns 1 on progress, 0 if both sides have to wait, -1 if the client is gone
+int relay_splice(Conn *c) {
+    int progress = 0;
+    while (c->remaining > (off_t)c->pipe_len && c->pipe_len < c->pipe_size && !c->be_eof) {
+        size_t want = MIN((off_t)(c->pipe_size - c->pipe_len), c->remaining - (off_t)c->pipe_len);
+        ssize_t n = splice(c->be.fd, NULL, c->pipe_fd[1], NULL, want,
+                           SPLICE_F_MOVE | SPLICE_F_NONBLOCK);
+        if (n > 0) {
+            c->pipe_len += n;
+            c->be_rx += n;
+            progress = 1;
+        } else if (n == 0) {
+            c->be_eof = 1;
+            progress = 1;
+        } else if (errno == EINTR) {
+            continue;
+        } else if (errno == EAGAIN || errno == EWOULDBLOCK) {
+            break;
+        } else if ((errno == EINVAL || errno == ENOSYS) && c->pipe_len == 0) {
+            // this kernel or socket cannot splice, relay through the buffers from now on
+            fprintf(stderr, "splice unavailable (%s), relaying through buffers\n", strerror(errno));
+            c->loop->no_splice = 1;
+            relay_pipe_close(c);
+            return 1;
+        } else {
+            c->be_error = 1;
+            c->be_eof = 1;
+            progress = 1;
+        }
+    }
+    while (c->pipe_len > 0) {
+        ssize_t n = splice(c->pipe_fd[0], NULL, c->cli.fd, NULL, c->pipe_len,
+                           SPLICE_F_MOVE | SPLICE_F_NONBLOCK);
+        if (n > 0) {
+            c->pipe_len -= n;
+            c->remaining -= n;
+            progress = 1;
+        } else if (n < 0 && errno == EINTR) {
+            continue;
+        } else if (n < 0 && (errno == EAGAIN || errno == EWOULDBLOCK)) {
+            break;
+        } else {
+            return -1;
+        }
+    }
+    return progress;
+}
+
+// storage server -> client; bytes that arrived with the reply header go through
+// the buffers, the rest is spliced when possible
+int step_relay_body(Conn *c) {
+    int progress = 0;
+    for (;;) {
+        while (c->remaining > (off_t)c->pipe_len && buf_pending(&c->bin) > 0 &&
+               buf_pending(&c->out) < HIGH_WATER) {
+            size_t n = MIN((off_t)buf_pending(&c->bin), c->remaining);
+            n = MIN(n, (size_t)IO_CHUNK);
+            buf_append(&c->out, c->bin.data + c->bin.off, n);
+            cache_fill_add(c, c->bin.data + c->bin.off, n);
+            buf_consume(&c->bin, n);
+            c->remaining -= n;
+            progress = 1;
+        }
+        // spliced bytes must not overtake buffered ones on the client socket
+        if (relay_splicing(c) && buf_pending(&c->bin) == 0 && buf_pending(&c->out) == 0) {
+            int r = relay_splice(c);
+            if (r < 0) {
+                conn_close(c);
+                return 1;
+            }
+            progress |= r;
+        }
+        if (c->remaining > 0) break;
+        if (!c->relay_chunked) {
+            backend_release(c);
+            cache_fill_end(c);
+            request_done(c);
+            return 1;
+        }
+
+        // between two chunks: pass the next chunk header on, an empty chunk ends the reply
+        if (buf_pending(&c->bin) < DFS_CHUNK_HEADER || buf_pending(&c->out) >= HIGH_WATER) break;
+        uint64_t len = dfs_get64((unsigned char *)c->bin.data + c->bin.off);
+        buf_append(&c->out, c->bin.data + c->bin.off, DFS_CHUNK_HEADER);
+        cache_fill_add(c, c->bin.data + c->bin.off, DFS_CHUNK_HEADER);
+        buf_consume(&c->bin, DFS_CHUNK_HEADER);
+        progress = 1;
+        if (len == 0) {
+            c->relay_chunked = 0;
+            backend_release(c);
+            cache_fill_end(c);
+            request_done(c);
+            return 1;
+        }
+        c->remaining = len;
+    }
+
+    int starved = c->remaining > 0 ? c->remaining > (off_t)c->pipe_len && buf_pending(&c->bin) == 0
+                                   : buf_pending(&c->bin) < DFS_CHUNK_HEADER;
+    if (c->be_eof && starved) {
+        // the client was promised more bytes than will come, it has to see the close
+        printf("Storage server closed with %ld bytes left\n", c->remaining);
+        backend_close(c);
+        cache_fill_stop(c);
+        if (c->pipe_fd[0] >= 0) relay_pipe_close(c);
+        c->state = ST_DONE;
+        return 1;
+    }
+    return progress;
+}
+
+// local file -> client socket with sendfile(), as much as the socket takes
+// returns 1 on progress, 0 if the socket is full, -1 on a file or socket error
+int sendfile_chunk(Conn *c) {
+    int progress = 0;
+    while (c->remaining > 0) {
+        ssize_t n = sendfile(c->cli.fd, c->file_fd, NULL, MIN(c->remaining, (off_t)DFS_SENDFILE_CHUNK));
+        if (n > 0) {
+            c->remaining -= n;
+            progress = 1;
+        } else if (n < 0 && errno == EINTR) {
+            continue;
+        } else if (n < 0 && (errno == EAGAIN || errno == EWOULDBLOCK)) {
+            break;
+        } else if (n < 0 && (errno == EINVAL || errno == ENOSYS)) {
+            // the file offset is where sendfile stopped, pump_file carries on from there
+            fprintf(stderr, "sendfile unavailable (%s), sending through buffers\n", strerror(errno));
+            c->loop->no_sendfile = 1;
+            return 1;
+        } else {
+            if (n == 0) fprintf(stderr, "File %s shrank while being sent\n", c->local_path);
+            else perror("sendfile failed");
+            return -1;
+        }
+    }
+    return progress;
+}
+
+// local file -> client; the reply header in the output buffer has to go out first
+int step_send_file(Conn *c) {
+    int progress;
+    if (c->loop->no_sendfile) progress = pump_file(c, &c->out);
+    else if (buf_pending(&c->out) > 0) progress = 0;
+    else progress = sendfile_chunk(c);
+    if (progress < 0 || c->remaining == 0) {
+        close(c->file_fd);
+        c->file_fd = -1;
+        if (progress < 0) c->state = ST_DONE;
+        else request_done(c);
+        return 1;
+    }
+    return progress;
+}
+
+// local tar -> client, one member at a time. small members are read into the
+// output buffer so that many of them share a send, large ones go out with
+// sendfile() once the buffer is empty
+int step_send_tar(Conn *c) {
+    int progress = 0;
+    for (;;) {
+        if (c->remaining > 0 && c->file_fd >= 0) {
+            int r;
+            if (c->loop->no_sendfile || c->remaining < IO_CHUNK) r = pump_file(c, &c->out);
+            else if (buf_pending(&c->out) > 0) r = 0;
+            else r = sendfile_chunk(c);
+            if (r < 0) {
+                close(c->file_fd);
+                c->file_fd = -1;
+            } else {
+                progress |= r;
+                if (c->remaining > 0) return progress;
+            }
+        }
+        if (c->remaining > 0) {
+            // the file shrank after its header was queued; zeros keep the
+            // member at the length its chunk announced
+            while (c->remaining > 0 && buf_pending(&c->out) < HIGH_WATER) {
+                size_t n = MIN(c->remaining, (off_t)IO_CHUNK);
+                buf_append_zeros(&c->out, n);
+                c->remaining -= n;
+            }
+            if (c->remaining > 0) return 1;
+        }
+        if (c->file_fd >= 0) {
+            close(c->file_fd);
+            c->file_fd = -1;
+        }
+        if (buf_pending(&c->out) >= HIGH_WATER) return progress;
+
+        buf_append_zeros(&c->out, c->tar_pad);
+        c->tar_pad = 0;
+
+        DfsTarEntry e;
+        int fd;
+        int r = dfs_tar_next(&c->tar, &e, &fd);
+        if (r < 0) {
+            // the reply is under way, the client learns of the failure by the close
+            fprintf(stderr, "Out of memory walking ~/S1 for a tar\n");
+            dfs_tar_close(&c->tar);
+            c->state = ST_DONE;
+            return 1;
+        }
+        if (r == 0) {
+            unsigned char end[DFS_TAR_END_MAX];
+            buf_append(&c->out, end, dfs_tar_end(end, c->tar.count));
+            dfs_tar_close(&c->tar);
+            request_done(c);
+            return 1;
+        }
+
+        unsigned char start[DFS_TAR_CHUNK_MAX];
+        buf_append(&c->out, start, dfs_tar_member_start(start, &e));
+        snprintf(c->local_path, sizeof(c->local_path), "%s", e.path);
+        c->file_fd = fd;
+        posix_fadvise(fd, 0, 0, POSIX_FADV_SEQUENTIAL);
+        c->remaining = e.size;
+        c->tar_pad = dfs_tar_round(e.size) - e.size;
+        progress = 1;
+    }
+}
+
+// function to handle downlf command
+void handle_downlf_command(Conn *c, char *filepath) {
+    // the offset and length of a range come first, step_range_args is back here with them
+    if (c->req_body > 0) {
+        c->state = ST_RANGE_ARGS;
+        return;
+    }
+
+    // filepath starts with ~S1/
+    if (strncmp(filepath, "~S1/", 4) != 0) {
+        reply(c, DFS_E_INVALID, "ERR: Path must start with ~S1/");
+        return;
+    }
+
+    // check file extension
+    int port = server_for_file(filepath);
+    DfsIndexEntry entry;
+    int known = port < 0 ? -1 : index_lookup(filepath, port, &entry);
+    // the reply names the version of the file as the index has it
+    if (known > 0) dfs_file_tag(c->file_tag, entry.size, entry.mtime, entry.has_checksum ? entry.checksum : 0);
+    if (port < 0) {
+        reply(c, DFS_E_INVALID, "ERR: Unsupported file type");
+    } else if (known == 0) {
+        // the index has every file of the type, neither disk nor storage server is asked
+        reply(c, DFS_E_NOTFOUND, "ERR: File not found");
+    } else if (c->range_tag[0] && strcmp(c->range_tag, c->file_tag) != 0) {
+        // the bytes the client has are of another version, or S1 cannot tell
+        reply(c, DFS_E_MISSING, "ERR: File changed since the download was interrupted");
+    } else if (port == 0) {
+        // c files are stored locally
+        char full_path[MAX_BUFF + 8];
+        snprintf(full_path, sizeof(full_path), "~/S1/%s", filepath + 4); // Skip ~S1/
+        send_local_file(c, expand_path(full_path));
+    } else if (known > 0 && cache_serve(c, filepath, &entry)) {
+        printf("S1: %s served from the read cache\n", filepath);
+    } else {
+        // PDF files are stored on S2, TXT on S3 and ZIP on S4; the read cache
+        // only keeps whole replies of files it can check against the index
+        if (known > 0 && !(c->req.flags & DFS_F_RANGE)) cache_fill_begin(c, &entry);
+        else cache_fill_stop(c);
+        get_file_from_server(c, port, filepath);
+    }
+}
+
+// function to remove a file from another server
+void remove_file_from_server(Conn *c, int server_port, char *filepath) {
+    if (backend_request(c, server_port, DFS_OP_REMOVE, 0, filepath) < 0) {
+        reply(c, DFS_E_UNAVAILABLE, "ERR: Cannot connect to storage server");
+        return;
+    }
+    c->state = ST_REMOVE_ACK;
+}
+
+// acknowledgment of a remote remove
+int step_remove_ack(Conn *c) {
+    DfsHeader h;
+    int r = backend_reply(c, &h);
+    if (r == 0) return 0;
+    if (r < 0 && backend_retry(c)) return 1;
+
+    char response[64];
+    int status = r > 0 ? h.status : DFS_E_UNAVAILABLE;
+    uint64_t lsn = 0;
+    if (status == DFS_OK || status == DFS_E_NOTFOUND) lsn = index_file_removed(c->path, c->target_port);
+    if (status == DFS_OK) {
+        snprintf(response, sizeof(response), "OK: File removed from %s", server_name(c->target_port));
+    } else {
+        snprintf(response, sizeof(response), "ERR: Could not remove file from %s", server_name(c->target_port));
+    }
+    if (r > 0 && h.payload_len == 0) backend_release(c);
+    else backend_close(c);
+    reply_durable(c, lsn, status, response);
+    return 1;
+}
+
+// Function to handle removef command
+void handle_removef_command(Conn *c, char *filepath) {
+    // filepath starts with ~S1/
+    if (strncmp(filepath, "~S1/", 4) != 0) {
+        reply(c, DFS_E_INVALID, "ERR: Path must start with ~S1/");
+        return;
+    }
+
+    // Check file extension
+    int port = server_for_file(filepath);
+    DfsIndexEntry entry;
+    if (port < 0) {
+        reply(c, DFS_E_INVALID, "ERR: Unsupported file type");
+    } else if (index_lookup(filepath, port, &entry) == 0) {
+        // the index has every file of the type, answered as the server would
+        char response[64];
+        snprintf(response, sizeof(response), "ERR: Could not remove file from %s", server_name(port));
+        reply(c, DFS_E_NOTFOUND, port ? response : "ERR: Could not remove file");
+    } else if (port == 0) {
+        // c files are stored locally
+        char full_path[MAX_BUFF + 8];
+        snprintf(full_path, sizeof(full_path), "~/S1/%s", filepath + 4); // Skip ~S1/
+        char *expanded_full_path = expand_path(full_path);
+
+        // try to remove the file
+        if (unlink(expanded_full_path) == 0) {
+            reply_durable(c, index_file_removed(filepath, 0), DFS_OK, "OK: File removed");
+        } else {
+            int err = errno;
+            perror("File removal failed");
+            if (err == ENOENT) {
+                reply_durable(c, index_file_removed(filepath, 0), DFS_E_NOTFOUND, "ERR: Could not remove file");
+            } else {
+                reply(c, DFS_E_IO, "ERR: Could not remove file");
+            }
+        }
+    } else {
+        // PDF files are stored on S2, TXT on S3 and ZIP on S4
+        remove_file_from_server(c, port, filepath);
+    }
+}
+
+// function to handle downltar command
+void handle_downltar_command(Conn *c, char *filetype) {
+    // Check valid file types
+    if (strcmp(filetype, "c") == 0) {
+        // the archive is sent while ~/S1 is walked, starting right away
+        if (dfs_tar_open(&c->tar, expand_path("~/S1"), ".c") < 0) {
+            dfs_tar_close(&c->tar);
+            reply(c, DFS_E_IO, "ERR: Failed to read the file tree");
+            return;
+        }
+
+        reply_chunked_header(c, 0);
+        dfs_set_send_buffer(c->cli.fd);
+        c->remaining = 0;
+        c->tar_pad = 0;
+        c->state = ST_SEND_TAR;
+    } else if (strcmp(filetype, "p") == 0) {
+        // PDF files are stored on S2
+        get_tar_from_server(c, S2_PORT, filetype);
+    } else if (strcmp(filetype, "t") == 0) {
+        // TXT files are stored on S3
+        get_tar_from_server(c, S3_PORT, filetype);
+    } else if (strcmp(filetype, "z") == 0) {
+        // ZIP files are stored on S4
+        get_tar_from_server(c, S4_PORT, filetype);
+    } else {
+        reply(c, DFS_E_INVALID, "ERR: Unsupported file type");
+    }
+}
+
+// Function to handle stat command, answered from the index alone
+void handle_stat_command(Conn *c, char *filepath) {
+    // filepath starts with ~S1/
+    if (strncmp(filepath, "~S1/", 4) != 0) {
+        reply(c, DFS_E_INVALID, "ERR: Path must start with ~S1/");
+        return;
+    }
+    int port = server_for_file(filepath);
+    if (port < 0) {
+        reply(c, DFS_E_INVALID, "ERR: Unsupported file type");
+        return;
+    }
+    char key[DFS_MAX_PATH];
+    if (dfs_index_key(filepath, key, sizeof(key)) <= 0) {
+        reply(c, DFS_E_INVALID, "ERR: Invalid path");
+        return;
+    }
+
+    DfsIndexEntry e;
+    int r = index_lookup(filepath, port, &e);
+    if (r <= 0) {
+        char response[64];
+        snprintf(response, sizeof(response), "ERR: Files of %s are not indexed yet", server_name(port));
+        reply(c, r < 0 ? DFS_E_UNAVAILABLE : DFS_E_NOTFOUND, r < 0 ? response : "ERR: File not found");
+        return;
+    }
+
+    time_t mtime = e.mtime;
+    struct tm tm;
+    char modified[32] = "unknown";
+    if (localtime_r(&mtime, &tm)) strftime(modified, sizeof(modified), "%Y-%m-%d %H:%M:%S", &tm);
+    // files S1 only knows from a scan were never read by it
+    char checksum[32] = "unknown";
+    if (e.has_checksum) snprintf(checksum, sizeof(checksum), "xxh64:%016llx", (unsigned long long)e.checksum);
+
+    char response[DFS_MAX_PATH + 256];
+    snprintf(response, sizeof(response), "File: %s\nServer: %s\nSize: %llu bytes\nModified: %s\nChecksum: %s\n",
+             filepath, server_name(port), (unsigned long long)e.size, modified, checksum);
+    reply(c, DFS_OK, response);
+}
+
+// readable name of a file type in listings
+const char *list_type_name(char type) {
+    switch (type) {
+        case 'c': return "C source";
+        case 'p': return "PDF document";
+        case 't': return "Text file";
+        case 'z': return "ZIP archive";
+    }
+    return "";
+}
+
+// send the LIST request of a storage server on a connection of the source. a
+// page asks for the names from the resume token on, two more than it holds:
+// one may be the last name of the previous page, one tells if more follow
+int list_source_request(Conn *c, ListSource *ls) {
+    if (backend_open(c->loop, ls->port, ls->retried, &ls->ep, &ls->connecting, &ls->reused) < 0) return -1;
+
+    unsigned char args[DFS_LIST_ARGS_MAX];
+    size_t args_len = 0;
+    if (c->list_limit > 0 || c->list_after[0]) {
+        size_t from_len = c->list_after[0] ? strlen(c->list_after + 1) : 0;
+        dfs_put64(args, c->list_limit ? c->list_limit + 2 : 0);
+        memcpy(args + 8, c->list_after + 1, from_len);
+        args_len = 8 + from_len;
+    }
+
+    unsigned char frame[DFS_HEADER_SIZE + DFS_MAX_PATH];
+    ls->id = c->loop->next_request_id++;
+    buf_append(&ls->out, frame, dfs_frame(frame, DFS_OP_LIST, c->list_long ? DFS_F_LONG : 0, 0, ls->id,
+                                          c->path, args_len));
+    buf_append(&ls->out, args, args_len);
+    return 0;
+}
+
+// a source is used up or failed; a connection that finished its listing
+// cleanly goes back to the pool
+void list_source_finish(Conn *c, ListSource *ls) {
+    if (ls->ep.fd >= 0) {
+        if (ls->error || ls->eof || ls->connecting || !ls->header_done || !ls->last_chunk ||
+            ls->chunk_left > 0 || buf_pending(&ls->in) > 0 || buf_pending(&ls->out) > 0 ||
+            backend_park(c->loop, ls->port, &ls->ep) < 0) {
+            close(ls->ep.fd);
+            ls->ep.fd = -1;
+            ls->ep.registered = 0;
+            ls->ep.events = 0;
+        }
+    }
+    buf_free(&ls->in);
+    buf_free(&ls->out);
+    ls->active = 0;
+}
+
+// reply header of a storage server listing
+// returns 1 if the source moved on, 0 while waiting for it
+int list_source_header(Conn *c, ListSource *ls) {
+    DfsHeader h;
+    char path[1];
+    int r = buf_get_frame(&ls->in, &h, path, sizeof(path));
+    if (r == 0 && !ls->eof) return 0;
+
+    if (r > 0 && (h.flags & DFS_F_REPLY) && h.request_id == ls->id && h.opcode == DFS_OP_LIST &&
+        (h.status != DFS_OK || (h.flags & DFS_F_CHUNKED))) {
+        ls->header_done = 1;
+        // a failed listing has no payload, the source just has no names
+        if (h.status != DFS_OK) {
+            ls->last_chunk = 1;
+            list_source_finish(c, ls);
+        }
+        return 1;
+    }
+
+    if (r == 0 && ls->reused && ls->rx == 0 && !ls->retried) {
+        // a pooled connection the server closed before answering, ask once more
+        printf("S1: Pooled connection to %s went away, retrying\n", server_name(ls->port));
+        list_source_finish(c, ls);
+        ls->eof = 0;
+        ls->error = 0;
+        ls->retried = 1;
+        ls->active = list_source_request(c, ls) == 0;
+        return 1;
+    }
+    if (r != 0) printf("S1: Unexpected reply from %s\n", server_name(ls->port));
+    ls->error = 1;
+    list_source_finish(c, ls);
+    return 1;
+}
+
+// one name of a directory walk of the index, for the source of its type
+int list_index_visit(void *arg, const char *name, size_t len, const DfsIndexEntry *e) {
+    ListIndexWalk *w = arg;
+    int i = index_source(e->port);
+    ListSource *ls = &w->c->lists[i];
+    if (!ls->active || !ls->from_index || (w->limit && w->counts[i] == w->limit)) return 0;
+    buf_append(&ls->in, name, len);
+    if (w->c->list_long) {
+        char meta[48];
+        buf_append(&ls->in, meta, snprintf(meta, sizeof(meta), "/%llu/%lld", (unsigned long long)e->size,
+                                           (long long)e->mtime));
+    }
+    buf_append(&ls->in, "\n", 1);
+    if (++w->counts[i] == w->limit) w->open--;
+    return w->limit && w->open == 0;
+}
+
+// names of the sources the index covers, the way their storage servers would
+// list them: sorted, from the resume token on, two more than a page holds
+void list_index_files(Conn *c) {
+    char dir[DFS_MAX_PATH];
+    int len = dfs_index_key(c->path, dir, sizeof(dir) - 1);
+    if (len > 0) dir[len++] = '/';
+
+    ListIndexWalk w;
+    memset(&w, 0, sizeof(w));
+    w.c = c;
+    w.limit = c->list_limit ? c->list_limit + 2 : 0;
+    for (int i = 0; i < LIST_SOURCES; i++) {
+        if (c->lists[i].active && c->lists[i].from_index) w.open++;
+    }
+    int failed = 0;
+    if (len >= 0) {
+        index_rdlock();
+        failed = dfs_index_list(&file_index, dir, len, c->list_after[0] ? c->list_after + 1 : "",
+                                list_index_visit, &w) < 0;
+        index_rdunlock();
+    }
+    if (failed) printf("S1: Out of memory listing from the index\n");
+
+    for (int i = 0; i < LIST_SOURCES; i++) {
+        ListSource *ls = &c->lists[i];
+        if (!ls->active || !ls->from_index) continue;
+        ls->header_done = 1;
+        ls->last_chunk = 1;
+        ls->chunk_left = ls->in.len;
+        if (failed) {
+            ls->error = 1;
+            list_source_finish(c, ls);
+        }
+    }
+}
+
+// List local C files, sorted the way the storage servers sort theirs; used
+// while the index does not have them. the directory is read in one pass
+void list_local_files(Conn *c, ListSource *local) {
+    // Convert pathname
+    char dir_path[MAX_BUFF + 8];
+    snprintf(dir_path, sizeof(dir_path), "~/S1/%s", c->path + 4); // Skip ~S1/
+    char *expanded_dir_path = expand_path(dir_path);
+
+    DfsNames names;
+    dfs_names_init(&names, c->list_limit ? c->list_limit + 2 : 0);
+    const char *from = c->list_after[0] ? c->list_after + 1 : "";
+    int failed = 0;
+    DfsDir dir;
+    if (dfs_dir_open(&dir, expanded_dir_path) == 0) {
+        const char *name;
+        unsigned char type;
+        while (!failed && (name = dfs_dir_next(&dir, &type))) {
+            // Check if it's a .c file
+            char *ext = strrchr(name, '.');
+            if (!ext || strcmp(ext, ".c") != 0 || strcmp(name, from) < 0) continue;
+            if (!c->list_long) {
+                failed = dfs_names_add(&names, name) < 0;
+                continue;
+            }
+            struct statx stx;
+            char line[DFS_LIST_LINE_MAX + 1];
+            if (strlen(name) > DFS_LIST_NAME_MAX || dfs_dir_stat(&dir, name, &stx) != 0) continue;
+            snprintf(line, sizeof(line), "%s/%llu/%lld", name, (unsigned long long)stx.stx_size,
+                     (long long)stx.stx_mtime.tv_sec);
+            failed = dfs_names_add(&names, line) < 0;
+        }
+        dfs_dir_close(&dir);
+    }
+
+    dfs_names_sort(&names);
+    for (size_t i = 0; !failed && i < names.count; i++) {
+        buf_append(&local->in, names.names[i], strlen(names.names[i]));
+        buf_append(&local->in, "\n", 1);
+    }
+    dfs_names_free(&names);
+
+    local->header_done = 1;
+    local->last_chunk = 1;
+    local->chunk_left = local->in.len;
+    if (failed) {
+        printf("S1: Out of memory listing local files\n");
+        local->error = 1;
+        list_source_finish(c, local);
+    }
+}
+
+// bytewise order of two names that are not NUL terminated, like strcmp
+int list_name_cmp(const char *a, size_t alen, const char *b, size_t blen) {
+    int r = memcmp(a, b, alen < blen ? alen : blen);
+    if (r != 0) return r;
+    return alen < blen ? -1 : alen > blen;
+}
+
+// a name up to the resume token, which an earlier page already had; equal
+// names of different types are ordered like the sources
+int list_before_token(Conn *c, ListSource *ls, const char *name, size_t len) {
+    if (!c->list_after[0]) return 0;
+    int r = list_name_cmp(name, len, c->list_after + 1, strlen(c->list_after + 1));
+    return r < 0 || (r == 0 && ls - c->lists <= c->list_after_source);
+}
+
+// a merged name leaves the buffer of its source
+void list_source_consume(ListSource *ls, size_t len) {
+    buf_consume(&ls->in, len + 1);
+    ls->chunk_left -= len + 1;
+}
+
+// next line of a source, which stays in its buffer until it is merged; its
+// name is the part before a '/'. returns 1 with the line, 0 while it is
+// incomplete, -1 if the source finished
+int list_source_head(Conn *c, ListSource *ls, const char **name, size_t *len, size_t *name_len) {
+    while (1) {
+        if (ls->chunk_left == 0) {
+            if (ls->last_chunk) {
+                list_source_finish(c, ls);
+                return -1;
+            }
+            if (buf_pending(&ls->in) < DFS_CHUNK_HEADER) {
+                if (!ls->eof) return 0;
+                break;
+            }
+            ls->chunk_left = dfs_get64((unsigned char *)ls->in.data + ls->in.off);
+            buf_consume(&ls->in, DFS_CHUNK_HEADER);
+            if (ls->chunk_left == 0) ls->last_chunk = 1;
+            continue;
+        }
+
+        size_t pending = MIN((uint64_t)buf_pending(&ls->in), ls->chunk_left);
+        const char *start = ls->in.data + ls->in.off;
+        const char *nl = pending ? memchr(start, '\n', pending) : NULL;
+        if (!nl) {
+            if (ls->eof || pending == ls->chunk_left || pending > DFS_LIST_LINE_MAX) break;
+            return 0;
+        }
+        const char *slash = memchr(start, '/', nl - start);
+        size_t n = slash ? (size_t)(slash - start) : (size_t)(nl - start);
+        if (n > DFS_LIST_NAME_MAX || nl - start > DFS_LIST_LINE_MAX) break;
+        if (list_before_token(c, ls, start, n)) {
+            list_source_consume(ls, nl - start);
+            continue;
+        }
+        *name = start;
+        *len = nl - start;
+        *name_len = n;
+        return 1;
+    }
+    printf("S1: Listing from %s was cut short\n", server_name(ls->port));
+    ls->error = 1;
+    list_source_finish(c, ls);
+    return -1;
+}
+
+// Format: filename (type), one per line, into p which has room for it; a
+// long listing puts size and modification time in front, like ls -l
+// returns the length of the line
+size_t list_format(char *p, const char *name, size_t line_len, size_t len, char type) {
+    const char *type_name = list_type_name(type);
+    size_t type_len = strlen(type_name);
+    if (line_len > len) {
+        char meta[64];
+        memcpy(meta, name + len + 1, MIN(line_len - len - 1, sizeof(meta) - 1));
+        meta[MIN(line_len - len - 1, sizeof(meta) - 1)] = '\0';
+        unsigned long long size = 0;
+        long long mtime = 0;
+        sscanf(meta, "%llu/%lld", &size, &mtime);
+        time_t t = mtime;
+        struct tm tm;
+        char modified[32] = "?";
+        if (localtime_r(&t, &tm)) strftime(modified, sizeof(modified), "%Y-%m-%d %H:%M", &tm);
+        size_t n = sprintf(p, "%12llu  %s  ", size, modified);
+        return n + list_format(p + n, name, len, len, type);
+    }
+    memcpy(p, name, len);
+    memcpy(p + len, " (", 2);
+    memcpy(p + len + 2, type_name, type_len);
+    memcpy(p + len + 2 + type_len, ")\n", 2);
+    return len + type_len + 4;
+}
+
+// queue the merged lines of a batch for the client as one chunk
+void list_flush_batch(Conn *c, const char *batch, size_t *len) {
+    if (*len == 0) return;
+    unsigned char chunk_header[DFS_CHUNK_HEADER];
+    dfs_put64(chunk_header, *len);
+    buf_append(&c->out, chunk_header, sizeof(chunk_header));
+    buf_append(&c->out, batch, *len);
+    *len = 0;
+}
+
+// every listing is merged: end the stream, or send the page with the token
+// that resumes the listing after it
+void list_reply(Conn *c, char *batch, size_t *batch_len) {
+    if (c->list_limit == 0) {
+        unsigned char end[DFS_CHUNK_HEADER] = {0};
+        list_flush_batch(c, batch, batch_len);
+        buf_append(&c->out, end, sizeof(end));
+    } else {
+        unsigned char header[DFS_HEADER_SIZE + sizeof(c->list_after)];
+        size_t page_len = buf_pending(&c->list_page);
+        size_t n = dfs_frame(header, c->req.opcode, DFS_F_REPLY, DFS_OK, c->req.request_id,
+                             c->list_more ? c->list_after : NULL, page_len);
+        buf_append(&c->out, header, n);
+        if (page_len > 0) buf_append(&c->out, c->list_page.data + c->list_page.off, page_len);
+        buf_free(&c->list_page);
+    }
+    request_done(c);
+}
+
+// k-way merge of the sorted sources into the reply: the smallest head name
+// goes out as soon as every active source has one. a streamed listing holds
+// no more than a buffer per source however long it is; a page is collected
+// first, since its reply header carries the resume token
+int step_list_merge(Conn *c) {
+    int progress = 0;
+    int from_index = 0;
+    for (int i = 1; i < LIST_SOURCES; i++) {
+        ListSource *ls = &c->lists[i];
+        if (!ls->active || ls->header_done) continue;
+        if (ls->from_index) from_index = 1;
+        else progress |= list_source_header(c, ls);
+    }
+    if (from_index || (c->lists[0].active && !c->lists[0].header_done && c->lists[0].from_index)) {
+        list_index_files(c);
+        return 1;
+    }
+    if (c->lists[0].active && !c->lists[0].header_done) {
+        list_local_files(c, &c->lists[0]);
+        return 1;
+    }
+
+    char batch[IO_CHUNK];
+    size_t batch_len = 0;
+    while (buf_pending(&c->out) < HIGH_WATER) {
+        ListSource *min = NULL;
+        const char *min_name = NULL;
+        size_t min_len = 0, min_line = 0;
+        int waiting = 0;
+
+        for (int i = 0; i < LIST_SOURCES; i++) {
+            ListSource *ls = &c->lists[i];
+            const char *name;
+            size_t line, len;
+            if (!ls->active) continue;
+            int r = ls->header_done ? list_source_head(c, ls, &name, &line, &len) : 0;
+            if (r < 0) {
+                progress = 1;
+            } else if (r == 0) {
+                waiting = 1;
+            } else if (!min || list_name_cmp(name, len, min_name, min_len) < 0) {
+                min = ls;
+                min_name = name;
+                min_len = len;
+                min_line = line;
+            }
+        }
+        if (waiting) break;
+        if (!min) {
+            list_reply(c, batch, &batch_len);
+            return 1;
+        }
+        progress = 1;
+
+        if (c->list_limit == 0) {
+            if (batch_len + min_len + LIST_FORMAT_EXTRA > sizeof(batch)) {
+                list_flush_batch(c, batch, &batch_len);
+                continue;
+            }
+            batch_len += list_format(batch + batch_len, min_name, min_line, min_len, min->type);
+        } else if (c->list_count < c->list_limit) {
+            buf_reserve(&c->list_page, min_len + LIST_FORMAT_EXTRA);
+            c->list_page.len += list_format(c->list_page.data + c->list_page.len, min_name, min_line, min_len,
+                                            min->type);
+            c->list_after[0] = min->type;
+            memcpy(c->list_after + 1, min_name, min_len);
+            c->list_after[min_len + 1] = '\0';
+            c->list_after_source = min - c->lists;
+        } else {
+            // the page is full and another name follows; the rest of every
+            // source is read and dropped so the connections can be pooled
+            c->list_more = 1;
+        }
+        list_source_consume(min, min_line);
+        c->list_count++;
+    }
+    list_flush_batch(c, batch, &batch_len);
+    return progress;
+}
+
+// query every source of a listing at once
+void list_start(Conn *c) {
+    static const int ports[] = { 0, S2_PORT, S3_PORT, S4_PORT };
+    int ready[LIST_SOURCES];
+
+    index_rdlock();
+    for (int i = 0; i < LIST_SOURCES; i++) ready[i] = index_sources[i].ready;
+    index_rdunlock();
+
+    for (int i = 0; i < LIST_SOURCES; i++) {
+        ListSource *ls = &c->lists[i];
+        Endpoint ep = ls->ep;
+        memset(ls, 0, sizeof(*ls));
+        ls->ep = ep;
+        ls->port = ports[i];
+        ls->type = LIST_TYPES[i];
+        ls->from_index = ready[i];
+        // indexed and local files are listed once the requests are on their way
+        ls->active = ls->from_index || i == 0 || list_source_request(c, ls) == 0;
+    }
+
+    if (c->list_limit == 0) reply_chunked_header(c, 0);
+    c->state = ST_LIST_MERGE;
+}
+
+// limit and resume token of a listing, the payload of its request
+int step_list_args(Conn *c) {
+    if (buf_pending(&c->in) < c->req_body) {
+        if (c->cli_eof) {
+            c->state = ST_DONE;
+            return 1;
+        }
+        return 0;
+    }
+
+    unsigned char args[DFS_LIST_ARGS_MAX];
+    size_t n = c->req_body;
+    memcpy(args, c->in.data + c->in.off, n);
+    buf_consume(&c->in, n);
+    c->req_body = 0;
+
+    const char *type = n > 8 && args[8] ? strchr(LIST_TYPES, args[8]) : NULL;
+    if (n < 8 || (n > 8 && (!type || memchr(args + 9, '\0', n - 9)))) {
+        reply(c, DFS_E_INVALID, "ERR: Invalid resume token");
+        return 1;
+    }
+    c->list_limit = MIN(dfs_get64(args), LIST_PAGE_MAX);
+    if (n > 8) {
+        memcpy(c->list_after, args + 8, n - 8);
+        c->list_after[n - 8] = '\0';
+        c->list_after_source = type - LIST_TYPES;
+    }
+    list_start(c);
+    return 1;
+}
+
+// offset and length of a range download
+int step_range_args(Conn *c) {
+    if (buf_pending(&c->in) < c->req_body) {
+        if (c->cli_eof) {
+            c->state = ST_DONE;
+            return 1;
+        }
+        return 0;
+    }
+    unsigned char *args = (unsigned char *)c->in.data + c->in.off;
+    c->range_off = dfs_get64(args);
+    c->range_len = dfs_get64(args + 8);
+    size_t tag_len = c->req_body - DFS_RANGE_ARGS;
+    memcpy(c->range_tag, args + DFS_RANGE_ARGS, tag_len);
+    c->range_tag[tag_len] = '\0';
+    buf_consume(&c->in, c->req_body);
+    c->req_body = 0;
+    handle_downlf_command(c, c->path);
+    return 1;
+}
+
+// Function to handle dispfnames command
+void handle_dispfnames_command(Conn *c, char *pathname) {
+    // pathname starts with ~S1/
+    if (strncmp(pathname, "~S1/", 4) != 0) {
+        reply(c, DFS_E_INVALID, "ERR: Path must start with ~S1/");
+        return;
+    }
+
+    char dir[DFS_MAX_PATH];
+    if (dfs_index_key(pathname, dir, sizeof(dir) - 1) < 0) {
+        reply(c, DFS_E_INVALID, "ERR: Invalid path");
+        return;
+    }
+
+    c->list_limit = 0;
+    c->list_long = (c->req.flags & DFS_F_LONG) != 0;
+    c->list_count = 0;
+    c->list_more = 0;
+    c->list_after[0] = '\0';
+    if (c->req_body > 0) {
+        c->state = ST_LIST_ARGS;
+        return;
+    }
+    list_start(c);
+}
+
+// Function to dispatch one client request
+void process_client_request(Conn *c) {
+    printf("S1: %s request: %s\n", dfs_op_name(c->req.opcode), c->path);
+    c->file_tag[0] = '\0';
+    c->range_tag[0] = '\0';
+
+    // only uploads and patches carry a payload, listings their limit and resume
+    // token, and range downloads their offset and length
+    int range = c->req.opcode == DFS_OP_DOWNLOAD && (c->req.flags & DFS_F_RANGE);
+    if (c->req_body > 0 && c->req.opcode != DFS_OP_UPLOAD && c->req.opcode != DFS_OP_PATCH &&
+        !(c->req.opcode == DFS_OP_LIST && c->req_body <= DFS_LIST_ARGS_MAX) && !range) {
+        reply(c, DFS_E_INVALID, "ERR: Unexpected request payload");
+        return;
+    }
+    if (range && c->req_body != DFS_RANGE_ARGS && c->req_body != DFS_RANGE_ARGS + DFS_FILE_TAG) {
+        reply(c, DFS_E_INVALID, "ERR: Invalid byte range");
+        return;
+    }
+
+    switch (c->req.opcode) {
+        case DFS_OP_UPLOAD:   handle_uploadf_command(c, c->path); break;
+        case DFS_OP_DOWNLOAD: handle_downlf_command(c, c->path); break;
+        case DFS_OP_REMOVE:   handle_removef_command(c, c->path); break;
+        case DFS_OP_TAR:      handle_downltar_command(c, c->path); break;
+        case DFS_OP_LIST:     handle_dispfnames_command(c, c->path); break;
+        case DFS_OP_STAT:     handle_stat_command(c, c->path); break;
+        case DFS_OP_SIGS:     handle_sigs_command(c, c->path); break;
+        case DFS_OP_PATCH:    handle_patch_command(c, c->path); break;
+        case DFS_OP_PING:     reply(c, DFS_OK, ""); break;
+        default:              reply(c, DFS_E_PROTO, "ERR: Unknown command"); break;
+    }
+}
+
+// request header from the client
+int step_cmd(Conn *c) {
+    int r = buf_get_frame(&c->in, &c->req, c->path, sizeof(c->path));
+    if (r == 0) {
+        if (c->cli_eof) {
+            // earlier replies may still be on their way out
+            if (buf_pending(&c->out) > 0) c->state = ST_DONE;
+            else conn_close(c);
+            return 1;
+        }
+        return 0;
+    }
+    if (r < 0) {
+        // nothing after a malformed header can be trusted
+        memset(&c->req, 0, sizeof(c->req));
+        c->req_body = 0;
+        reply(c, DFS_E_PROTO, "ERR: Malformed request");
+        c->state = ST_DONE;
+        return 1;
+    }
+    c->req_body = c->req.payload_len;
+    c->req_chunked = (c->req.flags & DFS_F_CHUNKED) != 0;
+    if (c->req_chunked) {
+        // only a compressed upload may be sent before its length is known; its
+        // size and checksum come ahead of the first chunk
+        c->req_body = DFS_LEN_CHUNKED;
+        c->chunk_left = c->req.flags & DFS_F_LZ4 ? DFS_LZ4_HEADER : 0;
+        c->chunk_head_len = 0;
+        if (c->req.opcode != DFS_OP_UPLOAD || (c->req.flags & (DFS_F_LZ4 | DFS_F_HASH)) != DFS_F_LZ4) {
+            reply(c, DFS_E_INVALID, "ERR: Only compressed uploads may be chunked");
+            return 1;
+        }
+    }
+    c->be_retried = 0;
+    process_client_request(c);
+    return 1;
+}
+
+// advance the state machine as far as the buffered data allows
+int conn_step(Conn *c) {
+    switch (c->state) {
+        case ST_CMD:          return step_cmd(c);
+        case ST_UPLOAD_BODY:  return step_upload_body(c);
+        case ST_UPLOAD_CLAIM: return step_upload_claim(c);
+        case ST_UPLOAD_LZ4:   return step_upload_lz4(c);
+        case ST_LINK_ACK:     return step_link_ack(c);
+        case ST_PATCH_HEADER: return step_patch_header(c);
+        case ST_PATCH_BODY:   return step_patch_body(c);
+        case ST_SEND_SIGS:    return step_send_sigs(c);
+        case ST_DISCARD:      return step_discard(c);
+        case ST_STREAM_BODY:  return step_stream_body(c);
+        case ST_FORWARD_ACK:  return step_forward_ack(c);
+        case ST_SEND_FILE:    return step_send_file(c);
+        case ST_SEND_LZ4:     return step_send_lz4(c);
+        case ST_SEND_TAR:     return step_send_tar(c);
+        case ST_SEND_CACHED:  return step_send_cached(c);
+        case ST_RELAY_HEADER: return step_relay_header(c);
+        case ST_RELAY_BODY:   return step_relay_body(c);
+        case ST_REMOVE_ACK:   return step_remove_ack(c);
+        case ST_LIST_ARGS:    return step_list_args(c);
+        case ST_RANGE_ARGS:   return step_range_args(c);
+        case ST_LIST_MERGE:   return step_list_merge(c);
+        case ST_JOB:          return 0;
+        case ST_WAL_SYNC:     return step_wal_sync(c);
+        case ST_DONE:
+            if (buf_pending(&c->out) == 0) {
+                conn_close(c);
+                return 1;
+            }
+            return 0;
+    }
+    return 0;
+}
+
+// read, advance and write until nothing more can happen without waiting
+void conn_run(Conn *c) {
+    int progress = 1;
+    // bounded so one busy transfer cannot starve the other connections
+    for (int rounds = 0; progress && rounds < 32 && !c->dead; rounds++) {
+        progress = conn_fill(c);
+        if (!c->dead) progress |= conn_step(c);
+        if (!c->dead) progress |= conn_drain(c);
+    }
+    if (!c->dead) conn_update_events(c);
+}
+
+// socket event for a connection
+// outcome of a non-blocking connect that reported an event
+// returns 0 once connected, the errno of a failure, -1 if the event was stale
+int backend_connect_result(int fd) {
+    int err = 0;
+    socklen_t len = sizeof(err);
+    getsockopt(fd, SOL_SOCKET, SO_ERROR, &err, &len);
+    if (!err) {
+        // the event may belong to an earlier socket that had the same fd
+        struct sockaddr_in peer;
+        socklen_t peer_len = sizeof(peer);
+        if (getpeername(fd, (struct sockaddr *)&peer, &peer_len) < 0) {
+            if (errno == ENOTCONN) return -1;
+            err = errno;
+        }
+    }
+    return err;
+}
+
+void conn_handle_event(Conn *c, Endpoint *ep, uint32_t events) {
+    if (c->dead) return;
+    if (ep->kind == EP_BACKEND && c->be_connecting) {
+        int err = backend_connect_result(c->be.fd);
+        if (err < 0) {
+            conn_run(c);
+            return;
+        }
+        c->be_connecting = 0;
+        if (err) {
+            fprintf(stderr, "Failed to connect to storage server on port %d: %s\n",
+                    c->target_port, strerror(err));
+            c->be_error = 1;
+            c->be_eof = 1;
+            buf_free(&c->bout);
+        }
+    }
+    if (ep->kind == EP_LIST) {
+        ListSource *ls = (ListSource *)ep;
+        int err = ls->connecting && ls->ep.fd >= 0 ? backend_connect_result(ls->ep.fd) : -1;
+        if (err >= 0) {
+            ls->connecting = 0;
+            if (err) {
+                fprintf(stderr, "Failed to connect to storage server on port %d: %s\n",
+                        ls->port, strerror(err));
+                ls->error = 1;
+                ls->eof = 1;
+                buf_free(&ls->out);
+            }
+        }
+    }
+    if (ep->kind == EP_CLIENT && (events & (EPOLLERR | EPOLLHUP)) && !(events & EPOLLIN)) {
+        conn_close(c);
         return;
     }
-    
+    conn_run(c);
+}
+
+// event on an idle pooled connection: the ping reply, or the server went away
+void pooled_handle_event(EventLoop *loop, PooledConn *pc, uint32_t events) {
+    if (pc->dead) return;
+    if (pc->ping_sent && (events & EPOLLIN)) {
+        ssize_t n = recv(pc->ep.fd, pc->pong + pc->pong_len, sizeof(pc->pong) - pc->pong_len, 0);
+        if (n > 0) {
+            pc->pong_len += n;
+            if (pc->pong_len < sizeof(pc->pong)) return;
+
+            DfsHeader h;
+            if (dfs_decode_header(pc->pong, &h) == 0 && h.opcode == DFS_OP_PING &&
+                (h.flags & DFS_F_REPLY) && h.request_id == pc->ping_id &&
+                h.status == DFS_OK && h.path_len == 0 && h.payload_len == 0) {
+                pc->ping_sent = 0;
+                pc->pong_len = 0;
+                pc->idle_since = time(NULL);
+                return;
+            }
+        } else if (n < 0 && (errno == EAGAIN || errno == EWOULDBLOCK)) {
+            return;
+        }
+    }
+    pooled_close(loop, pc);
+}
+
+// ping connections that sat idle for a while and drop the ones that stopped answering
+void pool_health_check(EventLoop *loop) {
+    time_t now = time(NULL);
+    if (now - loop->last_health_check < 1) return;
+    loop->last_health_check = now;
+
+    for (int i = 0; i < 3; i++) {
+        PooledConn *pc = loop->pools[i].idle;
+        while (pc) {
+            PooledConn *next = pc->next;
+            if (pc->ping_sent && now - pc->ping_sent >= PING_TIMEOUT) {
+                printf("S1: Dropping unresponsive connection to %s\n", server_name(pc->port));
+                pooled_close(loop, pc);
+            } else if (!pc->ping_sent && now - pc->idle_since >= HEALTH_INTERVAL) {
+                unsigned char ping[DFS_HEADER_SIZE];
+                pc->ping_id = loop->next_request_id++;
+                dfs_frame(ping, DFS_OP_PING, 0, 0, pc->ping_id, NULL, 0);
+                if (send(pc->ep.fd, ping, sizeof(ping), MSG_NOSIGNAL) == sizeof(ping)) {
+                    pc->ping_sent = now;
+                } else {
+                    pooled_close(loop, pc);
+                }
+            }
+            pc = next;
+        }
+    }
+}
+
+// accept every pending connection on the listening socket
+void loop_accept(EventLoop *loop) {
+    while (1) {
+        int client_sock = accept4(loop->listener.fd, NULL, NULL, SOCK_NONBLOCK | SOCK_CLOEXEC);
+        if (client_sock < 0) {
+            if (errno == EINTR) continue;
+            if (errno != EAGAIN && errno != EWOULDBLOCK) perror("Accept failed");
+            return;
+        }
+        printf("New client connected\n");
+        dfs_set_nodelay(client_sock);
+        Conn *c = conn_new(loop, client_sock);
+        if (c) conn_run(c);
+    }
+}
+
+// the log writer got further: replies waiting for it go out
+void loop_wal_synced(EventLoop *loop) {
+    uint64_t n;
+    while (read(loop->wal_event.fd, &n, sizeof(n)) < 0 && errno == EINTR);
+    Conn *c = loop->wal_waiters;
+    loop->wal_waiters = NULL;
+    while (c) {
+        // one still waiting puts itself back on the list
+        Conn *next = c->next_wal_waiter;
+        c->wal_waiting = 0;
+        conn_run(c);
+        c = next;
+    }
+}
+
+// connections the helper threads are done with go on where they left off
+void loop_jobs_done(EventLoop *loop) {
+    uint64_t n;
+    while (read(loop->job_event.fd, &n, sizeof(n)) < 0 && errno == EINTR);
+    pthread_mutex_lock(&loop->job_lock);
+    Conn *c = loop->jobs_done;
+    loop->jobs_done = NULL;
+    pthread_mutex_unlock(&loop->job_lock);
+    while (c) {
+        Conn *next = c->next_job;
+        c->job_running = 0;
+        c->job_done(c);
+        if (c->dead) {
+            c->next_dead = loop->dead;
+            loop->dead = c;
+        } else {
+            conn_run(c);
+        }
+        c = next;
+    }
+}
+
+// event loop of the server
+void loop_run(EventLoop *loop) {
+    struct epoll_event events[MAX_EVENTS];
+
+    while (1) {
+        fflush(stdout);
+        int n = epoll_wait(loop->epfd, events, MAX_EVENTS, 1000);
+        if (n < 0) {
+            if (errno == EINTR) continue;
+            perror("epoll_wait failed");
+            exit(EXIT_FAILURE);
+        }
+
+        for (int i = 0; i < n; i++) {
+            Endpoint *ep = events[i].data.ptr;
+            if (ep->kind == EP_LISTEN) {
+                loop_accept(loop);
+            } else if (ep->kind == EP_IDLE) {
+                pooled_handle_event(loop, ep->pooled, events[i].events);
+            } else if (ep->kind == EP_WAL) {
+                loop_wal_synced(loop);
+            } else if (ep->kind == EP_JOB) {
+                loop_jobs_done(loop);
+            } else {
+                conn_handle_event(ep->conn, ep, events[i].events);
+            }
+        }
+
+        // connections closed in this batch may still have had events queued in it
+        while (loop->dead) {
+            Conn *c = loop->dead;
+            loop->dead = c->next_dead;
+            free(c);
+        }
+        while (loop->dead_pooled) {
+            PooledConn *pc = loop->dead_pooled;
+            loop->dead_pooled = pc->next;
+            free(pc);
+        }
+        pool_health_check(loop);
+    }
+}
+
+// a scan of a source begins; what it reports replaces the entries of the
+// source, except those an upload or remove changed after it began
+void index_scan_begin(int source) {
+    index_wrlock();
+    IndexSource *src = &index_sources[source];
+    src->scanning = 1;
+    src->scan_failed = 0;
+    src->scan_seq = file_index.seq;
+    src->scan_mark++;
+    // the snapshot only changes in this thread, so it stays put while the scan runs
+    free(index_base_seen);
+    index_base_seen = calloc(file_index.base.count + 1, 1);
+    if (!index_base_seen) src->scan_failed = 1;
+    index_wrunlock();
+}
+
+// a file the scan found, called with the index locked
+// returns 0, or -1 when out of memory
+int index_scan_add(int source, int port, const char *key, size_t len, uint64_t size, int64_t mtime) {
+    IndexSource *src = &index_sources[source];
+    DfsIndexEntry *e = dfs_index_find(&file_index, key, len);
+    if (e && e->seq > src->scan_seq) return 0;
+
+    // a snapshot entry the scan agrees with is only marked as seen
+    size_t pos;
+    DfsIndexEntry snap;
+    int in_base = index_base_seen && dfs_index_base_find(&file_index.base, key, len, &pos);
+    if (in_base) {
+        index_base_seen[pos] = 1;
+        dfs_index_base_entry(&file_index.base, pos, &snap);
+        if (!e && snap.port == port && snap.size == size && mtime <= snap.mtime) return 0;
+    }
+
+    // a checksum taken of an upload holds as long as the file was not changed since
+    int unchanged = e && !e->removed && e->port == port && e->size == size && mtime <= e->mtime;
+    if (!e) e = dfs_index_put(&file_index, key, len);
+    if (!e) return -1;
+    if (!unchanged) e->has_checksum = 0;
+    e->port = port;
+    e->size = size;
+    e->mtime = mtime;
+    e->removed = 0;
+    e->mark = src->scan_mark;
+    return 0;
+}
+
+// entries of the scanned source that are gone after a complete scan: what
+// it did not see and nobody touched while it ran. tombstones stay, they may
+// hide a snapshot entry; the next snapshot does away with them
+int index_scan_drop(void *arg, const DfsIndexEntry *e) {
+    int source = *(int *)arg;
+    IndexSource *src = &index_sources[source];
+    if (index_source(e->port) != source) return 0;
+    return !e->removed && !src->scan_failed && e->mark != src->scan_mark && e->seq <= src->scan_seq;
+}
+
+// snapshot entries of the source the scan did not see get tombstones, unless
+// the trie has something newer; a batch at a time, so the loops are not
+// locked out for a whole pass over the snapshot
+void index_scan_hide_unseen(int source) {
+    const DfsIndexBase *b = &file_index.base;
+    int port = source == 0 ? 0 : S2_PORT + source - 1;
+    size_t i = 0;
+    while (i < b->count) {
+        index_wrlock();
+        for (size_t end = MIN(i + 4096, b->count); i < end; i++) {
+            if (index_base_seen[i] || b->entries[i].port != port) continue;
+            size_t len;
+            const char *key = dfs_index_base_key(b, i, &len);
+            if (dfs_index_find(&file_index, key, len)) continue;
+            if (dfs_index_delete(&file_index, key, len, port, 1) < 0) {
+                index_lost(source);
+                i = b->count;
+            }
+        }
+        index_wrunlock();
+    }
+}
+
+// the scan is over, the source is complete in the index if it went through
+void index_scan_end(int source, int ok) {
+    index_wrlock();
+    IndexSource *src = &index_sources[source];
+    if (!ok) src->scan_failed = 1;
+    dfs_index_sweep(&file_index, index_scan_drop, &source);
+    index_wrunlock();
+
+    if (!src->scan_failed) index_scan_hide_unseen(source);
+
+    index_wrlock();
+    src->scanning = 0;
+    src->ready = !src->scan_failed;
+    free(index_base_seen);
+    index_base_seen = NULL;
+    index_wrunlock();
+}
+
+// index the .c files kept on S1, without opening them
+// returns 0, or -1 when out of memory
+int index_scan_local() {
+    DfsTarWalk walk;
+    index_scan_begin(0);
+    int ok = dfs_tar_open(&walk, expand_path("~/S1"), ".c") == 0;
+    walk.stat_only = 1;
+    size_t root_len = strlen(walk.path);
+
+    DfsTarEntry e;
+    int fd, r = 0;
+    while (ok && (r = dfs_tar_next(&walk, &e, &fd)) > 0) {
+        const char *rel = e.path + root_len + 1;
+        if (strchr(rel, '\n')) continue;
+        index_wrlock();
+        ok = index_scan_add(0, 0, rel, strlen(rel), e.size, e.mtime) == 0;
+        index_wrunlock();
+    }
+    ok = ok && r == 0;
+    size_t count = walk.count;
+    dfs_tar_close(&walk);
+    index_scan_end(0, ok);
+    printf("S1: Indexed %zu local .c files%s\n", count, ok ? "" : " (out of memory)");
+    return ok ? 0 : -1;
+}
+
+// the "size mtime path" lines of one chunk of a SCAN reply
+// returns 0, or -1 if a line is malformed or memory ran out
+int index_scan_lines(int source, char *p, size_t len, size_t *count) {
+    char *end = p + len;
+    int port = S2_PORT + source - 1;
+    index_wrlock();
+    while (p < end) {
+        char *nl = memchr(p, '\n', end - p);
+        char *q;
+        if (!nl) break;
+        *nl = '\0';
+        uint64_t size = strtoull(p, &q, 10);
+        if (*q != ' ') break;
+        int64_t mtime = strtoll(q + 1, &q, 10);
+        if (*q != ' ' || q + 1 == nl) break;
+        if (index_scan_add(source, port, q + 1, nl - q - 1, size, mtime) < 0) break;
+        (*count)++;
+        p = nl + 1;
+    }
+    index_wrunlock();
+    return p == end ? 0 : -1;
+}
+
+// index every file a storage server holds, asked for with a SCAN request on
+// a blocking connection of the scanner's own
+// returns 0, or -1 if the scan has to be tried again
+int index_scan_backend(int source) {
+    int port = S2_PORT + source - 1;
+    int fd = socket(AF_INET, SOCK_STREAM | SOCK_CLOEXEC, 0);
+    if (fd < 0) return -1;
+    struct timeval tv = { INDEX_SCAN_TIMEOUT, 0 };
+    setsockopt(fd, SOL_SOCKET, SO_RCVTIMEO, &tv, sizeof(tv));
+    setsockopt(fd, SOL_SOCKET, SO_SNDTIMEO, &tv, sizeof(tv));
+
     struct sockaddr_in server_addr;
+    memset(&server_addr, 0, sizeof(server_addr));
     server_addr.sin_family = AF_INET;
-    server_addr.sin_port = htons(server_port);
+    server_addr.sin_port = htons(port);
     inet_pton(AF_INET, "127.0.0.1", &server_addr.sin_addr);
-    
-    if (connect(server_sock, (struct sockaddr*)&server_addr, sizeof(server_addr)) < 0) {
-        perror("Failed to connect to storage server");
-        close(server_sock);
-        return;
-    }
-    
-    // Send listf command to the server
-    char command[MAX_BUFF];
-    snprintf(command, sizeof(command), "listf %s", pathname);
-    write(server_sock, command, strlen(command));
-    
-    // Read count of files
-    char count_buf[32];
-    read_until(server_sock, count_buf, '\n');
-    int file_count = atoi(count_buf);
-    
-    // Read filenames
-    char buffer[MAX_BUFF];
-    for (int i = 0; i < file_count && *count < 1000; i++) {
-        read_until(server_sock, buffer, '\n');
-        
-        // Add to entries array with appropriate type
-        if (server_port == S2_PORT) {
-            strncpy(entries[*count].name, buffer, sizeof(entries[*count].name) - 1);
-            entries[*count].type = 'p';
-            (*count)++;
-        } else if (server_port == S3_PORT) {
-            strncpy(entries[*count].name, buffer, sizeof(entries[*count].name) - 1);
-            entries[*count].type = 't';
-            (*count)++;
-        } else if (server_port == S4_PORT) {
-            strncpy(entries[*count].name, buffer, sizeof(entries[*count].name) - 1);
-            entries[*count].type = 'z';
-            (*count)++;
-        }
-    }
-    
-    close(server_sock);
-}
-
-// Compare function for sorting files
-int compare_file_entries(const void *a, const void *b) {
-    return strcmp(((const FileEntry *)a)->name, ((const FileEntry *)b)->name);
+
+    static DfsReader rd;
+    static char chunk[DFS_LIST_BLOCK];
+    DfsHeader h;
+    char path[1];
+    dfs_reader_init(&rd, fd);
+    if (connect(fd, (struct sockaddr*)&server_addr, sizeof(server_addr)) < 0 ||
+        dfs_send_header(fd, DFS_OP_SCAN, 0, 0, 1, NULL, 0) < 0 ||
+        dfs_read_header(&rd, &h, path, sizeof(path)) <= 0 ||
+        !(h.flags & DFS_F_REPLY) || h.opcode != DFS_OP_SCAN || h.status != DFS_OK || !(h.flags & DFS_F_CHUNKED)) {
+        close(fd);
+        return -1;
+    }
+
+    index_scan_begin(source);
+    size_t count = 0;
+    int ok = 0;
+    while (1) {
+        unsigned char len_buf[DFS_CHUNK_HEADER];
+        if (dfs_read_full(&rd, len_buf, sizeof(len_buf)) < 0) break;
+        uint64_t len = dfs_get64(len_buf);
+        if (len == 0) {
+            ok = 1;
+            break;
+        }
+        if (len > sizeof(chunk) || dfs_read_full(&rd, chunk, len) < 0 ||
+            index_scan_lines(source, chunk, len, &count) < 0) break;
+    }
+    close(fd);
+    index_scan_end(source, ok);
+    printf("S1: Indexed %zu files of %s%s\n", count, server_name(port), ok ? "" : " (scan cut short)");
+    return ok ? 0 : -1;
 }
 
-// Function to handle dispfnames command
-void handle_dispfnames_command(int client_sock, char *pathname) {
-    // pathname starts with ~S1/
-    if (strncmp(pathname, "~S1/", 4) != 0) {
-        write(client_sock, "ERR: Path must start with ~S1/\n", 29);
-        return;
+// path of a file in INDEX_DIR
+const char *index_file(char *path, size_t max, const char *name, uint64_t gen) {
+    snprintf(path, max, "%s/%s", expand_path(INDEX_DIR), name);
+    if (gen) snprintf(path + strlen(path), max - strlen(path), ".%llu", (unsigned long long)gen);
+    return path;
+}
+
+// make renames and new files in INDEX_DIR stick
+int index_sync_dir() {
+    int fd = open(expand_path(INDEX_DIR), O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+    if (fd < 0) return -1;
+    int r = fsync(fd);
+    close(fd);
+    return r;
+}
+
+// log file of a generation, created empty
+int wal_open(uint64_t gen) {
+    char path[PATH_MAX];
+    int fd = open(index_file(path, sizeof(path), "wal", gen), O_WRONLY | O_CREAT | O_TRUNC | O_APPEND | O_CLOEXEC, 0644);
+    if (fd >= 0 && index_sync_dir() < 0) {
+        close(fd);
+        return -1;
     }
-    
-    // Convert pathname
-    char dir_path[MAX_BUFF];
-    snprintf(dir_path, sizeof(dir_path), "~/S1/%s", pathname + 4); // Skip ~S1/
-    char *expanded_dir_path = expand_path(dir_path);
-    // Array to hold file entries
-    FileEntry entries[1000];
-    int count = 0;
-    
-    // List local C files
-    DIR *dir = opendir(expanded_dir_path);
-    if (dir) {
-        struct dirent *entry;
-        while ((entry = readdir(dir)) && count < 1000) {
-            // Skip . and ..
-            if (strcmp(entry->d_name, ".") == 0 || strcmp(entry->d_name, "..") == 0)
-                continue;
-                
-            // Check if it's a .c file
-            char *ext = strrchr(entry->d_name, '.');
-            if (ext && strcmp(ext, ".c") == 0) {
-                strncpy(entries[count].name, entry->d_name, sizeof(entries[count].name) - 1);
-                entries[count].type = 'c';
-                count++;
+    return fd;
+}
+
+// write a batch of records and wait for the disk; returns 0, or -1
+int wal_write(int fd, const char *data, size_t n) {
+    while (n > 0) {
+        ssize_t w = write(fd, data, n);
+        if (w < 0 && errno == EINTR) continue;
+        if (w <= 0) return -1;
+        data += w;
+        n -= w;
+    }
+    return fdatasync(fd);
+}
+
+// the log writer: takes what piled up, writes and fsyncs it while the next
+// batch piles up, then tells the loops how far the disk has got
+void *wal_writer(void *arg) {
+    (void)arg;
+    Buf batch = {0};
+    pthread_mutex_lock(&index_wal.lock);
+    while (1) {
+        while (buf_pending(&index_wal.pending) == 0 && index_wal.rotate_gen <= index_wal.gen) {
+            pthread_cond_wait(&index_wal.wake, &index_wal.lock);
+        }
+        Buf taken = index_wal.pending;
+        index_wal.pending = batch;
+        index_wal.pending.off = index_wal.pending.len = 0;
+        batch = taken;
+        uint64_t last = index_wal.appended;
+        uint64_t gen = index_wal.gen;
+        uint64_t rotate_gen = index_wal.rotate_gen;
+        size_t split = rotate_gen > gen ? index_wal.rotate_at : batch.len;
+        int fd = index_wal.fd;
+        int failed = index_wal.failed;
+        pthread_mutex_unlock(&index_wal.lock);
+
+        if (!failed) {
+            failed = wal_write(fd, batch.data, split) < 0;
+            if (!failed && rotate_gen > gen) {
+                // the records after the split are the first the next snapshot will not have
+                int next = wal_open(rotate_gen);
+                failed = next < 0;
+                if (!failed) {
+                    close(fd);
+                    fd = next;
+                    gen = rotate_gen;
+                }
+            }
+            if (!failed && split < batch.len) failed = wal_write(fd, batch.data + split, batch.len - split) < 0;
+            if (failed) {
+                // acknowledging changes a restart would forget is worse than not persisting at all
+                char path[PATH_MAX];
+                perror("S1: Writing the index log failed, the index is not persisted any more");
+                unlink(index_file(path, sizeof(path), "snapshot", 0));
+                close(fd);
+                fd = -1;
             }
         }
-        closedir(dir);
-    }
-    
-    // Get filenames from other servers
-    get_filenames_from_server(S2_PORT, pathname, entries, &count); // PDF files
-    get_filenames_from_server(S3_PORT, pathname, entries, &count); // TXT files
-    get_filenames_from_server(S4_PORT, pathname, entries, &count); // ZIP files
-    
-    // Sort entries alphabetically
-    qsort(entries, count, sizeof(FileEntry), compare_file_entries);
-    
-    // Send the count to client
-    char count_header[32];
-    snprintf(count_header, sizeof(count_header), "%d\n", count);
-    write(client_sock, count_header, strlen(count_header));
-    
-    // Send the file list to client
-    for (int i = 0; i < count; i++) {
-        char file_info[MAX_BUFF];
-        // Format: filename (type)
-        char type_char = entries[i].type;
-        char *type_name = "";
-        
-        switch (type_char) {
-            case 'c': type_name = "C source"; break;
-            case 'p': type_name = "PDF document"; break;
-            case 't': type_name = "Text file"; break;
-            case 'z': type_name = "ZIP archive"; break;
-        }
-        
-        snprintf(file_info, sizeof(file_info), "%s (%s)\n", entries[i].name, type_name);
-        write(client_sock, file_info, strlen(file_info));
-    }
-}
-
-// Function to process client requests
-void process_client(int client_sock) {
-    char buffer[MAX_BUFF];
-    
-    // Read command
-    ssize_t bytes_read = read_until(client_sock, buffer, ' ');
-    if (bytes_read <= 0) {
-        close(client_sock);
-        return;
-    }
-    buffer[bytes_read] = '\0';
-    
-    if (strcmp(buffer, "uploadf") == 0) {
-        // Read filename
-        memset(buffer, 0, MAX_BUFF);
-        bytes_read = read_until(client_sock, buffer, ' ');
-        if (bytes_read <= 0) {
-            close(client_sock);
-            return;
+
+        pthread_mutex_lock(&index_wal.lock);
+        index_wal.fd = fd;
+        index_wal.gen = gen;
+        if (failed) {
+            index_wal.failed = 1;
+            index_wal.rotate_gen = 0;
         }
-        buffer[bytes_read] = '\0';
-        char filename[MAX_BUFF];
-        strncpy(filename, buffer, MAX_BUFF - 1);
-        
-        // Read destination path
-        memset(buffer, 0, MAX_BUFF);
-        bytes_read = read_until(client_sock, buffer, '\n');
-        if (bytes_read <= 0) {
-            close(client_sock);
-            return;
+        __atomic_store_n(&index_wal.durable, last, __ATOMIC_RELEASE);
+        pthread_cond_broadcast(&index_wal.synced);
+        batch.off = batch.len = 0;
+
+        uint64_t one = 1;
+        for (int i = 0; i < event_loop_count; i++) {
+            if (write(event_loops[i].wal_event.fd, &one, sizeof(one)) < 0 && errno != EAGAIN) {
+                perror("eventfd write failed");
+            }
         }
-        buffer[bytes_read] = '\0';
-        char dest_path[MAX_BUFF];
-        strncpy(dest_path, buffer, MAX_BUFF - 1);
-        
-        handle_uploadf_command(client_sock, filename, dest_path);
-    } else if (strcmp(buffer, "downlf") == 0) {
-        // Read filepath
-        memset(buffer, 0, MAX_BUFF);
-        bytes_read = read_until(client_sock, buffer, '\n');
-        if (bytes_read <= 0) {
-            close(client_sock);
-            return;
+    }
+    return NULL;
+}
+
+// start a new log file with the next record appended; called with the index
+// locked, so the records before the switch are exactly what the trie holds
+// returns the new generation, 0 if the index is not persisted
+uint64_t wal_rotate() {
+    pthread_mutex_lock(&index_wal.lock);
+    uint64_t gen = 0;
+    if (!index_wal.failed) {
+        gen = index_wal.rotate_gen = index_wal.gen + 1;
+        index_wal.rotate_at = buf_pending(&index_wal.pending);
+        index_wal.bytes = 0;
+        pthread_cond_signal(&index_wal.wake);
+    }
+    pthread_mutex_unlock(&index_wal.lock);
+    return gen;
+}
+
+// wait until the writer switched to generation gen; returns 0, or -1 if it never will
+int wal_wait_gen(uint64_t gen) {
+    pthread_mutex_lock(&index_wal.lock);
+    while (!index_wal.failed && index_wal.gen < gen) pthread_cond_wait(&index_wal.synced, &index_wal.lock);
+    int r = index_wal.failed ? -1 : 0;
+    pthread_mutex_unlock(&index_wal.lock);
+    return r;
+}
+
+// generations of the log files in INDEX_DIR, sorted
+size_t wal_generations(uint64_t **gens) {
+    size_t count = 0, cap = 0;
+    *gens = NULL;
+    DIR *dir = opendir(expand_path(INDEX_DIR));
+    if (!dir) return 0;
+    struct dirent *entry;
+    while ((entry = readdir(dir))) {
+        char *end;
+        if (strncmp(entry->d_name, "wal.", 4) != 0) continue;
+        uint64_t gen = strtoull(entry->d_name + 4, &end, 10);
+        if (*end || gen == 0) continue;
+        if (count == cap) {
+            cap = cap ? cap * 2 : 16;
+            uint64_t *grown = realloc(*gens, cap * sizeof(uint64_t));
+            if (!grown) break;
+            *gens = grown;
         }
-        buffer[bytes_read] = '\0';
-        
-        handle_downlf_command(client_sock, buffer);
-    } else if (strcmp(buffer, "removef") == 0) {
-        // Read filepath
-        memset(buffer, 0, MAX_BUFF);
-        bytes_read = read_until(client_sock, buffer, '\n');
-        if (bytes_read <= 0) {
-            close(client_sock);
-            return;
+        (*gens)[count++] = gen;
+    }
+    closedir(dir);
+    for (size_t i = 1; i < count; i++) {
+        for (size_t j = i; j > 0 && (*gens)[j - 1] > (*gens)[j]; j--) {
+            uint64_t t = (*gens)[j];
+            (*gens)[j] = (*gens)[j - 1];
+            (*gens)[j - 1] = t;
         }
-        buffer[bytes_read] = '\0';
-        
-        handle_removef_command(client_sock, buffer);
-    } else if (strcmp(buffer, "downltar") == 0) {
-        // Read filetype
-        memset(buffer, 0, MAX_BUFF);
-        bytes_read = read_until(client_sock, buffer, '\n');
-        if (bytes_read <= 0) {
-            close(client_sock);
-            return;
+    }
+    return count;
+}
+
+// apply one log file to the index; a torn record at its end was never
+// acknowledged and is ignored. returns the records applied
+size_t wal_replay_file(uint64_t gen, int *lost) {
+    char path[PATH_MAX];
+    int fd = open(index_file(path, sizeof(path), "wal", gen), O_RDONLY | O_CLOEXEC);
+    struct stat st;
+    if (fd < 0 || fstat(fd, &st) < 0 || st.st_size == 0) {
+        // an empty file is left by a run that logged nothing
+        if (fd >= 0) {
+            close(fd);
+            unlink(path);
         }
-        buffer[bytes_read] = '\0';
-        
-        handle_downltar_command(client_sock, buffer);
-    } else if (strcmp(buffer, "dispfnames") == 0) {
-        // Read pathname
-        memset(buffer, 0, MAX_BUFF);
-        bytes_read = read_until(client_sock, buffer, '\n');
-        if (bytes_read <= 0) {
-            close(client_sock);
-            return;
+        return 0;
+    }
+    unsigned char *map = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+    close(fd);
+    if (map == MAP_FAILED) {
+        *lost = 1;
+        return 0;
+    }
+    madvise(map, st.st_size, MADV_SEQUENTIAL);
+
+    size_t off = 0, count = 0, n;
+    int op;
+    const char *key;
+    size_t len;
+    DfsIndexEntry e;
+    while ((n = dfs_wal_parse(map + off, st.st_size - off, &op, &key, &len, &e)) > 0) {
+        if (op == DFS_WAL_PUT) {
+            if (!dfs_index_set(&file_index, key, len, &e)) *lost = 1;
+        } else if (op == DFS_WAL_DEL) {
+            // a tombstone either way, looking the path up in the snapshot would touch its pages
+            if (dfs_index_delete(&file_index, key, len, e.port, 1) < 0) *lost = 1;
         }
-        buffer[bytes_read] = '\0';
-        
-        handle_dispfnames_command(client_sock, buffer);
-    } else {
-        write(client_sock, "ERR: Unknown command\n", 21);
+        off += n;
+        count++;
+    }
+    if (off < (size_t)st.st_size) printf("S1: Ignoring a torn record at the end of %s\n", path);
+    index_wal.bytes += off;
+    munmap(map, st.st_size);
+    return count;
+}
+
+// load the index a previous run left: map the snapshot and replay the log
+// files after it. sources the snapshot did not have complete are scanned
+void index_load() {
+    struct timespec t0, t1;
+    clock_gettime(CLOCK_MONOTONIC, &t0);
+    mkdirp(INDEX_DIR);
+
+    char path[PATH_MAX];
+    int r = dfs_index_base_open(&file_index.base, index_file(path, sizeof(path), "snapshot", 0));
+    if (r < 0) printf("S1: Ignoring unreadable index snapshot %s: %s\n", path, strerror(errno));
+    uint64_t first = r == 0 ? file_index.base.header.wal_gen : 1;
+    uint32_t ready = r == 0 ? file_index.base.header.ready : 0;
+    if (r != 0) {
+        dfs_index_base_close(&file_index.base);
+        // log files a missing snapshot would have covered cannot be told apart
+        first = 1;
+    }
+
+    uint64_t *gens;
+    size_t ngens = wal_generations(&gens);
+    size_t records = 0;
+    int lost = 0;
+    uint64_t next = first;
+    for (size_t i = 0; i < ngens; i++) {
+        if (gens[i] < first) {
+            unlink(index_file(path, sizeof(path), "wal", gens[i]));
+            continue;
+        }
+        records += wal_replay_file(gens[i], &lost);
+        next = gens[i] + 1;
+    }
+    free(gens);
+    if (lost) {
+        printf("S1: Out of memory loading the index, it is built again\n");
+        ready = 0;
+    }
+    for (int i = 0; i < LIST_SOURCES; i++) index_sources[i].ready = (ready >> i) & 1;
+    index_snapshot_ready = ready;
+
+    // new records go to a file of their own, after whatever the last run left
+    index_wal.gen = next;
+    index_wal.fd = wal_open(next);
+    if (index_wal.fd < 0) {
+        perror("S1: Cannot open the index log, the index is not persisted");
+        index_wal.failed = 1;
+    }
+
+    clock_gettime(CLOCK_MONOTONIC, &t1);
+    printf("S1: Loaded index with %zu snapshot entries and %zu logged changes in %ld ms\n",
+           file_index.base.count, records,
+           (long)((t1.tv_sec - t0.tv_sec) * 1000 + (t1.tv_nsec - t0.tv_nsec) / 1000000));
+}
+
+// trie entries the new snapshot has; changes made while it was written stay
+int index_compact_drop(void *arg, const DfsIndexEntry *e) {
+    return e->seq <= *(uint64_t *)arg;
+}
+
+// fold the trie into a new snapshot and drop the log files it covers; the
+// trie is copied under the lock, the snapshot written without it
+void index_compact() {
+    struct timespec t0, t1;
+    clock_gettime(CLOCK_MONOTONIC, &t0);
+    DfsIndexCopy cp;
+    index_wrlock();
+    uint64_t snap_seq = file_index.seq;
+    uint32_t ready = 0;
+    for (int i = 0; i < LIST_SOURCES; i++) {
+        if (index_sources[i].ready) ready |= 1u << i;
+    }
+    int r = dfs_index_copy(&file_index, &cp);
+    uint64_t gen = r == 0 ? wal_rotate() : 0;
+    index_compacting = gen > 0;
+    index_wrunlock();
+    if (r < 0) {
+        printf("S1: Out of memory writing an index snapshot\n");
+        return;
+    }
+    if (gen == 0) {
+        dfs_index_copy_free(&cp);
+        return;
+    }
+
+    char path[PATH_MAX], tmp[PATH_MAX];
+    index_file(path, sizeof(path), "snapshot", 0);
+    index_file(tmp, sizeof(tmp), "snapshot.tmp", 0);
+    int fd = open(tmp, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+    int ok = fd >= 0 && dfs_index_write_snapshot(fd, &file_index.base, &cp, gen, ready) == 0 && fsync(fd) == 0;
+    if (fd >= 0) close(fd);
+    dfs_index_copy_free(&cp);
+    DfsIndexBase fresh;
+    // the snapshot must not name a log file that does not exist yet
+    ok = ok && wal_wait_gen(gen) == 0 && rename(tmp, path) == 0 && index_sync_dir() == 0;
+    ok = ok && dfs_index_base_open(&fresh, path) == 0;
+    if (!ok) perror("S1: Writing an index snapshot failed");
+
+    index_wrlock();
+    DfsIndexBase old = file_index.base;
+    if (ok) {
+        file_index.base = fresh;
+        dfs_index_sweep(&file_index, index_compact_drop, &snap_seq);
+    }
+    index_compacting = 0;
+    index_wrunlock();
+    if (!ok) {
+        unlink(tmp);
+        return;
+    }
+    dfs_index_base_close(&old);
+    index_snapshot_ready = ready;
+
+    uint64_t *gens;
+    size_t ngens = wal_generations(&gens);
+    for (size_t i = 0; i < ngens; i++) {
+        if (gens[i] < gen) unlink(index_file(path, sizeof(path), "wal", gens[i]));
+    }
+    free(gens);
+    clock_gettime(CLOCK_MONOTONIC, &t1);
+    printf("S1: Wrote index snapshot of %zu entries in %ld ms\n", fresh.count,
+           (long)((t1.tv_sec - t0.tv_sec) * 1000 + (t1.tv_nsec - t0.tv_nsec) / 1000000));
+}
+
+// keeps the index whole: scans the sources it does not have complete, one
+// that cannot be reached every INDEX_RETRY seconds, and writes a snapshot
+// after a scan or once the log grew past INDEX_COMPACT_BYTES
+void *index_maintainer(void *arg) {
+    (void)arg;
+    int reported[LIST_SOURCES] = {0};
+    hint_load();
+    while (1) {
+        uint32_t ready = 0;
+        int scanned = 0;
+        for (int i = 0; i < LIST_SOURCES; i++) {
+            index_rdlock();
+            int was_ready = index_sources[i].ready;
+            index_rdunlock();
+            if (!was_ready) {
+                int r = i == 0 ? index_scan_local() : index_scan_backend(i);
+                if (r < 0 && i > 0 && !reported[i]) {
+                    printf("S1: %s not reachable for its index scan, retrying every %d sec\n",
+                           server_name(S2_PORT + i - 1), INDEX_RETRY);
+                }
+                reported[i] = r < 0;
+                scanned |= r == 0;
+            }
+            index_rdlock();
+            if (index_sources[i].ready) ready |= 1u << i;
+            index_rdunlock();
+        }
+
+        pthread_mutex_lock(&index_wal.lock);
+        int compact = !index_wal.failed &&
+                      (scanned || ready != index_snapshot_ready || index_wal.bytes >= INDEX_COMPACT_BYTES);
+        pthread_mutex_unlock(&index_wal.lock);
+        if (compact) index_compact();
+        sleep(INDEX_RETRY);
+    }
+    return NULL;
+}
+
+// allow as many open descriptors as the hard limit permits
+void raise_fd_limit() {
+    struct rlimit rl;
+    if (getrlimit(RLIMIT_NOFILE, &rl) == 0 && rl.rlim_cur < rl.rlim_max) {
+        rl.rlim_cur = rl.rlim_max;
+        setrlimit(RLIMIT_NOFILE, &rl);
+    }
+}
+
+// only one S1 may own the index, its log and the cache: a second one would
+// keep state of its own and drift apart from the first. the lock goes with
+// the process, so a crashed S1 leaves nothing to clean up
+void lock_state() {
+    int fd = open(expand_path(LOCK_FILE), O_RDWR | O_CREAT | O_CLOEXEC, 0644);
+    if (fd < 0) {
+        perror("S1: Cannot open " LOCK_FILE);
+        exit(EXIT_FAILURE);
+    }
+    if (flock(fd, LOCK_EX | LOCK_NB) < 0) {
+        if (errno == EWOULDBLOCK) fprintf(stderr, "S1: Another S1 is running on this home directory\n");
+        else perror("S1: Cannot lock " LOCK_FILE);
+        exit(EXIT_FAILURE);
+    }
+    // fd stays open, and locked, until the process ends
+}
+
+// fail if the port is taken: the listeners share it with SO_REUSEPORT, which
+// would let them join those of another S1 of the same user without an error.
+// a socket bound without it conflicts with any listener on the port
+void check_port_free() {
+    struct sockaddr_in address;
+    int opt = 1;
+    int fd = socket(AF_INET, SOCK_STREAM | SOCK_CLOEXEC, 0);
+    memset(&address, 0, sizeof(address));
+    address.sin_family = AF_INET;
+    address.sin_addr.s_addr = INADDR_ANY;
+    address.sin_port = htons(PORT);
+    if (fd < 0 || setsockopt(fd, SOL_SOCKET, SO_REUSEADDR, &opt, sizeof(opt)) < 0 ||
+        bind(fd, (struct sockaddr*)&address, sizeof(address)) < 0) {
+        perror("Bind failed");
+        exit(EXIT_FAILURE);
     }
-    
-    close(client_sock);
+    close(fd);
 }
 
-int main() {
-    int server_fd, client_sock;
+// listening socket of one event loop; every loop binds its own with SO_REUSEPORT
+// so the kernel spreads incoming connections across them
+int create_listener() {
+    int server_fd;
     struct sockaddr_in address;
-    int addrlen = sizeof(address);
     int opt = 1;
-    
+
     // Create socket
-    if ((server_fd = socket(AF_INET, SOCK_STREAM, 0)) < 0) {
+    if ((server_fd = socket(AF_INET, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0)) < 0) {
         perror("Socket creation failed");
         exit(EXIT_FAILURE);
     }
-    
+
     // Set socket options
-    if (setsockopt(server_fd, SOL_SOCKET, SO_REUSEADDR, &opt, sizeof(opt)) < 0) {
+    if (setsockopt(server_fd, SOL_SOCKET, SO_REUSEADDR, &opt, sizeof(opt)) < 0 ||
+        setsockopt(server_fd, SOL_SOCKET, SO_REUSEPORT, &opt, sizeof(opt)) < 0) {
         perror("Setsockopt failed");
         exit(EXIT_FAILURE);
     }
-    
+
+    memset(&address, 0, sizeof(address));
     address.sin_family = AF_INET;
     address.sin_addr.s_addr = INADDR_ANY;
     address.sin_port = htons(PORT);
-    
+
     // Bind socket
     if (bind(server_fd, (struct sockaddr*)&address, sizeof(address)) < 0) {
         perror("Bind failed");
         exit(EXIT_FAILURE);
     }
-    
+
     // Listen for connections
-    if (listen(server_fd, 10) < 0) {
+    if (listen(server_fd, SOMAXCONN) < 0) {
         perror("Listen failed");
         exit(EXIT_FAILURE);
     }
-    
-    printf("S1 Server started on port %d\n", PORT);
-    
+    return server_fd;
+}
+
+void loop_init(EventLoop *loop, int id) {
+    memset(loop, 0, sizeof(*loop));
+    loop->id = id;
+    loop->epfd = epoll_create1(EPOLL_CLOEXEC);
+    if (loop->epfd < 0) {
+        perror("epoll_create1 failed");
+        exit(EXIT_FAILURE);
+    }
+    loop->listener.fd = create_listener();
+    loop->listener.kind = EP_LISTEN;
+    endpoint_watch(loop, &loop->listener, EPOLLIN);
+    loop->wal_event.fd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+    if (loop->wal_event.fd < 0) {
+        perror("eventfd failed");
+        exit(EXIT_FAILURE);
+    }
+    loop->wal_event.kind = EP_WAL;
+    endpoint_watch(loop, &loop->wal_event, EPOLLIN);
+    loop->job_event.fd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+    if (loop->job_event.fd < 0) {
+        perror("eventfd failed");
+        exit(EXIT_FAILURE);
+    }
+    loop->job_event.kind = EP_JOB;
+    endpoint_watch(loop, &loop->job_event, EPOLLIN);
+    pthread_mutex_init(&loop->job_lock, NULL);
+}
+
+// worker thread: pin to a core and run its own loop, sharing nothing with the others
+void *loop_thread(void *arg) {
+    EventLoop *loop = arg;
+    long ncpu = sysconf(_SC_NPROCESSORS_ONLN);
+    if (ncpu > 1) {
+        cpu_set_t set;
+        CPU_ZERO(&set);
+        CPU_SET(loop->id % ncpu, &set);
+        pthread_setaffinity_np(pthread_self(), sizeof(set), &set);
+    }
+    loop_run(loop);
+    return NULL;
+}
+
+int main(int argc, char *argv[]) {
+    int nthreads = 1;
+    int cache_mb = CACHE_MEM_MB;
+    int spill_mb = CACHE_SPILL_MB;
+    int opt;
+
+    // -t <n>: number of event loop threads, 0 for one per online core
+    // -m <MiB>: memory tier of the read cache, 0 turns the cache off
+    // -s <MiB>: its spill tier in ~/S1_cache, 0 keeps it in memory only
+    while ((opt = getopt(argc, argv, "t:m:s:")) != -1) {
+        if (opt == 't') {
+            nthreads = atoi(optarg);
+        } else if (opt == 'm' && atoi(optarg) >= 0) {
+            cache_mb = atoi(optarg);
+        } else if (opt == 's' && atoi(optarg) >= 0) {
+            spill_mb = atoi(optarg);
+        } else {
+            fprintf(stderr, "Usage: %s [-t threads] [-m cache MiB] [-s spill MiB]\n", argv[0]);
+            exit(EXIT_FAILURE);
+        }
+    }
+    if (nthreads <= 0) nthreads = sysconf(_SC_NPROCESSORS_ONLN);
+    if (nthreads <= 0) nthreads = 1;
+
+    // a vanished client must not take the whole server down
+    signal(SIGPIPE, SIG_IGN);
+    raise_fd_limit();
+
     // Create base directory
     mkdirp("~/S1");
-    
-    // Main server loop
-    while (1) {
-        if ((client_sock = accept(server_fd, (struct sockaddr*)&address, (socklen_t*)&addrlen)) < 0) {
-            perror("Accept failed");
-            continue;
+    lock_state();
+    cache_init(cache_mb, spill_mb);
+
+    // the index comes back from its snapshot and log; the local .c files are
+    // indexed before the first request if it has not got them, S2-S4 in the
+    // background. until a server is scanned its files are asked for as before
+    if (dfs_index_init(&file_index) < 0) {
+        perror("Index allocation failed");
+        exit(EXIT_FAILURE);
+    }
+    index_load();
+    if (!index_sources[0].ready) index_scan_local();
+
+    // listeners are all bound before any thread starts, and only once the
+    // port is known to be free, so a busy port fails fast
+    check_port_free();
+    EventLoop *loops = calloc(nthreads, sizeof(EventLoop));
+    if (!loops) {
+        perror("Event loop allocation failed");
+        exit(EXIT_FAILURE);
+    }
+    for (int i = 0; i < nthreads; i++) {
+        loop_init(&loops[i], i);
+    }
+
+    event_loops = loops;
+    event_loop_count = nthreads;
+
+    printf("S1 Server started on port %d with %d event loop%s\n", PORT, nthreads, nthreads > 1 ? "s" : "");
+
+    pthread_t writer, maintainer;
+    if (pthread_create(&writer, NULL, wal_writer, NULL) != 0 ||
+        pthread_create(&maintainer, NULL, index_maintainer, NULL) != 0) {
+        perror("pthread_create failed");
+        exit(EXIT_FAILURE);
+    }
+    pthread_detach(writer);
+    pthread_detach(maintainer);
+    for (int i = 0; i < HELPER_THREADS; i++) {
+        pthread_t tid;
+        if (pthread_create(&tid, NULL, job_helper, NULL) != 0) {
+            perror("pthread_create failed");
+            exit(EXIT_FAILURE);
         }
-        
-        printf("New client connected\n");
-        
-        // Fork a child process to handle the client
-        pid_t pid = fork();
-        if (pid < 0) {
-            perror("Fork failed");
-            close(client_sock);
-            continue;
-        } else if (pid == 0) {
-            // Child process
-            close(server_fd);
-            process_client(client_sock);
-            exit(EXIT_SUCCESS);
-        } else {
-            // Parent process
-            close(client_sock);
-            // Clean up zombie processes
-            waitpid(-1, NULL, WNOHANG);
+        pthread_detach(tid);
+    }
+
+    for (int i = 1; i < nthreads; i++) {
+        pthread_t tid;
+        if (pthread_create(&tid, NULL, loop_thread, &loops[i]) != 0) {
+            perror("pthread_create failed");
+            exit(EXIT_FAILURE);
         }
+        pthread_detach(tid);
     }
-    
+
+    // Main server loop
+    loop_thread(&loops[0]);
+
     return 0;
-}
\ No newline at end of file
+}
@@ -1,3 +1,4 @@
+#define _GNU_SOURCE
 #define _DEFAULT_SOURCE
 #define _XOPEN_SOURCE 700
 #include <stdio.h>
@@ -12,14 +13,30 @@
 #include <libgen.h>
 #include <sys/wait.h>
 #include <sys/types.h>
-#include <ftw.h>
 #include <limits.h>
+#include <errno.h>
+#include <pthread.h>
+#include <signal.h>
+#include <time.h>
+#include <sys/time.h>
+#include <sys/epoll.h>
+#include "dfs_proto.h"
+#include "dfs_tar.h"
+#include "dfs_list.h"
+#include "dfs_inventory.h"
+#include "dfs_chunk.h"
+#include "dfs_delta.h"
+#include "dfs_lz4.h"
 
 #define PORT 9082
 #define MAX_BUFF 4096
 #define HOME_DIR "~/S3"
+#define DEFAULT_WORKERS 8
+#define QUEUE_CAP 1024     // pending sockets per worker queue
 
-char tar_filepath[PATH_MAX];
+unsigned int upload_seq = 0;     // makes temp file names of concurrent uploads unique
+DfsInventory inventory;          // every TXT file under ~/S3
+DfsChunkStore chunks;            // ~/S3_chunks, content of the files stored as chunks
 
 // Create directories recursively
 void create_dir(char *path) {
@@ -34,9 +51,12 @@ void create_dir(char *path) {
 
 // function to transform path from S1 notation to S3 notation
 char* transform_path(const char* path) {
-    static char new_path[MAX_BUFF];
+    static __thread char new_path[MAX_BUFF];
     if (strncmp(path, "~S1/", 4) == 0) {
-        snprintf(new_path, sizeof(new_path), "~/S3/%s", path + 4);
+        // a path too long for the buffer names no file, rather than another one
+        if (snprintf(new_path, sizeof(new_path), "~/S3/%s", path + 4) >= (int)sizeof(new_path)) {
+            new_path[0] = '\0';
+        }
     } else {
         strncpy(new_path, path, sizeof(new_path));
         new_path[sizeof(new_path) - 1] = '\0';
@@ -46,7 +66,7 @@ char* transform_path(const char* path) {
 
 // Helper function to expand HOME_DIR to actual path
 char* expand_path(const char* path) {
-    static char expanded[PATH_MAX];
+    static __thread char expanded[PATH_MAX];
     
     if (strncmp(path, "~/", 2) == 0) {
         char* home = getenv("HOME");
@@ -59,17 +79,55 @@ char* expand_path(const char* path) {
     return (char*)path;
 }
 
-// Function to handle file uploading
-void handle_upload(int sock, char *filename, char *dest_path, char *file_data, size_t data_size) {
-    // Create full path for S3
-    char full_path[MAX_BUFF];
-    printf("S3: handle_upload - dest_path: %s, filename: %s\n", dest_path, filename);
+// Function to pack the plain content of a temp file, size bytes of it, into
+// a new temp file that takes its name; *fd becomes the new file and
+// *packed is set. content that does not shrink is left as it is
+// returns 0, or -1 with errno set
+int pack_temp_file(const char *tmp_path, int *fd, uint64_t size, int *packed) {
+    char packed_path[PATH_MAX];
+    snprintf(packed_path, sizeof(packed_path), "%s-z", tmp_path);
+    int out = open(packed_path, O_RDWR | O_CREAT | O_EXCL | O_CLOEXEC, 0666);
+    if (out < 0) return -1;
+    int r = dfs_pack_file(*fd, size, out, chunks.pack_level);
+    if (r > 0 && rename(packed_path, tmp_path) == 0) {
+        close(*fd);
+        *fd = out;
+        *packed = 1;
+        return 0;
+    }
+    int err = errno;
+    close(out);
+    unlink(packed_path);
+    errno = err;
+    return r == 0 ? 0 : -1;
+}
 
-    sprintf(full_path, "~/S3/%s/%s", dest_path, filename);
-    
+// Function to handle file uploading, returns DFS_OK or the error status for S1,
+// or -1 if the upload stream broke off. the payload goes straight from the
+// socket into a temp file in the target directory, which replaces the old file
+// only once all of it is on disk. a compressed upload (DFS_F_LZ4) is decoded
+// on the way and has to match the size and checksum it starts with; it may
+// be chunked, then its length is only known at its empty chunk. with packing
+// on (-z) and chunking off, the file is stored packed if it shrinks
+int handle_upload(DfsReader *rd, char *path, off_t data_size, int compressed, int chunked) {
+    // payload still to be read; data_size becomes the decoded size of a compressed upload
+    uint64_t payload = data_size, left = chunked ? DFS_LEN_CHUNKED : (uint64_t)data_size, checksum = 0;
+    if (compressed) {
+        unsigned char head[DFS_LZ4_HEADER];
+        if (left < sizeof(head)) return dfs_skip(rd, left) == 0 ? DFS_E_INVALID : -1;
+        if (dfs_read_full(rd, head, sizeof(head)) < 0) return -1;
+        if (!chunked) left -= sizeof(head);
+        data_size = dfs_get64(head);
+        checksum = dfs_get64(head + 8);
+        if (data_size <= 0) return dfs_skip(rd, left) == 0 ? DFS_E_INVALID : -1;
+    }
+
+    // Create full path for S3
+    char *full_path = transform_path(path);
+    printf("S3: handle_upload - path: %s\n", path);
     printf("S3: Expanded path: %s\n", full_path);
     char *expanded_full_path = expand_path(full_path);
-   
+
     // Create directory structure
     char *dir_path = strdup(expanded_full_path);
     char *dir = dirname(dir_path);
@@ -78,163 +136,703 @@ void handle_upload(int sock, char *filename, char *dest_path, char *file_data, s
     snprintf(cmd, sizeof(cmd), "mkdir -p %s", dir);
     printf("S3: Creating directory with cmd: %s\n", cmd);
     system(cmd);
-    free(dir_path);
 
-    // Create and write to file
+    // no extension, so listings and tars never pick up a half written file
+    char tmp_path[PATH_MAX];
+    snprintf(tmp_path, sizeof(tmp_path), "%s/.upload-%d-%u", dir, (int)getpid(),
+             __sync_fetch_and_add(&upload_seq, 1));
     printf("S3: Opening file for writing: %s\n", full_path);
-    int fd = open(expanded_full_path, O_WRONLY | O_CREAT | O_TRUNC, 0666);
-    if (fd >= 0) {
-        size_t bytes_written = write(fd, file_data, data_size);
+    int fd = open(tmp_path, (compressed ? O_RDWR : O_WRONLY) | O_CREAT | O_EXCL | O_CLOEXEC, 0666);
+    if (fd < 0) {
+        printf("S3: Failed to open file for writing: %s\n", strerror(errno));
+        free(dir_path);
+        return dfs_skip(rd, left) == 0 ? DFS_E_IO : -1;
+    }
+
+    // reserve the space up front; filesystems without fallocate just grow the file
+    int packing = chunks.pack_level && !chunks.enabled, packed = 0;
+    int err = chunks.enabled || packing ? 0 : fallocate(fd, 0, 0, data_size);
+    if (err < 0 && errno != EOPNOTSUPP && errno != ENOSYS) {
+        printf("S3: Cannot reserve %ld bytes: %s\n", data_size, strerror(errno));
         close(fd);
-        
-        if (bytes_written == data_size) {
-            printf("S3: Saved file to %s\n", full_path);
-            send(sock, "ACK", 3, 0); // ACK success
-        } else {
-            printf("S3: Error writing file (wrote %zu of %zu bytes)\n", bytes_written, data_size);
-            send(sock, "ERR", 3, 0); //  error
+        unlink(tmp_path);
+        free(dir_path);
+        return dfs_skip(rd, left) == 0 ? DFS_E_IO : -1;
+    }
+
+    // with chunking on, the data goes to the chunk store and the file holds
+    // the recipe for it; decoded data is cut into chunks once it is checked
+    DfsRecipe recipe;
+    memset(&recipe, 0, sizeof(recipe));
+    int r;
+    if (compressed) {
+        DfsXxh64 hash;
+        dfs_xxh64_init(&hash);
+        uint64_t written;
+        r = dfs_lz4_recv(rd, &left, fd, &written, &hash);
+        if (r == DFS_OK && (written != (uint64_t)data_size || dfs_xxh64_digest(&hash) != checksum)) {
+            r = DFS_E_INVALID;
         }
+        if (r == DFS_OK && chunks.enabled && dfs_chunk_file(&chunks, fd, data_size, &recipe) < 0) r = DFS_E_IO;
+        if (r == DFS_OK && packing && pack_temp_file(tmp_path, &fd, data_size, &packed) < 0) r = DFS_E_IO;
+    } else if (chunks.enabled) {
+        r = dfs_chunk_recv(&chunks, rd, data_size, &recipe);
+        if (r == 0 && dfs_recipe_write(fd, &recipe) < 0) r = DFS_E_IO;
+    } else if (packing) {
+        r = dfs_pack_recv(rd, fd, data_size, chunks.pack_level, &packed);
+    } else {
+        r = dfs_recv_file(rd, fd, data_size);
+    }
+    if (r > 0) r = r == DFS_E_INVALID ? r : DFS_E_IO;
+    struct stat st;
+    if (r == 0 && (fsync(fd) < 0 || fstat(fd, &st) < 0)) r = DFS_E_IO;
+    if (close(fd) < 0 && r == 0) r = DFS_E_IO;
+    if (r == 0 && dfs_chunk_replace(&chunks, tmp_path, expanded_full_path) < 0) r = DFS_E_IO;
+    if (r != 0) {
+        if (r < 0) printf("S3: Incomplete file transfer, upload discarded\n");
+        else if (r == DFS_E_INVALID) printf("S3: Corrupt compressed upload, discarded\n");
+        else printf("S3: Error writing file: %s\n", strerror(errno));
+        unlink(tmp_path);
+        dfs_recipe_release(&chunks, &recipe);
+        dfs_recipe_free(&recipe);
+        free(dir_path);
+        return r < 0 ? -1 : r;
+    }
+
+    // make the rename itself durable
+    int dir_fd = open(dir, O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+    if (dir_fd >= 0) {
+        fsync(dir_fd);
+        close(dir_fd);
+    }
+    free(dir_path);
+    if (dfs_inv_stored(&inventory, path, data_size, st.st_mtime) < 0) {
+        printf("S3: Out of memory updating the inventory\n");
+    }
+    if (compressed && !chunked) {
+        printf("S3: Decoded %llu bytes of compressed upload\n", (unsigned long long)payload);
+    }
+    if (chunks.enabled) {
+        printf("S3: Saved file to %s (%ld bytes in %zu chunks)\n", full_path, data_size, recipe.count);
+    } else if (packed) {
+        printf("S3: Saved file to %s (%ld bytes, packed to %lld)\n", full_path, data_size,
+               (long long)st.st_size);
     } else {
-        perror("S3: Failed to open file for writing");
-        send(sock, "ERR", 3, 0); //  error
+        printf("S3: Saved file to %s (%ld bytes)\n", full_path, data_size);
+    }
+    dfs_recipe_free(&recipe);
+    return DFS_OK;
+}
+
+// whether the stored content at path has the given SHA-256
+int link_matches(const char *path, const unsigned char *digest) {
+    DfsContent content;
+    unsigned char got[DFS_SHA256_SIZE];
+    if (dfs_content_open(&chunks, path, &content) < 0) return 0;
+    int same = dfs_content_sha256(&content, got) == 0 && memcmp(got, digest, sizeof(got)) == 0;
+    dfs_content_close(&content);
+    return same;
+}
+
+// Function to store an upload whose content S1 knows S3 has: the file at
+// the source path in the payload gets path as a second name, nothing is
+// copied, once the SHA-256 of its content is the one in the payload.
+// returns DFS_OK or the error status for S1, or -1 if the stream broke off
+int handle_link(DfsReader *rd, const DfsHeader *req, char *path) {
+    unsigned char args[8 + DFS_SHA256_SIZE + DFS_MAX_PATH];
+    if (req->payload_len <= 8 + DFS_SHA256_SIZE || req->payload_len >= sizeof(args) || path[0] == '\0') {
+        return dfs_skip(rd, req->payload_len) == 0 ? DFS_E_INVALID : -1;
+    }
+    if (dfs_read_full(rd, args, req->payload_len) < 0) return -1;
+    args[req->payload_len] = '\0';
+    uint64_t size = dfs_get64(args);
+    const unsigned char *digest = args + 8;
+    char *source = (char *)args + 8 + DFS_SHA256_SIZE;
+    if (strncmp(source, "~S1/", 4) != 0) return DFS_E_INVALID;
+
+    char from[PATH_MAX], to[PATH_MAX];
+    snprintf(from, sizeof(from), "%s", expand_path(transform_path(source)));
+    snprintf(to, sizeof(to), "%s", expand_path(transform_path(path)));
+    create_dir(to);
+    char *dir_path = strdup(to);
+    char *dir = dirname(dir_path);
+    char tmp_path[PATH_MAX];
+    snprintf(tmp_path, sizeof(tmp_path), "%s/.upload-%d-%u", dir, (int)getpid(),
+             __sync_fetch_and_add(&upload_seq, 1));
+
+    uint64_t linked;
+    if (dfs_chunk_link(&chunks, from, tmp_path, &linked) < 0) {
+        int err = errno;
+        printf("S3: Cannot link %s: %s\n", source, strerror(err));
+        free(dir_path);
+        return err == ENOENT ? DFS_E_NOTFOUND : DFS_E_IO;
+    }
+    // the content linked has to be the client's: the source may have been
+    // replaced since S1 saw it, or merely collide with the claim's XXH64
+    int status = linked == size && link_matches(tmp_path, digest) ? DFS_OK : DFS_E_NOTFOUND;
+    if (status == DFS_OK && strcmp(from, to) == 0) {
+        // the file holds that content already
+        dfs_chunk_unlink(&chunks, tmp_path);
+        free(dir_path);
+        return DFS_OK;
+    }
+    if (status == DFS_OK && dfs_chunk_replace(&chunks, tmp_path, to) < 0) status = DFS_E_IO;
+    if (status != DFS_OK) {
+        printf("S3: Cannot link %s: %s\n", source, status == DFS_E_IO ? strerror(errno) : "content differs");
+        dfs_chunk_unlink(&chunks, tmp_path);
+        free(dir_path);
+        return status;
     }
+
+    int dir_fd = open(dir, O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+    if (dir_fd >= 0) {
+        fsync(dir_fd);
+        close(dir_fd);
+    }
+    free(dir_path);
+    struct stat st;
+    if (dfs_inv_stored(&inventory, path, size, stat(to, &st) == 0 ? st.st_mtime : time(NULL)) < 0) {
+        printf("S3: Out of memory updating the inventory\n");
+    }
+    printf("S3: Linked %s to %s (%llu bytes)\n", transform_path(path), source, (unsigned long long)size);
+    return DFS_OK;
+}
+
+// Function to apply a delta upload: the new version is built from blocks of
+// the stored one and the bytes the patch carries, in a temp file that
+// replaces the file once it matches the patch's size and checksum. returns
+// DFS_OK or the error status for S1, or -1 if the stream broke off
+int handle_patch(DfsReader *rd, const DfsHeader *req, char *path) {
+    unsigned char head[DFS_DELTA_HEADER];
+    DfsPatch patch;
+    if (req->payload_len < DFS_DELTA_HEADER || path[0] == '\0') {
+        return dfs_skip(rd, req->payload_len) == 0 ? DFS_E_INVALID : -1;
+    }
+    if (dfs_read_full(rd, head, sizeof(head)) < 0) return -1;
+    uint64_t left = req->payload_len - DFS_DELTA_HEADER;
+    if (dfs_patch_parse(head, &patch) < 0) return dfs_skip(rd, left) == 0 ? DFS_E_INVALID : -1;
+
+    char to[PATH_MAX];
+    snprintf(to, sizeof(to), "%s", expand_path(transform_path(path)));
+    DfsContent base;
+    if (dfs_content_open(&chunks, to, &base) < 0) {
+        int status = errno == ENOENT ? DFS_E_MISSING : DFS_E_IO;
+        printf("S3: No stored version of %s to patch\n", transform_path(path));
+        return dfs_skip(rd, left) == 0 ? status : -1;
+    }
+    char *dir_path = strdup(to);
+    char *dir = dirname(dir_path);
+    char tmp_path[PATH_MAX];
+    snprintf(tmp_path, sizeof(tmp_path), "%s/.upload-%d-%u", dir, (int)getpid(),
+             __sync_fetch_and_add(&upload_seq, 1));
+    int fd = open(tmp_path, O_RDWR | O_CREAT | O_EXCL | O_CLOEXEC, 0777);
+    int status;
+    if (fd < 0) status = dfs_skip(rd, left) == 0 ? DFS_E_IO : -1;
+    else status = dfs_delta_apply(rd, left, &patch, &base, fd);
+    dfs_content_close(&base);
+
+    // with chunking or packing on, the new version is stored like an upload
+    DfsRecipe recipe;
+    memset(&recipe, 0, sizeof(recipe));
+    struct stat st;
+    int packed = 0;
+    if (status == DFS_OK && chunks.enabled && dfs_chunk_file(&chunks, fd, patch.size, &recipe) < 0) {
+        status = DFS_E_IO;
+    }
+    if (status == DFS_OK && !chunks.enabled && chunks.pack_level &&
+        pack_temp_file(tmp_path, &fd, patch.size, &packed) < 0) {
+        status = DFS_E_IO;
+    }
+    if (status == DFS_OK && (fsync(fd) < 0 || fstat(fd, &st) < 0)) status = DFS_E_IO;
+    if (fd >= 0 && close(fd) < 0 && status == DFS_OK) status = DFS_E_IO;
+    if (status == DFS_OK && dfs_chunk_replace(&chunks, tmp_path, to) < 0) status = DFS_E_IO;
+    if (status != DFS_OK) {
+        printf("S3: Patch of %s failed: %s\n", transform_path(path),
+               status < 0 ? "incomplete transfer" : dfs_status_name(status));
+        if (fd >= 0) unlink(tmp_path);
+        dfs_recipe_release(&chunks, &recipe);
+        dfs_recipe_free(&recipe);
+        free(dir_path);
+        return status;
+    }
+
+    int dir_fd = open(dir, O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+    if (dir_fd >= 0) {
+        fsync(dir_fd);
+        close(dir_fd);
+    }
+    free(dir_path);
+    if (dfs_inv_stored(&inventory, path, patch.size, st.st_mtime) < 0) {
+        printf("S3: Out of memory updating the inventory\n");
+    }
+    printf("S3: Patched %s (%llu bytes, %llu bytes of patch)%s\n", transform_path(path),
+           (unsigned long long)patch.size, (unsigned long long)req->payload_len, packed ? ", packed" : "");
+    dfs_recipe_free(&recipe);
+    return DFS_OK;
+}
+
+// Function to send the block signatures of a stored file, for a delta upload
+// returns 0 if the connection can no longer be used for further requests
+int send_signatures(int sock, const DfsHeader *req, const char *path) {
+    DfsContent base;
+    if (dfs_content_open(&chunks, expand_path(transform_path(path)), &base) < 0) {
+        return dfs_send_reply(sock, req, errno == ENOENT ? DFS_E_NOTFOUND : DFS_E_IO, NULL, 0) == 0;
+    }
+    int ok = dfs_delta_send_sigs(sock, req, &base) == 0;
+    printf("S3: Sent block signatures of %s (%llu bytes)\n", transform_path(path),
+           (unsigned long long)base.size);
+    dfs_content_close(&base);
+    return ok;
 }
 
 // Function to send a file back to S1
-void send_file_to_s1(int sock, const char *full_path) {
+// returns 0 if the connection can no longer be used for further requests
+int send_file_to_s1(int sock, const DfsHeader *req, const char *full_path) {
     char *expanded_path = expand_path(full_path);
+
+    // compressed if S1 asked for it and the content looks like it will shrink
+    if (req->flags & DFS_F_LZ4) {
+        DfsContent content;
+        if (dfs_content_open(&chunks, expanded_path, &content) == 0) {
+            int r = dfs_lz4_send(sock, req, &content, full_path);
+            dfs_content_close(&content);
+            if (r > 0) printf("S3: Sent %s compressed\n", full_path);
+            if (r != 0) return r > 0;
+        }
+    }
     struct stat st;
-    if (stat(expanded_path, &st) != 0) {
-        send(sock, "ERR", 3, 0);
-        return;
+    int fd = open(expanded_path, O_RDONLY);
+    if (fd < 0 || fstat(fd, &st) != 0) {
+        if (fd >= 0) close(fd);
+        return dfs_send_reply(sock, req, DFS_E_NOTFOUND, NULL, 0) == 0;
     }
+
+    // a file stored as chunks is read from the chunk store, a packed one is decoded
+    DfsRecipe recipe;
+    DfsPack pack;
+    int chunked = dfs_recipe_read(&chunks, fd, &recipe);
+    int packed = chunked == 0 && chunks.packed ? dfs_pack_open(fd, &pack) : 0;
+    if (chunked < 0 || packed < 0) {
+        close(fd);
+        return dfs_send_reply(sock, req, DFS_E_IO, NULL, 0) == 0;
+    }
+    uint64_t size = chunked ? recipe.size : packed ? pack.size : (uint64_t)st.st_size;
     
-    // Send file size
-    char size_str[32];
-    snprintf(size_str, sizeof(size_str), "%ld", st.st_size);
-    send(sock, size_str, strlen(size_str), 0);
-    send(sock, "\n", 1, 0);
-    
-    // Send file content
-    int fd = open(expanded_path, O_RDONLY);
-    if (fd < 0) {
-        perror("S3: Cannot open file for sending");
-        return;
+    // Send reply header with the file size
+    if (dfs_send_header(sock, req->opcode, DFS_F_REPLY, DFS_OK, req->request_id,
+                        NULL, size) < 0) {
+        dfs_recipe_free(&recipe);
+        if (packed) dfs_pack_close(&pack);
+        close(fd);
+        return 0;
     }
     
-    char buffer[MAX_BUFF];
-    ssize_t bytes_read;
-    while ((bytes_read = read(fd, buffer, MAX_BUFF)) > 0) {
-        send(sock, buffer, bytes_read, 0);
+    // Send file content
+    int sent;
+    if (chunked) {
+        uint64_t left = size;
+        sent = dfs_chunk_send_part(&chunks, sock, &recipe, &left) == 0 && left == 0;
+    } else if (packed) {
+        uint64_t left = size;
+        sent = dfs_pack_send(sock, fd, &pack, &left) == 0 && left == 0;
+        dfs_pack_close(&pack);
+    } else {
+        sent = dfs_send_file(sock, fd, st.st_size) == 0;
     }
+    dfs_recipe_free(&recipe);
     close(fd);
+    return sent;
 }
 
-// Function to handle file deletion
-void handle_delete(int sock, char *path) {
+// Function to handle file deletion, returns DFS_OK or the error status for S1
+int handle_delete(char *path) {
     // Transform and expand path
     char *transformed = transform_path(path);
     char *expanded = expand_path(transformed);
     
-    if (unlink(expanded) == 0) {
+    int status = DFS_OK;
+    if (dfs_chunk_unlink(&chunks, expanded) == 0) {
         printf("S3: Deleted file %s\n", expanded);
-        send(sock, "ACK", 3, 0);
     } else {
         perror("S3: File deletion failed");
-        send(sock, "ERR", 3, 0);
+        if (errno != ENOENT) return DFS_E_IO;
+        status = DFS_E_NOTFOUND;
+    }
+    // a file that was already gone must not linger in the inventory either
+    if (dfs_inv_removed(&inventory, path) < 0) printf("S3: Out of memory updating the inventory\n");
+    return status;
+}
+
+// Function to create a tar of all TXT files, streamed to S1 from the inventory
+int create_txt_tar(int sock, const DfsHeader *req) {
+    if (dfs_send_header(sock, req->opcode, DFS_F_REPLY | DFS_F_CHUNKED, DFS_OK, req->request_id,
+                        NULL, 0) < 0) {
+        return 0;
+    }
+    size_t count = 0;
+    int ok = dfs_inv_send_tar(&inventory, sock, &count) == 0;
+    printf("S3: Sent tar of %zu TXT files%s\n", count, ok ? "" : " (incomplete)");
+    return ok;
+}
+
+// Function to report every stored TXT file to S1, which keeps an index of them
+int scan_txt_files(int sock, const DfsHeader *req) {
+    size_t count = 0;
+    int ok = dfs_inv_send_scan(&inventory, sock, req, &count) == 0;
+    printf("S3: Reported %zu TXT files to the index%s\n", count, ok ? "" : " (incomplete)");
+    return ok;
+}
+
+// Function to list the TXT files in a directory: sorted, from the name `from`
+// on and at most limit of them (0 = all), read from the inventory. a long
+// listing (DFS_F_LONG) adds their size and mtime
+int list_txt_files(int sock, const DfsHeader *req, const char *path, uint64_t limit, const char *from) {
+    printf("S3: Listing TXT files in directory: %s\n", transform_path(path));
+    DfsNames names;
+    dfs_names_init(&names, limit);
+    int ok;
+    if (dfs_inv_list(&inventory, path, from, (req->flags & DFS_F_LONG) != 0, &names) < 0) {
+        printf("S3: Out of memory listing TXT files\n");
+        ok = dfs_send_reply(sock, req, DFS_E_IO, NULL, 0) == 0;
+    } else {
+        printf("S3: Found %zu TXT files\n", names.count);
+        ok = dfs_send_names(sock, req, &names) == 0;
     }
+    dfs_names_free(&names);
+    return ok;
 }
 
-// callback function for file traversal for tar 
-int tar_add_file(const char *fpath, const struct stat *sb, int typeflag, struct FTW *ftwbuf) {
-    if (typeflag == FTW_F && strstr(fpath, ".txt") != NULL) {
-        char cmd[MAX_BUFF * 2];
-        snprintf(cmd, sizeof(cmd), "tar -rf %s '%s'", tar_filepath, fpath);
-        system(cmd);
+// part of a file back to S1, for a DFS_F_RANGE download; only those bytes
+// are read, from whichever way the file is stored
+// returns 0 if the connection can no longer be used for further requests
+int send_range_to_s1(int sock, const DfsHeader *req, const char *full_path, uint64_t off, uint64_t len) {
+    DfsContent content;
+    if (dfs_content_open(&chunks, expand_path(full_path), &content) < 0) {
+        return dfs_send_reply(sock, req, DFS_E_NOTFOUND, NULL, 0) == 0;
+    }
+    int ok;
+    if (dfs_range_clip(content.size, off, &len) < 0) {
+        ok = dfs_send_reply(sock, req, DFS_E_INVALID, NULL, 0) == 0;
+    } else {
+        ok = dfs_send_header(sock, req->opcode, DFS_F_REPLY, DFS_OK, req->request_id, NULL, len) == 0 &&
+             dfs_content_send(sock, &content, off, len) == 0;
+        if (ok) printf("S3: Sent %llu bytes of %s from offset %llu\n", (unsigned long long)len, full_path,
+                       (unsigned long long)off);
+    }
+    dfs_content_close(&content);
+    return ok;
+}
+
+// Function to serve one request from S1 on a worker thread
+// returns 1 when the connection is still in sync and can serve another request
+int handle_request(DfsReader *rd) {
+    int new_sock = rd->fd;
+    DfsHeader req;
+    char path[DFS_MAX_PATH];
+
+    // Read request header and path from S1
+    int r = dfs_read_header(rd, &req, path, sizeof(path));
+    if (r <= 0) {
+        if (r < 0) printf("S3: Malformed request from S1\n");
+        return 0;
+    }
+    printf("S3: Received %s request: %s\n", dfs_op_name(req.opcode), path);
+
+    if (req.opcode == DFS_OP_UPLOAD) {
+        off_t file_size = req.payload_len;
+        // only a compressed upload comes chunked, its length unknown up front
+        int chunked = (req.flags & DFS_F_CHUNKED) != 0;
+        if (chunked) {
+            printf("S3: Expecting compressed file of unknown size\n");
+        } else {
+            printf("S3: Expecting file of size: %ld bytes\n", file_size);
+        }
+        if ((chunked ? !(req.flags & DFS_F_LZ4) : file_size <= 0) || path[0] == '\0') {
+            return dfs_skip(rd, chunked ? DFS_LEN_CHUNKED : (uint64_t)file_size) == 0 &&
+                   dfs_send_reply(new_sock, &req, DFS_E_INVALID, NULL, 0) == 0;
+        }
+
+        int status = handle_upload(rd, path, file_size, (req.flags & DFS_F_LZ4) != 0, chunked);
+        if (status < 0) return 0;
+        return dfs_send_reply(new_sock, &req, status, NULL, 0) == 0;
+    }
+
+    if (req.opcode == DFS_OP_PATCH) {
+        int status = handle_patch(rd, &req, path);
+        if (status < 0) return 0;
+        return dfs_send_reply(new_sock, &req, status, NULL, 0) == 0;
+    }
+
+    if (req.opcode == DFS_OP_LINK) {
+        int status = handle_link(rd, &req, path);
+        if (status < 0) return 0;
+        return dfs_send_reply(new_sock, &req, status, NULL, 0) == 0;
+    }
+
+    if (req.opcode == DFS_OP_LIST) {
+        // a page of the listing: at most limit names, starting at from
+        uint64_t limit;
+        char from[DFS_LIST_NAME_MAX + 1];
+        r = dfs_read_list_args(rd, &req, &limit, from, sizeof(from));
+        if (r < 0) return 0;
+        if (r > 0) return dfs_send_reply(new_sock, &req, DFS_E_INVALID, NULL, 0) == 0;
+        return list_txt_files(new_sock, &req, path, limit, from);
+    }
+
+    if (req.opcode == DFS_OP_DOWNLOAD && (req.flags & DFS_F_RANGE)) {
+        uint64_t off, len;
+        r = dfs_read_range(rd, &req, &off, &len);
+        if (r < 0) return 0;
+        if (r > 0) return dfs_send_reply(new_sock, &req, DFS_E_INVALID, NULL, 0) == 0;
+        return send_range_to_s1(new_sock, &req, transform_path(path), off, len);
+    }
+
+    // no other request carries a payload
+    if (req.payload_len > 0) {
+        printf("S3: Unexpected payload in %s request\n", dfs_op_name(req.opcode));
+        return 0;
     }
+
+    switch (req.opcode) {
+        case DFS_OP_DOWNLOAD:
+            // Handle file retrieval for S1
+            return send_file_to_s1(new_sock, &req, transform_path(path));
+        case DFS_OP_REMOVE:
+            // Handle file deletion
+            return dfs_send_reply(new_sock, &req, handle_delete(path), NULL, 0) == 0;
+        case DFS_OP_TAR:
+            return create_txt_tar(new_sock, &req);
+        case DFS_OP_SIGS:
+            return send_signatures(new_sock, &req, path);
+        case DFS_OP_SCAN:
+            return scan_txt_files(new_sock, &req);
+        case DFS_OP_PING:
+            // health check from S1's connection pool
+            return dfs_send_reply(new_sock, &req, DFS_OK, NULL, 0) == 0;
+    }
+    printf("S3: Unknown opcode: %d\n", req.opcode);
+    dfs_send_reply(new_sock, &req, DFS_E_PROTO, NULL, 0);
     return 0;
 }
 
-// Function to create a tar of all TXT files
-void create_txt_tar(int sock) {
-    char *s3_root = expand_path("~/S3");
-    
-    // Create a temporary tar file
-    snprintf(tar_filepath, sizeof(tar_filepath), "%s/txt.tar", s3_root);
-    
-    // empty tar file
-    char cmd[MAX_BUFF];
-    snprintf(cmd, sizeof(cmd), "rm -f %s && touch %s", tar_filepath, tar_filepath);
-    system(cmd);
-    
-    // traverse the directory and add TXT files to the tar
-    nftw(s3_root, tar_add_file, 20, FTW_PHYS);
-    
-    // Send the tar file to S1
-    send_file_to_s1(sock, tar_filepath);
-    
-    // Clean up
-    unlink(tar_filepath);
+// per-worker deque of accepted sockets: the owner takes from the tail,
+// idle workers steal from the head of the others; guarded by pool_lock
+typedef struct {
+    int fds[QUEUE_CAP];
+    unsigned head;
+    unsigned tail;
+} WorkQueue;
+
+WorkQueue *queues;
+int num_workers = DEFAULT_WORKERS;
+int queued = 0;                 // sockets waiting in all queues
+pthread_mutex_t pool_lock = PTHREAD_MUTEX_INITIALIZER;
+pthread_cond_t work_available = PTHREAD_COND_INITIALIZER;
+pthread_cond_t space_available = PTHREAD_COND_INITIALIZER;
+int idle_epfd = -1;             // kept-alive S1 connections waiting for their next request
+
+// take a socket from our own tail, or steal one from another worker's head;
+// the caller holds pool_lock and has seen queued > 0, so one is always found
+int pool_take(int self) {
+    for (int i = 0; i < num_workers; i++) {
+        WorkQueue *q = &queues[(self + i) % num_workers];
+        if (q->tail != q->head) {
+            if (i == 0) return q->fds[--q->tail % QUEUE_CAP];
+            return q->fds[q->head++ % QUEUE_CAP];
+        }
+    }
+    return -1;
 }
 
-// Function to list all TXT files in a directory
-void list_txt_files(int sock, const char *path) {
-    char *transformed = transform_path(path);
-    char *expanded = expand_path(transformed);
-    
-    printf("S3: Listing TXT files in directory: %s\n", transformed);
-    
-    DIR *dir = opendir(expanded);
-    if (!dir) {
-        perror("S3: Failed to open directory");
-        // Send count 0 instead of empty string
-        send(sock, "0\n", 2, 0);
-        return;
+// hand an accepted socket to the next worker queue with room,
+// blocking the submitter (acceptor or idle thread) while every queue is full
+void pool_submit(int fd) {
+    static unsigned next = 0;   // guarded by pool_lock
+
+    pthread_mutex_lock(&pool_lock);
+    while (queued >= num_workers * QUEUE_CAP) {
+        pthread_cond_wait(&space_available, &pool_lock);
     }
-    
-    // First pass: count TXT files
-    int count = 0;
-    struct dirent *entry;
-    while ((entry = readdir(dir)) != NULL) {
-        if (entry->d_type == DT_REG && strstr(entry->d_name, ".txt") != NULL) {
-            count++;
+    // queued counts exactly what the queues hold, so one of them has room
+    for (;; next++) {
+        WorkQueue *q = &queues[next % num_workers];
+        if (q->tail - q->head < QUEUE_CAP) {
+            q->fds[q->tail++ % QUEUE_CAP] = fd;
+            next++;
+            break;
         }
     }
-    
-    // Send the count 
-    char count_str[32];
-    snprintf(count_str, sizeof(count_str), "%d\n", count);
-    send(sock, count_str, strlen(count_str), 0);
-    
-    printf("S3: Found %d TXT files\n", count);
-    
-    if (count > 0) {
-        // Reset directory stream and send file names one by one
-        rewinddir(dir);
-        while ((entry = readdir(dir)) != NULL) {
-            if (entry->d_type == DT_REG && strstr(entry->d_name, ".txt") != NULL) {
-                printf("S3: Sending TXT: %s\n", entry->d_name);
-                send(sock, entry->d_name, strlen(entry->d_name), 0);
-                send(sock, "\n", 1, 0);  // Send newline 
-            }
+    queued++;
+    pthread_cond_signal(&work_available);
+    pthread_mutex_unlock(&pool_lock);
+}
+
+// park a kept-alive S1 connection until its next request arrives
+void park_connection(int fd) {
+    struct epoll_event ev;
+    ev.events = EPOLLIN | EPOLLRDHUP | EPOLLONESHOT;
+    ev.data.fd = fd;
+    if (epoll_ctl(idle_epfd, EPOLL_CTL_MOD, fd, &ev) < 0 &&
+        (errno != ENOENT || epoll_ctl(idle_epfd, EPOLL_CTL_ADD, fd, &ev) < 0)) {
+        close(fd);
+    }
+}
+
+// serve requests on one S1 connection until it goes idle or out of sync
+void handle_connection(int fd) {
+    DfsReader rd;
+    dfs_reader_init(&rd, fd);
+    int keep;
+
+    // requests S1 already pipelined into the reader are served right away
+    do {
+        keep = handle_request(&rd);
+    } while (keep && dfs_reader_pending(&rd) > 0);
+
+    if (keep) {
+        park_connection(fd);
+    } else {
+        close(fd);
+    }
+}
+
+// hand idle connections back to the worker pool once S1 sends on them again
+void *idle_main(void *arg) {
+    struct epoll_event events[64];
+    (void)arg;
+
+    while (1) {
+        int n = epoll_wait(idle_epfd, events, 64, -1);
+        for (int i = 0; i < n; i++) {
+            // hangups are submitted too, the worker sees EOF and closes
+            pool_submit(events[i].data.fd);
         }
     }
-    
-    closedir(dir);
+    return NULL;
 }
 
-int main() {
+void *worker_main(void *arg) {
+    int self = (int)(long)arg;
+
+    while (1) {
+        // sleep until a socket is queued, then take it from our own or another queue
+        pthread_mutex_lock(&pool_lock);
+        while (queued == 0) {
+            pthread_cond_wait(&work_available, &pool_lock);
+        }
+        int fd = pool_take(self);
+        queued--;
+        pthread_cond_signal(&space_available);
+        pthread_mutex_unlock(&pool_lock);
+
+        handle_connection(fd);
+        fflush(stdout);
+    }
+    return NULL;
+}
+
+// Function to build the inventory by walking ~/S3, one thread per worker
+// returns 0, or -1 if it ran out of memory
+int build_inventory(void) {
+    struct timespec start, end;
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    size_t count = 0;
+    if (dfs_inv_rebuild(&inventory, num_workers, &count) < 0) {
+        printf("S3: Out of memory building the inventory\n");
+        return -1;
+    }
+    clock_gettime(CLOCK_MONOTONIC, &end);
+    printf("S3: Inventory of %zu TXT files built in %ld ms\n", count,
+           (end.tv_sec - start.tv_sec) * 1000 + (end.tv_nsec - start.tv_nsec) / 1000000);
+    fflush(stdout);
+    return 0;
+}
+
+// corrects an inventory read from the manifest, then keeps the manifest current
+void *inventory_main(void *arg) {
+    if (arg) build_inventory();
+    while (1) {
+        if (dfs_inv_save(&inventory) < 0) perror("S3: Failed to save the manifest");
+        sleep(DFS_INV_SAVE_DELAY);
+    }
+    return NULL;
+}
+
+int main(int argc, char *argv[]) {
+
     int serverfd, new_sock;
     struct sockaddr_in addr;
     int addrlen = sizeof(addr);
     int opt = 1;
 
+    // -w <n>: number of worker threads serving S1 requests
+    // -d: store uploads as deduplicated chunks
+    // -z fast|dense: store uploads packed, compressed so any range reads back quickly
+    int chunking = 0, packing = 0;
+    while ((opt = getopt(argc, argv, "w:dz:")) != -1) {
+        if (opt == 'w' && atoi(optarg) > 0) {
+            num_workers = atoi(optarg);
+        } else if (opt == 'd') {
+            chunking = 1;
+        } else if (opt == 'z' && strcmp(optarg, "fast") == 0) {
+            packing = DFS_PACK_FAST;
+        } else if (opt == 'z' && strcmp(optarg, "dense") == 0) {
+            packing = DFS_PACK_DENSE;
+        } else {
+            fprintf(stderr, "Usage: %s [-w workers] [-d] [-z fast|dense]\n", argv[0]);
+            exit(EXIT_FAILURE);
+        }
+    }
+    opt = 1;
+    signal(SIGPIPE, SIG_IGN);
+
+    if (dfs_chunk_init(&chunks, expand_path("~/S3"), chunking) < 0) {
+        perror("S3: Cannot open the chunk store");
+        exit(EXIT_FAILURE);
+    }
+    if (dfs_chunk_packing(&chunks, expand_path("~/S3"), packing) < 0) {
+        perror("S3: Cannot set up packing");
+        exit(EXIT_FAILURE);
+    }
+    if (packing && chunking) printf("S3: Uploads are stored as chunks, -z has no effect\n");
+    else if (packing) printf("S3: Packing uploads (%s)\n", packing == DFS_PACK_DENSE ? "dense" : "fast");
+
+    // the inventory comes from the manifest if there is one, checked by a
+    // walk in the background, else the walk has to finish first. with a
+    // chunk store the walk always comes first: it counts the references to
+    // the chunks, which have to be known before any of them is deleted
+    if (dfs_inv_init(&inventory, expand_path("~/S3"), ".txt", PORT) < 0) {
+        printf("S3: Cannot set up the inventory\n");
+        exit(EXIT_FAILURE);
+    }
+    inventory.chunks = chunks.present || chunks.packed ? &chunks : NULL;
+    size_t loaded;
+    int r = chunks.present ? 1 : dfs_inv_load(&inventory, &loaded);
+    if (r == 0) {
+        printf("S3: Loaded manifest of %zu TXT files\n", loaded);
+    } else {
+        if (r < 0) printf("S3: Ignoring unreadable manifest\n");
+        if (build_inventory() < 0) chunks.count_failed = 1;
+    }
+    if (chunks.count_failed) {
+        printf("S3: Not all recipes could be read, unused chunks are kept\n");
+    } else if (chunks.present) {
+        size_t deleted = dfs_chunk_sweep(&chunks);
+        printf("S3: Chunk store holds %zu chunks, %zu unused ones deleted\n", chunks.count, deleted);
+    }
+    pthread_t inventory_tid;
+    if (pthread_create(&inventory_tid, NULL, inventory_main, (void *)(long)(r == 0)) != 0) {
+        perror("S3: pthread_create failed");
+        exit(EXIT_FAILURE);
+    }
+    pthread_detach(inventory_tid);
+
     // Create socket
-    if ((serverfd = socket(AF_INET, SOCK_STREAM, 0)) == 0) {
+    if ((serverfd = socket(AF_INET, SOCK_STREAM, 0)) < 0) {
         perror("S3: socket creation failed");
         exit(EXIT_FAILURE);
     }
-    
+
     // Set socket options
     if (setsockopt(serverfd, SOL_SOCKET, SO_REUSEADDR, &opt, sizeof(opt))) {
         perror("S3: setsockopt failed");
@@ -251,13 +849,39 @@ int main() {
         exit(EXIT_FAILURE);
     }
 
-    if (listen(serverfd, 5) < 0) {
+    if (listen(serverfd, SOMAXCONN) < 0) {
         perror("S3: listen failed");
         exit(EXIT_FAILURE);
     }
 
-    printf("S3: Listening on port %d...\n", PORT);
-    create_dir("~/S3");
+    printf("S3: Listening on port %d with %d workers...\n", PORT, num_workers);
+    create_dir(expand_path("~/S3/"));
+
+    // start the worker pool
+    queues = calloc(num_workers, sizeof(WorkQueue));
+    if (!queues) {
+        perror("S3: worker queue allocation failed");
+        exit(EXIT_FAILURE);
+    }
+    idle_epfd = epoll_create1(0);
+    if (idle_epfd < 0) {
+        perror("S3: epoll_create1 failed");
+        exit(EXIT_FAILURE);
+    }
+    pthread_t idle_tid;
+    if (pthread_create(&idle_tid, NULL, idle_main, NULL) != 0) {
+        perror("S3: pthread_create failed");
+        exit(EXIT_FAILURE);
+    }
+    pthread_detach(idle_tid);
+    for (int i = 0; i < num_workers; i++) {
+        pthread_t tid;
+        if (pthread_create(&tid, NULL, worker_main, (void *)(long)i) != 0) {
+            perror("S3: pthread_create failed");
+            exit(EXIT_FAILURE);
+        }
+        pthread_detach(tid);
+    }
 
     while (1) {
         fflush(stdout);
@@ -267,136 +891,15 @@ int main() {
             continue;
         }
 
-        // Fork to handle the request
-        pid_t pid = fork();
-        if (pid == 0) {
-            close(serverfd); 
-
-            char buffer[MAX_BUFF];
-            memset(buffer, 0, MAX_BUFF);
-            
-            // Read command from S1
-            ssize_t cmd_len = read(new_sock, buffer, MAX_BUFF);
-            if (cmd_len <= 0) {
-                close(new_sock);
-                exit(0);
-            }
-            
-            buffer[cmd_len] = '\0';
-            printf("S3: Received command: %s\n", buffer);
-            
-            // Parse command
-            char *cmd = strtok(buffer, " \n");
-            
-            if (strcmp(cmd, "uploadf") == 0) {
-                // Parse upload command
-                char *filename = strtok(NULL, " \n");
-                char *dest_path = strtok(NULL, " \n");
-                char local_filename[MAX_BUFF];
-                char local_dest_path[MAX_BUFF];
-                strncpy(local_filename, filename, MAX_BUFF-1);
-                local_filename[MAX_BUFF-1] = '\0';
-                strncpy(local_dest_path, dest_path, MAX_BUFF-1);
-                local_dest_path[MAX_BUFF-1] = '\0';
-                
-                printf("S3: Parsed uploadf command - filename: '%s', dest_path: '%s'\n", 
-                       filename ? filename : "NULL", 
-                       dest_path ? dest_path : "NULL");
-
-                if (!filename || !dest_path) {
-                    printf("S3: Missing filename or dest_path in uploadf command\n");
-                    send(new_sock, "ERR", 3, 0);
-                    close(new_sock);
-                    exit(0);
-                }
-                
-                // Read file size
-                memset(buffer, 0, MAX_BUFF);
-                if (read(new_sock, buffer, MAX_BUFF) <= 0) {
-                    close(new_sock);
-                    exit(0);
-                }
-                
-                off_t file_size = atol(buffer);
-                printf("S3: Expecting file of size: %ld bytes\n", file_size);
-                fflush(stdout);
-
-                // Allocate buffer for file data
-                char *file_data = (char *)malloc(file_size);
-                if (!file_data) {
-                    perror("S3: Memory allocation failed");
-                    send(new_sock, "ERR", 3, 0);
-                    close(new_sock);
-                    exit(0);
-                }
-                
-                // Read file data
-                size_t total_read = 0;
-                ssize_t bytes_read;
-                
-                while (total_read < file_size && 
-                       (bytes_read = recv(new_sock, file_data + total_read, 
-                                          file_size - total_read, 0)) > 0) {
-                    printf("S3: Received %ld bytes in this read\n", bytes_read);
-                    total_read += bytes_read;
-                    printf("S3: Total bytes received: %zu of %ld expected\n", total_read, file_size);
-                }
-                
-                if (total_read == file_size) {
-                    if (file_data) {
-                        printf("S3: file_data pointer is not NULL\n");
-                        if (file_size > 0) {
-                            printf("S3: First few bytes: %02x %02x %02x %02x\n", 
-                                   file_data[0] & 0xff, 
-                                   file_size > 1 ? file_data[1] & 0xff : 0, 
-                                   file_size > 2 ? file_data[2] & 0xff : 0, 
-                                   file_size > 3 ? file_data[3] & 0xff : 0);
-                        }
-                    } else {
-                        printf("S3: WARNING - file_data is NULL!\n");
-                    }
-                    handle_upload(new_sock, local_filename, local_dest_path, file_data, file_size);
-                } else {
-                    send(new_sock, "ERR", 3, 0);
-                }
-                
-                free(file_data);
-            } else if (strcmp(cmd, "getf") == 0) {
-                // Handle file retrieval for S1
-                char *path = strtok(NULL, " \n");
-                if (path) {
-                    char *transformed = transform_path(path);
-                    char *expanded = expand_path(transformed);
-                    send_file_to_s1(new_sock, transformed);
-                }
-            } else if (strcmp(cmd, "removef") == 0) {
-                // Handle file deletion
-                char *path = strtok(NULL, " \n");
-                if (path) {
-                    handle_delete(new_sock, path);
-                }
-            } else if (strcmp(cmd, "gettar") == 0) {
-                // Create and send tar of all TXT files
-                create_txt_tar(new_sock);
-            } else if (strcmp(cmd, "listf") == 0) {
-                // List TXT files in directory
-                char *path = strtok(NULL, " \n");
-                if (path) {
-                    list_txt_files(new_sock, path);
-                }
-            }
-
-            close(new_sock);
-            exit(0);
-        } else if (pid > 0) {
-            close(new_sock); // parent closes connected socket
-            waitpid(-1, NULL, WNOHANG);
-        } else {
-            perror("S3: fork failed");
-            close(new_sock);
-        }
+        // a stalled S1 connection must not pin a worker forever
+        struct timeval read_timeout = { .tv_sec = 30, .tv_usec = 0 };
+        setsockopt(new_sock, SOL_SOCKET, SO_RCVTIMEO, &read_timeout, sizeof(read_timeout));
+        dfs_set_send_buffer(new_sock);
+        dfs_set_nodelay(new_sock);
+
+        // hand the connection to the worker pool
+        pool_submit(new_sock);
     }
 
-    close(serverfd);
     return 0;
 }
@@ -0,0 +1,845 @@
+// dfs_chunk.h - deduplicated storage of uploads on the storage servers
+//
+// with chunking on (-d), an upload is cut into chunks at content-defined
+// boundaries, FastCDC style: a gear hash rolls over the bytes and a chunk
+// ends where its top bits are all zero, with a harder test before the
+// average size and an easier one after it, so sizes cluster around it. an
+// edit only moves the boundaries close to it, and a file that differs from a
+// stored one in a few places shares all its other chunks with it.
+//
+// each chunk is stored once below <root>_chunks (~/S2_chunks for S2), in a
+// file named after its XXH64, its length and a slot. XXH64 is no proof of
+// equal content, so a chunk is compared byte for byte with the stored one
+// before it is shared; one that merely collides goes to the next slot. the
+// uploaded file itself becomes a recipe: its size, the chunks it is made of
+// and a checksum of the recipe. files written without chunking stay as they
+// are, and both kinds are read the same way. a recipe is told apart by the
+// mark the server sets on it (DFS_KIND_XATTR, dfs_pack.h), not by its bytes:
+// an upload stored as it is may look like a recipe, but it never names
+// chunks its uploader could not read or takes references it does not hold.
+// the store is only used on a filesystem that keeps the mark.
+//
+// the store counts the references to every chunk in memory. the startup walk
+// of the inventory (dfs_inventory.h) counts them by reading every recipe;
+// uploads and removes keep them current, and a chunk is deleted when the
+// last recipe using it goes. chunks no recipe refers to after the walk,
+// left behind by a crash, are deleted then.
+//
+// files a server stores packed (dfs_pack.h) are the third kind. the store
+// knows whether there may be any, and DfsContent reads all three alike.
+
+#ifndef DFS_CHUNK_H
+#define DFS_CHUNK_H
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <limits.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <sys/stat.h>
+#include "dfs_proto.h"
+#include "dfs_hash.h"
+#include "dfs_dir.h"
+#include "dfs_pack.h"
+
+#define DFS_CHUNK_MIN (16 * 1024)
+#define DFS_CHUNK_AVG (64 * 1024)
+#define DFS_CHUNK_MAX (256 * 1024)
+#define DFS_CHUNK_MASK_S (~0ULL << (64 - 18))   // before the average size: 1 in 256 KiB
+#define DFS_CHUNK_MASK_L (~0ULL << (64 - 14))   // after it: 1 in 16 KiB
+#define DFS_CHUNK_BUFFER (4 * DFS_CHUNK_MAX)    // upload data waiting to be cut
+#define DFS_CHUNK_NAME_MAX 48                   // "ab/<hash>.<len>.<slot>"
+
+#define DFS_RECIPE_MAGIC "DFSRCP1\n"
+#define DFS_RECIPE_HEADER 24                    // magic, size, chunk count
+#define DFS_RECIPE_ENTRY 16                     // hash, length, slot
+#define DFS_RECIPE_TRAILER 8                    // XXH64 of everything before it
+
+typedef struct {
+    uint64_t hash;
+    uint32_t len;
+    uint32_t slot;          // how many other chunks collided with this hash
+} DfsChunkId;
+
+typedef struct {
+    DfsChunkId id;
+    uint32_t refs;          // 0 marks a free slot of the table
+} DfsChunkRef;
+
+typedef struct {
+    int present;            // the store exists, so files may be recipes
+    int enabled;            // uploads are stored as chunks
+    int counted;            // references are known, chunks may be deleted
+    int count_failed;       // a recipe could not be read while counting
+    int packed;             // files may be packed
+    int pack_level;         // uploads are packed at this level, 0 if not
+    int fd;                 // the store directory
+    unsigned seq;           // makes temp file names unique
+    pthread_mutex_t lock;   // the table
+    DfsChunkRef *refs;      // open addressing, linear probing
+    size_t count;
+    size_t cap;
+    pthread_mutex_t files;  // one file replaced or removed at a time
+    char root[PATH_MAX];
+} DfsChunkStore;
+
+typedef struct {
+    uint64_t size;
+    size_t count;
+    size_t cap;
+    DfsChunkId *ids;
+} DfsRecipe;
+
+static uint64_t dfs_chunk_gear[256];
+
+// same table on every run, or stored chunks would never match again
+static inline void dfs_chunk_gear_init(void) {
+    uint64_t x = 0x6a09e667f3bcc908ULL;
+    for (int i = 0; i < 256; i++) {
+        // splitmix64
+        uint64_t z = (x += 0x9e3779b97f4a7c15ULL);
+        z = (z ^ (z >> 30)) * 0xbf58476d1ce4e5b9ULL;
+        z = (z ^ (z >> 27)) * 0x94d049bb133111ebULL;
+        dfs_chunk_gear[i] = z ^ (z >> 31);
+    }
+}
+
+// length of the chunk at the start of p, n bytes of which are known; n must
+// be at least DFS_CHUNK_MAX unless the data ends there
+static inline size_t dfs_chunk_cut(const unsigned char *p, size_t n) {
+    if (n <= DFS_CHUNK_MIN) return n;
+    size_t normal = n < DFS_CHUNK_AVG ? n : DFS_CHUNK_AVG;
+    size_t max = n < DFS_CHUNK_MAX ? n : DFS_CHUNK_MAX;
+    uint64_t h = 0;
+    size_t i = DFS_CHUNK_MIN;
+    for (; i < normal; i++) {
+        h = (h << 1) + dfs_chunk_gear[p[i]];
+        if (!(h & DFS_CHUNK_MASK_S)) return i + 1;
+    }
+    for (; i < max; i++) {
+        h = (h << 1) + dfs_chunk_gear[p[i]];
+        if (!(h & DFS_CHUNK_MASK_L)) return i + 1;
+    }
+    return max;
+}
+
+static inline void dfs_chunk_name(const DfsChunkId *id, char *name) {
+    snprintf(name, DFS_CHUNK_NAME_MAX, "%02x/%016llx.%x.%x", (unsigned)(id->hash >> 56),
+             (unsigned long long)id->hash, id->len, id->slot);
+}
+
+// the store of the server whose files are under root; with enable, uploads
+// are chunked and the store is created. returns 0, or -1 with errno set
+static inline int dfs_chunk_init(DfsChunkStore *s, const char *root, int enable) {
+    memset(s, 0, sizeof(*s));
+    s->fd = -1;
+    pthread_mutex_init(&s->lock, NULL);
+    pthread_mutex_init(&s->files, NULL);
+    dfs_chunk_gear_init();
+    if (snprintf(s->root, sizeof(s->root), "%s_chunks", root) >= (int)sizeof(s->root)) {
+        errno = ENAMETOOLONG;
+        return -1;
+    }
+    if (enable && mkdir(s->root, 0755) < 0 && errno != EEXIST) return -1;
+    s->fd = open(s->root, O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+    if (s->fd < 0) return errno == ENOENT && !enable ? 0 : -1;
+    if (dfs_kind_probe(s->fd) < 0) return -1;
+    for (int i = 0; i < 256; i++) {
+        char dir[4];
+        snprintf(dir, sizeof(dir), "%02x", i);
+        if (mkdirat(s->fd, dir, 0755) < 0 && errno != EEXIST) return -1;
+    }
+    s->present = 1;
+    s->enabled = enable;
+    return 0;
+}
+
+// whether files of the server under root may be packed: they may once
+// <root>_packed exists. with level, uploads are packed and it is created
+// returns 0, or -1 with errno set
+static inline int dfs_chunk_packing(DfsChunkStore *s, const char *root, int level) {
+    char marker[PATH_MAX];
+    if (snprintf(marker, sizeof(marker), "%s_packed", root) >= (int)sizeof(marker)) {
+        errno = ENAMETOOLONG;
+        return -1;
+    }
+    if (level) {
+        int fd = open(marker, O_WRONLY | O_CREAT | O_CLOEXEC, 0644);
+        if (fd < 0) return -1;
+        int r = dfs_kind_probe(fd);
+        int err = errno;
+        close(fd);
+        errno = err;
+        if (r < 0) return -1;
+    }
+    s->packed = access(marker, F_OK) == 0;
+    s->pack_level = level;
+    return 0;
+}
+
+static inline size_t dfs_chunk_home(size_t cap, const DfsChunkId *id) {
+    return (id->hash ^ id->len ^ (uint64_t)id->slot << 32) & (cap - 1);
+}
+
+// slot of id in a table of cap slots, or the free slot where it would go;
+// the table must have room
+static inline size_t dfs_chunk_find(const DfsChunkRef *refs, size_t cap, const DfsChunkId *id) {
+    size_t i = dfs_chunk_home(cap, id);
+    while (refs[i].refs > 0) {
+        const DfsChunkId *o = &refs[i].id;
+        if (o->hash == id->hash && o->len == id->len && o->slot == id->slot) break;
+        i = (i + 1) & (cap - 1);
+    }
+    return i;
+}
+
+// the slot of id in the store's table, grown first if it is getting full
+// returns NULL when out of memory. called with the lock held
+static inline DfsChunkRef *dfs_chunk_slot(DfsChunkStore *s, const DfsChunkId *id) {
+    if ((s->count + 1) * 10 >= s->cap * 7) {
+        size_t cap = s->cap ? s->cap * 2 : 4096;
+        DfsChunkRef *refs = calloc(cap, sizeof(DfsChunkRef));
+        if (!refs) return NULL;
+        for (size_t i = 0; i < s->cap; i++) {
+            if (s->refs[i].refs > 0) refs[dfs_chunk_find(refs, cap, &s->refs[i].id)] = s->refs[i];
+        }
+        free(s->refs);
+        s->refs = refs;
+        s->cap = cap;
+    }
+    return &s->refs[dfs_chunk_find(s->refs, s->cap, id)];
+}
+
+// add a reference to id; with known set only if the chunk is in the table
+// returns the references it has now, 0 if it was not known, -1 when out of memory
+static inline long dfs_chunk_ref(DfsChunkStore *s, const DfsChunkId *id, int known) {
+    pthread_mutex_lock(&s->lock);
+    long r = -1;
+    DfsChunkRef *ref = dfs_chunk_slot(s, id);
+    if (ref) {
+        if (ref->refs > 0 || !known) {
+            if (ref->refs == 0) {
+                ref->id = *id;
+                s->count++;
+            }
+            r = ++ref->refs;
+        } else {
+            r = 0;
+        }
+    }
+    pthread_mutex_unlock(&s->lock);
+    return r;
+}
+
+// drop a reference; the chunk is deleted with its last one, once the
+// references are known to be complete
+static inline void dfs_chunk_release(DfsChunkStore *s, const DfsChunkId *id) {
+    pthread_mutex_lock(&s->lock);
+    size_t i = s->cap ? dfs_chunk_find(s->refs, s->cap, id) : 0;
+    if (s->cap == 0 || s->refs[i].refs == 0 || --s->refs[i].refs > 0) {
+        pthread_mutex_unlock(&s->lock);
+        return;
+    }
+    if (s->counted) {
+        char name[DFS_CHUNK_NAME_MAX];
+        dfs_chunk_name(id, name);
+        unlinkat(s->fd, name, 0);
+    }
+    // close the gap, so every entry stays reachable from its home slot
+    size_t j = i;
+    while (1) {
+        j = (j + 1) & (s->cap - 1);
+        if (s->refs[j].refs == 0) break;
+        size_t k = dfs_chunk_home(s->cap, &s->refs[j].id);
+        if (i <= j ? (k <= i || k > j) : (k <= i && k > j)) {
+            s->refs[i] = s->refs[j];
+            i = j;
+        }
+    }
+    s->refs[i].refs = 0;
+    s->count--;
+    pthread_mutex_unlock(&s->lock);
+}
+
+// whether the stored chunk id holds data
+static inline int dfs_chunk_same(DfsChunkStore *s, const DfsChunkId *id, const unsigned char *data) {
+    char name[DFS_CHUNK_NAME_MAX];
+    dfs_chunk_name(id, name);
+    int fd = openat(s->fd, name, O_RDONLY | O_CLOEXEC);
+    if (fd < 0) return 0;
+    unsigned char buf[65536];
+    size_t off = 0;
+    while (off < id->len) {
+        size_t want = id->len - off < sizeof(buf) ? id->len - off : sizeof(buf);
+        ssize_t n = pread(fd, buf, want, off);
+        if (n < 0 && errno == EINTR) continue;
+        if (n <= 0 || memcmp(buf, data + off, n) != 0) break;
+        off += n;
+    }
+    close(fd);
+    return off == id->len;
+}
+
+// write(2) all of data to a file; returns 0, or -1 with errno set
+static inline int dfs_chunk_write_all(int fd, const void *data, size_t len) {
+    const char *p = data;
+    while (len > 0) {
+        ssize_t n = write(fd, p, len);
+        if (n < 0 && errno == EINTR) continue;
+        if (n < 0) return -1;
+        if (n == 0) {
+            errno = EIO;
+            return -1;
+        }
+        p += n;
+        len -= n;
+    }
+    return 0;
+}
+
+// write a chunk that is not in the table yet and add it with one reference
+// returns 1, 0 if another upload stored it meanwhile, -1 with errno set
+static inline int dfs_chunk_add(DfsChunkStore *s, const unsigned char *data, const DfsChunkId *id) {
+    char tmp[DFS_CHUNK_NAME_MAX], name[DFS_CHUNK_NAME_MAX];
+    snprintf(tmp, sizeof(tmp), ".tmp-%d-%u", (int)getpid(), __sync_fetch_and_add(&s->seq, 1));
+    dfs_chunk_name(id, name);
+    int fd = openat(s->fd, tmp, O_WRONLY | O_CREAT | O_EXCL | O_CLOEXEC, 0644);
+    int r = fd < 0 ? -1 : dfs_chunk_write_all(fd, data, id->len);
+    if (fd >= 0 && close(fd) < 0) r = -1;
+
+    // the table lock keeps an upload of the same chunk from getting ahead
+    pthread_mutex_lock(&s->lock);
+    DfsChunkRef *ref = r == 0 ? dfs_chunk_slot(s, id) : NULL;
+    int added = 0;
+    if (r == 0 && !ref) {
+        errno = ENOMEM;
+        r = -1;
+    } else if (ref && ref->refs == 0) {
+        r = renameat(s->fd, tmp, s->fd, name);
+        if (r == 0) {
+            ref->id = *id;
+            ref->refs = 1;
+            s->count++;
+            added = 1;
+        }
+    }
+    pthread_mutex_unlock(&s->lock);
+    if (added) return 1;
+    int err = errno;
+    if (fd >= 0) unlinkat(s->fd, tmp, 0);
+    errno = err;
+    return r < 0 ? -1 : 0;
+}
+
+// store a chunk, or take a reference to the same one stored already; *fresh
+// is set when one had to be written. returns 0, or -1 with errno set
+static inline int dfs_chunk_put(DfsChunkStore *s, const unsigned char *data, size_t len, DfsChunkId *id,
+                                int *fresh) {
+    DfsXxh64 h;
+    dfs_xxh64_init(&h);
+    dfs_xxh64_update(&h, data, len);
+    id->hash = dfs_xxh64_digest(&h);
+    id->len = len;
+    id->slot = 0;
+    while (1) {
+        long r = dfs_chunk_ref(s, id, 1);
+        if (r < 0) {
+            errno = ENOMEM;
+            return -1;
+        }
+        if (r == 0) {
+            int added = dfs_chunk_add(s, data, id);
+            if (added < 0) return -1;
+            if (added > 0) {
+                *fresh = 1;
+                return 0;
+            }
+            continue;       // stored by another upload meanwhile
+        }
+        if (dfs_chunk_same(s, id, data)) return 0;
+        dfs_chunk_release(s, id);
+        id->slot++;
+    }
+}
+
+static inline void dfs_recipe_free(DfsRecipe *r) {
+    free(r->ids);
+    memset(r, 0, sizeof(*r));
+}
+
+// returns 0, or -1 when out of memory
+static inline int dfs_recipe_add(DfsRecipe *r, const DfsChunkId *id) {
+    if (r->count == r->cap) {
+        size_t cap = r->cap ? r->cap * 2 : 64;
+        DfsChunkId *grown = realloc(r->ids, cap * sizeof(*grown));
+        if (!grown) return -1;
+        r->ids = grown;
+        r->cap = cap;
+    }
+    r->ids[r->count++] = *id;
+    return 0;
+}
+
+// drop the references of every chunk of a recipe
+static inline void dfs_recipe_release(DfsChunkStore *s, const DfsRecipe *r) {
+    for (size_t i = 0; i < r->count; i++) dfs_chunk_release(s, &r->ids[i]);
+}
+
+// write a recipe to a new file; returns 0, or -1 with errno set
+static inline int dfs_recipe_write(int fd, const DfsRecipe *r) {
+    size_t len = DFS_RECIPE_HEADER + r->count * DFS_RECIPE_ENTRY + DFS_RECIPE_TRAILER;
+    unsigned char *buf = malloc(len);
+    if (!buf) {
+        errno = ENOMEM;
+        return -1;
+    }
+    memcpy(buf, DFS_RECIPE_MAGIC, 8);
+    dfs_put64(buf + 8, r->size);
+    dfs_put64(buf + 16, r->count);
+    unsigned char *p = buf + DFS_RECIPE_HEADER;
+    for (size_t i = 0; i < r->count; i++, p += DFS_RECIPE_ENTRY) {
+        dfs_put64(p, r->ids[i].hash);
+        dfs_put32(p + 8, r->ids[i].len);
+        dfs_put32(p + 12, r->ids[i].slot);
+    }
+    DfsXxh64 h;
+    dfs_xxh64_init(&h);
+    dfs_xxh64_update(&h, buf, p - buf);
+    dfs_put64(p, dfs_xxh64_digest(&h));
+    int written = dfs_chunk_write_all(fd, buf, len);
+    if (written == 0) written = dfs_kind_mark(fd, DFS_KIND_RECIPE);
+    int err = errno;
+    free(buf);
+    errno = err;
+    return written;
+}
+
+// read the recipe an open file holds, if the store exists and the server
+// wrote it as one. returns 1 with the recipe, 0 for a plain file, -1 with errno set
+static inline int dfs_recipe_read(const DfsChunkStore *s, int fd, DfsRecipe *r) {
+    memset(r, 0, sizeof(*r));
+    if (!s || !s->present) return 0;
+    struct stat st;
+    unsigned char head[DFS_RECIPE_HEADER];
+    if (fstat(fd, &st) < 0) return -1;
+    if (!S_ISREG(st.st_mode) || st.st_size < DFS_RECIPE_HEADER + DFS_RECIPE_TRAILER) return 0;
+    int marked = dfs_kind_is(fd, DFS_KIND_RECIPE);
+    if (marked <= 0) return marked;
+    ssize_t n = pread(fd, head, sizeof(head), 0);
+    if (n < 0) return -1;
+    if (n < (ssize_t)sizeof(head) || memcmp(head, DFS_RECIPE_MAGIC, 8) != 0) return 0;
+    uint64_t count = dfs_get64(head + 16);
+    if (count > (uint64_t)st.st_size / DFS_RECIPE_ENTRY ||
+        DFS_RECIPE_HEADER + count * DFS_RECIPE_ENTRY + DFS_RECIPE_TRAILER != (uint64_t)st.st_size) {
+        return 0;
+    }
+
+    unsigned char *buf = malloc(st.st_size);
+    if (!buf) {
+        errno = ENOMEM;
+        return -1;
+    }
+    size_t got = 0;
+    while (got < (size_t)st.st_size) {
+        n = pread(fd, buf + got, st.st_size - got, got);
+        if (n < 0 && errno == EINTR) continue;
+        if (n <= 0) break;
+        got += n;
+    }
+    DfsXxh64 h;
+    dfs_xxh64_init(&h);
+    dfs_xxh64_update(&h, buf, st.st_size - DFS_RECIPE_TRAILER);
+    uint64_t sum = 0;
+    int ok = got == (size_t)st.st_size && dfs_get64(buf + got - DFS_RECIPE_TRAILER) == dfs_xxh64_digest(&h);
+    r->ids = ok ? malloc(count ? count * sizeof(DfsChunkId) : 1) : NULL;
+    if (ok && !r->ids) {
+        free(buf);
+        errno = ENOMEM;
+        return -1;
+    }
+    for (size_t i = 0; ok && i < count; i++) {
+        const unsigned char *p = buf + DFS_RECIPE_HEADER + i * DFS_RECIPE_ENTRY;
+        r->ids[i].hash = dfs_get64(p);
+        r->ids[i].len = dfs_get32(p + 8);
+        r->ids[i].slot = dfs_get32(p + 12);
+        sum += r->ids[i].len;
+    }
+    free(buf);
+    if (!ok || sum != dfs_get64(head + 8)) {
+        dfs_recipe_free(r);
+        return 0;
+    }
+    r->size = sum;
+    r->count = r->cap = count;
+    return 1;
+}
+
+// read size bytes of upload payload into the store, cut into chunks listed
+// in r; new chunks are on disk when it returns. returns 0, 1 if the store
+// could not take them (the payload is still read, so the stream stays in
+// step), -1 if the stream failed. a failed upload keeps no references
+static inline int dfs_chunk_recv(DfsChunkStore *s, DfsReader *rd, uint64_t size, DfsRecipe *r) {
+    memset(r, 0, sizeof(*r));
+    r->size = size;
+    unsigned char *buf = malloc(DFS_CHUNK_BUFFER);
+    if (!buf) return dfs_skip(rd, size) == 0 ? 1 : -1;
+
+    size_t start = 0, end = 0;
+    int failed = 0, fresh = 0;
+    while (size > 0 || end > start) {
+        // keep a maximal chunk ahead, so every cut but the last one is a real one
+        if (size > 0 && end - start < DFS_CHUNK_MAX) {
+            if (DFS_CHUNK_BUFFER - end < DFS_CHUNK_MAX) {
+                memmove(buf, buf + start, end - start);
+                end -= start;
+                start = 0;
+            }
+            size_t want = DFS_CHUNK_BUFFER - end < size ? DFS_CHUNK_BUFFER - end : size;
+            ssize_t got = dfs_reader_read(rd, buf + end, want);
+            if (got <= 0) {
+                failed = -1;
+                break;
+            }
+            end += got;
+            size -= got;
+            continue;
+        }
+        size_t n = dfs_chunk_cut(buf + start, end - start);
+        DfsChunkId id;
+        if (!failed) {
+            if (dfs_chunk_put(s, buf + start, n, &id, &fresh) < 0) {
+                failed = 1;
+            } else if (dfs_recipe_add(r, &id) < 0) {
+                dfs_chunk_release(s, &id);
+                failed = 1;
+            }
+        }
+        start += n;
+    }
+    free(buf);
+
+    // one flush of the filesystem for all new chunks, instead of an fsync each
+    if (!failed && fresh && syncfs(s->fd) < 0) failed = 1;
+    if (failed) {
+        dfs_recipe_release(s, r);
+        dfs_recipe_free(r);
+    }
+    return failed;
+}
+
+// send the content of a recipe, up to *left bytes of it, to a blocking
+// socket. *left stays above 0 if a chunk is missing or short
+// returns 0, or -1 if the socket failed
+static inline int dfs_chunk_send_part(const DfsChunkStore *s, int sock, const DfsRecipe *r, uint64_t *left) {
+    for (size_t i = 0; i < r->count && *left > 0; i++) {
+        char name[DFS_CHUNK_NAME_MAX];
+        dfs_chunk_name(&r->ids[i], name);
+        int fd = openat(s->fd, name, O_RDONLY | O_CLOEXEC);
+        if (fd < 0) return 0;
+        uint64_t want = r->ids[i].len < *left ? r->ids[i].len : *left;
+        uint64_t chunk_left = want;
+        int sent = dfs_send_file_part(sock, fd, &chunk_left);
+        close(fd);
+        *left -= want - chunk_left;
+        if (sent < 0) return -1;
+        if (chunk_left > 0) return 0;
+    }
+    return 0;
+}
+
+// cut the plain content of a file, size bytes of it, into chunks and replace
+// it with the recipe for them; for content that did not arrive as an upload
+// returns 0, or -1 with errno set. a failure keeps no references
+static inline int dfs_chunk_file(DfsChunkStore *s, int fd, uint64_t size, DfsRecipe *r) {
+    DfsReader *rd = malloc(sizeof(DfsReader));
+    if (!rd) {
+        errno = ENOMEM;
+        return -1;
+    }
+    int failed = lseek(fd, 0, SEEK_SET) < 0;
+    if (!failed) {
+        dfs_reader_init(rd, fd);
+        errno = EIO;
+        failed = dfs_chunk_recv(s, rd, size, r) != 0;
+    } else {
+        memset(r, 0, sizeof(*r));
+    }
+    free(rd);
+    if (failed) return -1;
+    if (ftruncate(fd, 0) < 0 || lseek(fd, 0, SEEK_SET) < 0 || dfs_recipe_write(fd, r) < 0) {
+        int err = errno;
+        dfs_recipe_release(s, r);
+        dfs_recipe_free(r);
+        errno = err;
+        return -1;
+    }
+    return 0;
+}
+
+// a stored file's content, read at any offset: a plain file, the chunks
+// of a recipe, or the frames of a packed file
+typedef struct {
+    const DfsChunkStore *s;
+    int fd;
+    int chunked;
+    DfsRecipe r;
+    int packed;
+    DfsPack pack;
+    uint64_t size;
+    uint64_t *starts;       // offset of each chunk in the content
+    size_t cur;             // chunk open as cur_fd
+    int cur_fd;
+} DfsContent;
+
+static inline void dfs_content_close(DfsContent *c) {
+    if (c->fd >= 0) close(c->fd);
+    if (c->cur_fd >= 0) close(c->cur_fd);
+    free(c->starts);
+    dfs_recipe_free(&c->r);
+    dfs_pack_close(&c->pack);
+    c->fd = c->cur_fd = -1;
+    c->starts = NULL;
+}
+
+// returns 0, or -1 with errno set
+static inline int dfs_content_open(const DfsChunkStore *s, const char *path, DfsContent *c) {
+    memset(c, 0, sizeof(*c));
+    c->s = s;
+    c->cur_fd = -1;
+    c->fd = open(path, O_RDONLY | O_CLOEXEC);
+    struct stat st;
+    if (c->fd < 0) return -1;
+    if (fstat(c->fd, &st) < 0 || (c->chunked = dfs_recipe_read(s, c->fd, &c->r)) < 0 ||
+        (!c->chunked && s && s->packed && (c->packed = dfs_pack_open(c->fd, &c->pack)) < 0)) {
+        int err = errno;
+        dfs_content_close(c);
+        errno = err;
+        return -1;
+    }
+    c->size = c->chunked ? c->r.size : c->packed ? c->pack.size : (uint64_t)st.st_size;
+    if (c->chunked) {
+        c->starts = malloc((c->r.count + 1) * sizeof(uint64_t));
+        if (!c->starts) {
+            dfs_content_close(c);
+            errno = ENOMEM;
+            return -1;
+        }
+        c->starts[0] = 0;
+        for (size_t i = 0; i < c->r.count; i++) c->starts[i + 1] = c->starts[i] + c->r.ids[i].len;
+    }
+    return 0;
+}
+
+// read up to n bytes at off, within one chunk or frame; returns the bytes
+// read, 0 at the end of the content (or of a short chunk), -1 with errno set
+static inline ssize_t dfs_content_pread(DfsContent *c, void *buf, size_t n, uint64_t off) {
+    if (c->packed) return dfs_pack_pread(c->fd, &c->pack, buf, n, off);
+    if (!c->chunked) return pread(c->fd, buf, n, off);
+    if (off >= c->size) return 0;
+    size_t lo = 0, hi = c->r.count;
+    while (hi - lo > 1) {
+        size_t mid = lo + (hi - lo) / 2;
+        if (c->starts[mid] <= off) lo = mid;
+        else hi = mid;
+    }
+    if (c->cur_fd < 0 || c->cur != lo) {
+        if (c->cur_fd >= 0) close(c->cur_fd);
+        char name[DFS_CHUNK_NAME_MAX];
+        dfs_chunk_name(&c->r.ids[lo], name);
+        c->cur_fd = openat(c->s->fd, name, O_RDONLY | O_CLOEXEC);
+        if (c->cur_fd < 0) return -1;
+        c->cur = lo;
+    }
+    uint64_t in = off - c->starts[lo];
+    if (n > c->r.ids[lo].len - in) n = c->r.ids[lo].len - in;
+    return pread(c->cur_fd, buf, n, in);
+}
+
+// read n bytes at off, fewer only at the end; returns the bytes read, -1 with errno set
+static inline ssize_t dfs_content_read(DfsContent *c, void *buf, size_t n, uint64_t off) {
+    size_t got = 0;
+    while (got < n) {
+        ssize_t r = dfs_content_pread(c, (char *)buf + got, n - got, off + got);
+        if (r < 0 && errno == EINTR) continue;
+        if (r < 0) return -1;
+        if (r == 0) break;
+        got += r;
+    }
+    return got;
+}
+
+// SHA-256 of the content, kept with the stored file: a recipe or packed
+// file is hashed as the content it stands for. returns 0, or -1 with errno set
+static inline int dfs_content_sha256(DfsContent *c, unsigned char *out) {
+    if (!c->chunked && !c->packed) return dfs_sha256_file(c->fd, out);
+    if (dfs_sha256_cached(c->fd, out)) return 0;
+    unsigned char *buf = malloc(DFS_CHUNK_MAX);
+    if (!buf) {
+        errno = ENOMEM;
+        return -1;
+    }
+    DfsSha256 s;
+    dfs_sha256_init(&s);
+    ssize_t n = 0;
+    for (uint64_t off = 0; off < c->size; off += n) {
+        n = dfs_content_read(c, buf, DFS_CHUNK_MAX, off);
+        if (n <= 0) break;
+        dfs_sha256_update(&s, buf, n);
+    }
+    free(buf);
+    if (n <= 0 && c->size > 0) {
+        if (n == 0) errno = EIO;    // a chunk is missing or short
+        return -1;
+    }
+    dfs_sha256_final(&s, out);
+    dfs_sha256_keep(c->fd, out);
+    return 0;
+}
+
+// send len bytes of the content from off, for a range download. a plain
+// file goes out with sendfile, chunks and frames are read and sent
+// returns 0, or -1 if the socket failed or the content ended early
+static inline int dfs_content_send(int sock, DfsContent *c, uint64_t off, uint64_t len) {
+    if (!c->chunked && !c->packed) {
+        if (lseek(c->fd, off, SEEK_SET) < 0) return -1;
+        return dfs_send_file(sock, c->fd, len);
+    }
+    char buf[DFS_READER_SIZE];
+    while (len > 0) {
+        ssize_t n = dfs_content_read(c, buf, len < sizeof(buf) ? len : sizeof(buf), off);
+        if (n <= 0) return -1;
+        if (dfs_send_all(sock, buf, n, (uint64_t)n < len ? MSG_MORE : 0) < 0) return -1;
+        off += n;
+        len -= n;
+    }
+    return 0;
+}
+
+// rename(2) a new version of a file into place; the chunks of the version it
+// replaces are released. returns 0, or -1 with errno set
+static inline int dfs_chunk_replace(DfsChunkStore *s, const char *from, const char *to) {
+    if (!s->present) return rename(from, to);
+    DfsRecipe old;
+    memset(&old, 0, sizeof(old));
+    // one at a time, or two of them could both release the same old version
+    pthread_mutex_lock(&s->files);
+    int fd = open(to, O_RDONLY | O_CLOEXEC | O_NOFOLLOW | O_NONBLOCK);
+    int r = fd < 0 ? 0 : dfs_recipe_read(s, fd, &old);
+    if (fd >= 0) close(fd);
+    if (r >= 0) r = rename(from, to);
+    pthread_mutex_unlock(&s->files);
+    if (r == 0) dfs_recipe_release(s, &old);
+    dfs_recipe_free(&old);
+    return r;
+}
+
+// unlink(2) a file, releasing its chunks; returns 0, or -1 with errno set
+static inline int dfs_chunk_unlink(DfsChunkStore *s, const char *path) {
+    if (!s->present) return unlink(path);
+    DfsRecipe old;
+    memset(&old, 0, sizeof(old));
+    pthread_mutex_lock(&s->files);
+    int fd = open(path, O_RDONLY | O_CLOEXEC | O_NOFOLLOW | O_NONBLOCK);
+    int r = fd < 0 ? 0 : dfs_recipe_read(s, fd, &old);
+    if (fd >= 0) close(fd);
+    if (r >= 0) r = unlink(path);
+    pthread_mutex_unlock(&s->files);
+    if (r == 0) dfs_recipe_release(s, &old);
+    dfs_recipe_free(&old);
+    return r;
+}
+
+// link(2) a file to a new name, for an upload of content the server has; a
+// recipe's chunks gain the references of the new name. *size is the size of
+// the content, packed or not. returns 0, or -1 with errno set
+static inline int dfs_chunk_link(DfsChunkStore *s, const char *from, const char *to, uint64_t *size) {
+    DfsRecipe r;
+    memset(&r, 0, sizeof(r));
+    // the file read is the one linked, whatever replaces its name meanwhile
+    pthread_mutex_lock(&s->files);
+    int fd = open(from, O_RDONLY | O_CLOEXEC | O_NOFOLLOW | O_NONBLOCK);
+    struct stat st;
+    int chunked = -1;
+    int packed = 0;
+    DfsPack pack;
+    memset(&pack, 0, sizeof(pack));
+    if (fd >= 0 && fstat(fd, &st) == 0) {
+        if (S_ISREG(st.st_mode)) chunked = dfs_recipe_read(s, fd, &r);
+        else errno = ENOENT;
+        if (chunked == 0 && s->packed && (packed = dfs_pack_open(fd, &pack)) < 0) chunked = -1;
+    }
+    size_t refs = 0;
+    while (chunked > 0 && refs < r.count && dfs_chunk_ref(s, &r.ids[refs], 1) > 0) refs++;
+    int ret = -1;
+    if (chunked == 0 || (chunked > 0 && refs == r.count)) {
+        char proc[32];
+        snprintf(proc, sizeof(proc), "/proc/self/fd/%d", fd);
+        ret = linkat(AT_FDCWD, proc, AT_FDCWD, to, AT_SYMLINK_FOLLOW);
+    } else if (chunked > 0) {
+        errno = EIO;    // a chunk of the recipe is gone
+    }
+    int err = errno;
+    if (fd >= 0) close(fd);
+    pthread_mutex_unlock(&s->files);
+    if (ret < 0) {
+        for (size_t i = 0; i < refs; i++) dfs_chunk_release(s, &r.ids[i]);
+    } else {
+        *size = chunked ? r.size : packed ? pack.size : (uint64_t)st.st_size;
+    }
+    dfs_recipe_free(&r);
+    dfs_pack_close(&pack);
+    errno = err;
+    return ret;
+}
+
+// count the references of a recipe found by the startup walk
+// returns 0, or -1 when out of memory
+static inline int dfs_chunk_count(DfsChunkStore *s, const DfsRecipe *r) {
+    for (size_t i = 0; i < r->count; i++) {
+        if (dfs_chunk_ref(s, &r->ids[i], 0) < 0) return -1;
+    }
+    return 0;
+}
+
+// after the references were counted: delete the chunks nothing refers to
+// and the temp files of uploads that broke off. returns the number deleted
+static inline size_t dfs_chunk_sweep(DfsChunkStore *s) {
+    size_t deleted = 0;
+    if (!s->present || s->count_failed) return 0;
+    for (int i = 0; i < 256; i++) {
+        char dir[4];
+        snprintf(dir, sizeof(dir), "%02x", i);
+        DfsDir d;
+        if (dfs_dir_openat(&d, s->fd, dir) < 0) continue;
+        const char *name;
+        unsigned char type;
+        while ((name = dfs_dir_next(&d, &type)) != NULL) {
+            unsigned long long hash;
+            unsigned len, slot;
+            int end = 0;
+            if (sscanf(name, "%16llx.%x.%x%n", &hash, &len, &slot, &end) != 3 || name[end]) continue;
+            DfsChunkId id = { .hash = hash, .len = len, .slot = slot };
+            pthread_mutex_lock(&s->lock);
+            int used = s->cap && s->refs[dfs_chunk_find(s->refs, s->cap, &id)].refs > 0;
+            pthread_mutex_unlock(&s->lock);
+            if (!used && unlinkat(d.fd, name, 0) == 0) deleted++;
+        }
+        dfs_dir_close(&d);
+    }
+    DfsDir d;
+    if (dfs_dir_openat(&d, s->fd, ".") == 0) {
+        const char *name;
+        unsigned char type;
+        while ((name = dfs_dir_next(&d, &type)) != NULL) {
+            if (strncmp(name, ".tmp-", 5) == 0) unlinkat(d.fd, name, 0);
+        }
+        dfs_dir_close(&d);
+    }
+    s->counted = 1;
+    return deleted;
+}
+
+#endif
@@ -0,0 +1,240 @@
+// dfs_delta.h - delta uploads: a new version of a stored file sent as its
+// changes, rsync style
+//
+// SIGS asks for the signatures of the stored version. it is cut into blocks
+// and each block gets a weak checksum that rolls (rsync's: the sum of the
+// bytes and the sum of those sums, 16 bits each) and a strong one (XXH64).
+// the client rolls the weak checksum over its own file a byte at a time;
+// where it matches a block and the strong one agrees, that block is reused.
+// a PATCH then carries copies of stored blocks and, literally, the bytes in
+// between. its header has the size and XXH64 of the new version, and the
+// server checks what it built against them: a stored version that changed
+// after its signatures were sent fails the patch with DFS_E_MISSING instead
+// of turning into a corrupt file.
+//
+// signatures: 8 byte block size, 8 byte size of the stored version, then a
+// 4 byte weak and an 8 byte strong checksum per block; the last block may be
+// short. patch: 8 byte size, 8 byte XXH64, 8 byte block size, then records
+//   'C', 8 byte first block, 8 byte block count     blocks of the stored version
+//   'L', 8 byte length, that many bytes             literal data
+// integers are big-endian, like the rest of the protocol.
+
+#ifndef DFS_DELTA_H
+#define DFS_DELTA_H
+
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include "dfs_proto.h"
+#include "dfs_hash.h"
+#include "dfs_chunk.h"
+
+#define DFS_DELTA_HEADER 24             // of the signatures (16 bytes used) and of a patch
+#define DFS_DELTA_SIG 12                // weak and strong checksum of one block
+#define DFS_DELTA_BLOCK_MIN 1024
+#define DFS_DELTA_BLOCK_MAX (128 * 1024)
+#define DFS_DELTA_OP_COPY 'C'
+#define DFS_DELTA_OP_LITERAL 'L'
+#define DFS_DELTA_COPY 17               // length of a copy record
+#define DFS_DELTA_LITERAL 9             // and of a literal's, before its bytes
+#define DFS_DELTA_BUFFER (1 << 20)      // bytes a server moves per read and write
+
+typedef struct {
+    uint64_t size;          // of the new version
+    uint64_t checksum;      // its XXH64
+    uint64_t block;
+} DfsPatch;
+
+typedef struct {
+    int type;               // DFS_DELTA_OP_*
+    uint64_t a;             // first block, or literal length
+    uint64_t b;             // block count
+} DfsDeltaOp;
+
+// rolling weak checksum of a window of len bytes
+typedef struct {
+    uint32_t a;
+    uint32_t b;
+    uint32_t len;
+} DfsWeak;
+
+// blocks of about the square root of the size balance the signatures sent
+// against the bytes a changed block costs
+static inline uint64_t dfs_delta_block_size(uint64_t size) {
+    uint64_t block = DFS_DELTA_BLOCK_MIN;
+    while (block < DFS_DELTA_BLOCK_MAX && block * block < size) block *= 2;
+    return block;
+}
+
+static inline uint64_t dfs_delta_blocks(uint64_t size, uint64_t block) {
+    return (size + block - 1) / block;
+}
+
+static inline void dfs_weak_init(DfsWeak *w, const unsigned char *p, size_t n) {
+    w->a = w->b = 0;
+    w->len = n;
+    for (size_t i = 0; i < n; i++) {
+        w->a += p[i];
+        w->b += w->a;
+    }
+}
+
+// slide the window one byte: out leaves it, in enters it
+static inline void dfs_weak_roll(DfsWeak *w, unsigned char out, unsigned char in) {
+    w->a += in - out;
+    w->b += w->a - w->len * out;
+}
+
+static inline uint32_t dfs_weak_value(const DfsWeak *w) {
+    return (w->a & 0xffff) | (w->b << 16);
+}
+
+static inline uint64_t dfs_delta_strong(const void *p, size_t n) {
+    DfsXxh64 h;
+    dfs_xxh64_init(&h);
+    dfs_xxh64_update(&h, p, n);
+    return dfs_xxh64_digest(&h);
+}
+
+// signature of one block into out, DFS_DELTA_SIG bytes
+static inline void dfs_delta_sign(unsigned char *out, const unsigned char *block, size_t n) {
+    DfsWeak w;
+    dfs_weak_init(&w, block, n);
+    dfs_put32(out, dfs_weak_value(&w));
+    dfs_put64(out + 4, dfs_delta_strong(block, n));
+}
+
+// header of a patch; returns 0, or -1 if its block size is out of range
+static inline int dfs_patch_parse(const unsigned char *p, DfsPatch *patch) {
+    patch->size = dfs_get64(p);
+    patch->checksum = dfs_get64(p + 8);
+    patch->block = dfs_get64(p + 16);
+    return patch->block >= 1 && patch->block <= DFS_DELTA_BLOCK_MAX ? 0 : -1;
+}
+
+// decode the record at p, avail bytes of which are at hand
+// returns the length of its header, 0 if more bytes are needed, -1 if it is malformed
+static inline int dfs_delta_op(const unsigned char *p, size_t avail, DfsDeltaOp *op) {
+    if (avail == 0) return 0;
+    int len = p[0] == DFS_DELTA_OP_COPY ? DFS_DELTA_COPY : p[0] == DFS_DELTA_OP_LITERAL ? DFS_DELTA_LITERAL : -1;
+    if (len < 0) return -1;
+    if (avail < (size_t)len) return 0;
+    op->type = p[0];
+    op->a = dfs_get64(p + 1);
+    op->b = op->type == DFS_DELTA_OP_COPY ? dfs_get64(p + 9) : 0;
+    return len;
+}
+
+// the bytes of the stored version a copy record stands for
+// returns 0, or -1 if it reaches past its end
+static inline int dfs_delta_copy_range(const DfsDeltaOp *op, uint64_t block, uint64_t base_size,
+                                       uint64_t *off, uint64_t *len) {
+    uint64_t blocks = dfs_delta_blocks(base_size, block);
+    if (op->b == 0 || op->a >= blocks || op->b > blocks - op->a) return -1;
+    *off = op->a * block;
+    *len = op->b * block < base_size - *off ? op->b * block : base_size - *off;
+    return 0;
+}
+
+// write(2) a piece of the new version and hash it; a failed disk sets *status
+static inline void dfs_delta_put(int fd, const void *data, size_t n, DfsXxh64 *h, int *status) {
+    dfs_xxh64_update(h, data, n);
+    if (*status == DFS_OK && dfs_chunk_write_all(fd, data, n) < 0) *status = DFS_E_IO;
+}
+
+// the signatures of a stored version as the reply to req
+// returns 0, or -1 if the socket failed
+static inline int dfs_delta_send_sigs(int sock, const DfsHeader *req, DfsContent *base) {
+    uint64_t block = dfs_delta_block_size(base->size);
+    uint64_t blocks = dfs_delta_blocks(base->size, block);
+    size_t len = DFS_DELTA_HEADER - 8 + blocks * DFS_DELTA_SIG;
+    unsigned char *sigs = malloc(len);
+    unsigned char *buf = malloc(block);
+    int status = sigs && buf ? DFS_OK : DFS_E_IO;
+    for (uint64_t i = 0; status == DFS_OK && i < blocks; i++) {
+        uint64_t n = base->size - i * block < block ? base->size - i * block : block;
+        if (dfs_content_read(base, buf, n, i * block) != (ssize_t)n) status = DFS_E_IO;
+        else dfs_delta_sign(sigs + DFS_DELTA_HEADER - 8 + i * DFS_DELTA_SIG, buf, n);
+    }
+    free(buf);
+    int r;
+    if (status != DFS_OK) {
+        r = dfs_send_reply(sock, req, status, NULL, 0);
+    } else {
+        dfs_put64(sigs, block);
+        dfs_put64(sigs + 8, base->size);
+        r = dfs_send_header(sock, req->opcode, DFS_F_REPLY, DFS_OK, req->request_id, NULL, len) < 0 ? -1
+            : dfs_send_all(sock, sigs, len, 0);
+    }
+    free(sigs);
+    return r;
+}
+
+// build the new version of a patch into out_fd from the records, left bytes
+// of payload, and the stored version base. the whole payload is read
+// whatever happens, so the stream stays in step
+// returns DFS_OK, a DFS_E_* status, or -1 if the stream failed
+static inline int dfs_delta_apply(DfsReader *rd, uint64_t left, const DfsPatch *patch, DfsContent *base, int out_fd) {
+    unsigned char *buf = malloc(DFS_DELTA_BUFFER);
+    if (!buf) return dfs_skip(rd, left) == 0 ? DFS_E_IO : -1;
+
+    DfsXxh64 h;
+    dfs_xxh64_init(&h);
+    uint64_t written = 0;
+    int status = DFS_OK;
+    while (left > 0) {
+        unsigned char head[DFS_DELTA_COPY];
+        DfsDeltaOp op;
+        if (dfs_read_full(rd, head, 1) < 0) break;
+        left--;
+        uint64_t rest = head[0] == DFS_DELTA_OP_COPY ? DFS_DELTA_COPY - 1 : DFS_DELTA_LITERAL - 1;
+        int n = -1;
+        if ((head[0] == DFS_DELTA_OP_COPY || head[0] == DFS_DELTA_OP_LITERAL) && rest <= left) {
+            if (dfs_read_full(rd, head + 1, rest) < 0) break;
+            left -= rest;
+            n = dfs_delta_op(head, rest + 1, &op);
+        }
+        if (n <= 0 || (op.type == DFS_DELTA_OP_LITERAL && op.a > left)) {
+            // nothing after a malformed record can be parsed
+            status = DFS_E_INVALID;
+            break;
+        }
+
+        if (op.type == DFS_DELTA_OP_LITERAL) {
+            for (uint64_t todo = op.a; todo > 0; ) {
+                size_t want = todo < DFS_DELTA_BUFFER ? todo : DFS_DELTA_BUFFER;
+                if (dfs_read_full(rd, buf, want) < 0) {
+                    free(buf);
+                    return -1;
+                }
+                dfs_delta_put(out_fd, buf, want, &h, &status);
+                todo -= want;
+                left -= want;
+                written += want;
+            }
+            continue;
+        }
+        uint64_t off, todo;
+        if (dfs_delta_copy_range(&op, patch->block, base->size, &off, &todo) < 0) {
+            // blocks the stored version does not have: it is not the one the patch is for
+            if (status == DFS_OK) status = DFS_E_MISSING;
+            continue;
+        }
+        while (todo > 0 && status == DFS_OK) {
+            size_t want = todo < DFS_DELTA_BUFFER ? todo : DFS_DELTA_BUFFER;
+            if (dfs_content_read(base, buf, want, off) != (ssize_t)want) status = DFS_E_IO;
+            else dfs_delta_put(out_fd, buf, want, &h, &status);
+            off += want;
+            todo -= want;
+            written += want;
+        }
+    }
+    free(buf);
+    if (left > 0 && (status != DFS_E_INVALID || dfs_skip(rd, left) < 0)) return -1;
+    if (status == DFS_OK && (written != patch->size || dfs_xxh64_digest(&h) != patch->checksum)) {
+        status = DFS_E_MISSING;
+    }
+    return status;
+}
+
+#endif
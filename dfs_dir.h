@@ -0,0 +1,79 @@
+// dfs_dir.h - directories read in one pass with large getdents64 buffers
+//
+// readdir() fetches 32 KiB of entries per system call. a DfsDir asks the
+// kernel for DFS_DIR_BUFFER bytes at a time, so a directory of 100k entries
+// is read in a handful of calls, and each name and type is handed out
+// straight from the buffer. "." and ".." are skipped.
+//
+// metadata is looked up with statx() asking only for the fields a caller
+// needs, relative to the directory's descriptor so no path is resolved again.
+
+#ifndef DFS_DIR_H
+#define DFS_DIR_H
+
+#include <stdlib.h>
+#include <string.h>
+#include <dirent.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/stat.h>
+
+#define DFS_DIR_BUFFER (256 * 1024)
+
+typedef struct {
+    int fd;
+    char *buf;
+    size_t len;             // bytes of entries in buf
+    size_t off;             // next entry
+} DfsDir;
+
+// returns 0, or -1 with errno set
+static inline int dfs_dir_openat(DfsDir *d, int at, const char *path) {
+    d->len = d->off = 0;
+    d->fd = openat(at, path, O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+    if (d->fd < 0) return -1;
+    d->buf = malloc(DFS_DIR_BUFFER);
+    if (!d->buf) {
+        close(d->fd);
+        d->fd = -1;
+        return -1;
+    }
+    return 0;
+}
+
+static inline int dfs_dir_open(DfsDir *d, const char *path) {
+    return dfs_dir_openat(d, AT_FDCWD, path);
+}
+
+static inline void dfs_dir_close(DfsDir *d) {
+    if (d->fd >= 0) close(d->fd);
+    free(d->buf);
+    d->fd = -1;
+    d->buf = NULL;
+}
+
+// next entry's name, its d_type in *type (DT_UNKNOWN where the filesystem
+// does not tell); NULL at the end of the directory or if reading it failed
+static inline const char *dfs_dir_next(DfsDir *d, unsigned char *type) {
+    while (1) {
+        if (d->off >= d->len) {
+            ssize_t n = getdents64(d->fd, d->buf, DFS_DIR_BUFFER);
+            if (n <= 0) return NULL;
+            d->len = n;
+            d->off = 0;
+        }
+        struct dirent64 *e = (struct dirent64 *)(d->buf + d->off);
+        d->off += e->d_reclen;
+        const char *name = e->d_name;
+        if (name[0] == '.' && (!name[1] || (name[1] == '.' && !name[2]))) continue;
+        *type = e->d_type;
+        return name;
+    }
+}
+
+// type, size and mtime of an entry, symlinks not followed; returns 0 or -1
+static inline int dfs_dir_stat(const DfsDir *d, const char *name, struct statx *stx) {
+    return statx(d->fd, name, AT_SYMLINK_NOFOLLOW, STATX_TYPE | STATX_SIZE | STATX_MTIME, stx);
+}
+
+#endif
@@ -0,0 +1,345 @@
+// dfs_hash.h - content checksums, shared by S1 and the storage servers
+//
+// XXH64 (seed 0), computed incrementally as file data streams past, so a
+// checksum costs no extra pass over the file. it catches corruption, it is
+// not meant to stand up to someone forging content.
+//
+// SHA-256 is for when it has to: an upload by hash (DFS_F_HASH) only takes
+// stored content for the client's if their SHA-256 digests match. a stored
+// file's digest is computed when it is first asked for and kept in an
+// extended attribute of the file, along with the size and mtime it was
+// computed for, so a file is hashed once however often it is claimed.
+// x86-64 processors with the SHA extensions hash with them, several times
+// faster than the portable rounds.
+
+#ifndef DFS_HASH_H
+#define DFS_HASH_H
+
+#include <stdint.h>
+#include <string.h>
+#include <errno.h>
+#include <unistd.h>
+#include <sys/stat.h>
+#include <sys/xattr.h>
+#if defined(__x86_64__)
+#include <cpuid.h>
+#include <immintrin.h>
+#endif
+
+#define DFS_XXH_P1 11400714785074694791ULL
+#define DFS_XXH_P2 14029467366897019727ULL
+#define DFS_XXH_P3 1609587929392839161ULL
+#define DFS_XXH_P4 9650029242287828579ULL
+#define DFS_XXH_P5 2870177450012600261ULL
+
+typedef struct {
+    uint64_t v[4];          // the four lanes, fed 32 bytes at a time
+    uint64_t total;         // bytes hashed so far
+    unsigned char buf[32];  // input that does not fill a stripe yet
+    size_t buf_len;
+} DfsXxh64;
+
+static inline uint64_t dfs_xxh_rotl(uint64_t x, int r) {
+    return (x << r) | (x >> (64 - r));
+}
+
+// little-endian loads, whatever the host
+static inline uint64_t dfs_xxh_read64(const unsigned char *p) {
+    return (uint64_t)p[0] | (uint64_t)p[1] << 8 | (uint64_t)p[2] << 16 | (uint64_t)p[3] << 24 |
+           (uint64_t)p[4] << 32 | (uint64_t)p[5] << 40 | (uint64_t)p[6] << 48 | (uint64_t)p[7] << 56;
+}
+
+static inline uint32_t dfs_xxh_read32(const unsigned char *p) {
+    return (uint32_t)p[0] | (uint32_t)p[1] << 8 | (uint32_t)p[2] << 16 | (uint32_t)p[3] << 24;
+}
+
+static inline uint64_t dfs_xxh_round(uint64_t acc, uint64_t input) {
+    acc += input * DFS_XXH_P2;
+    acc = dfs_xxh_rotl(acc, 31);
+    return acc * DFS_XXH_P1;
+}
+
+static inline uint64_t dfs_xxh_merge(uint64_t acc, uint64_t v) {
+    acc ^= dfs_xxh_round(0, v);
+    return acc * DFS_XXH_P1 + DFS_XXH_P4;
+}
+
+static inline void dfs_xxh64_init(DfsXxh64 *s) {
+    memset(s, 0, sizeof(*s));
+    s->v[0] = DFS_XXH_P1 + DFS_XXH_P2;
+    s->v[1] = DFS_XXH_P2;
+    s->v[2] = 0;
+    s->v[3] = -DFS_XXH_P1;
+}
+
+static inline void dfs_xxh64_stripe(DfsXxh64 *s, const unsigned char *p) {
+    s->v[0] = dfs_xxh_round(s->v[0], dfs_xxh_read64(p));
+    s->v[1] = dfs_xxh_round(s->v[1], dfs_xxh_read64(p + 8));
+    s->v[2] = dfs_xxh_round(s->v[2], dfs_xxh_read64(p + 16));
+    s->v[3] = dfs_xxh_round(s->v[3], dfs_xxh_read64(p + 24));
+}
+
+static inline void dfs_xxh64_update(DfsXxh64 *s, const void *data, size_t n) {
+    const unsigned char *p = data;
+    s->total += n;
+    if (s->buf_len > 0) {
+        size_t take = 32 - s->buf_len < n ? 32 - s->buf_len : n;
+        memcpy(s->buf + s->buf_len, p, take);
+        s->buf_len += take;
+        p += take;
+        n -= take;
+        if (s->buf_len < 32) return;
+        dfs_xxh64_stripe(s, s->buf);
+        s->buf_len = 0;
+    }
+    for (; n >= 32; p += 32, n -= 32) dfs_xxh64_stripe(s, p);
+    memcpy(s->buf, p, n);
+    s->buf_len = n;
+}
+
+static inline uint64_t dfs_xxh64_digest(const DfsXxh64 *s) {
+    uint64_t h;
+    if (s->total >= 32) {
+        h = dfs_xxh_rotl(s->v[0], 1) + dfs_xxh_rotl(s->v[1], 7) +
+            dfs_xxh_rotl(s->v[2], 12) + dfs_xxh_rotl(s->v[3], 18);
+        for (int i = 0; i < 4; i++) h = dfs_xxh_merge(h, s->v[i]);
+    } else {
+        h = DFS_XXH_P5;
+    }
+    h += s->total;
+
+    const unsigned char *p = s->buf;
+    size_t n = s->buf_len;
+    for (; n >= 8; p += 8, n -= 8) {
+        h ^= dfs_xxh_round(0, dfs_xxh_read64(p));
+        h = dfs_xxh_rotl(h, 27) * DFS_XXH_P1 + DFS_XXH_P4;
+    }
+    if (n >= 4) {
+        h ^= (uint64_t)dfs_xxh_read32(p) * DFS_XXH_P1;
+        h = dfs_xxh_rotl(h, 23) * DFS_XXH_P2 + DFS_XXH_P3;
+        p += 4;
+        n -= 4;
+    }
+    for (; n > 0; p++, n--) {
+        h ^= *p * DFS_XXH_P5;
+        h = dfs_xxh_rotl(h, 11) * DFS_XXH_P1;
+    }
+
+    h ^= h >> 33;
+    h *= DFS_XXH_P2;
+    h ^= h >> 29;
+    h *= DFS_XXH_P3;
+    h ^= h >> 32;
+    return h;
+}
+
+#define DFS_SHA256_SIZE 32
+#define DFS_SHA256_XATTR "user.dfs.sha256"
+
+typedef struct {
+    uint32_t h[8];
+    uint64_t total;         // bytes hashed so far
+    unsigned char buf[64];  // input that does not fill a block yet
+    size_t buf_len;
+} DfsSha256;
+
+static const uint32_t dfs_sha256_k[64] = {
+    0x428a2f98, 0x71374491, 0xb5c0fbcf, 0xe9b5dba5, 0x3956c25b, 0x59f111f1, 0x923f82a4, 0xab1c5ed5,
+    0xd807aa98, 0x12835b01, 0x243185be, 0x550c7dc3, 0x72be5d74, 0x80deb1fe, 0x9bdc06a7, 0xc19bf174,
+    0xe49b69c1, 0xefbe4786, 0x0fc19dc6, 0x240ca1cc, 0x2de92c6f, 0x4a7484aa, 0x5cb0a9dc, 0x76f988da,
+    0x983e5152, 0xa831c66d, 0xb00327c8, 0xbf597fc7, 0xc6e00bf3, 0xd5a79147, 0x06ca6351, 0x14292967,
+    0x27b70a85, 0x2e1b2138, 0x4d2c6dfc, 0x53380d13, 0x650a7354, 0x766a0abb, 0x81c2c92e, 0x92722c85,
+    0xa2bfe8a1, 0xa81a664b, 0xc24b8b70, 0xc76c51a3, 0xd192e819, 0xd6990624, 0xf40e3585, 0x106aa070,
+    0x19a4c116, 0x1e376c08, 0x2748774c, 0x34b0bcb5, 0x391c0cb3, 0x4ed8aa4a, 0x5b9cca4f, 0x682e6ff3,
+    0x748f82ee, 0x78a5636f, 0x84c87814, 0x8cc70208, 0x90befffa, 0xa4506ceb, 0xbef9a3f7, 0xc67178f2,
+};
+
+static inline uint32_t dfs_sha_rotr(uint32_t x, int r) {
+    return (x >> r) | (x << (32 - r));
+}
+
+static inline void dfs_sha256_init(DfsSha256 *s) {
+    static const uint32_t iv[8] = {
+        0x6a09e667, 0xbb67ae85, 0x3c6ef372, 0xa54ff53a, 0x510e527f, 0x9b05688c, 0x1f83d9ab, 0x5be0cd19,
+    };
+    memset(s, 0, sizeof(*s));
+    memcpy(s->h, iv, sizeof(iv));
+}
+
+static inline void dfs_sha256_block(DfsSha256 *s, const unsigned char *p) {
+    uint32_t w[64];
+    for (int i = 0; i < 16; i++) {
+        w[i] = (uint32_t)p[4 * i] << 24 | (uint32_t)p[4 * i + 1] << 16 | (uint32_t)p[4 * i + 2] << 8 | p[4 * i + 3];
+    }
+    for (int i = 16; i < 64; i++) {
+        uint32_t s0 = dfs_sha_rotr(w[i - 15], 7) ^ dfs_sha_rotr(w[i - 15], 18) ^ (w[i - 15] >> 3);
+        uint32_t s1 = dfs_sha_rotr(w[i - 2], 17) ^ dfs_sha_rotr(w[i - 2], 19) ^ (w[i - 2] >> 10);
+        w[i] = w[i - 16] + s0 + w[i - 7] + s1;
+    }
+    uint32_t a = s->h[0], b = s->h[1], c = s->h[2], d = s->h[3];
+    uint32_t e = s->h[4], f = s->h[5], g = s->h[6], h = s->h[7];
+    for (int i = 0; i < 64; i++) {
+        uint32_t t1 = h + (dfs_sha_rotr(e, 6) ^ dfs_sha_rotr(e, 11) ^ dfs_sha_rotr(e, 25)) +
+                      ((e & f) ^ (~e & g)) + dfs_sha256_k[i] + w[i];
+        uint32_t t2 = (dfs_sha_rotr(a, 2) ^ dfs_sha_rotr(a, 13) ^ dfs_sha_rotr(a, 22)) +
+                      ((a & b) ^ (a & c) ^ (b & c));
+        h = g;
+        g = f;
+        f = e;
+        e = d + t1;
+        d = c;
+        c = b;
+        b = a;
+        a = t1 + t2;
+    }
+    s->h[0] += a;
+    s->h[1] += b;
+    s->h[2] += c;
+    s->h[3] += d;
+    s->h[4] += e;
+    s->h[5] += f;
+    s->h[6] += g;
+    s->h[7] += h;
+}
+
+#if defined(__x86_64__)
+// blocks of 64 bytes with the SHA extensions; the state is kept in the
+// ABEF/CDGH order sha256rnds2 takes between blocks
+__attribute__((target("sha,sse4.1"))) static inline void dfs_sha256_blocks_ni(uint32_t *h, const unsigned char *p,
+                                                                               size_t blocks) {
+    const __m128i swap = _mm_set_epi64x(0x0c0d0e0f08090a0bULL, 0x0405060700010203ULL);
+    __m128i tmp = _mm_shuffle_epi32(_mm_loadu_si128((const __m128i *)h), 0xb1);
+    __m128i st1 = _mm_shuffle_epi32(_mm_loadu_si128((const __m128i *)(h + 4)), 0x1b);
+    __m128i st0 = _mm_alignr_epi8(tmp, st1, 8);
+    st1 = _mm_blend_epi16(st1, tmp, 0xf0);
+    for (; blocks > 0; blocks--, p += 64) {
+        __m128i abef = st0, cdgh = st1, w[16];
+        for (int i = 0; i < 16; i++) {
+            if (i < 4) {
+                w[i] = _mm_shuffle_epi8(_mm_loadu_si128((const __m128i *)(p + 16 * i)), swap);
+            } else {
+                __m128i x = _mm_sha256msg1_epu32(w[i - 4], w[i - 3]);
+                x = _mm_add_epi32(x, _mm_alignr_epi8(w[i - 1], w[i - 2], 4));
+                w[i] = _mm_sha256msg2_epu32(x, w[i - 1]);
+            }
+            __m128i m = _mm_add_epi32(w[i], _mm_loadu_si128((const __m128i *)&dfs_sha256_k[4 * i]));
+            st1 = _mm_sha256rnds2_epu32(st1, st0, m);
+            st0 = _mm_sha256rnds2_epu32(st0, st1, _mm_shuffle_epi32(m, 0x0e));
+        }
+        st0 = _mm_add_epi32(st0, abef);
+        st1 = _mm_add_epi32(st1, cdgh);
+    }
+    tmp = _mm_shuffle_epi32(st0, 0x1b);
+    st1 = _mm_shuffle_epi32(st1, 0xb1);
+    _mm_storeu_si128((__m128i *)h, _mm_blend_epi16(tmp, st1, 0xf0));
+    _mm_storeu_si128((__m128i *)(h + 4), _mm_alignr_epi8(st1, tmp, 8));
+}
+#endif
+
+// whether the processor has the SHA extensions, asked once
+static int dfs_sha256_ni = -1;
+
+static inline int dfs_sha256_has_ni(void) {
+#if defined(__x86_64__)
+    if (dfs_sha256_ni < 0) {
+        unsigned a, b, c, d;
+        int sse41 = __get_cpuid(1, &a, &b, &c, &d) && (c & bit_SSE4_1);
+        dfs_sha256_ni = sse41 && __get_cpuid_count(7, 0, &a, &b, &c, &d) && (b & bit_SHA);
+    }
+    return dfs_sha256_ni;
+#else
+    return 0;
+#endif
+}
+
+// n blocks of 64 bytes
+static inline void dfs_sha256_blocks(DfsSha256 *s, const unsigned char *p, size_t n) {
+#if defined(__x86_64__)
+    if (dfs_sha256_has_ni()) {
+        dfs_sha256_blocks_ni(s->h, p, n);
+        return;
+    }
+#endif
+    for (; n > 0; n--, p += 64) dfs_sha256_block(s, p);
+}
+
+static inline void dfs_sha256_update(DfsSha256 *s, const void *data, size_t n) {
+    const unsigned char *p = data;
+    s->total += n;
+    if (s->buf_len > 0) {
+        size_t take = 64 - s->buf_len < n ? 64 - s->buf_len : n;
+        memcpy(s->buf + s->buf_len, p, take);
+        s->buf_len += take;
+        p += take;
+        n -= take;
+        if (s->buf_len < 64) return;
+        dfs_sha256_blocks(s, s->buf, 1);
+        s->buf_len = 0;
+    }
+    dfs_sha256_blocks(s, p, n / 64);
+    p += n / 64 * 64;
+    n %= 64;
+    memcpy(s->buf, p, n);
+    s->buf_len = n;
+}
+
+// the digest into out, DFS_SHA256_SIZE bytes; s is used up
+static inline void dfs_sha256_final(DfsSha256 *s, unsigned char *out) {
+    uint64_t bits = s->total * 8;
+    unsigned char pad[72] = {0x80};
+    size_t n = (s->buf_len < 56 ? 56 : 120) - s->buf_len;
+    for (int i = 0; i < 8; i++) pad[n + i] = bits >> (56 - 8 * i);
+    dfs_sha256_update(s, pad, n + 8);
+    for (int i = 0; i < 8; i++) {
+        out[4 * i] = s->h[i] >> 24;
+        out[4 * i + 1] = s->h[i] >> 16;
+        out[4 * i + 2] = s->h[i] >> 8;
+        out[4 * i + 3] = s->h[i];
+    }
+}
+
+// the digest kept with the open file fd, if it was computed for the file as
+// it is now. returns 1 with it in out, 0 if there is none
+static inline int dfs_sha256_cached(int fd, unsigned char *out) {
+    unsigned char value[DFS_SHA256_SIZE + 24];
+    struct stat st;
+    if (fstat(fd, &st) < 0) return 0;
+    if (fgetxattr(fd, DFS_SHA256_XATTR, value, sizeof(value)) != (ssize_t)sizeof(value)) return 0;
+    uint64_t stamp[3] = {st.st_size, st.st_mtim.tv_sec, st.st_mtim.tv_nsec};
+    if (memcmp(value + DFS_SHA256_SIZE, stamp, sizeof(stamp)) != 0) return 0;
+    memcpy(out, value, DFS_SHA256_SIZE);
+    return 1;
+}
+
+// keep the digest of the open file fd with it; where extended attributes
+// are not supported it is computed again next time
+static inline void dfs_sha256_keep(int fd, const unsigned char *digest) {
+    unsigned char value[DFS_SHA256_SIZE + 24];
+    struct stat st;
+    if (fstat(fd, &st) < 0) return;
+    uint64_t stamp[3] = {st.st_size, st.st_mtim.tv_sec, st.st_mtim.tv_nsec};
+    memcpy(value, digest, DFS_SHA256_SIZE);
+    memcpy(value + DFS_SHA256_SIZE, stamp, sizeof(stamp));
+    fsetxattr(fd, DFS_SHA256_XATTR, value, sizeof(value), 0);
+}
+
+// SHA-256 of a plain file, kept with it; returns 0, or -1 with errno set
+static inline int dfs_sha256_file(int fd, unsigned char *out) {
+    if (dfs_sha256_cached(fd, out)) return 0;
+    unsigned char buf[64 * 1024];
+    DfsSha256 s;
+    dfs_sha256_init(&s);
+    for (uint64_t off = 0;; ) {
+        ssize_t n = pread(fd, buf, sizeof(buf), off);
+        if (n < 0 && errno == EINTR) continue;
+        if (n < 0) return -1;
+        if (n == 0) break;
+        dfs_sha256_update(&s, buf, n);
+        off += n;
+    }
+    dfs_sha256_final(&s, out);
+    dfs_sha256_keep(fd, out);
+    return 0;
+}
+
+#endif
@@ -0,0 +1,903 @@
+// dfs_index.h - S1's namespace index: every stored file, where it is and what it is
+//
+// a path-compressed trie over the paths below ~S1/ ("dir/name", no leading
+// '/'). each edge carries a run of bytes, so a lookup, insert or remove is
+// one walk down the key however many files there are, and the children of a
+// node are kept sorted by their first byte, so a walk hands out paths in
+// bytewise order. the files directly in a directory are the subtree below
+// "dir/" minus every edge that crosses another '/'.
+//
+// the index itself does no locking; S1 guards it with a rwlock. the storage
+// servers keep their inventory in the same trie (dfs_inventory.h).
+
+#ifndef DFS_INDEX_H
+#define DFS_INDEX_H
+
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stddef.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include "dfs_proto.h"
+#include "dfs_hash.h"
+
+#define DFS_INDEX_NAME_MAX 255      // longest name a directory walk hands out
+#define DFS_INDEX_KEY_MAX 4096      // longest path the index keeps
+#define DFS_SNAP_MAGIC "DFSSNAP1"
+#define DFS_SNAP_CHECKSUM 1         // flag of a snapshot entry: its checksum is known
+
+typedef struct {
+    int port;               // 0 for S1's own .c files, else the storage server holding it
+    uint64_t size;
+    int64_t mtime;
+    uint64_t checksum;      // xxh64 of the content, if has_checksum
+    int has_checksum;
+    int removed;            // tombstone: hides the snapshot entry, or keeps a scan from reviving it
+    uint32_t mark;          // scan that last saw the file
+    uint64_t seq;           // index change that last wrote the entry
+} DfsIndexEntry;
+
+typedef struct DfsIndexNode {
+    struct DfsIndexNode **children;     // sorted by the first byte of their label
+    uint32_t count;
+    uint32_t cap;
+    int has_entry;
+    DfsIndexEntry entry;
+    uint32_t label_len;
+    char label[];           // bytes on the edge from the parent
+} DfsIndexNode;
+
+// snapshot file, in host byte order: this header, count entries sorted by
+// key, then the keys back to back
+typedef struct {
+    char magic[8];
+    uint64_t count;
+    uint64_t keys_len;
+    uint64_t wal_gen;       // first log generation the snapshot does not cover
+    uint32_t ready;         // bit per source of S1 whose files were all indexed
+    uint32_t reserved;
+    uint64_t check;         // xxh64 of the header up to here
+} DfsSnapHeader;
+
+typedef struct {
+    uint64_t key_off;       // into the keys
+    uint64_t size;
+    int64_t mtime;
+    uint64_t checksum;
+    uint32_t key_len;
+    uint16_t port;
+    uint16_t flags;
+} DfsSnapEntry;
+
+// a mapped snapshot; count is 0 when there is none
+typedef struct {
+    void *map;
+    size_t map_len;
+    const DfsSnapEntry *entries;
+    const char *keys;
+    size_t count;
+    DfsSnapHeader header;
+} DfsIndexBase;
+
+typedef struct {
+    DfsIndexNode *root;     // empty label, never holds an entry
+    size_t entries;         // in the trie, tombstones included
+    uint64_t seq;           // bumped by every change of the trie
+    DfsIndexBase base;
+} DfsIndex;
+
+// visitor of a directory walk, returns non-zero to stop it
+typedef int (*DfsIndexVisit)(void *arg, const char *name, size_t len, const DfsIndexEntry *e);
+
+static inline DfsIndexNode *dfs_index_node_new(const char *label, size_t len) {
+    DfsIndexNode *n = malloc(sizeof(DfsIndexNode) + len);
+    if (!n) return NULL;
+    memset(n, 0, sizeof(*n));
+    memcpy(n->label, label, len);
+    n->label_len = len;
+    return n;
+}
+
+static inline void dfs_index_node_free(DfsIndexNode *n) {
+    for (uint32_t i = 0; i < n->count; i++) dfs_index_node_free(n->children[i]);
+    free(n->children);
+    free(n);
+}
+
+static inline int dfs_index_init(DfsIndex *idx) {
+    memset(idx, 0, sizeof(*idx));
+    idx->root = dfs_index_node_new("", 0);
+    return idx->root ? 0 : -1;
+}
+
+static inline void dfs_index_base_close(DfsIndexBase *b) {
+    if (b->map) munmap(b->map, b->map_len);
+    memset(b, 0, sizeof(*b));
+}
+
+static inline void dfs_index_free(DfsIndex *idx) {
+    if (idx->root) dfs_index_node_free(idx->root);
+    dfs_index_base_close(&idx->base);
+    memset(idx, 0, sizeof(*idx));
+}
+
+// path below ~S1/ as the index keys it, with empty, "." and ".." components
+// resolved; returns its length, or -1 if it climbs out of ~S1/ or does not fit
+static inline int dfs_index_key(const char *path, char *key, size_t max) {
+    if (strncmp(path, "~S1/", 4) != 0) return -1;
+    size_t len = 0;
+    const char *p = path + 4;
+    while (*p) {
+        const char *end = strchrnul(p, '/');
+        size_t n = end - p;
+        if (memchr(p, '\n', n)) return -1;     // would break the lines of a listing
+        if (n == 2 && p[0] == '.' && p[1] == '.') {
+            if (len == 0) return -1;
+            while (len > 0 && key[len - 1] != '/') len--;
+            if (len > 0) len--;
+        } else if (n > 0 && !(n == 1 && p[0] == '.')) {
+            if (len + 1 + n >= max) return -1;
+            if (len > 0) key[len++] = '/';
+            memcpy(key + len, p, n);
+            len += n;
+        }
+        p = *end ? end + 1 : end;
+    }
+    key[len] = '\0';
+    return len;
+}
+
+// bytewise order of two keys that are not NUL terminated
+static inline int dfs_index_keycmp(const char *a, size_t alen, const char *b, size_t blen) {
+    int r = memcmp(a, b, alen < blen ? alen : blen);
+    if (r != 0) return r;
+    return alen < blen ? -1 : alen > blen;
+}
+
+static inline uint64_t dfs_snap_header_check(const DfsSnapHeader *h) {
+    DfsXxh64 x;
+    dfs_xxh64_init(&x);
+    dfs_xxh64_update(&x, h, offsetof(DfsSnapHeader, check));
+    return dfs_xxh64_digest(&x);
+}
+
+// map the snapshot at path; returns 0, 1 if there is none, -1 if it cannot
+// be read or is not a whole snapshot
+static inline int dfs_index_base_open(DfsIndexBase *b, const char *path) {
+    memset(b, 0, sizeof(*b));
+    int fd = open(path, O_RDONLY | O_CLOEXEC);
+    if (fd < 0) return errno == ENOENT ? 1 : -1;
+
+    struct stat st;
+    DfsSnapHeader h;
+    if (fstat(fd, &st) < 0 || pread(fd, &h, sizeof(h), 0) != (ssize_t)sizeof(h)) {
+        close(fd);
+        return -1;
+    }
+    size_t body = st.st_size - sizeof(h);
+    if (memcmp(h.magic, DFS_SNAP_MAGIC, sizeof(h.magic)) != 0 || h.check != dfs_snap_header_check(&h) ||
+        h.count > body / sizeof(DfsSnapEntry) || h.keys_len != body - h.count * sizeof(DfsSnapEntry)) {
+        close(fd);
+        errno = EINVAL;
+        return -1;
+    }
+    void *map = mmap(NULL, st.st_size, PROT_READ, MAP_SHARED, fd, 0);
+    close(fd);
+    if (map == MAP_FAILED) return -1;
+
+    b->map = map;
+    b->map_len = st.st_size;
+    b->entries = (const DfsSnapEntry *)((char *)map + sizeof(h));
+    b->keys = (const char *)(b->entries + h.count);
+    b->count = h.count;
+    b->header = h;
+    return 0;
+}
+
+// key of snapshot entry i; a record pointing outside the keys reads as empty
+static inline const char *dfs_index_base_key(const DfsIndexBase *b, size_t i, size_t *len) {
+    const DfsSnapEntry *e = &b->entries[i];
+    uint64_t keys_len = b->header.keys_len;
+    *len = e->key_off <= keys_len && e->key_len <= keys_len - e->key_off ? e->key_len : 0;
+    return b->keys + (*len ? e->key_off : 0);
+}
+
+// first snapshot entry whose key is >= key
+static inline size_t dfs_index_base_lower(const DfsIndexBase *b, const char *key, size_t len) {
+    size_t lo = 0, hi = b->count;
+    while (lo < hi) {
+        size_t mid = lo + (hi - lo) / 2;
+        size_t klen;
+        const char *k = dfs_index_base_key(b, mid, &klen);
+        if (dfs_index_keycmp(k, klen, key, len) < 0) lo = mid + 1;
+        else hi = mid;
+    }
+    return lo;
+}
+
+// position of a path in the snapshot; returns 1 if it has the path
+static inline int dfs_index_base_find(const DfsIndexBase *b, const char *key, size_t len, size_t *pos) {
+    *pos = dfs_index_base_lower(b, key, len);
+    if (*pos == b->count) return 0;
+    size_t klen;
+    const char *k = dfs_index_base_key(b, *pos, &klen);
+    return klen == len && memcmp(k, key, len) == 0;
+}
+
+static inline void dfs_index_base_entry(const DfsIndexBase *b, size_t i, DfsIndexEntry *e) {
+    const DfsSnapEntry *s = &b->entries[i];
+    memset(e, 0, sizeof(*e));
+    e->port = s->port;
+    e->size = s->size;
+    e->mtime = s->mtime;
+    e->checksum = s->checksum;
+    e->has_checksum = (s->flags & DFS_SNAP_CHECKSUM) != 0;
+}
+
+// position of the child whose label starts with byte, or where it would go
+static inline uint32_t dfs_index_child(const DfsIndexNode *n, unsigned char byte, int *found) {
+    uint32_t lo = 0, hi = n->count;
+    while (lo < hi) {
+        uint32_t mid = (lo + hi) / 2;
+        unsigned char b = n->children[mid]->label[0];
+        if (b == byte) {
+            *found = 1;
+            return mid;
+        }
+        if (b < byte) lo = mid + 1;
+        else hi = mid;
+    }
+    *found = 0;
+    return lo;
+}
+
+static inline int dfs_index_insert_child(DfsIndexNode *n, uint32_t pos, DfsIndexNode *child) {
+    if (n->count == n->cap) {
+        uint32_t cap = n->cap ? n->cap * 2 : 2;
+        DfsIndexNode **grown = realloc(n->children, cap * sizeof(*grown));
+        if (!grown) return -1;
+        n->children = grown;
+        n->cap = cap;
+    }
+    memmove(n->children + pos + 1, n->children + pos, (n->count - pos) * sizeof(*n->children));
+    n->children[pos] = child;
+    n->count++;
+    return 0;
+}
+
+static inline size_t dfs_index_common(const char *a, size_t alen, const char *b, size_t blen) {
+    size_t i = 0;
+    while (i < alen && i < blen && a[i] == b[i]) i++;
+    return i;
+}
+
+// entry of a path, tombstones included; NULL if the index has none
+static inline DfsIndexEntry *dfs_index_find(DfsIndex *idx, const char *key, size_t len) {
+    DfsIndexNode *n = idx->root;
+    while (len > 0) {
+        int found;
+        uint32_t pos = dfs_index_child(n, key[0], &found);
+        if (!found) return NULL;
+        DfsIndexNode *child = n->children[pos];
+        if (child->label_len > len || memcmp(child->label, key, child->label_len) != 0) return NULL;
+        key += child->label_len;
+        len -= child->label_len;
+        n = child;
+    }
+    return n->has_entry ? &n->entry : NULL;
+}
+
+// entry of a path, created zeroed if there is none; NULL when out of memory
+static inline DfsIndexEntry *dfs_index_put(DfsIndex *idx, const char *key, size_t len) {
+    DfsIndexNode *n = idx->root;
+    while (len > 0) {
+        int found;
+        uint32_t pos = dfs_index_child(n, key[0], &found);
+        if (!found) {
+            DfsIndexNode *leaf = dfs_index_node_new(key, len);
+            if (!leaf) return NULL;
+            if (dfs_index_insert_child(n, pos, leaf) < 0) {
+                free(leaf);
+                return NULL;
+            }
+            n = leaf;
+            break;
+        }
+
+        DfsIndexNode *child = n->children[pos];
+        size_t common = dfs_index_common(child->label, child->label_len, key, len);
+        if (common < child->label_len) {
+            // the key leaves this edge part way: split it, the child keeps the tail
+            DfsIndexNode *mid = dfs_index_node_new(child->label, common);
+            if (!mid) return NULL;
+            mid->children = malloc(2 * sizeof(*mid->children));
+            if (!mid->children) {
+                free(mid);
+                return NULL;
+            }
+            mid->children[0] = child;
+            mid->count = 1;
+            mid->cap = 2;
+            child->label_len -= common;
+            memmove(child->label, child->label + common, child->label_len);
+            n->children[pos] = mid;
+            child = mid;
+        }
+        key += common;
+        len -= common;
+        n = child;
+    }
+    if (!n->has_entry) {
+        memset(&n->entry, 0, sizeof(n->entry));
+        n->has_entry = 1;
+        idx->entries++;
+    }
+    return &n->entry;
+}
+
+// a node without entry and children goes, one with a single child is merged
+// into it; the root stays. returns -1 when out of memory (nothing is lost,
+// the node is just not compressed)
+static inline int dfs_index_tidy(DfsIndexNode **slot, int is_root) {
+    DfsIndexNode *n = *slot;
+    if (is_root || n->has_entry || n->count > 1) return 0;
+    if (n->count == 0) {
+        free(n->children);
+        free(n);
+        *slot = NULL;
+        return 0;
+    }
+    DfsIndexNode *child = n->children[0];
+    DfsIndexNode *merged = malloc(sizeof(DfsIndexNode) + n->label_len + child->label_len);
+    if (!merged) return -1;
+    *merged = *child;
+    memcpy(merged->label, n->label, n->label_len);
+    memcpy(merged->label + n->label_len, child->label, child->label_len);
+    merged->label_len = n->label_len + child->label_len;
+    free(n->children);
+    free(n);
+    free(child);
+    *slot = merged;
+    return 0;
+}
+
+// drop the child at pos if tidying left nothing of it
+static inline void dfs_index_tidy_child(DfsIndexNode *n, uint32_t pos) {
+    dfs_index_tidy(&n->children[pos], 0);
+    if (!n->children[pos]) {
+        memmove(n->children + pos, n->children + pos + 1, (n->count - pos - 1) * sizeof(*n->children));
+        n->count--;
+    }
+}
+
+static inline int dfs_index_remove_at(DfsIndex *idx, DfsIndexNode *n, const char *key, size_t len) {
+    int found;
+    uint32_t pos = dfs_index_child(n, key[0], &found);
+    if (!found) return 0;
+    DfsIndexNode *child = n->children[pos];
+    if (child->label_len > len || memcmp(child->label, key, child->label_len) != 0) return 0;
+
+    int removed;
+    if (child->label_len == len) {
+        removed = child->has_entry;
+        if (removed) idx->entries--;
+        child->has_entry = 0;
+    } else {
+        removed = dfs_index_remove_at(idx, child, key + child->label_len, len - child->label_len);
+    }
+    if (removed) dfs_index_tidy_child(n, pos);
+    return removed;
+}
+
+// forget a path; returns 1 if it was there
+static inline int dfs_index_remove(DfsIndex *idx, const char *key, size_t len) {
+    return len > 0 && dfs_index_remove_at(idx, idx->root, key, len);
+}
+
+// the live entry of a path, from the trie or else the snapshot; returns 1
+// with it, 0 if the index has no such file
+static inline int dfs_index_get(DfsIndex *idx, const char *key, size_t len, DfsIndexEntry *e) {
+    DfsIndexEntry *found = dfs_index_find(idx, key, len);
+    if (found) {
+        *e = *found;
+        return !found->removed;
+    }
+    size_t pos;
+    if (!dfs_index_base_find(&idx->base, key, len, &pos)) return 0;
+    dfs_index_base_entry(&idx->base, pos, e);
+    return 1;
+}
+
+// record a file, replacing what the index had of the path; returns its trie
+// entry, NULL when out of memory
+static inline DfsIndexEntry *dfs_index_set(DfsIndex *idx, const char *key, size_t len, const DfsIndexEntry *value) {
+    DfsIndexEntry *e = dfs_index_put(idx, key, len);
+    if (!e) return NULL;
+    *e = *value;
+    e->removed = 0;
+    e->seq = ++idx->seq;
+    return e;
+}
+
+// forget a file of port; a tombstone stays if the snapshot has the path or
+// keep asks for one. returns 0, or -1 when out of memory
+static inline int dfs_index_delete(DfsIndex *idx, const char *key, size_t len, int port, int keep) {
+    size_t pos;
+    idx->seq++;
+    if (!keep && !dfs_index_base_find(&idx->base, key, len, &pos)) {
+        dfs_index_remove(idx, key, len);
+        return 0;
+    }
+    DfsIndexEntry *e = dfs_index_put(idx, key, len);
+    if (!e) return -1;
+    memset(e, 0, sizeof(*e));
+    e->port = port;
+    e->removed = 1;
+    e->seq = idx->seq;
+    return 0;
+}
+
+// drop every entry drop() picks, tidying the trie on the way back up
+static inline void dfs_index_sweep_at(DfsIndex *idx, DfsIndexNode *n,
+                                      int (*drop)(void *arg, const DfsIndexEntry *e), void *arg) {
+    for (uint32_t i = n->count; i-- > 0;) {
+        DfsIndexNode *child = n->children[i];
+        dfs_index_sweep_at(idx, child, drop, arg);
+        if (child->has_entry && drop(arg, &child->entry)) {
+            child->has_entry = 0;
+            idx->entries--;
+        }
+        dfs_index_tidy_child(n, i);
+    }
+}
+
+static inline void dfs_index_sweep(DfsIndex *idx, int (*drop)(void *arg, const DfsIndexEntry *e), void *arg) {
+    dfs_index_sweep_at(idx, idx->root, drop, arg);
+}
+
+// hand out the entries below n, tombstones included; name holds the name so
+// far, len bytes of it, and names that are below from or run into another
+// '/' are skipped
+static inline int dfs_index_walk(DfsIndexNode *n, char *name, size_t len, size_t added,
+                                 const char *from, size_t from_len, DfsIndexVisit visit, void *arg) {
+    if (memchr(name + len - added, '/', added)) return 0;
+    // a name that sorts below the prefix of from has only smaller names under it
+    size_t cmp_len = len < from_len ? len : from_len;
+    int cmp = memcmp(name, from, cmp_len);
+    if (cmp < 0) return 0;
+    if (cmp > 0 || len >= from_len) from_len = 0;
+
+    if (n->has_entry && len > 0 && from_len == 0) {
+        if (visit(arg, name, len, &n->entry)) return 1;
+    }
+    for (uint32_t i = 0; i < n->count; i++) {
+        DfsIndexNode *child = n->children[i];
+        if (len + child->label_len > DFS_INDEX_NAME_MAX) continue;
+        memcpy(name + len, child->label, child->label_len);
+        if (dfs_index_walk(child, name, len + child->label_len, child->label_len,
+                           from, from_len, visit, arg)) return 1;
+    }
+    return 0;
+}
+
+// the trie's side of a directory listing, copied out to be merged with the snapshot
+typedef struct {
+    size_t off;             // into names
+    size_t len;
+    const DfsIndexEntry *e;
+} DfsIndexDirItem;
+
+typedef struct {
+    char *names;
+    size_t names_len;
+    size_t names_cap;
+    DfsIndexDirItem *items;
+    size_t count;
+    size_t cap;
+    int failed;             // out of memory
+} DfsIndexDir;
+
+static inline int dfs_index_dir_add(void *arg, const char *name, size_t len, const DfsIndexEntry *e) {
+    DfsIndexDir *d = arg;
+    if (d->count == d->cap) {
+        size_t cap = d->cap ? d->cap * 2 : 64;
+        DfsIndexDirItem *grown = realloc(d->items, cap * sizeof(*grown));
+        if (!grown) return d->failed = 1;
+        d->items = grown;
+        d->cap = cap;
+    }
+    if (d->names_len + len > d->names_cap) {
+        size_t cap = d->names_cap ? d->names_cap * 2 : 4096;
+        while (cap < d->names_len + len) cap *= 2;
+        char *grown = realloc(d->names, cap);
+        if (!grown) return d->failed = 1;
+        d->names = grown;
+        d->names_cap = cap;
+    }
+    memcpy(d->names + d->names_len, name, len);
+    d->items[d->count].off = d->names_len;
+    d->items[d->count].len = len;
+    d->items[d->count].e = e;
+    d->names_len += len;
+    d->count++;
+    return 0;
+}
+
+// the trie entries directly in dir whose name is >= from
+static inline void dfs_index_list_trie(DfsIndex *idx, const char *dir, size_t dir_len, const char *from,
+                                       DfsIndexVisit visit, void *arg) {
+    DfsIndexNode *n = idx->root;
+    size_t skip = 0;        // bytes of n's label that still belong to dir
+    while (dir_len > 0) {
+        int found;
+        uint32_t pos = dfs_index_child(n, dir[0], &found);
+        if (!found) return;
+        n = n->children[pos];
+        size_t common = dfs_index_common(n->label, n->label_len, dir, dir_len);
+        if (common < n->label_len && common < dir_len) return;
+        dir += common;
+        dir_len -= common;
+        skip = common;
+    }
+
+    char name[DFS_INDEX_NAME_MAX + 1];
+    size_t len = n->label_len - skip;
+    if (len > DFS_INDEX_NAME_MAX) return;
+    memcpy(name, n->label + skip, len);
+    dfs_index_walk(n, name, len, len, from, strlen(from), visit, arg);
+}
+
+// next snapshot entry at or after *i that is a file directly in dir; a
+// subdirectory is jumped over with one search. returns its name, or NULL
+static inline const char *dfs_index_base_next(const DfsIndexBase *b, size_t *i, const char *dir, size_t dir_len,
+                                              size_t *len) {
+    char probe[DFS_INDEX_KEY_MAX + 1];
+    while (*i < b->count) {
+        size_t klen;
+        const char *k = dfs_index_base_key(b, *i, &klen);
+        if (klen <= dir_len || memcmp(k, dir, dir_len) != 0) break;
+        const char *slash = memchr(k + dir_len, '/', klen - dir_len);
+        if (slash) {
+            // "sub0" sorts right after everything below "sub/"
+            size_t n = slash - k;
+            if (n >= sizeof(probe)) {
+                (*i)++;
+                continue;
+            }
+            memcpy(probe, k, n);
+            probe[n] = '/' + 1;
+            *i = dfs_index_base_lower(b, probe, n + 1);
+            continue;
+        }
+        if (klen - dir_len > DFS_INDEX_NAME_MAX) {
+            (*i)++;
+            continue;
+        }
+        *len = klen - dir_len;
+        return k + dir_len;
+    }
+    *i = b->count;
+    return NULL;
+}
+
+// visit, in bytewise order, the files directly in dir whose name is >= from;
+// dir is "" for the top or ends in '/'. the trie's entries win over the
+// snapshot's, tombstones are left out. returns 0, or -1 when out of memory
+static inline int dfs_index_list(DfsIndex *idx, const char *dir, size_t dir_len, const char *from,
+                                 DfsIndexVisit visit, void *arg) {
+    DfsIndexDir d;
+    memset(&d, 0, sizeof(d));
+    dfs_index_list_trie(idx, dir, dir_len, from, dfs_index_dir_add, &d);
+    if (d.failed) {
+        free(d.names);
+        free(d.items);
+        return -1;
+    }
+
+    const DfsIndexBase *b = &idx->base;
+    size_t i = b->count, j = 0;
+    size_t from_len = strlen(from);
+    char start[DFS_INDEX_KEY_MAX + DFS_INDEX_NAME_MAX + 2];
+    if (dir_len + from_len <= sizeof(start)) {
+        memcpy(start, dir, dir_len);
+        memcpy(start + dir_len, from, from_len);
+        i = dfs_index_base_lower(b, start, dir_len + from_len);
+    }
+
+    size_t len = 0;
+    const char *name = dfs_index_base_next(b, &i, dir, dir_len, &len);
+    while (name || j < d.count) {
+        DfsIndexDirItem *it = j < d.count ? &d.items[j] : NULL;
+        int cmp = !name ? 1 : !it ? -1 : dfs_index_keycmp(name, len, d.names + it->off, it->len);
+        int stop;
+        if (cmp < 0) {
+            DfsIndexEntry e;
+            dfs_index_base_entry(b, i, &e);
+            stop = visit(arg, name, len, &e);
+        } else {
+            stop = !it->e->removed && visit(arg, d.names + it->off, it->len, it->e);
+            j++;
+        }
+        if (stop) break;
+        if (cmp <= 0) {
+            i++;
+            name = dfs_index_base_next(b, &i, dir, dir_len, &len);
+        }
+    }
+    free(d.names);
+    free(d.items);
+    return 0;
+}
+
+// every path of the trie with its entry, tombstones included, copied out
+// so that a snapshot can be written without holding the index
+typedef struct {
+    size_t key_off;         // into keys
+    size_t len;
+    DfsIndexEntry e;
+} DfsIndexItem;
+
+typedef struct {
+    DfsIndexItem *items;    // sorted by key
+    size_t count;
+    size_t cap;
+    char *keys;
+    size_t keys_len;
+    size_t keys_cap;
+} DfsIndexCopy;
+
+static inline void dfs_index_copy_free(DfsIndexCopy *cp) {
+    free(cp->items);
+    free(cp->keys);
+    memset(cp, 0, sizeof(*cp));
+}
+
+// append a path and its entry; returns 0, or -1 when out of memory
+static inline int dfs_index_copy_add(DfsIndexCopy *cp, const char *key, size_t len, const DfsIndexEntry *e) {
+    if (cp->count == cp->cap) {
+        size_t cap = cp->cap ? cp->cap * 2 : 1024;
+        DfsIndexItem *grown = realloc(cp->items, cap * sizeof(*grown));
+        if (!grown) return -1;
+        cp->items = grown;
+        cp->cap = cap;
+    }
+    if (cp->keys_len + len > cp->keys_cap) {
+        size_t cap = cp->keys_cap ? cp->keys_cap * 2 : 65536;
+        while (cap < cp->keys_len + len) cap *= 2;
+        char *grown = realloc(cp->keys, cap);
+        if (!grown) return -1;
+        cp->keys = grown;
+        cp->keys_cap = cap;
+    }
+    memcpy(cp->keys + cp->keys_len, key, len);
+    cp->items[cp->count].key_off = cp->keys_len;
+    cp->items[cp->count].len = len;
+    cp->items[cp->count].e = *e;
+    cp->keys_len += len;
+    cp->count++;
+    return 0;
+}
+
+static inline int dfs_index_copy_at(DfsIndexNode *n, char *key, size_t len, DfsIndexCopy *cp) {
+    if (n->has_entry && len > 0 && dfs_index_copy_add(cp, key, len, &n->entry) < 0) return -1;
+    for (uint32_t i = 0; i < n->count; i++) {
+        DfsIndexNode *child = n->children[i];
+        if (len + child->label_len > DFS_INDEX_KEY_MAX) continue;
+        memcpy(key + len, child->label, child->label_len);
+        if (dfs_index_copy_at(child, key, len + child->label_len, cp) < 0) return -1;
+    }
+    return 0;
+}
+
+// returns 0, or -1 when out of memory
+static inline int dfs_index_copy(DfsIndex *idx, DfsIndexCopy *cp) {
+    char key[DFS_INDEX_KEY_MAX];
+    memset(cp, 0, sizeof(*cp));
+    if (dfs_index_copy_at(idx->root, key, 0, cp) == 0) return 0;
+    dfs_index_copy_free(cp);
+    return -1;
+}
+
+// hand out, in bytewise order and tombstones included, the entries below n
+// whose path sorts after the first after_len bytes of after; key holds the
+// path so far, len bytes of it
+static inline int dfs_index_range_at(DfsIndexNode *n, char *key, size_t len, const char *after,
+                                     size_t after_len, DfsIndexVisit visit, void *arg) {
+    // a path that sorts below the prefix of after has only smaller paths under it
+    size_t cmp_len = len < after_len ? len : after_len;
+    int cmp = memcmp(key, after, cmp_len);
+    if (cmp < 0) return 0;
+    if (cmp > 0 || len > after_len) after_len = 0;
+
+    if (n->has_entry && len > 0 && after_len == 0) {
+        if (visit(arg, key, len, &n->entry)) return 1;
+    }
+    for (uint32_t i = 0; i < n->count; i++) {
+        DfsIndexNode *child = n->children[i];
+        if (len + child->label_len > DFS_INDEX_KEY_MAX) continue;
+        memcpy(key + len, child->label, child->label_len);
+        if (dfs_index_range_at(child, key, len + child->label_len, after, after_len, visit, arg)) return 1;
+    }
+    return 0;
+}
+
+// the trie's entries after a path, until visit returns non-zero; an empty
+// after starts at the first one
+static inline void dfs_index_range(DfsIndex *idx, const char *after, size_t after_len,
+                                   DfsIndexVisit visit, void *arg) {
+    char key[DFS_INDEX_KEY_MAX];
+    dfs_index_range_at(idx->root, key, 0, after, after_len, visit, arg);
+}
+
+// buffered writes to one region of a snapshot file
+typedef struct {
+    int fd;
+    off_t off;
+    size_t len;
+    int failed;
+    char buf[1 << 16];
+} DfsSnapOut;
+
+static inline void dfs_snap_flush(DfsSnapOut *o) {
+    size_t done = 0;
+    while (!o->failed && done < o->len) {
+        ssize_t n = pwrite(o->fd, o->buf + done, o->len - done, o->off);
+        if (n < 0 && errno == EINTR) continue;
+        if (n <= 0) {
+            o->failed = 1;
+            break;
+        }
+        done += n;
+        o->off += n;
+    }
+    o->len = 0;
+}
+
+static inline void dfs_snap_put(DfsSnapOut *o, const void *data, size_t n) {
+    const char *p = data;
+    while (n > 0) {
+        if (o->len == sizeof(o->buf)) dfs_snap_flush(o);
+        size_t take = sizeof(o->buf) - o->len < n ? sizeof(o->buf) - o->len : n;
+        memcpy(o->buf + o->len, p, take);
+        o->len += take;
+        p += take;
+        n -= take;
+    }
+}
+
+// where the entries and the keys of a snapshot being written go
+typedef struct {
+    uint64_t count;
+    uint64_t keys_len;
+    DfsSnapOut entries;
+    DfsSnapOut keys;
+    int writing;            // the first pass only counts
+} DfsSnapWriter;
+
+static inline void dfs_snap_emit(DfsSnapWriter *w, const char *key, size_t len, const DfsIndexEntry *e) {
+    if (w->writing) {
+        DfsSnapEntry s;
+        memset(&s, 0, sizeof(s));
+        s.key_off = w->keys_len;
+        s.size = e->size;
+        s.mtime = e->mtime;
+        s.checksum = e->checksum;
+        s.key_len = len;
+        s.port = e->port;
+        s.flags = e->has_checksum ? DFS_SNAP_CHECKSUM : 0;
+        dfs_snap_put(&w->entries, &s, sizeof(s));
+        dfs_snap_put(&w->keys, key, len);
+    }
+    w->count++;
+    w->keys_len += len;
+}
+
+// the snapshot merged with the copied trie, live entries only
+static inline void dfs_snap_merge(DfsSnapWriter *w, const DfsIndexBase *b, const DfsIndexCopy *cp) {
+    size_t i = 0, j = 0;
+    while (i < b->count || j < cp->count) {
+        size_t klen = 0;
+        const char *k = i < b->count ? dfs_index_base_key(b, i, &klen) : NULL;
+        const DfsIndexItem *it = j < cp->count ? &cp->items[j] : NULL;
+        int cmp = !k ? 1 : !it ? -1 : dfs_index_keycmp(k, klen, cp->keys + it->key_off, it->len);
+        if (cmp < 0) {
+            DfsIndexEntry e;
+            dfs_index_base_entry(b, i, &e);
+            dfs_snap_emit(w, k, klen, &e);
+        } else if (!it->e.removed) {
+            dfs_snap_emit(w, cp->keys + it->key_off, it->len, &it->e);
+        }
+        if (cmp <= 0) i++;
+        if (cmp >= 0) j++;
+    }
+}
+
+// write the snapshot b with the copied trie applied to fd, which is empty;
+// wal_gen and ready go into the header. returns 0, or -1 with errno set
+static inline int dfs_index_write_snapshot(int fd, const DfsIndexBase *b, const DfsIndexCopy *cp,
+                                           uint64_t wal_gen, uint32_t ready) {
+    DfsSnapWriter *w = calloc(1, sizeof(*w));
+    if (!w) return -1;
+    dfs_snap_merge(w, b, cp);
+
+    DfsSnapHeader h;
+    memset(&h, 0, sizeof(h));
+    memcpy(h.magic, DFS_SNAP_MAGIC, sizeof(h.magic));
+    h.count = w->count;
+    h.keys_len = w->keys_len;
+    h.wal_gen = wal_gen;
+    h.ready = ready;
+    h.check = dfs_snap_header_check(&h);
+
+    w->entries.fd = w->keys.fd = fd;
+    w->entries.off = sizeof(h);
+    w->keys.off = sizeof(h) + h.count * sizeof(DfsSnapEntry);
+    w->count = w->keys_len = 0;
+    w->writing = 1;
+    dfs_snap_merge(w, b, cp);
+    dfs_snap_flush(&w->entries);
+    dfs_snap_flush(&w->keys);
+    int r = w->entries.failed || w->keys.failed ||
+            pwrite(fd, &h, sizeof(h), 0) != (ssize_t)sizeof(h) ? -1 : 0;
+    free(w);
+    return r;
+}
+
+// a log record: a 4 byte length and the low half of the xxh64 of the body,
+// then the body: op, flags, port, size, mtime, checksum and the key, all
+// big-endian like the wire protocol
+#define DFS_WAL_PUT 1
+#define DFS_WAL_DEL 2
+#define DFS_WAL_HEADER 8
+#define DFS_WAL_BODY 28             // body bytes before the key
+#define DFS_WAL_RECORD_MAX (DFS_WAL_HEADER + DFS_WAL_BODY + DFS_INDEX_KEY_MAX)
+
+static inline uint32_t dfs_wal_check(const unsigned char *body, size_t len) {
+    DfsXxh64 x;
+    dfs_xxh64_init(&x);
+    dfs_xxh64_update(&x, body, len);
+    return (uint32_t)dfs_xxh64_digest(&x);
+}
+
+// encode a change into p, which has room for DFS_WAL_RECORD_MAX bytes
+// returns the record's length
+static inline size_t dfs_wal_record(unsigned char *p, int op, const char *key, size_t len, const DfsIndexEntry *e) {
+    unsigned char *body = p + DFS_WAL_HEADER;
+    body[0] = op;
+    body[1] = e->has_checksum ? DFS_SNAP_CHECKSUM : 0;
+    dfs_put16(body + 2, e->port);
+    dfs_put64(body + 4, e->size);
+    dfs_put64(body + 12, e->mtime);
+    dfs_put64(body + 20, e->checksum);
+    memcpy(body + DFS_WAL_BODY, key, len);
+    dfs_put32(p, DFS_WAL_BODY + len);
+    dfs_put32(p + 4, dfs_wal_check(body, DFS_WAL_BODY + len));
+    return DFS_WAL_HEADER + DFS_WAL_BODY + len;
+}
+
+// decode the record at p, avail bytes of log from there on; returns its
+// length, or 0 at the end of the log and at a torn or damaged record
+static inline size_t dfs_wal_parse(const unsigned char *p, size_t avail, int *op, const char **key,
+                                   size_t *len, DfsIndexEntry *e) {
+    if (avail < DFS_WAL_HEADER) return 0;
+    uint32_t body_len = dfs_get32(p);
+    const unsigned char *body = p + DFS_WAL_HEADER;
+    if (body_len < DFS_WAL_BODY || body_len > DFS_WAL_BODY + DFS_INDEX_KEY_MAX ||
+        body_len > avail - DFS_WAL_HEADER || dfs_get32(p + 4) != dfs_wal_check(body, body_len)) return 0;
+    *op = body[0];
+    memset(e, 0, sizeof(*e));
+    e->has_checksum = (body[1] & DFS_SNAP_CHECKSUM) != 0;
+    e->port = dfs_get16(body + 2);
+    e->size = dfs_get64(body + 4);
+    e->mtime = dfs_get64(body + 12);
+    e->checksum = dfs_get64(body + 20);
+    *key = (const char *)body + DFS_WAL_BODY;
+    *len = body_len - DFS_WAL_BODY;
+    return DFS_WAL_HEADER + body_len;
+}
+
+#endif
@@ -0,0 +1,557 @@
+// dfs_inventory.h - what a storage server holds, kept in memory
+//
+// every regular file under the server's root whose name ends in its
+// extension, in a DfsIndex trie (dfs_index.h) keyed on the path below the
+// root. the inventory is built at startup by a walk of the tree spread over
+// several threads, then kept current by the server's own uploads and
+// removes, so listings, tars and SCAN replies come from memory and never walk
+// the filesystem.
+//
+// it is saved as a manifest, ~/S2_manifest for S2, in the snapshot format of
+// dfs_index.h and rewritten a while after it changed. a server that finds
+// its manifest answers from it right away and corrects it with the walk in
+// the background: changes made while the walk runs are kept aside and
+// replayed on what it found. files changed behind the server's back show up
+// once that walk is over.
+//
+// a server with a chunk store (dfs_chunk.h) may hold recipes instead of
+// files. the walk reads each of them, for the size of the file it stands for
+// and to count the references to its chunks, and tars stream their chunks.
+// packed files (dfs_pack.h) are listed and archived with the size of their
+// content, and tars decode them.
+
+#ifndef DFS_INVENTORY_H
+#define DFS_INVENTORY_H
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <limits.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <sys/stat.h>
+#include "dfs_proto.h"
+#include "dfs_dir.h"
+#include "dfs_tar.h"
+#include "dfs_list.h"
+#include "dfs_index.h"
+#include "dfs_chunk.h"
+
+#define DFS_INV_BATCH 256           // entries copied out per look at the inventory
+#define DFS_INV_SAVE_DELAY 30       // seconds between manifest rewrites
+
+typedef struct {
+    pthread_rwlock_t lock;
+    DfsIndex files;
+    DfsIndex changes;       // made while a walk runs, tombstones for removes
+    int walking;
+    int dirty;              // changed since the manifest was written
+    int port;
+    char root[PATH_MAX];
+    char ext[16];
+    char manifest[PATH_MAX];
+    DfsChunkStore *chunks;  // where recipes keep their content, NULL without recipes or packed files
+} DfsInventory;
+
+// directories waiting to be read by the threads of a walk
+typedef struct {
+    pthread_mutex_t lock;
+    pthread_cond_t more;
+    char **dirs;            // paths below the root, "" or ending in '/'
+    size_t count;
+    size_t cap;
+    int busy;               // threads reading a directory
+    int failed;             // out of memory
+    DfsInventory *inv;
+} DfsInvWalk;
+
+typedef struct {
+    DfsInvWalk *walk;
+    DfsIndexCopy found;
+    pthread_t tid;
+} DfsInvWalker;
+
+// returns 0, or -1 when out of memory
+static inline int dfs_inv_init(DfsInventory *inv, const char *root, const char *ext, int port) {
+    memset(inv, 0, sizeof(*inv));
+    if (strlen(ext) >= sizeof(inv->ext) ||
+        snprintf(inv->manifest, sizeof(inv->manifest), "%s_manifest", root) >= (int)sizeof(inv->manifest)) {
+        return -1;
+    }
+    snprintf(inv->root, sizeof(inv->root), "%s", root);
+    strcpy(inv->ext, ext);
+    inv->port = port;
+    pthread_rwlock_init(&inv->lock, NULL);
+    return dfs_index_init(&inv->files);
+}
+
+// inventory key of a ~S1/ path; -1 if it is not one of the server's files
+static inline int dfs_inv_key(const DfsInventory *inv, const char *path, char *key) {
+    int len = dfs_index_key(path, key, DFS_INDEX_KEY_MAX);
+    if (len <= 0) return -1;
+    const char *name = memrchr(key, '/', len);
+    return dfs_tar_has_ext(name ? name + 1 : key, inv->ext) ? len : -1;
+}
+
+// read the manifest into the inventory; returns 0, 1 if there is none,
+// -1 if it cannot be read
+static inline int dfs_inv_load(DfsInventory *inv, size_t *count) {
+    DfsIndexBase b;
+    int r = dfs_index_base_open(&b, inv->manifest);
+    if (r != 0) return r;
+    for (size_t i = 0; i < b.count && r == 0; i++) {
+        size_t len;
+        const char *key = dfs_index_base_key(&b, i, &len);
+        DfsIndexEntry e;
+        dfs_index_base_entry(&b, i, &e);
+        if (len > 0 && !dfs_index_set(&inv->files, key, len, &e)) r = -1;
+    }
+    dfs_index_base_close(&b);
+    *count = inv->files.entries;
+    return r;
+}
+
+static inline void dfs_inv_push(DfsInvWalk *w, const char *dir, size_t len) {
+    char *copy = malloc(len + 1);
+    pthread_mutex_lock(&w->lock);
+    if (w->count == w->cap) {
+        size_t cap = w->cap ? w->cap * 2 : 256;
+        char **grown = realloc(w->dirs, cap * sizeof(*grown));
+        if (grown) {
+            w->dirs = grown;
+            w->cap = cap;
+        }
+    }
+    if (copy && w->count < w->cap) {
+        memcpy(copy, dir, len);
+        copy[len] = '\0';
+        w->dirs[w->count++] = copy;
+        pthread_cond_signal(&w->more);
+    } else {
+        free(copy);
+        w->failed = 1;
+        pthread_cond_broadcast(&w->more);
+    }
+    pthread_mutex_unlock(&w->lock);
+}
+
+// the next directory to read, NULL once every thread ran out of them
+static inline char *dfs_inv_pop(DfsInvWalk *w, int done) {
+    pthread_mutex_lock(&w->lock);
+    w->busy -= done;
+    if (w->count == 0 && w->busy == 0) pthread_cond_broadcast(&w->more);
+    while (w->count == 0 && w->busy > 0 && !w->failed) pthread_cond_wait(&w->more, &w->lock);
+    char *dir = NULL;
+    if (w->count > 0 && !w->failed) {
+        dir = w->dirs[--w->count];
+        w->busy++;
+    }
+    pthread_mutex_unlock(&w->lock);
+    return dir;
+}
+
+// a recipe or packed file found by the walk: the size of its content goes
+// into e, and until the store knows them, a recipe's references are
+// counted. one that cannot be read makes the count incomplete, so no chunk
+// is deleted. returns 0, or -1 when out of memory
+static inline int dfs_inv_read_recipe(DfsChunkStore *s, int dir_fd, const char *name, DfsIndexEntry *e) {
+    int fd = openat(dir_fd, name, O_RDONLY | O_CLOEXEC | O_NOFOLLOW | O_NONBLOCK);
+    DfsRecipe r;
+    int found = fd < 0 ? -1 : dfs_recipe_read(s, fd, &r);
+    DfsPack pack;
+    if (found == 0 && s->packed && dfs_pack_open(fd, &pack) > 0) {
+        e->size = pack.size;
+        dfs_pack_close(&pack);
+    }
+    if (fd >= 0) close(fd);
+    if (found < 0 && errno == ENOMEM) return -1;
+    if (found < 0) s->count_failed = 1;
+    if (found <= 0) return 0;
+    e->size = r.size;
+    int ok = s->counted || dfs_chunk_count(s, &r) == 0;
+    dfs_recipe_free(&r);
+    return ok ? 0 : -1;
+}
+
+// read one directory: subdirectories go back to the walk, files are kept
+static inline void dfs_inv_read_dir(DfsInvWalker *t, const char *dir) {
+    DfsInventory *inv = t->walk->inv;
+    char path[PATH_MAX];
+    if (snprintf(path, sizeof(path), "%s/%s", inv->root, dir) >= (int)sizeof(path)) return;
+    DfsDir d;
+    if (dfs_dir_open(&d, path) < 0) return;     // unreadable directories are left out, as tar would
+
+    char key[DFS_INDEX_KEY_MAX];
+    size_t dir_len = strlen(dir);
+    memcpy(key, dir, dir_len);
+    const char *name;
+    unsigned char type;
+    while ((name = dfs_dir_next(&d, &type)) != NULL) {
+        size_t n = strlen(name);
+        if (dir_len + n + 1 >= sizeof(key) || strchr(name, '\n')) continue;
+        memcpy(key + dir_len, name, n);
+
+        // d_type saves a stat for everything but the files that are kept
+        struct statx stx;
+        if (type == DT_UNKNOWN) {
+            if (dfs_dir_stat(&d, name, &stx) != 0) continue;
+            type = S_ISDIR(stx.stx_mode) ? DT_DIR : S_ISREG(stx.stx_mode) ? DT_REG : DT_UNKNOWN;
+        }
+        if (type == DT_DIR) {
+            key[dir_len + n] = '/';
+            dfs_inv_push(t->walk, key, dir_len + n + 1);
+            continue;
+        }
+        if (type != DT_REG || !dfs_tar_has_ext(name, inv->ext)) continue;
+        if (dfs_dir_stat(&d, name, &stx) != 0 || !S_ISREG(stx.stx_mode)) continue;
+
+        DfsIndexEntry e;
+        memset(&e, 0, sizeof(e));
+        e.port = inv->port;
+        e.size = stx.stx_size;
+        e.mtime = stx.stx_mtime.tv_sec;
+        if (inv->chunks && dfs_inv_read_recipe(inv->chunks, d.fd, name, &e) < 0) {
+            pthread_mutex_lock(&t->walk->lock);
+            t->walk->failed = 1;
+            pthread_cond_broadcast(&t->walk->more);
+            pthread_mutex_unlock(&t->walk->lock);
+            break;
+        }
+        if (dfs_index_copy_add(&t->found, key, dir_len + n, &e) < 0) {
+            pthread_mutex_lock(&t->walk->lock);
+            t->walk->failed = 1;
+            pthread_cond_broadcast(&t->walk->more);
+            pthread_mutex_unlock(&t->walk->lock);
+            break;
+        }
+    }
+    dfs_dir_close(&d);
+}
+
+static inline void *dfs_inv_walker(void *arg) {
+    DfsInvWalker *t = arg;
+    char *dir;
+    int done = 0;
+    while ((dir = dfs_inv_pop(t->walk, done)) != NULL) {
+        dfs_inv_read_dir(t, dir);
+        free(dir);
+        done = 1;
+    }
+    return NULL;
+}
+
+// walk the tree on threads threads and put what it holds into files
+// returns 0, or -1 when out of memory
+static inline int dfs_inv_walk(DfsInventory *inv, int threads, DfsIndex *files) {
+    DfsInvWalk w;
+    memset(&w, 0, sizeof(w));
+    pthread_mutex_init(&w.lock, NULL);
+    pthread_cond_init(&w.more, NULL);
+    w.inv = inv;
+    dfs_inv_push(&w, "", 0);
+
+    DfsInvWalker *t = calloc(threads, sizeof(*t));
+    int started = 0;
+    if (t) {
+        for (; started < threads; started++) {
+            t[started].walk = &w;
+            if (pthread_create(&t[started].tid, NULL, dfs_inv_walker, &t[started]) != 0) break;
+        }
+        // with no thread to spare the walk runs here
+        if (started == 0) dfs_inv_walker(&t[started++]);
+    }
+    for (int i = 0; i < started; i++) {
+        if (t[i].tid) pthread_join(t[i].tid, NULL);
+        for (size_t j = 0; j < t[i].found.count && !w.failed; j++) {
+            DfsIndexItem *it = &t[i].found.items[j];
+            if (!dfs_index_set(files, t[i].found.keys + it->key_off, it->len, &it->e)) w.failed = 1;
+        }
+        dfs_index_copy_free(&t[i].found);
+    }
+    int r = !t || w.failed ? -1 : 0;
+    while (w.count > 0) free(w.dirs[--w.count]);
+    free(w.dirs);
+    free(t);
+    pthread_mutex_destroy(&w.lock);
+    pthread_cond_destroy(&w.more);
+    return r;
+}
+
+// replace the inventory with a fresh walk of the tree, the changes made
+// meanwhile replayed on it. returns 0 with the number of files, or -1 when
+// out of memory (the old inventory stays)
+static inline int dfs_inv_rebuild(DfsInventory *inv, int threads, size_t *count) {
+    DfsIndex fresh;
+    if (dfs_index_init(&fresh) < 0) return -1;
+    pthread_rwlock_wrlock(&inv->lock);
+    int r = dfs_index_init(&inv->changes);
+    inv->walking = r == 0;
+    pthread_rwlock_unlock(&inv->lock);
+    if (r == 0) r = dfs_inv_walk(inv, threads, &fresh);
+
+    pthread_rwlock_wrlock(&inv->lock);
+    DfsIndexCopy cp;
+    if (r == 0) r = dfs_index_copy(&inv->changes, &cp);
+    if (r == 0) {
+        for (size_t i = 0; i < cp.count && r == 0; i++) {
+            DfsIndexItem *it = &cp.items[i];
+            if (it->e.removed) dfs_index_remove(&fresh, cp.keys + it->key_off, it->len);
+            else if (!dfs_index_set(&fresh, cp.keys + it->key_off, it->len, &it->e)) r = -1;
+        }
+        dfs_index_copy_free(&cp);
+    }
+    if (r == 0) {
+        DfsIndex old = inv->files;
+        inv->files = fresh;
+        fresh = old;
+        inv->dirty = 1;
+        *count = inv->files.entries;
+    }
+    dfs_index_free(&inv->changes);
+    inv->walking = 0;
+    pthread_rwlock_unlock(&inv->lock);
+    dfs_index_free(&fresh);
+    return r;
+}
+
+// an upload stored path; returns 0, or -1 when out of memory
+static inline int dfs_inv_stored(DfsInventory *inv, const char *path, uint64_t size, int64_t mtime) {
+    char key[DFS_INDEX_KEY_MAX];
+    int len = dfs_inv_key(inv, path, key);
+    if (len < 0) return 0;
+    DfsIndexEntry e;
+    memset(&e, 0, sizeof(e));
+    e.port = inv->port;
+    e.size = size;
+    e.mtime = mtime;
+
+    pthread_rwlock_wrlock(&inv->lock);
+    int r = dfs_index_set(&inv->files, key, len, &e) ? 0 : -1;
+    if (inv->walking && !dfs_index_set(&inv->changes, key, len, &e)) r = -1;
+    inv->dirty = 1;
+    pthread_rwlock_unlock(&inv->lock);
+    return r;
+}
+
+// path was removed; returns 0, or -1 when out of memory
+static inline int dfs_inv_removed(DfsInventory *inv, const char *path) {
+    char key[DFS_INDEX_KEY_MAX];
+    int len = dfs_inv_key(inv, path, key);
+    if (len < 0) return 0;
+
+    pthread_rwlock_wrlock(&inv->lock);
+    dfs_index_remove(&inv->files, key, len);
+    int r = inv->walking ? dfs_index_delete(&inv->changes, key, len, inv->port, 1) : 0;
+    inv->dirty = 1;
+    pthread_rwlock_unlock(&inv->lock);
+    return r;
+}
+
+// write the manifest if the inventory changed since the last time
+// returns 0, or -1 with errno set
+static inline int dfs_inv_save(DfsInventory *inv) {
+    DfsIndexCopy cp;
+    pthread_rwlock_rdlock(&inv->lock);
+    int dirty = inv->dirty;
+    int r = dirty ? dfs_index_copy(&inv->files, &cp) : 0;
+    // no writer runs beside a read lock, and this is the only reader that writes
+    if (r == 0) inv->dirty = 0;
+    pthread_rwlock_unlock(&inv->lock);
+    if (!dirty) return 0;
+    if (r < 0) {
+        errno = ENOMEM;
+        return -1;
+    }
+
+    char tmp[PATH_MAX + 8];
+    snprintf(tmp, sizeof(tmp), "%s.tmp", inv->manifest);
+    DfsIndexBase none;
+    memset(&none, 0, sizeof(none));
+    int fd = open(tmp, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+    r = fd < 0 ? -1 : dfs_index_write_snapshot(fd, &none, &cp, 0, 0);
+    if (r == 0) r = fsync(fd);
+    if (fd >= 0 && close(fd) < 0) r = -1;
+    if (r == 0) r = rename(tmp, inv->manifest);
+    dfs_index_copy_free(&cp);
+    if (r < 0) {
+        int err = errno;
+        if (fd >= 0) unlink(tmp);
+        pthread_rwlock_wrlock(&inv->lock);
+        inv->dirty = 1;
+        pthread_rwlock_unlock(&inv->lock);
+        errno = err;
+    }
+    return r;
+}
+
+typedef struct {
+    DfsIndexCopy *cp;
+    int failed;             // out of memory
+} DfsInvBatch;
+
+static inline int dfs_inv_batch_add(void *arg, const char *key, size_t len, const DfsIndexEntry *e) {
+    DfsInvBatch *b = arg;
+    if (dfs_index_copy_add(b->cp, key, len, e) < 0) return b->failed = 1;
+    return b->cp->count == DFS_INV_BATCH;
+}
+
+// up to DFS_INV_BATCH files whose path sorts after the first after_len bytes
+// of after, copied out so that no lock is held while they are sent
+// returns 0, or -1 when out of memory
+static inline int dfs_inv_batch(DfsInventory *inv, const char *after, size_t after_len, DfsIndexCopy *cp) {
+    DfsInvBatch b = { .cp = cp };
+    cp->count = 0;
+    cp->keys_len = 0;
+    pthread_rwlock_rdlock(&inv->lock);
+    dfs_index_range(&inv->files, after, after_len, dfs_inv_batch_add, &b);
+    pthread_rwlock_unlock(&inv->lock);
+    return b.failed ? -1 : 0;
+}
+
+// remember the last path of a batch, where the next one starts
+static inline size_t dfs_inv_last(const DfsIndexCopy *cp, char *after) {
+    const DfsIndexItem *it = &cp->items[cp->count - 1];
+    memcpy(after, cp->keys + it->key_off, it->len);
+    return it->len;
+}
+
+// a member whose content is in the chunk store, like dfs_tar_send_member
+static inline int dfs_inv_send_recipe(const DfsChunkStore *s, int sock, const DfsTarEntry *e,
+                                      const DfsRecipe *r) {
+    unsigned char start[DFS_TAR_CHUNK_MAX];
+    uint64_t left = e->size;
+    size_t n = dfs_tar_member_start(start, e);
+    if (dfs_send_all(sock, start, n, MSG_MORE) < 0 || dfs_chunk_send_part(s, sock, r, &left) < 0) return -1;
+    return dfs_tar_zeros(sock, left + dfs_tar_round(e->size) - e->size);
+}
+
+// a member whose file is packed, decoded on the way
+static inline int dfs_inv_send_packed(int sock, const DfsTarEntry *e, int fd, DfsPack *p) {
+    unsigned char start[DFS_TAR_CHUNK_MAX];
+    uint64_t left = e->size;
+    size_t n = dfs_tar_member_start(start, e);
+    if (dfs_send_all(sock, start, n, MSG_MORE) < 0 || dfs_pack_send(sock, fd, p, &left) < 0) return -1;
+    return dfs_tar_zeros(sock, left + dfs_tar_round(e->size) - e->size);
+}
+
+// write the archive of every file to a blocking socket as a chunked payload,
+// after the reply header. *count is set to the number of members
+// returns 0, or -1 if the socket failed or memory ran out
+static inline int dfs_inv_send_tar(DfsInventory *inv, int sock, size_t *count) {
+    DfsIndexCopy cp;
+    memset(&cp, 0, sizeof(cp));
+    char after[DFS_INDEX_KEY_MAX];
+    size_t after_len = 0;
+    int r = 0;
+    *count = 0;
+    while (r == 0 && (r = dfs_inv_batch(inv, after, after_len, &cp)) == 0 && cp.count > 0) {
+        for (size_t i = 0; i < cp.count && r == 0; i++) {
+            DfsIndexItem *it = &cp.items[i];
+            char path[PATH_MAX];
+            if (snprintf(path, sizeof(path), "%s/%.*s", inv->root, (int)it->len,
+                         cp.keys + it->key_off) >= (int)sizeof(path)) continue;
+
+            // no symlinks, and a fifo put in a file's place must not block the archive
+            int fd = open(path, O_RDONLY | O_CLOEXEC | O_NOFOLLOW | O_NONBLOCK);
+            if (fd < 0) continue;
+            struct stat st;
+            DfsRecipe recipe;
+            DfsPack pack;
+            int chunked = -1, packed = 0;
+            if (fstat(fd, &st) == 0 && S_ISREG(st.st_mode)) chunked = dfs_recipe_read(inv->chunks, fd, &recipe);
+            if (chunked == 0 && inv->chunks && inv->chunks->packed && (packed = dfs_pack_open(fd, &pack)) < 0) {
+                chunked = -1;
+            }
+            if (chunked >= 0) {
+                uint64_t size = chunked ? recipe.size : packed ? pack.size : (uint64_t)st.st_size;
+                DfsTarEntry e = { .path = path, .size = size, .mtime = st.st_mtime, .mode = st.st_mode & 07777,
+                                  .uid = st.st_uid, .gid = st.st_gid };
+                r = chunked ? dfs_inv_send_recipe(inv->chunks, sock, &e, &recipe)
+                    : packed ? dfs_inv_send_packed(sock, &e, fd, &pack)
+                    : dfs_tar_send_member(sock, &e, fd);
+                (*count)++;
+                dfs_recipe_free(&recipe);
+                if (packed) dfs_pack_close(&pack);
+            }
+            close(fd);
+        }
+        after_len = dfs_inv_last(&cp, after);
+    }
+    dfs_index_copy_free(&cp);
+    if (r < 0) return -1;
+
+    unsigned char end[DFS_TAR_END_MAX];
+    return dfs_send_all(sock, end, dfs_tar_end(end, *count), 0);
+}
+
+// every file as a chunked SCAN reply of "size mtime path" lines
+// returns 0, or -1 if the socket failed or memory ran out mid-reply (the
+// connection has to go then)
+static inline int dfs_inv_send_scan(DfsInventory *inv, int sock, const DfsHeader *req, size_t *count) {
+    if (dfs_send_header(sock, req->opcode, DFS_F_REPLY | DFS_F_CHUNKED, DFS_OK,
+                        req->request_id, NULL, 0) < 0) return -1;
+
+    static __thread DfsLineWriter w;
+    w.fd = sock;
+    w.len = 0;
+    DfsIndexCopy cp;
+    memset(&cp, 0, sizeof(cp));
+    char after[DFS_INDEX_KEY_MAX];
+    size_t after_len = 0;
+    int r = 0;
+    *count = 0;
+    while (r == 0 && (r = dfs_inv_batch(inv, after, after_len, &cp)) == 0 && cp.count > 0) {
+        for (size_t i = 0; i < cp.count && r == 0; i++) {
+            DfsIndexItem *it = &cp.items[i];
+            char line[64 + DFS_INDEX_KEY_MAX];
+            int len = snprintf(line, sizeof(line), "%llu %lld %.*s", (unsigned long long)it->e.size,
+                               (long long)it->e.mtime, (int)it->len, cp.keys + it->key_off);
+            if (len >= (int)sizeof(line)) continue;
+            r = dfs_lines_put(&w, line, len);
+            (*count)++;
+        }
+        after_len = dfs_inv_last(&cp, after);
+    }
+    dfs_index_copy_free(&cp);
+    if (r < 0) return -1;
+    return dfs_lines_end(&w);
+}
+
+typedef struct {
+    DfsNames *names;
+    int long_list;          // "name/size/mtime" lines
+    int failed;             // out of memory
+} DfsInvList;
+
+static inline int dfs_inv_list_add(void *arg, const char *name, size_t len, const DfsIndexEntry *e) {
+    DfsInvList *l = arg;
+    char line[DFS_LIST_LINE_MAX + 1];
+    if (len > DFS_LIST_NAME_MAX) return 0;
+    memcpy(line, name, len);
+    line[len] = '\0';
+    if (l->long_list) {
+        snprintf(line + len, sizeof(line) - len, "/%llu/%lld", (unsigned long long)e->size,
+                 (long long)e->mtime);
+    }
+    if (dfs_names_add(l->names, line) < 0) return l->failed = 1;
+    return l->names->limit && l->names->count == l->names->limit;
+}
+
+// the files directly in the directory path names, from the name from on,
+// into n, with their size and mtime for a long listing; they arrive sorted,
+// so a limit ends the walk once it is reached. returns 0, or -1 when out of memory
+static inline int dfs_inv_list(DfsInventory *inv, const char *path, const char *from, int long_list,
+                               DfsNames *n) {
+    char dir[DFS_INDEX_KEY_MAX];
+    int len = dfs_index_key(path, dir, sizeof(dir) - 1);
+    if (len < 0) return 0;
+    if (len > 0) dir[len++] = '/';
+
+    DfsInvList l = { .names = n, .long_list = long_list };
+    pthread_rwlock_rdlock(&inv->lock);
+    int r = dfs_index_list(&inv->files, dir, len, from, dfs_inv_list_add, &l);
+    pthread_rwlock_unlock(&inv->lock);
+    return r < 0 || l.failed ? -1 : 0;
+}
+
+#endif
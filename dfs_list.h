@@ -0,0 +1,244 @@
+// dfs_list.h - directory listings, shared by S1 and the storage servers
+//
+// names read from a directory are copied into an arena of 64 KiB blocks, so
+// adding one costs a copy and no malloc of its own. a listing with a limit
+// keeps only the smallest limit names in a max-heap and compacts the arena
+// when evicted names take up most of it, so a page of a huge directory needs
+// memory for the page, not for the directory.
+//
+// a LIST request may carry a payload: an 8 byte big-endian limit (0 = all
+// names), then where to start. towards a storage server that is a name, and
+// the reply holds the names >= it. towards S1 it is a resume token: the type
+// letter and the name of the last entry of the previous page.
+//
+// storage servers answer LIST with a chunked reply of their names sorted
+// bytewise, one per '\n' terminated line, and never split a line across
+// chunks. S1 merges them. a long listing (DFS_F_LONG) has "name/size/mtime"
+// lines instead: no name holds a '/', so the name is what comes before the
+// first one, and names are compared only up to it. SCAN is answered the same
+// way with every file a storage server holds, which is how S1 fills its
+// index (dfs_index.h).
+
+#ifndef DFS_LIST_H
+#define DFS_LIST_H
+
+#include <stdlib.h>
+#include <string.h>
+#include "dfs_proto.h"
+
+#define DFS_LIST_BLOCK 65536
+#define DFS_LIST_NAME_MAX 255                               // longest name a listing carries
+#define DFS_LIST_LINE_MAX (DFS_LIST_NAME_MAX + 42)          // and a long listing's size and mtime
+#define DFS_LIST_ARGS_MAX (8 + 1 + DFS_LIST_NAME_MAX)       // limit and resume token
+
+typedef struct DfsNameBlock {
+    struct DfsNameBlock *next;
+    size_t used;
+    char data[DFS_LIST_BLOCK];
+} DfsNameBlock;
+
+typedef struct {
+    DfsNameBlock *blocks;   // newest first, names are NUL terminated
+    char **names;           // a max-heap while a limit is set, sorted by dfs_names_sort
+    size_t count;
+    size_t cap;
+    size_t limit;           // keep only the smallest limit names, 0 keeps all
+    size_t live;            // arena bytes of the names kept
+    size_t used;            // arena bytes handed out
+} DfsNames;
+
+static inline void dfs_names_init(DfsNames *n, size_t limit) {
+    memset(n, 0, sizeof(*n));
+    n->limit = limit;
+}
+
+static inline void dfs_names_free(DfsNames *n) {
+    while (n->blocks) {
+        DfsNameBlock *b = n->blocks;
+        n->blocks = b->next;
+        free(b);
+    }
+    free(n->names);
+    dfs_names_init(n, n->limit);
+}
+
+// NUL terminated copy of a name in the arena, NULL when out of memory
+static inline char *dfs_names_copy(DfsNames *n, const char *name, size_t len) {
+    DfsNameBlock *b = n->blocks;
+    if (!b || b->used + len + 1 > sizeof(b->data)) {
+        b = malloc(sizeof(DfsNameBlock));
+        if (!b) return NULL;
+        b->next = n->blocks;
+        b->used = 0;
+        n->blocks = b;
+    }
+    char *p = b->data + b->used;
+    memcpy(p, name, len);
+    p[len] = '\0';
+    b->used += len + 1;
+    n->used += len + 1;
+    n->live += len + 1;
+    return p;
+}
+
+static inline void dfs_names_swap(char **names, size_t a, size_t b) {
+    char *t = names[a];
+    names[a] = names[b];
+    names[b] = t;
+}
+
+// bytewise order of the names of two lines, which end at a '/' or the NUL
+static inline int dfs_name_cmp(const char *a, const char *b) {
+    while (*a == *b && *a && *a != '/') {
+        a++;
+        b++;
+    }
+    unsigned char x = *a == '/' ? 0 : *a, y = *b == '/' ? 0 : *b;
+    return x - y;
+}
+
+static inline void dfs_names_sift_up(char **names, size_t i) {
+    while (i > 0 && dfs_name_cmp(names[i], names[(i - 1) / 2]) > 0) {
+        dfs_names_swap(names, i, (i - 1) / 2);
+        i = (i - 1) / 2;
+    }
+}
+
+static inline void dfs_names_sift_down(char **names, size_t count, size_t i) {
+    while (1) {
+        size_t max = i, l = 2 * i + 1, r = l + 1;
+        if (l < count && dfs_name_cmp(names[l], names[max]) > 0) max = l;
+        if (r < count && dfs_name_cmp(names[r], names[max]) > 0) max = r;
+        if (max == i) return;
+        dfs_names_swap(names, i, max);
+        i = max;
+    }
+}
+
+// move the kept names into a fresh arena; on failure the old one stays in use
+static inline void dfs_names_compact(DfsNames *n) {
+    DfsNames fresh;
+    dfs_names_init(&fresh, n->limit);
+    fresh.names = malloc(n->cap * sizeof(char *));
+    if (!fresh.names) return;
+    fresh.cap = n->cap;
+    for (size_t i = 0; i < n->count; i++) {
+        fresh.names[i] = dfs_names_copy(&fresh, n->names[i], strlen(n->names[i]));
+        if (!fresh.names[i]) {
+            dfs_names_free(&fresh);
+            return;
+        }
+    }
+    fresh.count = n->count;
+    dfs_names_free(n);
+    *n = fresh;
+}
+
+// add a name or a long listing's line; with a limit it is only kept while
+// it is among the smallest. returns 0, or -1 when out of memory
+static inline int dfs_names_add(DfsNames *n, const char *name) {
+    size_t len = strlen(name);
+    if (strcspn(name, "/") > DFS_LIST_NAME_MAX) return 0;
+
+    if (n->limit && n->count == n->limit) {
+        // full page: the name replaces the largest one if it is smaller
+        if (dfs_name_cmp(name, n->names[0]) >= 0) return 0;
+        char *p = dfs_names_copy(n, name, len);
+        if (!p) return -1;
+        n->live -= strlen(n->names[0]) + 1;
+        n->names[0] = p;
+        dfs_names_sift_down(n->names, n->count, 0);
+        if (n->used > 2 * n->live + DFS_LIST_BLOCK) dfs_names_compact(n);
+        return 0;
+    }
+
+    if (n->count == n->cap) {
+        size_t cap = n->cap ? n->cap * 2 : 1024;
+        char **grown = realloc(n->names, cap * sizeof(char *));
+        if (!grown) return -1;
+        n->names = grown;
+        n->cap = cap;
+    }
+    char *p = dfs_names_copy(n, name, len);
+    if (!p) return -1;
+    n->names[n->count++] = p;
+    if (n->limit) dfs_names_sift_up(n->names, n->count - 1);
+    return 0;
+}
+
+static inline int dfs_names_cmp(const void *a, const void *b) {
+    return dfs_name_cmp(*(char *const *)a, *(char *const *)b);
+}
+
+// bytewise order, the order in which S1 merges the listings
+static inline void dfs_names_sort(DfsNames *n) {
+    qsort(n->names, n->count, sizeof(char *), dfs_names_cmp);
+}
+
+// lines going out as chunks of at most DFS_LIST_BLOCK bytes, none split
+typedef struct {
+    int fd;
+    size_t len;
+    char chunk[DFS_CHUNK_HEADER + DFS_LIST_BLOCK];
+} DfsLineWriter;
+
+static inline int dfs_lines_flush(DfsLineWriter *w) {
+    if (w->len == 0) return 0;
+    dfs_put64((unsigned char *)w->chunk, w->len);
+    int r = dfs_send_all(w->fd, w->chunk, DFS_CHUNK_HEADER + w->len, MSG_MORE);
+    w->len = 0;
+    return r;
+}
+
+// queue line and a '\n'; returns 0, or -1 if the socket failed
+static inline int dfs_lines_put(DfsLineWriter *w, const char *line, size_t len) {
+    if (w->len + len + 1 > DFS_LIST_BLOCK && dfs_lines_flush(w) < 0) return -1;
+    memcpy(w->chunk + DFS_CHUNK_HEADER + w->len, line, len);
+    w->chunk[DFS_CHUNK_HEADER + w->len + len] = '\n';
+    w->len += len + 1;
+    return 0;
+}
+
+// the last lines and the end chunk
+static inline int dfs_lines_end(DfsLineWriter *w) {
+    if (dfs_lines_flush(w) < 0) return -1;
+    unsigned char end[DFS_CHUNK_HEADER] = {0};
+    return dfs_send_all(w->fd, end, sizeof(end), 0);
+}
+
+// sorted names as a chunked LIST reply; returns 0, or -1 if the socket failed
+static inline int dfs_send_names(int fd, const DfsHeader *req, DfsNames *n) {
+    if (dfs_send_header(fd, req->opcode, DFS_F_REPLY | DFS_F_CHUNKED, DFS_OK,
+                        req->request_id, NULL, 0) < 0) return -1;
+    dfs_names_sort(n);
+
+    static __thread DfsLineWriter w;
+    w.fd = fd;
+    w.len = 0;
+    for (size_t i = 0; i < n->count; i++) {
+        if (dfs_lines_put(&w, n->names[i], strlen(n->names[i])) < 0) return -1;
+    }
+    return dfs_lines_end(&w);
+}
+
+// optional payload of a LIST request: the limit and where to start
+// returns 0, 1 if it was malformed (it is skipped), -1 if the stream failed
+static inline int dfs_read_list_args(DfsReader *rd, const DfsHeader *req, uint64_t *limit,
+                                     char *from, size_t from_max) {
+    *limit = 0;
+    from[0] = '\0';
+    if (req->payload_len == 0) return 0;
+    if (req->payload_len < 8 || req->payload_len - 8 >= from_max) {
+        return dfs_skip(rd, req->payload_len) < 0 ? -1 : 1;
+    }
+
+    unsigned char args[DFS_LIST_ARGS_MAX];
+    if (req->payload_len > sizeof(args)) return dfs_skip(rd, req->payload_len) < 0 ? -1 : 1;
+    if (dfs_read_full(rd, args, req->payload_len) < 0) return -1;
+    *limit = dfs_get64(args);
+    memcpy(from, args + 8, req->payload_len - 8);
+    from[req->payload_len - 8] = '\0';
+    return 0;
+}
+
+#endif
@@ -0,0 +1,215 @@
+// dfs_lz4.h - LZ4 compression of file data on the wire
+//
+// a DOWNLOAD with DFS_F_LZ4 set says the client takes a compressed reply;
+// the sender then compresses unless the content is unlikely to shrink: .zip
+// files, and files whose first block has a byte entropy near 8 bits, like
+// most PDFs. the client compresses an UPLOAD the same way and marks it with
+// DFS_F_LZ4. DFS_F_DENSE asks for the dense compressor, for slow links.
+//
+// a compressed payload is a chunk sequence like a DFS_F_CHUNKED one, ended
+// by an empty chunk. each chunk is one block of at most DFS_LZ4_BLOCK bytes:
+// its 4 byte length, then the block in LZ4's block format, or the bytes as
+// they are where that is not shorter. blocks are independent. an UPLOAD's
+// payload starts with the 8 byte size and XXH64 of the data, the layout of
+// DFS_F_HASH's claim, and the storing server checks what it decoded against
+// them. the client sends it with DFS_F_CHUNKED and a payload_len of 0, each
+// block going out as soon as it is compressed; S1 relays it the same way. a
+// compressed DOWNLOAD reply is chunked and carries both flags.
+//
+// the blocks are those of dfs_lz4_block.h, which any LZ4 decoder reads.
+
+#ifndef DFS_LZ4_H
+#define DFS_LZ4_H
+
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+#include "dfs_proto.h"
+#include "dfs_hash.h"
+#include "dfs_chunk.h"
+#include "dfs_lz4_block.h"
+
+#define DFS_LZ4_HEADER 16               // size and XXH64 ahead of an upload's chunks
+#define DFS_LZ4_CHUNK_MAX (DFS_CHUNK_HEADER + 4 + DFS_LZ4_BLOCK)
+#define DFS_LZ4_MIN 512                 // smaller files go as they are
+#define DFS_LZ4_ENTROPY_MAX (7 * 256)   // bits per byte, in 1/256, above which data is sent as it is
+#define DFS_LZ4_SAMPLE 16384
+
+// one block of at most DFS_LZ4_BLOCK bytes as a chunk, into out with room
+// for DFS_LZ4_CHUNK_MAX bytes; returns the length of the chunk
+static inline size_t dfs_lz4_chunk(DfsLz4 *z, const void *data, size_t n, unsigned char *out, int dense) {
+    unsigned char *body = out + DFS_CHUNK_HEADER + 4;
+    size_t len = dfs_lz4_compress(z, data, n, body, n - 1, dense);
+    if (len == 0) {
+        memcpy(body, data, n);
+        len = n;
+    }
+    dfs_put64(out, 4 + len);
+    dfs_put32(out + DFS_CHUNK_HEADER, n);
+    return DFS_CHUNK_HEADER + 4 + len;
+}
+
+// the block of a chunk whose len bytes, after the chunk header, are at p,
+// into out with room for DFS_LZ4_BLOCK bytes
+// returns the length of the block, or -1 if the chunk is malformed
+static inline ssize_t dfs_lz4_unchunk(const unsigned char *p, size_t len, unsigned char *out) {
+    if (len < 4 || len > 4 + DFS_LZ4_BLOCK) return -1;
+    size_t n = dfs_get32(p);
+    if (n == 0 || n > DFS_LZ4_BLOCK || len - 4 > n) return -1;
+    if (len - 4 == n) {
+        memcpy(out, p + 4, n);
+        return n;
+    }
+    return dfs_lz4_decompress(p + 4, len - 4, out, n) == 0 ? (ssize_t)n : -1;
+}
+
+// log2(x) in 1/256, linear between powers of two; x > 0
+static inline uint32_t dfs_lz4_log2(uint32_t x) {
+    int e = 31 - __builtin_clz(x);
+    uint32_t frac = e >= 8 ? (x >> (e - 8)) & 255 : (x << (8 - e)) & 255;
+    return e * 256 + frac;
+}
+
+// whether a file is worth compressing, judged by its name and the first n
+// bytes of it: not a .zip, and a sample whose order-0 entropy leaves room
+static inline int dfs_lz4_worth(const char *path, const void *sample, size_t n) {
+    const char *ext = strrchr(path, '.');
+    if (ext && strcasecmp(ext, ".zip") == 0) return 0;
+    if (n < DFS_LZ4_MIN) return 0;
+    if (n > DFS_LZ4_SAMPLE) n = DFS_LZ4_SAMPLE;
+    uint32_t counts[256] = {0};
+    for (size_t i = 0; i < n; i++) counts[((const unsigned char *)sample)[i]]++;
+    uint64_t bits = 0;
+    uint32_t total = dfs_lz4_log2(n);
+    for (int b = 0; b < 256; b++) {
+        if (counts[b]) bits += (uint64_t)counts[b] * (total - dfs_lz4_log2(counts[b]));
+    }
+    return bits / n < DFS_LZ4_ENTROPY_MAX;
+}
+
+// the frames of a packed file are blocks of a compressed reply already
+// (dfs_pack.h), and go out as they are stored; returns 1, or -1 if the
+// socket failed
+static inline int dfs_lz4_send_packed(int sock, const DfsHeader *req, DfsContent *content) {
+    unsigned char *chunk = malloc(DFS_LZ4_CHUNK_MAX);
+    if (!chunk || dfs_send_header(sock, req->opcode, DFS_F_REPLY | DFS_F_CHUNKED | DFS_F_LZ4, DFS_OK,
+                                  req->request_id, NULL, 0) < 0) {
+        free(chunk);
+        return -1;
+    }
+    int r = 1;
+    const DfsPack *p = &content->pack;
+    for (size_t i = 0; i < p->count && r > 0; i++) {
+        ssize_t len = dfs_pack_stored(content->fd, p, i, chunk + DFS_CHUNK_HEADER + 4);
+        // a read error ends the reply without its empty chunk, the receiver sees it cut short
+        if (len < 0) {
+            r = -1;
+            break;
+        }
+        dfs_put64(chunk, 4 + len);
+        dfs_put32(chunk + DFS_CHUNK_HEADER, dfs_pack_frame_len(p, i));
+        if (dfs_send_all(sock, chunk, DFS_CHUNK_HEADER + 4 + len, MSG_MORE) < 0) r = -1;
+    }
+    memset(chunk, 0, DFS_CHUNK_HEADER);
+    if (r > 0 && dfs_send_all(sock, chunk, DFS_CHUNK_HEADER, 0) < 0) r = -1;
+    free(chunk);
+    return r;
+}
+
+// send a stored file compressed, as the chunked reply to req
+// returns 1 if it was sent, 0 if it does not look compressible and nothing
+// was sent, -1 if the socket failed
+static inline int dfs_lz4_send(int sock, const DfsHeader *req, DfsContent *content, const char *path) {
+    if (content->packed && content->pack.frame == DFS_LZ4_BLOCK) return dfs_lz4_send_packed(sock, req, content);
+    unsigned char *block = malloc(DFS_LZ4_BLOCK);
+    unsigned char *chunk = malloc(DFS_LZ4_CHUNK_MAX);
+    DfsLz4 *z = dfs_lz4_new();
+    int r = 0;
+    uint64_t off = 0;
+    ssize_t n = block && chunk && z ? dfs_content_read(content, block, DFS_LZ4_BLOCK, 0) : -1;
+    if (n > 0 && dfs_lz4_worth(path, block, n)) {
+        int dense = (req->flags & DFS_F_DENSE) != 0;
+        r = dfs_send_header(sock, req->opcode, DFS_F_REPLY | DFS_F_CHUNKED | DFS_F_LZ4, DFS_OK,
+                            req->request_id, NULL, 0) < 0 ? -1 : 1;
+        while (r > 0 && n > 0) {
+            size_t len = dfs_lz4_chunk(z, block, n, chunk, dense);
+            if (dfs_send_all(sock, chunk, len, MSG_MORE) < 0) r = -1;
+            off += n;
+            if (off >= content->size) break;
+            n = dfs_content_read(content, block, DFS_LZ4_BLOCK, off);
+        }
+        // a read error ends the reply without its empty chunk, the receiver sees it cut short
+        if (r > 0 && off >= content->size) {
+            unsigned char last[DFS_CHUNK_HEADER] = {0};
+            if (dfs_send_all(sock, last, sizeof(last), 0) < 0) r = -1;
+        } else if (r > 0) {
+            r = -1;
+        }
+    }
+    free(block);
+    free(chunk);
+    free(z);
+    return r;
+}
+
+// decode the chunks of a compressed payload from rd into out_fd, up to and
+// including the empty chunk that ends them. left, unless NULL, is the
+// payload still to be read: chunks may not run past it, and whatever
+// happens it is all read, so the stream stays in step. DFS_LEN_CHUNKED
+// there stands for a chunked payload, read to its end unless its framing
+// is broken. *written is the decoded size, hashed into h unless that is NULL
+// returns DFS_OK, DFS_E_INVALID for malformed data, DFS_E_IO if out_fd
+// failed, or -1 if the stream failed
+static inline int dfs_lz4_recv(DfsReader *rd, uint64_t *left, int out_fd, uint64_t *written, DfsXxh64 *h) {
+    unsigned char *chunk = malloc(DFS_LZ4_CHUNK_MAX);
+    unsigned char *block = malloc(DFS_LZ4_BLOCK);
+    int status = chunk && block ? DFS_OK : DFS_E_IO;
+    uint64_t *chunked = left && *left == DFS_LEN_CHUNKED ? left : NULL;
+    int framed = 1;
+    if (chunked) left = NULL;
+    *written = 0;
+    while (status == DFS_OK) {
+        if (left && *left < DFS_CHUNK_HEADER) {
+            status = DFS_E_INVALID;
+            break;
+        }
+        if (dfs_read_full(rd, chunk, DFS_CHUNK_HEADER) < 0) {
+            status = -1;
+            break;
+        }
+        if (left) *left -= DFS_CHUNK_HEADER;
+        uint64_t len = dfs_get64(chunk);
+        if (len == 0) break;
+        if (len > DFS_LZ4_CHUNK_MAX - DFS_CHUNK_HEADER || (left && len > *left)) {
+            status = DFS_E_INVALID;
+            framed = 0;
+            break;
+        }
+        if (dfs_read_full(rd, chunk, len) < 0) {
+            status = -1;
+            break;
+        }
+        if (left) *left -= len;
+        ssize_t n = dfs_lz4_unchunk(chunk, len, block);
+        if (n < 0) status = DFS_E_INVALID;
+        else if (dfs_chunk_write_all(out_fd, block, n) < 0) status = DFS_E_IO;
+        else if (h) dfs_xxh64_update(h, block, n);
+        *written += n > 0 ? n : 0;
+    }
+    free(chunk);
+    free(block);
+    if (status < 0) return -1;
+    if (chunked) {
+        if (status != DFS_OK && (!framed || dfs_skip_chunks(rd) < 0)) return -1;
+        *chunked = 0;
+    }
+    if (left && *left > 0) {
+        if (dfs_skip(rd, *left) < 0) return -1;
+        *left = 0;
+        if (status == DFS_OK) status = DFS_E_INVALID;
+    }
+    return status;
+}
+
+#endif
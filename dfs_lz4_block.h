@@ -0,0 +1,215 @@
+// dfs_lz4_block.h - the LZ4 block codec
+//
+// compresses blocks of up to DFS_LZ4_BLOCK bytes in LZ4's block format and
+// decodes them again. the fast compressor tries one earlier position per
+// hash, the dense one follows a chain of them for the longest match. both
+// keep to the format's end-of-block rules, so any LZ4 decoder reads what
+// they write, and the decoder checks every length and offset against its
+// input and output, so malformed blocks fail instead of overrunning.
+//
+// the wire format of dfs_lz4.h and the packed files of dfs_pack.h are built
+// on it.
+
+#ifndef DFS_LZ4_BLOCK_H
+#define DFS_LZ4_BLOCK_H
+
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+
+#define DFS_LZ4_BLOCK 65536
+#define DFS_LZ4_HASH_LOG 16
+#define DFS_LZ4_DENSE_DEPTH 64          // candidates the dense compressor tries per position
+#define DFS_LZ4_MIN_MATCH 4
+#define DFS_LZ4_LAST_LITERALS 5         // a block ends with at least this many literals
+#define DFS_LZ4_MF_LIMIT 12             // and its last match starts this far from the end
+#define DFS_LZ4_MAX_DISTANCE 65535
+
+// compressor state, kept across blocks so its tables need no clearing
+typedef struct {
+    uint32_t head[1 << DFS_LZ4_HASH_LOG];   // base + position of the last occurrence of each hash
+    uint16_t chain[DFS_LZ4_BLOCK];          // distance from a position to the previous one with its hash
+    uint32_t base;                          // positions of the current block start here
+} DfsLz4;
+
+static inline DfsLz4 *dfs_lz4_new(void) {
+    DfsLz4 *z = calloc(1, sizeof(DfsLz4));
+    if (z) z->base = 1;
+    return z;
+}
+
+static inline uint32_t dfs_lz4_read32(const unsigned char *p) {
+    uint32_t v;
+    memcpy(&v, p, sizeof(v));
+    return v;
+}
+
+static inline uint32_t dfs_lz4_hash(const unsigned char *p) {
+    return (dfs_lz4_read32(p) * 2654435761u) >> (32 - DFS_LZ4_HASH_LOG);
+}
+
+// remember position i of the current block under its hash
+static inline uint32_t dfs_lz4_insert(DfsLz4 *z, const unsigned char *src, size_t i) {
+    uint32_t h = dfs_lz4_hash(src + i);
+    uint32_t prev = z->head[h];
+    z->head[h] = z->base + i;
+    z->chain[i] = prev >= z->base && z->base + i - prev <= DFS_LZ4_MAX_DISTANCE ? z->base + i - prev : 0;
+    return prev;
+}
+
+// length of the common run at a and b, b < a, up to limit; compared a word at a time
+static inline size_t dfs_lz4_match_len(const unsigned char *src, size_t a, size_t b, size_t limit) {
+    size_t n = 0;
+#if __BYTE_ORDER__ == __ORDER_LITTLE_ENDIAN__
+    while (a + n + 8 <= limit) {
+        uint64_t x, y;
+        memcpy(&x, src + a + n, 8);
+        memcpy(&y, src + b + n, 8);
+        if (x != y) return n + (__builtin_ctzll(x ^ y) >> 3);
+        n += 8;
+    }
+#endif
+    while (a + n < limit && src[a + n] == src[b + n]) n++;
+    return n;
+}
+
+// a length of 15 or more continues in bytes of 255 and a final smaller one
+static inline unsigned char *dfs_lz4_put_len(unsigned char *op, size_t len) {
+    for (; len >= 255; len -= 255) *op++ = 255;
+    *op++ = len;
+    return op;
+}
+
+// one sequence: literals, then a match at offset of len bytes (none if len is 0)
+// returns the end of the output, or NULL if it does not fit before end
+static inline unsigned char *dfs_lz4_sequence(unsigned char *op, unsigned char *end, const unsigned char *lit,
+                                              size_t lit_len, size_t offset, size_t len) {
+    size_t ml = len ? len - DFS_LZ4_MIN_MATCH : 0;
+    if ((size_t)(end - op) < 1 + lit_len / 255 + 1 + lit_len + 2 + ml / 255 + 1) return NULL;
+    unsigned char *token = op++;
+    *token = (lit_len >= 15 ? 15 : lit_len) << 4;
+    if (lit_len >= 15) op = dfs_lz4_put_len(op, lit_len - 15);
+    memcpy(op, lit, lit_len);
+    op += lit_len;
+    if (len == 0) return op;
+    *op++ = offset;
+    *op++ = offset >> 8;
+    *token |= ml >= 15 ? 15 : ml;
+    if (ml >= 15) op = dfs_lz4_put_len(op, ml - 15);
+    return op;
+}
+
+// compress n bytes of src, at most DFS_LZ4_BLOCK, into dst
+// returns the compressed length, or 0 if it does not fit in cap bytes
+static inline size_t dfs_lz4_compress(DfsLz4 *z, const unsigned char *src, size_t n,
+                                      unsigned char *dst, size_t cap, int dense) {
+    // positions are stored as base + offset; once base nears the top the tables start over
+    if (z->base > UINT32_MAX - 2 * DFS_LZ4_BLOCK) {
+        memset(z->head, 0, sizeof(z->head));
+        z->base = 1;
+    }
+    unsigned char *op = dst, *end = dst + cap;
+    size_t anchor = 0, i = 0, misses = 0;
+    size_t limit = n - DFS_LZ4_LAST_LITERALS;
+    while (n >= DFS_LZ4_MF_LIMIT + 1 && i <= n - DFS_LZ4_MF_LIMIT) {
+        uint32_t cand = dfs_lz4_insert(z, src, i);
+        size_t best = 0, from = 0;
+        for (int depth = 0; cand >= z->base && depth < (dense ? DFS_LZ4_DENSE_DEPTH : 1); depth++) {
+            size_t j = cand - z->base;
+            if (i - j > DFS_LZ4_MAX_DISTANCE) break;
+            if (dfs_lz4_read32(src + j) == dfs_lz4_read32(src + i)) {
+                size_t len = DFS_LZ4_MIN_MATCH + dfs_lz4_match_len(src, i + DFS_LZ4_MIN_MATCH, j + DFS_LZ4_MIN_MATCH, limit);
+                if (len > best) {
+                    best = len;
+                    from = j;
+                }
+            }
+            if (z->chain[j] == 0) break;
+            cand -= z->chain[j];
+        }
+        if (best == 0) {
+            // data that keeps missing is skipped through faster, as LZ4 does
+            i += 1 + (misses++ >> 6);
+            continue;
+        }
+        // a match may reach back into the pending literals
+        size_t start = i;
+        while (start > anchor && from > 0 && src[start - 1] == src[from - 1]) {
+            start--;
+            from--;
+            best++;
+        }
+        op = dfs_lz4_sequence(op, end, src + anchor, start - anchor, start - from, best);
+        if (!op) return 0;
+        size_t next = start + best;
+        if (dense) {
+            for (size_t k = i + 1; k < next && k <= n - DFS_LZ4_MF_LIMIT; k++) dfs_lz4_insert(z, src, k);
+        } else if (next - 2 <= n - DFS_LZ4_MF_LIMIT) {
+            dfs_lz4_insert(z, src, next - 2);
+        }
+        i = anchor = next;
+        misses = 0;
+    }
+    op = dfs_lz4_sequence(op, end, src + anchor, n - anchor, 0, 0);
+    z->base += DFS_LZ4_BLOCK;
+    return op ? (size_t)(op - dst) : 0;
+}
+
+// decompress an LZ4 block of len bytes into exactly n bytes at dst
+// returns 0, or -1 if it is malformed or does not decode to n bytes
+static inline int dfs_lz4_decompress(const unsigned char *src, size_t len, unsigned char *dst, size_t n) {
+    size_t ip = 0, op = 0;
+    for (;;) {
+        if (ip >= len) return -1;
+        unsigned token = src[ip++];
+        size_t lit = token >> 4;
+        if (lit == 15) {
+            unsigned char b;
+            do {
+                if (ip >= len) return -1;
+                b = src[ip++];
+                lit += b;
+            } while (b == 255);
+        }
+        if (lit > len - ip || lit > n - op) return -1;
+        // short runs, the common case, as one fixed size copy where there is room past them
+        if (lit <= 16 && len - ip >= 16 && n - op >= 16) memcpy(dst + op, src + ip, 16);
+        else memcpy(dst + op, src + ip, lit);
+        ip += lit;
+        op += lit;
+        // the last sequence has no match
+        if (ip == len) return op == n ? 0 : -1;
+
+        if (len - ip < 2) return -1;
+        size_t offset = src[ip] | (size_t)src[ip + 1] << 8;
+        ip += 2;
+        if (offset == 0 || offset > op) return -1;
+        size_t ml = token & 15;
+        if (ml == 15) {
+            unsigned char b;
+            do {
+                if (ip >= len) return -1;
+                b = src[ip++];
+                ml += b;
+            } while (b == 255);
+        }
+        ml += DFS_LZ4_MIN_MATCH;
+        if (ml > n - op) return -1;
+        // the match may overlap its own output; copy in runs that do not
+        unsigned char *d = dst + op;
+        const unsigned char *m = dst + (op - offset);
+        if (offset >= 8 && n - op >= ml + 8) {
+            for (size_t k = 0; k < ml; k += 8) memcpy(d + k, m + k, 8);
+        } else {
+            for (size_t left = ml; left > 0; ) {
+                size_t k = (size_t)(d - m) < left ? (size_t)(d - m) : left;
+                memcpy(d, m, k);
+                d += k;
+                left -= k;
+            }
+        }
+        op += ml;
+    }
+}
+
+#endif
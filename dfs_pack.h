@@ -0,0 +1,405 @@
+// dfs_pack.h - files stored compressed, readable at any offset
+//
+// a server that packs its uploads (S3 with -z) stores a file as frames of
+// DFS_PACK_FRAME bytes of content, each compressed on its own with the codec
+// of dfs_lz4_block.h, or kept as it is where that is not shorter. an index
+// at the end of the file has the stored length of every frame, so a read at
+// any offset finds its frame there and decodes that frame alone: a whole
+// file is decoded once, front to back, and a range costs only the frames
+// it touches. a file whose first frame does not shrink by an eighth, and a
+// file under DFS_PACK_MIN bytes, is stored plain.
+//
+// layout: the 8 byte magic, the 8 byte size of the content, the 4 byte frame
+// size and 4 zero bytes; the frames; a 4 byte stored length per frame; the
+// XXH64 of the header and the index. the server marks the files it packs
+// with an extended attribute (DFS_KIND_XATTR), which no client can set: an
+// upload stored as it is never reads as packed, whatever its bytes. like a
+// recipe (dfs_chunk.h), a marked file is also only taken for packed if all
+// of the layout adds up. frames are as large as the
+// blocks of a compressed DOWNLOAD reply (dfs_lz4.h), which sends them as
+// they are stored.
+
+#ifndef DFS_PACK_H
+#define DFS_PACK_H
+
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <unistd.h>
+#include <sys/stat.h>
+#include <sys/xattr.h>
+#include "dfs_proto.h"
+#include "dfs_hash.h"
+#include "dfs_lz4_block.h"
+
+#define DFS_PACK_MAGIC "DFSPAK1\n"
+#define DFS_PACK_HEADER 24              // magic, size, frame size
+#define DFS_PACK_ENTRY 4                // stored length of a frame
+#define DFS_PACK_TRAILER 8              // XXH64 of the header and the index
+#define DFS_PACK_FRAME DFS_LZ4_BLOCK
+#define DFS_PACK_FRAME_MIN 1024
+#define DFS_PACK_MIN 4096               // smaller files are stored plain
+#define DFS_PACK_FAST 1                 // packing levels
+#define DFS_PACK_DENSE 2
+
+// what the server made of a stored file, if it is not the content as it is;
+// kept by links and renames, lost by copies that drop extended attributes
+#define DFS_KIND_XATTR "user.dfs.kind"
+#define DFS_KIND_RECIPE "recipe"
+#define DFS_KIND_PACK "pack"
+
+// a file being written packed
+typedef struct {
+    int fd;
+    int dense;
+    int plain;              // the content did not shrink, it is written as it is
+    DfsLz4 *z;
+    unsigned char *out;     // a compressed frame
+    uint32_t *lens;         // stored length of each frame
+    size_t count;
+    uint64_t size;          // of the content
+    uint64_t pos;           // where the next frame goes
+} DfsPackWriter;
+
+// a packed file being read
+typedef struct {
+    uint64_t size;          // of the content
+    uint32_t frame;
+    size_t count;
+    uint64_t *starts;       // offset of each frame in the file, and the end of the last
+    unsigned char *buf;     // a frame as stored, and decoded
+    size_t cur;             // the frame decoded in buf, count if none
+} DfsPack;
+
+static inline uint64_t dfs_pack_frames(uint64_t size, uint32_t frame) {
+    return (size + frame - 1) / frame;
+}
+
+// pwrite(2) all of data; returns 0, or -1 with errno set
+static inline int dfs_pack_pwrite(int fd, const void *data, size_t n, uint64_t off) {
+    const char *p = data;
+    while (n > 0) {
+        ssize_t w = pwrite(fd, p, n, off);
+        if (w < 0 && errno == EINTR) continue;
+        if (w <= 0) {
+            if (w == 0) errno = EIO;
+            return -1;
+        }
+        p += w;
+        n -= w;
+        off += w;
+    }
+    return 0;
+}
+
+// pread(2) all of n bytes; returns 0, or -1 with errno set (EIO if the file is short)
+static inline int dfs_pack_pread_full(int fd, void *buf, size_t n, uint64_t off) {
+    char *p = buf;
+    while (n > 0) {
+        ssize_t r = pread(fd, p, n, off);
+        if (r < 0 && errno == EINTR) continue;
+        if (r <= 0) {
+            if (r == 0) errno = EIO;
+            return -1;
+        }
+        p += r;
+        n -= r;
+        off += r;
+    }
+    return 0;
+}
+
+// mark the file fd as being of a kind; returns 0, or -1 with errno set
+static inline int dfs_kind_mark(int fd, const char *kind) {
+    return fsetxattr(fd, DFS_KIND_XATTR, kind, strlen(kind), 0);
+}
+
+// whether the server marked the file fd as being of a kind
+// returns 1 if it did, 0 if not, -1 with errno set
+static inline int dfs_kind_is(int fd, const char *kind) {
+    char value[16];
+    ssize_t n = fgetxattr(fd, DFS_KIND_XATTR, value, sizeof(value));
+    if (n < 0) return errno == ENODATA || errno == ENOTSUP || errno == ERANGE ? 0 : -1;
+    return (size_t)n == strlen(kind) && memcmp(value, kind, n) == 0;
+}
+
+// whether the filesystem of the open file fd keeps the marks; the mark is
+// set and removed again. returns 0, or -1 with errno set (ENOTSUP if not)
+static inline int dfs_kind_probe(int fd) {
+    if (fsetxattr(fd, DFS_KIND_XATTR, "", 0, 0) < 0) return -1;
+    return fremovexattr(fd, DFS_KIND_XATTR);
+}
+
+// start writing size bytes of content to the new file fd at a level, 0 for plain
+// returns 0, or -1 when out of memory
+static inline int dfs_pack_begin(DfsPackWriter *w, int fd, uint64_t size, int level) {
+    memset(w, 0, sizeof(*w));
+    w->fd = fd;
+    w->size = size;
+    w->dense = level == DFS_PACK_DENSE;
+    w->plain = level == 0 || size < DFS_PACK_MIN;
+    if (w->plain) return 0;
+    w->z = dfs_lz4_new();
+    w->out = malloc(DFS_PACK_FRAME);
+    w->lens = malloc(dfs_pack_frames(size, DFS_PACK_FRAME) * sizeof(uint32_t));
+    if (!w->z || !w->out || !w->lens) {
+        free(w->z);
+        free(w->out);
+        free(w->lens);
+        errno = ENOMEM;
+        return -1;
+    }
+    w->pos = DFS_PACK_HEADER;
+    return 0;
+}
+
+// write the next frame of content, n bytes: DFS_PACK_FRAME but for the last
+// returns 0, or -1 with errno set
+static inline int dfs_pack_put(DfsPackWriter *w, const unsigned char *data, size_t n) {
+    size_t len = 0;
+    if (!w->plain) {
+        // the first frame decides whether packing pays
+        len = dfs_lz4_compress(w->z, data, n, w->out, w->count == 0 ? n - n / 8 : n - 1, w->dense);
+        if (len == 0 && w->count == 0) {
+            w->plain = 1;
+            w->pos = 0;
+        }
+    }
+    if (w->plain) {
+        if (dfs_pack_pwrite(w->fd, data, n, w->pos) < 0) return -1;
+        w->pos += n;
+        return 0;
+    }
+    if (dfs_pack_pwrite(w->fd, len ? w->out : data, len ? len : n, w->pos) < 0) return -1;
+    w->lens[w->count++] = len ? len : n;
+    w->pos += len ? len : n;
+    return 0;
+}
+
+// with keep, write the header and the index after the last frame; the
+// writer is freed either way. returns 0, or -1 with errno set
+static inline int dfs_pack_end(DfsPackWriter *w, int keep) {
+    int r = 0;
+    if (keep && !w->plain) {
+        size_t len = DFS_PACK_HEADER + w->count * DFS_PACK_ENTRY + DFS_PACK_TRAILER;
+        unsigned char *buf = malloc(len);
+        if (!buf) {
+            errno = ENOMEM;
+            r = -1;
+        } else {
+            memcpy(buf, DFS_PACK_MAGIC, 8);
+            dfs_put64(buf + 8, w->size);
+            dfs_put32(buf + 16, DFS_PACK_FRAME);
+            dfs_put32(buf + 20, 0);
+            unsigned char *p = buf + DFS_PACK_HEADER;
+            for (size_t i = 0; i < w->count; i++, p += DFS_PACK_ENTRY) dfs_put32(p, w->lens[i]);
+            DfsXxh64 h;
+            dfs_xxh64_init(&h);
+            dfs_xxh64_update(&h, buf, p - buf);
+            dfs_put64(p, dfs_xxh64_digest(&h));
+            r = dfs_pack_pwrite(w->fd, buf + DFS_PACK_HEADER, len - DFS_PACK_HEADER, w->pos);
+            if (r == 0) r = dfs_pack_pwrite(w->fd, buf, DFS_PACK_HEADER, 0);
+            if (r == 0) r = dfs_kind_mark(w->fd, DFS_KIND_PACK);
+            free(buf);
+        }
+    }
+    free(w->z);
+    free(w->out);
+    free(w->lens);
+    w->z = NULL;
+    w->out = NULL;
+    w->lens = NULL;
+    return r;
+}
+
+// read size bytes of upload payload into the new file fd, packed at level
+// if that pays; *packed says whether it was. returns 0, 1 if the file could
+// not be written (the payload is still read, so the stream stays in step),
+// -1 if the stream failed
+static inline int dfs_pack_recv(DfsReader *rd, int fd, uint64_t size, int level, int *packed) {
+    DfsPackWriter w;
+    unsigned char *buf = malloc(DFS_PACK_FRAME);
+    int failed = !buf || dfs_pack_begin(&w, fd, size, level) < 0;
+    if (failed) {
+        free(buf);
+        return dfs_skip(rd, size) == 0 ? 1 : -1;
+    }
+    for (uint64_t left = size; left > 0; ) {
+        size_t n = left < DFS_PACK_FRAME ? left : DFS_PACK_FRAME;
+        if (dfs_read_full(rd, buf, n) < 0) {
+            dfs_pack_end(&w, 0);
+            free(buf);
+            return -1;
+        }
+        if (!failed && dfs_pack_put(&w, buf, n) < 0) failed = 1;
+        left -= n;
+    }
+    *packed = !w.plain;
+    if (dfs_pack_end(&w, !failed) < 0) failed = 1;
+    free(buf);
+    return failed;
+}
+
+// pack the plain content of a file, size bytes of it, into the new file out_fd
+// returns 1, 0 if it does not pay and out_fd is of no use, -1 with errno set
+static inline int dfs_pack_file(int fd, uint64_t size, int out_fd, int level) {
+    DfsPackWriter w;
+    unsigned char *buf = malloc(DFS_PACK_FRAME);
+    if (!buf) {
+        errno = ENOMEM;
+        return -1;
+    }
+    if (dfs_pack_begin(&w, out_fd, size, level) < 0) {
+        free(buf);
+        return -1;
+    }
+    int r = 1;
+    for (uint64_t off = 0; off < size && r > 0 && !w.plain; ) {
+        size_t n = size - off < DFS_PACK_FRAME ? size - off : DFS_PACK_FRAME;
+        if (dfs_pack_pread_full(fd, buf, n, off) < 0 || dfs_pack_put(&w, buf, n) < 0) r = -1;
+        off += n;
+    }
+    if (r > 0 && w.plain) r = 0;
+    int err = errno;
+    if (dfs_pack_end(&w, r > 0) < 0) {
+        err = errno;
+        r = -1;
+    }
+    free(buf);
+    errno = err;
+    return r;
+}
+
+static inline void dfs_pack_close(DfsPack *p) {
+    free(p->starts);
+    free(p->buf);
+    memset(p, 0, sizeof(*p));
+}
+
+// read the index of an open file, if the server packed it
+// returns 1 with the index, 0 for a plain file, -1 with errno set
+static inline int dfs_pack_open(int fd, DfsPack *p) {
+    memset(p, 0, sizeof(*p));
+    struct stat st;
+    unsigned char head[DFS_PACK_HEADER];
+    if (fstat(fd, &st) < 0) return -1;
+    if (!S_ISREG(st.st_mode) || st.st_size < DFS_PACK_HEADER + DFS_PACK_TRAILER) return 0;
+    int marked = dfs_kind_is(fd, DFS_KIND_PACK);
+    if (marked <= 0) return marked;
+    ssize_t n = pread(fd, head, sizeof(head), 0);
+    if (n < 0) return -1;
+    if (n < (ssize_t)sizeof(head) || memcmp(head, DFS_PACK_MAGIC, 8) != 0) return 0;
+    uint64_t size = dfs_get64(head + 8);
+    uint32_t frame = dfs_get32(head + 16);
+    if (frame < DFS_PACK_FRAME_MIN || frame > DFS_PACK_FRAME) return 0;
+    uint64_t count = dfs_pack_frames(size, frame);
+    if (count > (uint64_t)st.st_size / DFS_PACK_ENTRY) return 0;
+    uint64_t index = count * DFS_PACK_ENTRY + DFS_PACK_TRAILER;
+    if (DFS_PACK_HEADER + index > (uint64_t)st.st_size) return 0;
+
+    unsigned char *buf = malloc(index);
+    p->starts = malloc((count + 1) * sizeof(uint64_t));
+    if (!buf || !p->starts) {
+        free(buf);
+        dfs_pack_close(p);
+        errno = ENOMEM;
+        return -1;
+    }
+    if (dfs_pack_pread_full(fd, buf, index, st.st_size - index) < 0) {
+        int err = errno;
+        free(buf);
+        dfs_pack_close(p);
+        errno = err;
+        return err == EIO ? 0 : -1;
+    }
+    DfsXxh64 h;
+    dfs_xxh64_init(&h);
+    dfs_xxh64_update(&h, head, sizeof(head));
+    dfs_xxh64_update(&h, buf, index - DFS_PACK_TRAILER);
+    int ok = dfs_get64(buf + index - DFS_PACK_TRAILER) == dfs_xxh64_digest(&h);
+    p->starts[0] = DFS_PACK_HEADER;
+    for (uint64_t i = 0; ok && i < count; i++) {
+        uint32_t len = dfs_get32(buf + i * DFS_PACK_ENTRY);
+        uint64_t raw = size - i * frame < frame ? size - i * frame : frame;
+        ok = len > 0 && len <= raw;
+        p->starts[i + 1] = p->starts[i] + len;
+    }
+    free(buf);
+    if (!ok || p->starts[count] != st.st_size - index) {
+        dfs_pack_close(p);
+        return 0;
+    }
+    p->size = size;
+    p->frame = frame;
+    p->count = p->cur = count;
+    return 1;
+}
+
+// bytes of content in frame i
+static inline size_t dfs_pack_frame_len(const DfsPack *p, size_t i) {
+    uint64_t at = (uint64_t)i * p->frame;
+    return p->size - at < p->frame ? p->size - at : p->frame;
+}
+
+// frame i as it is stored, into buf with room for a frame
+// returns its stored length, which is its length for a frame kept as it
+// is, or -1 with errno set
+static inline ssize_t dfs_pack_stored(int fd, const DfsPack *p, size_t i, unsigned char *buf) {
+    size_t len = p->starts[i + 1] - p->starts[i];
+    return dfs_pack_pread_full(fd, buf, len, p->starts[i]) < 0 ? -1 : (ssize_t)len;
+}
+
+// read up to n bytes of content at off, within one frame; returns the bytes
+// read, 0 at the end of the content, -1 with errno set (EIO for a frame
+// that does not decode)
+static inline ssize_t dfs_pack_pread(int fd, DfsPack *p, void *buf, size_t n, uint64_t off) {
+    if (off >= p->size) return 0;
+    size_t i = off / p->frame;
+    size_t in = off - (uint64_t)i * p->frame;
+    size_t raw = dfs_pack_frame_len(p, i);
+    if (n > raw - in) n = raw - in;
+    // a frame kept as it is needs no decoding
+    if (p->starts[i + 1] - p->starts[i] == raw) return pread(fd, buf, n, p->starts[i] + in);
+    if (p->cur != i) {
+        if (!p->buf && !(p->buf = malloc(2 * (size_t)p->frame))) {
+            errno = ENOMEM;
+            return -1;
+        }
+        p->cur = p->count;
+        unsigned char *stored = p->buf + p->frame;
+        ssize_t len = dfs_pack_stored(fd, p, i, stored);
+        if (len < 0) return -1;
+        if (dfs_lz4_decompress(stored, len, p->buf, raw) < 0) {
+            errno = EIO;
+            return -1;
+        }
+        p->cur = i;
+    }
+    memcpy(buf, p->buf + in, n);
+    return n;
+}
+
+// send the content of a packed file, up to *left bytes of it, to a
+// blocking socket. *left stays above 0 if a frame cannot be read
+// returns 0, or -1 if the socket failed
+static inline int dfs_pack_send(int sock, int fd, DfsPack *p, uint64_t *left) {
+    unsigned char *buf = malloc(p->frame);
+    if (!buf) return 0;
+    int r = 0;
+    uint64_t off = 0;
+    while (*left > 0) {
+        ssize_t n = dfs_pack_pread(fd, p, buf, *left < p->frame ? *left : p->frame, off);
+        if (n <= 0) break;
+        if (dfs_send_all(sock, buf, n, MSG_MORE) < 0) {
+            r = -1;
+            break;
+        }
+        off += n;
+        *left -= n;
+    }
+    free(buf);
+    return r;
+}
+
+#endif
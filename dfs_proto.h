@@ -0,0 +1,498 @@
+// dfs_proto.h - wire protocol shared by the client, S1 and the storage servers
+//
+// every message is a fixed 24 byte header, then path_len bytes of path (no
+// terminating NUL), then payload_len bytes of payload. integers are big-endian.
+//
+//   offset  size  field
+//        0     2  magic        DFS_MAGIC
+//        2     1  version      DFS_VERSION
+//        3     1  opcode       DFS_OP_*
+//        4     2  flags        DFS_F_*
+//        6     2  status       0 in requests, DFS_OK or DFS_E_* in replies
+//        8     4  request_id   chosen by the sender, echoed in the reply
+//       12     4  path_len
+//       16     8  payload_len
+//
+// requests and their replies (a reply has DFS_F_REPLY set and the same opcode):
+//   UPLOAD    path = ~S1/dir/name, payload = file data; reply payload = message.
+//             with DFS_F_HASH set the payload is the 8 byte size, the XXH64
+//             and the SHA-256 of the data instead: S1 stores the file from
+//             content it has already, if that has the same SHA-256, or
+//             answers DFS_E_MISSING and the data has to follow in a plain
+//             UPLOAD. the XXH64 only finds the stored file to compare. with
+//             DFS_F_LZ4 set the payload is the
+//             data compressed (dfs_lz4.h), and may be chunked
+//   DOWNLOAD  path = ~S1/dir/name; reply payload = file data. with DFS_F_LZ4
+//             set a compressed reply is welcome (dfs_lz4.h). with DFS_F_RANGE
+//             set the payload is an 8 byte offset and an 8 byte length (0
+//             for the rest of the file), and the reply carries only those
+//             bytes, never compressed; DFS_E_INVALID if the offset is past
+//             the end of the file. when S1's index knows the file, the reply
+//             path is its tag (DFS_FILE_TAG), and a range request may append
+//             that tag to its payload: S1 then answers DFS_E_MISSING unless
+//             the file is still that version, so a broken download resumes
+//             only onto the bytes it started with
+//   REMOVE    path = ~S1/dir/name; reply payload = message
+//   TAR       path = file type (c, p, t or z); reply payload = tar archive, chunked
+//   LIST      path = ~S1/dir, optional payload = limit and start (dfs_list.h);
+//             reply payload = one name per '\n' terminated line, sorted, chunked
+//             unless S1 answers a limit: then the reply path is the token
+//             that resumes the listing, empty after the last page. with
+//             DFS_F_LONG set a line carries the size and mtime too (dfs_list.h)
+//   STAT      path = ~S1/dir/name; reply payload = readable metadata from S1's index
+//   SCAN      empty, S1 -> storage server; reply payload = "size mtime path" line
+//             per stored file, path relative to the server's root, chunked
+//   PING      empty; empty reply
+//   LINK      path = ~S1/dir/name, payload = 8 byte size and SHA-256, then the
+//             path of a stored file with that content, S1 -> storage server;
+//             empty reply. the file is stored as a second name of it,
+//             DFS_E_NOTFOUND if there is no such file or its content differs
+//   SIGS      path = ~S1/dir/name; reply payload = block signatures of the
+//             stored version (dfs_delta.h)
+//   PATCH     path = ~S1/dir/name, payload = the new version as changes to
+//             the stored one (dfs_delta.h); reply payload = message.
+//             DFS_E_MISSING if the stored version is gone or is not the one
+//             the changes were made against: the whole file has to be sent
+// failed requests are answered with a DFS_E_* status; towards the client the
+// payload is then a readable message, storage servers send no payload.
+//
+// a reply with DFS_F_CHUNKED set has payload_len 0 and a payload whose length
+// is not known up front: chunks of an 8 byte big-endian length followed by that
+// many bytes, ended by a chunk of length 0. TAR replies are always chunked, so
+// archives are sent while they are being built. a compressed UPLOAD may be
+// chunked too, so the client sends each block as soon as it is compressed.
+
+#ifndef DFS_PROTO_H
+#define DFS_PROTO_H
+
+#include <stdint.h>
+#include <stdio.h>
+#include <string.h>
+#include <errno.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <sys/sendfile.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+
+#define DFS_MAGIC 0xDF5A
+#define DFS_VERSION 1
+#define DFS_HEADER_SIZE 24
+#define DFS_MAX_PATH 4096           // path_len must stay below this
+#define DFS_READER_SIZE 65536
+#define DFS_SENDFILE_CHUNK (1 << 30)   // most bytes handed to one sendfile() call
+#define DFS_SOCKET_BUFFER (4 << 20)    // send buffer for sockets carrying file data
+
+enum dfs_opcode {
+    DFS_OP_UPLOAD = 1,
+    DFS_OP_DOWNLOAD = 2,
+    DFS_OP_REMOVE = 3,
+    DFS_OP_TAR = 4,
+    DFS_OP_LIST = 5,
+    DFS_OP_PING = 6,
+    DFS_OP_STAT = 7,
+    DFS_OP_SCAN = 8,
+    DFS_OP_LINK = 9,
+    DFS_OP_SIGS = 10,
+    DFS_OP_PATCH = 11
+};
+
+#define DFS_F_REPLY 0x0001
+#define DFS_F_CHUNKED 0x0002        // payload is a chunk sequence, see above
+#define DFS_F_LONG 0x0004           // LIST request: names with size and mtime
+#define DFS_F_HASH 0x0008           // UPLOAD request: the payload is a size, XXH64 and SHA-256, see above
+#define DFS_HASH_CLAIM 48           // payload of such a request
+#define DFS_F_LZ4 0x0010            // UPLOAD, DOWNLOAD reply: the payload is compressed; DOWNLOAD: it may be
+#define DFS_F_DENSE 0x0020          // with DFS_F_LZ4: compress harder, for a slow link
+#define DFS_F_RANGE 0x0040          // DOWNLOAD request: only part of the file, see above
+#define DFS_RANGE_ARGS 16           // payload of such a request
+#define DFS_FILE_TAG 48             // version of a file: size, mtime and XXH64 (0 if unknown) in hex
+#define DFS_CHUNK_HEADER 8
+#define DFS_LEN_CHUNKED UINT64_MAX  // payload left of a chunked request, until its empty chunk
+
+enum dfs_status {
+    DFS_OK = 0,
+    DFS_E_NOTFOUND = 1,         // no such file or directory
+    DFS_E_INVALID = 2,          // malformed path, type or size
+    DFS_E_IO = 3,               // the server failed to read or write its disk
+    DFS_E_UNAVAILABLE = 4,      // a storage server could not be reached
+    DFS_E_PROTO = 5,            // bad magic, version or opcode
+    DFS_E_MISSING = 6           // UPLOAD by hash, PATCH: the content is not stored, send it
+};
+
+typedef struct {
+    uint16_t magic;
+    uint8_t version;
+    uint8_t opcode;
+    uint16_t flags;
+    uint16_t status;
+    uint32_t request_id;
+    uint32_t path_len;
+    uint64_t payload_len;
+} DfsHeader;
+
+// blocking buffered reader, so headers and small fields never cost a syscall each.
+// it read(2)s, so it works on a file as well as on a socket
+typedef struct {
+    int fd;
+    size_t off;
+    size_t len;
+    char buf[DFS_READER_SIZE];
+} DfsReader;
+
+static inline void dfs_put16(unsigned char *p, uint16_t v) {
+    p[0] = v >> 8;
+    p[1] = v;
+}
+
+static inline void dfs_put32(unsigned char *p, uint32_t v) {
+    dfs_put16(p, v >> 16);
+    dfs_put16(p + 2, v);
+}
+
+static inline void dfs_put64(unsigned char *p, uint64_t v) {
+    dfs_put32(p, v >> 32);
+    dfs_put32(p + 4, v);
+}
+
+static inline uint16_t dfs_get16(const unsigned char *p) {
+    return (uint16_t)(p[0] << 8 | p[1]);
+}
+
+static inline uint32_t dfs_get32(const unsigned char *p) {
+    return (uint32_t)dfs_get16(p) << 16 | dfs_get16(p + 2);
+}
+
+static inline uint64_t dfs_get64(const unsigned char *p) {
+    return (uint64_t)dfs_get32(p) << 32 | dfs_get32(p + 4);
+}
+
+// fill in a header for a request or reply
+static inline void dfs_header_init(DfsHeader *h, int opcode, int flags, int status,
+                                   uint32_t request_id, size_t path_len, uint64_t payload_len) {
+    h->magic = DFS_MAGIC;
+    h->version = DFS_VERSION;
+    h->opcode = opcode;
+    h->flags = flags;
+    h->status = status;
+    h->request_id = request_id;
+    h->path_len = path_len;
+    h->payload_len = payload_len;
+}
+
+static inline void dfs_encode_header(unsigned char *out, const DfsHeader *h) {
+    dfs_put16(out, h->magic);
+    out[2] = h->version;
+    out[3] = h->opcode;
+    dfs_put16(out + 4, h->flags);
+    dfs_put16(out + 6, h->status);
+    dfs_put32(out + 8, h->request_id);
+    dfs_put32(out + 12, h->path_len);
+    dfs_put64(out + 16, h->payload_len);
+}
+
+// returns 0 for a header this build understands, -1 otherwise
+static inline int dfs_decode_header(const unsigned char *in, DfsHeader *h) {
+    h->magic = dfs_get16(in);
+    h->version = in[2];
+    h->opcode = in[3];
+    h->flags = dfs_get16(in + 4);
+    h->status = dfs_get16(in + 6);
+    h->request_id = dfs_get32(in + 8);
+    h->path_len = dfs_get32(in + 12);
+    h->payload_len = dfs_get64(in + 16);
+    if (h->magic != DFS_MAGIC || h->version != DFS_VERSION) return -1;
+    if (h->path_len >= DFS_MAX_PATH) return -1;
+    return 0;
+}
+
+// header and path of a frame, ready to be written; out needs
+// DFS_HEADER_SIZE + strlen(path) bytes. returns the number of bytes used
+static inline size_t dfs_frame(unsigned char *out, int opcode, int flags, int status,
+                               uint32_t request_id, const char *path, uint64_t payload_len) {
+    size_t path_len = path ? strlen(path) : 0;
+    DfsHeader h;
+    dfs_header_init(&h, opcode, flags, status, request_id, path_len, payload_len);
+    dfs_encode_header(out, &h);
+    if (path_len) memcpy(out + DFS_HEADER_SIZE, path, path_len);
+    return DFS_HEADER_SIZE + path_len;
+}
+
+static inline const char *dfs_op_name(int opcode) {
+    switch (opcode) {
+        case DFS_OP_UPLOAD: return "upload";
+        case DFS_OP_DOWNLOAD: return "download";
+        case DFS_OP_REMOVE: return "remove";
+        case DFS_OP_TAR: return "tar";
+        case DFS_OP_LIST: return "list";
+        case DFS_OP_PING: return "ping";
+        case DFS_OP_STAT: return "stat";
+        case DFS_OP_SCAN: return "scan";
+        case DFS_OP_LINK: return "link";
+        case DFS_OP_SIGS: return "sigs";
+        case DFS_OP_PATCH: return "patch";
+    }
+    return "unknown";
+}
+
+static inline const char *dfs_status_name(int status) {
+    switch (status) {
+        case DFS_OK: return "OK";
+        case DFS_E_NOTFOUND: return "File not found";
+        case DFS_E_INVALID: return "Invalid request";
+        case DFS_E_IO: return "I/O error";
+        case DFS_E_UNAVAILABLE: return "Storage server unavailable";
+        case DFS_E_PROTO: return "Protocol error";
+        case DFS_E_MISSING: return "Content not stored";
+    }
+    return "Unknown error";
+}
+
+// write all of data, returns 0 or -1
+static inline int dfs_send_all(int fd, const void *data, size_t n, int flags) {
+    const char *p = data;
+    while (n > 0) {
+        ssize_t sent = send(fd, p, n, flags | MSG_NOSIGNAL);
+        if (sent < 0) {
+            if (errno == EINTR) continue;
+            return -1;
+        }
+        p += sent;
+        n -= sent;
+    }
+    return 0;
+}
+
+// send header and path; the caller sends payload_len bytes of payload after it
+static inline int dfs_send_header(int fd, int opcode, int flags, int status,
+                                  uint32_t request_id, const char *path, uint64_t payload_len) {
+    unsigned char frame[DFS_HEADER_SIZE + DFS_MAX_PATH];
+    if (path && strlen(path) >= DFS_MAX_PATH) return -1;
+    size_t n = dfs_frame(frame, opcode, flags, status, request_id, path, payload_len);
+    return dfs_send_all(fd, frame, n, payload_len ? MSG_MORE : 0);
+}
+
+// answer a request with a status and a small payload held in memory
+static inline int dfs_send_reply(int fd, const DfsHeader *req, int status,
+                                 const void *payload, size_t n) {
+    if (dfs_send_header(fd, req->opcode, DFS_F_REPLY, status, req->request_id, NULL, n) < 0) {
+        return -1;
+    }
+    return n ? dfs_send_all(fd, payload, n, 0) : 0;
+}
+
+// replies are written as they are produced, a chunk header or a short reply must
+// not sit in the kernel waiting for the peer's delayed ACK. writers that have
+// more to say pass MSG_MORE instead
+static inline void dfs_set_nodelay(int fd) {
+    int one = 1;
+    setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+}
+
+// give a socket that carries file data a large send buffer. setting SO_SNDBUF
+// turns off the kernel's autotuning, so this is skipped where net.core.wmem_max
+// would clamp the buffer below DFS_SOCKET_BUFFER
+static inline void dfs_set_send_buffer(int fd) {
+    static int allowed = -1;
+    if (allowed < 0) {
+        long max = 0;
+        FILE *f = fopen("/proc/sys/net/core/wmem_max", "r");
+        if (f) {
+            if (fscanf(f, "%ld", &max) != 1) max = 0;
+            fclose(f);
+        }
+        allowed = max >= DFS_SOCKET_BUFFER;
+    }
+    if (!allowed) return;
+    int size = DFS_SOCKET_BUFFER;
+    setsockopt(fd, SOL_SOCKET, SO_SNDBUF, &size, sizeof(size));
+}
+
+// send up to *left bytes of an open file, from its current offset. sendfile()
+// keeps the data out of user space; kernels or files that cannot do that get a
+// read/send loop. *left stays above 0 if the file ended early
+// returns 0, or -1 if the socket failed
+static inline int dfs_send_file_part(int fd, int file_fd, uint64_t *left) {
+    posix_fadvise(file_fd, 0, 0, POSIX_FADV_SEQUENTIAL);
+    while (*left > 0) {
+        ssize_t n = sendfile(fd, file_fd, NULL, *left < DFS_SENDFILE_CHUNK ? *left : DFS_SENDFILE_CHUNK);
+        if (n > 0) {
+            *left -= n;
+            continue;
+        }
+        if (n == 0) return 0;
+        if (errno == EINTR) continue;
+        if (errno == EINVAL || errno == ENOSYS) break;
+        return -1;
+    }
+    char buf[DFS_READER_SIZE];
+    while (*left > 0) {
+        ssize_t n = read(file_fd, buf, *left < sizeof(buf) ? *left : sizeof(buf));
+        if (n < 0 && errno == EINTR) continue;
+        if (n <= 0) return 0;
+        if (dfs_send_all(fd, buf, n, 0) < 0) return -1;
+        *left -= n;
+    }
+    return 0;
+}
+
+// send size bytes of an open file as the payload of a frame
+// returns 0, or -1 if the socket failed or the file shrank under us
+static inline int dfs_send_file(int fd, int file_fd, uint64_t size) {
+    if (dfs_send_file_part(fd, file_fd, &size) < 0) return -1;
+    return size == 0 ? 0 : -1;
+}
+
+static inline void dfs_reader_init(DfsReader *r, int fd) {
+    r->fd = fd;
+    r->off = r->len = 0;
+}
+
+// bytes already buffered but not consumed
+static inline size_t dfs_reader_pending(const DfsReader *r) {
+    return r->len - r->off;
+}
+
+// read up to n bytes, serving buffered data first
+// returns the number of bytes, 0 on EOF, -1 on error
+static inline ssize_t dfs_reader_read(DfsReader *r, void *dst, size_t n) {
+    if (r->off == r->len) {
+        // large reads bypass the buffer
+        if (n >= sizeof(r->buf)) {
+            ssize_t got;
+            do {
+                got = read(r->fd, dst, n);
+            } while (got < 0 && errno == EINTR);
+            return got;
+        }
+        ssize_t got;
+        do {
+            got = read(r->fd, r->buf, sizeof(r->buf));
+        } while (got < 0 && errno == EINTR);
+        if (got <= 0) return got;
+        r->off = 0;
+        r->len = got;
+    }
+    size_t avail = r->len - r->off;
+    if (avail > n) avail = n;
+    memcpy(dst, r->buf + r->off, avail);
+    r->off += avail;
+    return avail;
+}
+
+// read exactly n bytes, returns 0 or -1 if the stream ended or failed first
+static inline int dfs_read_full(DfsReader *r, void *dst, size_t n) {
+    char *p = dst;
+    while (n > 0) {
+        ssize_t got = dfs_reader_read(r, p, n);
+        if (got <= 0) return -1;
+        p += got;
+        n -= got;
+    }
+    return 0;
+}
+
+// write the next size bytes of payload to file_fd. if the disk fails, the rest of
+// the payload is still read so the stream stays in step with the sender
+// returns 0 on success, 1 if the file could not be written, -1 if the stream failed
+static inline int dfs_recv_file(DfsReader *r, int file_fd, uint64_t size) {
+    char buf[DFS_READER_SIZE];
+    int disk_error = 0;
+    while (size > 0) {
+        ssize_t got = dfs_reader_read(r, buf, size < sizeof(buf) ? size : sizeof(buf));
+        if (got <= 0) return -1;
+        size -= got;
+        for (char *p = buf; !disk_error && got > 0; ) {
+            ssize_t n = write(file_fd, p, got);
+            if (n < 0 && errno == EINTR) continue;
+            if (n <= 0) {
+                disk_error = 1;
+                break;
+            }
+            p += n;
+            got -= n;
+        }
+    }
+    return disk_error;
+}
+
+static inline int dfs_skip_chunks(DfsReader *r);
+
+// discard n bytes of payload the receiver has no use for, or the rest of a
+// chunked one if n is DFS_LEN_CHUNKED
+static inline int dfs_skip(DfsReader *r, uint64_t n) {
+    if (n == DFS_LEN_CHUNKED) return dfs_skip_chunks(r);
+    char scratch[4096];
+    while (n > 0) {
+        size_t want = n < sizeof(scratch) ? n : sizeof(scratch);
+        if (dfs_read_full(r, scratch, want) < 0) return -1;
+        n -= want;
+    }
+    return 0;
+}
+
+// discard a chunked payload up to and including its empty chunk
+static inline int dfs_skip_chunks(DfsReader *r) {
+    unsigned char head[DFS_CHUNK_HEADER];
+    uint64_t len;
+    do {
+        if (dfs_read_full(r, head, sizeof(head)) < 0) return -1;
+        len = dfs_get64(head);
+        if (len == DFS_LEN_CHUNKED || dfs_skip(r, len) < 0) return -1;
+    } while (len > 0);
+    return 0;
+}
+
+// read the next header and its NUL terminated path (path_max includes the NUL)
+// returns 1 on success, 0 on EOF before the first byte, -1 on error or a bad header
+static inline int dfs_read_header(DfsReader *r, DfsHeader *h, char *path, size_t path_max) {
+    unsigned char raw[DFS_HEADER_SIZE];
+    ssize_t got = dfs_reader_read(r, raw, sizeof(raw));
+    if (got <= 0) return got == 0 ? 0 : -1;
+    if (dfs_read_full(r, raw + got, sizeof(raw) - got) < 0) return -1;
+    if (dfs_decode_header(raw, h) < 0 || h->path_len >= path_max) return -1;
+    if (dfs_read_full(r, path, h->path_len) < 0) return -1;
+    path[h->path_len] = '\0';
+    return 1;
+}
+
+// offset and length of a DFS_F_RANGE download, from its payload
+// returns 0, 1 if the payload is malformed (it is skipped), -1 if the stream failed
+static inline int dfs_read_range(DfsReader *r, const DfsHeader *req, uint64_t *off, uint64_t *len) {
+    unsigned char args[DFS_RANGE_ARGS];
+    if (req->payload_len != sizeof(args)) return dfs_skip(r, req->payload_len) < 0 ? -1 : 1;
+    if (dfs_read_full(r, args, sizeof(args)) < 0) return -1;
+    *off = dfs_get64(args);
+    *len = dfs_get64(args + 8);
+    return 0;
+}
+
+// the tag of a file version into out, DFS_FILE_TAG + 1 bytes
+static inline void dfs_file_tag(char *out, uint64_t size, int64_t mtime, uint64_t checksum) {
+    snprintf(out, DFS_FILE_TAG + 1, "%016llx%016llx%016llx", (unsigned long long)size,
+             (unsigned long long)mtime, (unsigned long long)checksum);
+}
+
+// size and checksum from a tag; returns 0, or -1 if it is not one
+static inline int dfs_file_tag_parse(const char *tag, uint64_t *size, uint64_t *checksum) {
+    unsigned long long s, m, x;
+    if (strlen(tag) != DFS_FILE_TAG || strspn(tag, "0123456789abcdef") != DFS_FILE_TAG ||
+        sscanf(tag, "%16llx%16llx%16llx", &s, &m, &x) != 3) {
+        return -1;
+    }
+    *size = s;
+    *checksum = x;
+    return 0;
+}
+
+// fit a range to a file of size bytes: a length of 0, or one past the end,
+// stops at the end. returns 0, or -1 if the offset is past the end
+static inline int dfs_range_clip(uint64_t size, uint64_t off, uint64_t *len) {
+    if (off > size) return -1;
+    if (*len == 0 || *len > size - off) *len = size - off;
+    return 0;
+}
+
+#endif
@@ -0,0 +1,288 @@
+// dfs_tar.h - tar archives built in process, shared by S1 and the storage servers
+//
+// a DfsTarWalk goes through a directory tree one entry at a time and hands out
+// every regular file whose name ends in a given extension, already opened
+// (or only stat'ed, for the scans that fill S1's index).
+// each member is written as soon as the walk finds it, so the first bytes of
+// an archive leave before the tree has been fully read and memory stays the
+// same however many files there are. no temporary archive, no tar process.
+//
+// archives travel as chunked payloads (see DFS_F_CHUNKED): one chunk per
+// member holding its header blocks, body and padding, one chunk with the two
+// zero blocks that end the archive, then the empty end chunk. an archive
+// without members is just the end chunk.
+//
+// members are ustar; a name that does not fit ustar's prefix/name split or a
+// file of 8 GiB or more is preceded by a pax extended header carrying the
+// full path and size. member names are the absolute paths without the leading
+// '/', as tar itself stores them. a file that shrinks after its header went
+// out is padded with zeros so the member keeps the announced length.
+
+#ifndef DFS_TAR_H
+#define DFS_TAR_H
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <limits.h>
+#include <dirent.h>
+#include <sys/stat.h>
+#include "dfs_proto.h"
+#include "dfs_dir.h"
+
+#define DFS_TAR_BLOCK 512
+#define DFS_TAR_HEADER_MAX (3 * DFS_TAR_BLOCK + PATH_MAX)    // pax header, its records, ustar header
+#define DFS_TAR_CHUNK_MAX (DFS_CHUNK_HEADER + DFS_TAR_HEADER_MAX)
+#define DFS_TAR_END_MAX (2 * DFS_CHUNK_HEADER + 2 * DFS_TAR_BLOCK)
+
+typedef struct {
+    const char *path;       // valid until the next dfs_tar_next
+    uint64_t size;
+    time_t mtime;
+    mode_t mode;
+    uid_t uid;
+    gid_t gid;
+} DfsTarEntry;
+
+typedef struct {
+    DfsDir dir;
+    size_t len;             // length of the directory's path
+} DfsTarDir;
+
+// a walk in progress; path holds the directory or file being looked at
+typedef struct {
+    DfsTarDir *dirs;        // directories being read, innermost last
+    int depth;
+    int cap;
+    char path[PATH_MAX];
+    char ext[16];
+    size_t count;           // files handed out so far
+    int stat_only;          // hand out entries without opening the files, *fd is -1
+} DfsTarWalk;
+
+static inline uint64_t dfs_tar_round(uint64_t n) {
+    return (n + DFS_TAR_BLOCK - 1) / DFS_TAR_BLOCK * DFS_TAR_BLOCK;
+}
+
+static inline int dfs_tar_has_ext(const char *name, const char *ext) {
+    size_t n = strlen(name), e = strlen(ext);
+    return n > e && strcmp(name + n - e, ext) == 0;
+}
+
+// start reading the directory currently in path, whose length is len
+static inline int dfs_tar_push(DfsTarWalk *w, size_t len) {
+    if (w->depth == w->cap) {
+        int cap = w->cap ? w->cap * 2 : 16;
+        DfsTarDir *dirs = realloc(w->dirs, cap * sizeof(*dirs));
+        if (!dirs) return -1;
+        w->dirs = dirs;
+        w->cap = cap;
+    }
+    // unreadable directories are left out, as tar would
+    if (dfs_dir_open(&w->dirs[w->depth].dir, w->path) < 0) return errno == ENOMEM ? -1 : 0;
+    w->dirs[w->depth].len = len;
+    w->depth++;
+    return 0;
+}
+
+static inline void dfs_tar_close(DfsTarWalk *w) {
+    while (w->depth > 0) dfs_dir_close(&w->dirs[--w->depth].dir);
+    free(w->dirs);
+    w->dirs = NULL;
+    w->cap = 0;
+}
+
+// walk the files under root whose names end in ext; a missing root is an
+// empty walk. returns 0, or -1 if memory ran out
+static inline int dfs_tar_open(DfsTarWalk *w, const char *root, const char *ext) {
+    memset(w, 0, sizeof(*w));
+    size_t len = strlen(root);
+    if (len >= sizeof(w->path) || strlen(ext) >= sizeof(w->ext)) return -1;
+    memcpy(w->path, root, len + 1);
+    while (len > 1 && w->path[len - 1] == '/') w->path[--len] = '\0';
+    strcpy(w->ext, ext);
+    return dfs_tar_push(w, len);
+}
+
+// open the next matching file; e describes it and *fd reads it
+// returns 1, 0 when the walk is over, -1 if memory ran out
+static inline int dfs_tar_next(DfsTarWalk *w, DfsTarEntry *e, int *fd) {
+    while (w->depth > 0) {
+        DfsTarDir *top = &w->dirs[w->depth - 1];
+        unsigned char type;
+        const char *name = dfs_dir_next(&top->dir, &type);
+        if (!name) {
+            dfs_dir_close(&top->dir);
+            w->depth--;
+            continue;
+        }
+        size_t n = strlen(name);
+        if (top->len + 1 + n >= PATH_MAX) continue;
+        w->path[top->len] = '/';
+        memcpy(w->path + top->len + 1, name, n + 1);
+
+        // d_type saves a stat for everything but the files that go in the archive
+        struct statx stx;
+        if (type == DT_UNKNOWN) {
+            if (dfs_dir_stat(&top->dir, name, &stx) != 0) continue;
+            type = S_ISDIR(stx.stx_mode) ? DT_DIR : S_ISREG(stx.stx_mode) ? DT_REG : DT_UNKNOWN;
+        }
+        if (type == DT_DIR) {
+            if (dfs_tar_push(w, top->len + 1 + n) < 0) return -1;
+            continue;
+        }
+        if (type != DT_REG || !dfs_tar_has_ext(name, w->ext)) continue;
+
+        struct stat st;
+        int file_fd = -1;
+        if (w->stat_only) {
+            if (dfs_dir_stat(&top->dir, name, &stx) != 0 || !S_ISREG(stx.stx_mode)) continue;
+            memset(&st, 0, sizeof(st));
+            st.st_size = stx.stx_size;
+            st.st_mtime = stx.stx_mtime.tv_sec;
+        } else {
+            // no symlinks, and a fifo that happens to match must not block the walk
+            file_fd = openat(top->dir.fd, name, O_RDONLY | O_CLOEXEC | O_NOFOLLOW | O_NONBLOCK);
+            if (file_fd < 0) continue;
+            if (fstat(file_fd, &st) != 0 || !S_ISREG(st.st_mode)) {
+                close(file_fd);
+                continue;
+            }
+        }
+        e->path = w->path;
+        e->size = st.st_size;
+        e->mtime = st.st_mtime;
+        e->mode = st.st_mode & 07777;
+        e->uid = st.st_uid;
+        e->gid = st.st_gid;
+        *fd = file_fd;
+        w->count++;
+        return 1;
+    }
+    return 0;
+}
+
+// zero padded octal of width - 1 digits and a NUL, returns -1 if v does not fit
+static inline int dfs_tar_octal(unsigned char *field, size_t width, uint64_t v) {
+    for (size_t i = width - 1; i-- > 0; v >>= 3) field[i] = '0' + (v & 7);
+    field[width - 1] = '\0';
+    return v ? -1 : 0;
+}
+
+// one "<len> key=value\n" pax record, len counting its own digits
+static inline size_t dfs_tar_pax_record(char *out, const char *key, const char *value) {
+    size_t base = strlen(key) + strlen(value) + 3;
+    size_t len = base + 1;
+    while (base + (size_t)snprintf(NULL, 0, "%zu", len) != len) len++;
+    return sprintf(out, "%zu %s=%s\n", len, key, value);
+}
+
+static inline void dfs_tar_block(unsigned char *b, const char *name, uint64_t size, const DfsTarEntry *e,
+                                 char type, const char *prefix) {
+    memset(b, 0, DFS_TAR_BLOCK);
+    strncpy((char *)b, name, 100);
+    dfs_tar_octal(b + 100, 8, type == 'x' ? 0644 : e->mode);
+    if (dfs_tar_octal(b + 108, 8, e->uid) < 0) dfs_tar_octal(b + 108, 8, 0);
+    if (dfs_tar_octal(b + 116, 8, e->gid) < 0) dfs_tar_octal(b + 116, 8, 0);
+    if (dfs_tar_octal(b + 124, 12, size) < 0) dfs_tar_octal(b + 124, 12, 0);
+    dfs_tar_octal(b + 136, 12, e->mtime > 0 ? (uint64_t)e->mtime : 0);
+    b[156] = type;
+    memcpy(b + 257, "ustar", 6);
+    memcpy(b + 263, "00", 2);
+    if (prefix) strncpy((char *)b + 345, prefix, 155);
+
+    memset(b + 148, ' ', 8);
+    unsigned sum = 0;
+    for (int i = 0; i < DFS_TAR_BLOCK; i++) sum += b[i];
+    dfs_tar_octal(b + 148, 7, sum);
+}
+
+// header blocks of a member: a pax extended header where ustar is not enough,
+// then the ustar header. out needs DFS_TAR_HEADER_MAX bytes, returns the bytes used
+static inline size_t dfs_tar_header(unsigned char *out, const DfsTarEntry *e) {
+    const char *name = e->path;
+    while (*name == '/') name++;
+    size_t n = strlen(name);
+
+    // ustar keeps up to 155 bytes of directories in prefix and 100 in name
+    char prefix[156] = "";
+    const char *tail = NULL;
+    if (n <= 100) {
+        tail = name;
+    } else {
+        for (size_t i = n > 101 ? n - 101 : 0; i < n && i <= 155; i++) {
+            if (name[i] == '/' && n - i - 1 <= 100 && n - i - 1 > 0) {
+                memcpy(prefix, name, i);
+                prefix[i] = '\0';
+                tail = name + i + 1;
+                break;
+            }
+        }
+    }
+    int big = e->size >= (uint64_t)1 << 33;
+
+    size_t used = 0;
+    if (!tail || big) {
+        char records[PATH_MAX + 64];
+        size_t len = 0;
+        if (!tail) len += dfs_tar_pax_record(records + len, "path", name);
+        if (big) {
+            char size[24];
+            snprintf(size, sizeof(size), "%llu", (unsigned long long)e->size);
+            len += dfs_tar_pax_record(records + len, "size", size);
+        }
+        const char *base = strrchr(name, '/');
+        char pax_name[100];
+        snprintf(pax_name, sizeof(pax_name), "PaxHeader/%.80s", base ? base + 1 : name);
+        dfs_tar_block(out, pax_name, len, e, 'x', NULL);
+        memset(out + DFS_TAR_BLOCK, 0, dfs_tar_round(len));
+        memcpy(out + DFS_TAR_BLOCK, records, len);
+        used = DFS_TAR_BLOCK + dfs_tar_round(len);
+        // readers take the full name from the pax record
+        if (!tail) tail = name + n - 100;
+    }
+    dfs_tar_block(out + used, tail, big ? 0 : e->size, e, '0', prefix[0] ? prefix : NULL);
+    return used + DFS_TAR_BLOCK;
+}
+
+// chunk header and header blocks of a member, out needs DFS_TAR_CHUNK_MAX bytes
+// returns the bytes used; the body and its padding complete the chunk
+static inline size_t dfs_tar_member_start(unsigned char *out, const DfsTarEntry *e) {
+    size_t n = dfs_tar_header(out + DFS_CHUNK_HEADER, e);
+    dfs_put64(out, n + dfs_tar_round(e->size));
+    return DFS_CHUNK_HEADER + n;
+}
+
+// the chunk ending the archive (none for an archive without members) and the
+// end chunk of the payload. out needs DFS_TAR_END_MAX bytes, returns the bytes used
+static inline size_t dfs_tar_end(unsigned char *out, size_t count) {
+    size_t n = 0;
+    memset(out, 0, DFS_TAR_END_MAX);
+    if (count > 0) {
+        dfs_put64(out, 2 * DFS_TAR_BLOCK);
+        n = DFS_CHUNK_HEADER + 2 * DFS_TAR_BLOCK;
+    }
+    return n + DFS_CHUNK_HEADER;
+}
+
+static inline int dfs_tar_zeros(int fd, uint64_t n) {
+    static const char zeros[4096];
+    while (n > 0) {
+        size_t k = n < sizeof(zeros) ? n : sizeof(zeros);
+        if (dfs_send_all(fd, zeros, k, MSG_MORE) < 0) return -1;
+        n -= k;
+    }
+    return 0;
+}
+
+// write one member, the file fd reads, to a blocking socket as a chunk of
+// the archive; returns 0, or -1 if the socket failed
+static inline int dfs_tar_send_member(int sock, const DfsTarEntry *e, int fd) {
+    unsigned char start[DFS_TAR_CHUNK_MAX];
+    uint64_t left = e->size;
+    size_t n = dfs_tar_member_start(start, e);
+    if (dfs_send_all(sock, start, n, MSG_MORE) < 0 || dfs_send_file_part(sock, fd, &left) < 0) return -1;
+    return dfs_tar_zeros(sock, left + dfs_tar_round(e->size) - e->size);
+}
+
+#endif